@@ -0,0 +1,455 @@
+// Copyright (c) 2014 The Carboncoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfilter.h"
+
+#include "core.h"
+#include "hash.h"
+#include "main.h"
+#include "script.h"
+#include "ui_interface.h"
+#include "util.h"
+
+#include <algorithm>
+
+#include <boost/bind.hpp>
+#include <boost/foreach.hpp>
+
+using namespace std;
+
+CBlockFilterIndex* pblockfilterindex = NULL;
+
+// Appends bits to a byte vector, most significant bit first
+class CBitWriter
+{
+private:
+    vector<unsigned char>& vch;
+    unsigned char nBuffer;
+    int nOffset; // bits of nBuffer in use
+
+public:
+    CBitWriter(vector<unsigned char>& vchIn) : vch(vchIn), nBuffer(0), nOffset(0) {}
+
+    // Write the low nBits bits of data
+    void Write(uint64_t data, int nBits)
+    {
+        while (nBits > 0) {
+            int nTake = min(8 - nOffset, nBits);
+            nBuffer |= ((data >> (nBits - nTake)) & ((1 << nTake) - 1)) << (8 - nOffset - nTake);
+            nOffset += nTake;
+            nBits -= nTake;
+            if (nOffset == 8)
+                Flush();
+        }
+    }
+
+    // Pad the last byte with zeros
+    void Flush()
+    {
+        if (nOffset == 0)
+            return;
+        vch.push_back(nBuffer);
+        nBuffer = 0;
+        nOffset = 0;
+    }
+};
+
+class CBitReader
+{
+private:
+    const vector<unsigned char>& vch;
+    size_t nPos;
+    unsigned char nBuffer;
+    int nOffset; // bits of nBuffer consumed
+
+public:
+    CBitReader(const vector<unsigned char>& vchIn, size_t nPosIn) : vch(vchIn), nPos(nPosIn), nBuffer(0), nOffset(8) {}
+
+    uint64_t Read(int nBits)
+    {
+        uint64_t data = 0;
+        while (nBits > 0) {
+            if (nOffset == 8) {
+                if (nPos >= vch.size())
+                    throw ios_base::failure("CBitReader::Read : end of data");
+                nBuffer = vch[nPos++];
+                nOffset = 0;
+            }
+            int nTake = min(8 - nOffset, nBits);
+            data = (data << nTake) | ((nBuffer >> (8 - nOffset - nTake)) & ((1 << nTake) - 1));
+            nOffset += nTake;
+            nBits -= nTake;
+        }
+        return data;
+    }
+};
+
+// x is written as x >> P in unary followed by the low P bits of x
+static void GolombRiceEncode(CBitWriter& writer, unsigned char P, uint64_t x)
+{
+    uint64_t q = x >> P;
+    while (q > 0) {
+        int nBits = q <= 64 ? (int)q : 64;
+        writer.Write(~0ULL, nBits);
+        q -= nBits;
+    }
+    writer.Write(0, 1);
+    writer.Write(x, P);
+}
+
+static uint64_t GolombRiceDecode(CBitReader& reader, unsigned char P)
+{
+    uint64_t q = 0;
+    while (reader.Read(1) == 1)
+        q++;
+    return (q << P) + reader.Read(P);
+}
+
+// (x * n) >> 64, which maps a uniform 64-bit x uniformly onto [0, n)
+static uint64_t MapIntoRange(uint64_t x, uint64_t n)
+{
+    uint64_t x_hi = x >> 32, x_lo = x & 0xffffffff;
+    uint64_t n_hi = n >> 32, n_lo = n & 0xffffffff;
+    uint64_t ac = x_hi * n_hi;
+    uint64_t ad = x_hi * n_lo;
+    uint64_t bc = x_lo * n_hi;
+    uint64_t bd = x_lo * n_lo;
+    uint64_t mid = (bd >> 32) + (ad & 0xffffffff) + (bc & 0xffffffff);
+    return ac + (ad >> 32) + (bc >> 32) + (mid >> 32);
+}
+
+CGCSFilter::CGCSFilter(uint64_t k0In, uint64_t k1In, unsigned char PIn, uint32_t MIn) :
+    k0(k0In), k1(k1In), P(PIn), M(MIn), N(0), F(0)
+{
+    vEncoded.push_back(0);
+}
+
+CGCSFilter::CGCSFilter(uint64_t k0In, uint64_t k1In, unsigned char PIn, uint32_t MIn, const vector<unsigned char>& vEncodedIn) :
+    k0(k0In), k1(k1In), P(PIn), M(MIn), vEncoded(vEncodedIn)
+{
+    if (vEncoded.empty())
+        throw ios_base::failure("CGCSFilter : empty filter");
+    CDataStream stream(vEncoded, SER_NETWORK, PROTOCOL_VERSION);
+    N = ReadCompactSize(stream);
+    if (N >= 0x100000000ULL)
+        throw ios_base::failure("CGCSFilter : N must be below 2^32");
+    F = N * M;
+
+    // Decode all the differences once so a truncated filter is caught here
+    CBitReader reader(vEncoded, GetSizeOfCompactSize(N));
+    for (uint64_t i = 0; i < N; i++)
+        GolombRiceDecode(reader, P);
+}
+
+CGCSFilter::CGCSFilter(uint64_t k0In, uint64_t k1In, unsigned char PIn, uint32_t MIn, const ElementSet& elements) :
+    k0(k0In), k1(k1In), P(PIn), M(MIn)
+{
+    N = elements.size();
+    F = N * M;
+
+    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
+    WriteCompactSize(stream, N);
+    vEncoded.assign(stream.begin(), stream.end());
+
+    if (elements.empty())
+        return;
+
+    vector<uint64_t> vHashes = BuildHashedSet(elements);
+    CBitWriter writer(vEncoded);
+    uint64_t nLast = 0;
+    BOOST_FOREACH(uint64_t nHash, vHashes)
+    {
+        GolombRiceEncode(writer, P, nHash - nLast);
+        nLast = nHash;
+    }
+    writer.Flush();
+}
+
+uint64_t CGCSFilter::HashToRange(const Element& element) const
+{
+    uint64_t nHash = SipHash(k0, k1, element.empty() ? NULL : &element[0], element.size());
+    return MapIntoRange(nHash, F);
+}
+
+vector<uint64_t> CGCSFilter::BuildHashedSet(const ElementSet& elements) const
+{
+    vector<uint64_t> vHashes;
+    vHashes.reserve(elements.size());
+    BOOST_FOREACH(const Element& element, elements)
+        vHashes.push_back(HashToRange(element));
+    sort(vHashes.begin(), vHashes.end());
+    return vHashes;
+}
+
+bool CGCSFilter::MatchInternal(const uint64_t* pHashes, size_t nSize) const
+{
+    // Both the filter and pHashes are sorted, walk them side by side
+    CBitReader reader(vEncoded, GetSizeOfCompactSize(N));
+    uint64_t nValue = 0;
+    size_t nQuery = 0;
+    for (uint64_t i = 0; i < N; i++)
+    {
+        nValue += GolombRiceDecode(reader, P);
+        while (true)
+        {
+            if (nQuery == nSize)
+                return false;
+            if (pHashes[nQuery] == nValue)
+                return true;
+            if (pHashes[nQuery] > nValue)
+                break;
+            nQuery++;
+        }
+    }
+    return false;
+}
+
+bool CGCSFilter::Match(const Element& element) const
+{
+    if (N == 0)
+        return false;
+    uint64_t nQuery = HashToRange(element);
+    return MatchInternal(&nQuery, 1);
+}
+
+bool CGCSFilter::MatchAny(const ElementSet& elements) const
+{
+    if (N == 0 || elements.empty())
+        return false;
+    vector<uint64_t> vQueries = BuildHashedSet(elements);
+    return MatchInternal(&vQueries[0], vQueries.size());
+}
+
+static CGCSFilter::ElementSet BasicFilterElements(const CBlock& block, const CBlockUndo& blockundo)
+{
+    CGCSFilter::ElementSet elements;
+    BOOST_FOREACH(const CTransaction& tx, block.vtx)
+    {
+        BOOST_FOREACH(const CTxOut& txout, tx.vout)
+        {
+            const CScript& script = txout.scriptPubKey;
+            if (script.empty() || script[0] == OP_RETURN)
+                continue;
+            elements.insert(CGCSFilter::Element(script.begin(), script.end()));
+        }
+    }
+    BOOST_FOREACH(const CTxUndo& txundo, blockundo.vtxundo)
+    {
+        BOOST_FOREACH(const CTxInUndo& prevout, txundo.vprevout)
+        {
+            const CScript& script = prevout.txout.scriptPubKey;
+            if (script.empty())
+                continue;
+            elements.insert(CGCSFilter::Element(script.begin(), script.end()));
+        }
+    }
+    return elements;
+}
+
+CBlockFilter::CBlockFilter(BlockFilterType filterTypeIn, const CBlock& block, const CBlockUndo& blockundo) :
+    filterType(filterTypeIn), hashBlock(block.GetHash())
+{
+    assert(filterType == BLOCK_FILTER_BASIC);
+    filter = CGCSFilter(hashBlock.GetLow64(), (hashBlock >> 64).GetLow64(), BASIC_FILTER_P, BASIC_FILTER_M,
+                        BasicFilterElements(block, blockundo));
+}
+
+CBlockFilter::CBlockFilter(BlockFilterType filterTypeIn, const uint256& hashBlockIn, const vector<unsigned char>& vEncoded) :
+    filterType(filterTypeIn), hashBlock(hashBlockIn)
+{
+    assert(filterType == BLOCK_FILTER_BASIC);
+    filter = CGCSFilter(hashBlock.GetLow64(), (hashBlock >> 64).GetLow64(), BASIC_FILTER_P, BASIC_FILTER_M, vEncoded);
+}
+
+uint256 CBlockFilter::GetHash() const
+{
+    const vector<unsigned char>& vEncoded = filter.GetEncoded();
+    return Hash(vEncoded.begin(), vEncoded.end());
+}
+
+uint256 CBlockFilter::ComputeHeader(const uint256& hashPrevHeader) const
+{
+    uint256 hashFilter = GetHash();
+    return Hash(hashFilter.begin(), hashFilter.end(), hashPrevHeader.begin(), hashPrevHeader.end());
+}
+
+bool BlockFilterTypeByName(const string& name, BlockFilterType& filterType)
+{
+    if (name == "basic") {
+        filterType = BLOCK_FILTER_BASIC;
+        return true;
+    }
+    return false;
+}
+
+const char* BlockFilterTypeName(BlockFilterType filterType)
+{
+    switch (filterType)
+    {
+    case BLOCK_FILTER_BASIC: return "basic";
+    }
+    return "";
+}
+
+CBlockFilterIndex::CBlockFilterIndex(size_t nCacheSize, bool fMemory, bool fWipe) :
+    db(GetDataDir() / "indexes" / "blockfilter" / "basic", nCacheSize, fMemory, fWipe),
+    pindexBest(NULL), pthreadSync(NULL), fWake(false)
+{
+}
+
+CBlockFilterIndex::~CBlockFilterIndex()
+{
+    Stop();
+}
+
+bool CBlockFilterIndex::Init()
+{
+    uint256 hashBest;
+    if (!db.Read('B', hashBest))
+        return true;
+
+    LOCK(cs_main);
+    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBest);
+    if (mi == mapBlockIndex.end())
+    {
+        LogPrintf("Block filter index best block %s is unknown, rebuilding the index\n", hashBest.ToString());
+        return true;
+    }
+    pindexBest = mi->second;
+    LogPrintf("Block filter index synced up to height %d\n", pindexBest->nHeight);
+    return true;
+}
+
+void CBlockFilterIndex::Start()
+{
+    assert(pthreadSync == NULL);
+    connBlocksChanged = uiInterface.NotifyBlocksChanged.connect(boost::bind(&CBlockFilterIndex::Wake, this));
+    pthreadSync = new boost::thread(boost::bind(&TraceThread<boost::function<void()> >, "blockfilter",
+                                                boost::function<void()>(boost::bind(&CBlockFilterIndex::ThreadSync, this))));
+}
+
+void CBlockFilterIndex::Stop()
+{
+    connBlocksChanged.disconnect();
+    if (pthreadSync == NULL)
+        return;
+    pthreadSync->interrupt();
+    pthreadSync->join();
+    delete pthreadSync;
+    pthreadSync = NULL;
+}
+
+void CBlockFilterIndex::Wake()
+{
+    boost::unique_lock<boost::mutex> lock(mutexWake);
+    fWake = true;
+    condWake.notify_one();
+}
+
+void CBlockFilterIndex::ThreadSync()
+{
+    int64_t nLastLog = GetTime();
+    while (true)
+    {
+        boost::this_thread::interruption_point();
+        if (SyncOne())
+        {
+            if (GetTime() - nLastLog >= 30)
+            {
+                LOCK(cs_main);
+                LogPrintf("Syncing block filter index with block chain, at height %d\n", pindexBest->nHeight);
+                nLastLog = GetTime();
+            }
+            continue;
+        }
+
+        boost::unique_lock<boost::mutex> lock(mutexWake);
+        if (!fWake)
+            condWake.timed_wait(lock, boost::posix_time::seconds(10));
+        fWake = false;
+    }
+}
+
+bool CBlockFilterIndex::SyncOne()
+{
+    uint256 hashBlock, hashPrev;
+    CDiskBlockPos posBlock, posUndo;
+    {
+        LOCK(cs_main);
+
+        // After a reorg, continue from the fork point
+        CBlockIndex* pindexFork = pindexBest;
+        while (pindexFork && !chainActive.Contains(pindexFork))
+            pindexFork = pindexFork->pprev;
+        CBlockIndex* pindexNext = pindexFork ? chainActive.Next(pindexFork) : chainActive.Genesis();
+        if (pindexNext == NULL)
+            return false;
+
+        hashBlock = pindexNext->GetBlockHash();
+        posBlock = pindexNext->GetBlockPos();
+        if (pindexNext->pprev)
+        {
+            hashPrev = pindexNext->pprev->GetBlockHash();
+            posUndo = pindexNext->GetUndoPos();
+        }
+    }
+
+    // Reading the block and undo data is the slow part; do it without cs_main
+    CBlock block;
+    if (!ReadBlockFromDisk(block, posBlock) || block.GetHash() != hashBlock)
+        return error("CBlockFilterIndex::SyncOne : failed to read block %s", hashBlock.ToString());
+
+    // The genesis block spends nothing and has no undo data
+    CBlockUndo blockundo;
+    uint256 hashPrevHeader = 0;
+    if (hashPrev != 0)
+    {
+        if (!blockundo.ReadFromDisk(posUndo, hashPrev))
+            return error("CBlockFilterIndex::SyncOne : failed to read undo data of block %s", hashBlock.ToString());
+        CBlockFilterEntry entryPrev;
+        if (!LookupEntry(hashPrev, entryPrev))
+            return error("CBlockFilterIndex::SyncOne : no filter header for block %s", hashPrev.ToString());
+        hashPrevHeader = entryPrev.header;
+    }
+
+    CBlockFilter filter(BLOCK_FILTER_BASIC, block, blockundo);
+    CBlockFilterEntry entry;
+    entry.hash = filter.GetHash();
+    entry.header = filter.ComputeHeader(hashPrevHeader);
+
+    CLevelDBBatch batch;
+    batch.Write(make_pair('f', hashBlock), filter.GetEncodedFilter());
+    batch.Write(make_pair('h', hashBlock), entry);
+    batch.Write('B', hashBlock);
+    if (!db.WriteBatch(batch))
+        return error("CBlockFilterIndex::SyncOne : failed to write filter of block %s", hashBlock.ToString());
+
+    LOCK(cs_main);
+    pindexBest = mapBlockIndex[hashBlock];
+    return true;
+}
+
+int CBlockFilterIndex::GetBestHeight() const
+{
+    return pindexBest ? pindexBest->nHeight : -1;
+}
+
+bool CBlockFilterIndex::LookupFilter(const uint256& hashBlock, CBlockFilter& filter)
+{
+    vector<unsigned char> vEncoded;
+    if (!db.Read(make_pair('f', hashBlock), vEncoded))
+        return false;
+    try {
+        filter = CBlockFilter(BLOCK_FILTER_BASIC, hashBlock, vEncoded);
+    }
+    catch (std::exception &e) {
+        return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+    }
+    return true;
+}
+
+bool CBlockFilterIndex::LookupEntry(const uint256& hashBlock, CBlockFilterEntry& entry)
+{
+    return db.Read(make_pair('h', hashBlock), entry);
+}
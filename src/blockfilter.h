@@ -0,0 +1,167 @@
+// Copyright (c) 2014 The Carboncoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef CARBONCOIN_BLOCKFILTER_H
+#define CARBONCOIN_BLOCKFILTER_H
+
+#include "leveldbwrapper.h"
+#include "serialize.h"
+#include "uint256.h"
+
+#include <set>
+#include <string>
+#include <vector>
+
+#include <boost/signals2/connection.hpp>
+#include <boost/thread.hpp>
+
+class CBlock;
+class CBlockIndex;
+class CBlockUndo;
+
+/** Golomb-Rice parameter of the basic filter */
+static const unsigned char BASIC_FILTER_P = 19;
+/** Inverse false positive rate of the basic filter */
+static const uint32_t BASIC_FILTER_M = 784931;
+/** Most filters a single getcfilters may ask for */
+static const unsigned int MAX_GETCFILTERS_SIZE = 1000;
+/** Most filter hashes a single getcfheaders may ask for */
+static const unsigned int MAX_GETCFHEADERS_SIZE = 2000;
+/** Blocks between two filter headers of a cfcheckpt */
+static const unsigned int CFCHECKPT_INTERVAL = 1000;
+
+enum BlockFilterType
+{
+    BLOCK_FILTER_BASIC = 0,
+};
+
+/** A Golomb-coded set: each element is hashed into [0, N * M), and the
+ * sorted hashes are written as Golomb-Rice coded differences. Membership
+ * tests have a false positive rate of about 1/M and no false negatives.
+ */
+class CGCSFilter
+{
+public:
+    typedef std::vector<unsigned char> Element;
+    typedef std::set<Element> ElementSet;
+
+private:
+    // siphash keys
+    uint64_t k0, k1;
+    unsigned char P;
+    uint32_t M;
+    uint64_t N;
+    uint64_t F; // N * M
+    // CompactSize N followed by the coded differences
+    std::vector<unsigned char> vEncoded;
+
+    uint64_t HashToRange(const Element& element) const;
+    std::vector<uint64_t> BuildHashedSet(const ElementSet& elements) const;
+    bool MatchInternal(const uint64_t* pHashes, size_t nSize) const;
+
+public:
+    CGCSFilter(uint64_t k0In = 0, uint64_t k1In = 0, unsigned char PIn = 0, uint32_t MIn = 0);
+    // Decode; throws std::ios_base::failure if vEncodedIn is malformed
+    CGCSFilter(uint64_t k0In, uint64_t k1In, unsigned char PIn, uint32_t MIn, const std::vector<unsigned char>& vEncodedIn);
+    CGCSFilter(uint64_t k0In, uint64_t k1In, unsigned char PIn, uint32_t MIn, const ElementSet& elements);
+
+    uint64_t GetN() const { return N; }
+    const std::vector<unsigned char>& GetEncoded() const { return vEncoded; }
+
+    bool Match(const Element& element) const;
+    // True if any of elements may be in the set; a single pass over the filter
+    bool MatchAny(const ElementSet& elements) const;
+};
+
+/** The compact filter of a block, keyed with the first 16 bytes of its hash.
+ * The basic filter holds every output script of the block except OP_RETURN
+ * ones, and the scripts of all outputs it spends.
+ */
+class CBlockFilter
+{
+private:
+    BlockFilterType filterType;
+    uint256 hashBlock;
+    CGCSFilter filter;
+
+public:
+    CBlockFilter() : filterType(BLOCK_FILTER_BASIC) {}
+    CBlockFilter(BlockFilterType filterTypeIn, const CBlock& block, const CBlockUndo& blockundo);
+    // Decode; throws std::ios_base::failure if vEncoded is malformed
+    CBlockFilter(BlockFilterType filterTypeIn, const uint256& hashBlockIn, const std::vector<unsigned char>& vEncoded);
+
+    BlockFilterType GetFilterType() const { return filterType; }
+    const uint256& GetBlockHash() const { return hashBlock; }
+    const CGCSFilter& GetFilter() const { return filter; }
+    const std::vector<unsigned char>& GetEncodedFilter() const { return filter.GetEncoded(); }
+
+    uint256 GetHash() const;
+    // Chains this filter onto the header of the previous block's filter
+    uint256 ComputeHeader(const uint256& hashPrevHeader) const;
+};
+
+bool BlockFilterTypeByName(const std::string& name, BlockFilterType& filterType);
+const char* BlockFilterTypeName(BlockFilterType filterType);
+
+/** Filter hash and header of an indexed block */
+class CBlockFilterEntry
+{
+public:
+    uint256 hash;
+    uint256 header;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(hash);
+        READWRITE(header);
+    )
+};
+
+/** Basic filters of the active chain's blocks (indexes/blockfilter/basic/).
+ * Filters are computed from the blk and rev files by a thread of the index's
+ * own that follows chainActive. Entries are keyed by block hash and stay
+ * valid when their block is reorganized away.
+ */
+class CBlockFilterIndex
+{
+private:
+    CLevelDBWrapper db;
+
+    // Last block that was indexed; guarded by cs_main
+    CBlockIndex* pindexBest;
+
+    boost::thread* pthreadSync;
+    boost::signals2::connection connBlocksChanged;
+    boost::mutex mutexWake;
+    boost::condition_variable condWake;
+    bool fWake;
+
+    CBlockFilterIndex(const CBlockFilterIndex&);
+    void operator=(const CBlockFilterIndex&);
+
+    void ThreadSync();
+
+public:
+    CBlockFilterIndex(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    ~CBlockFilterIndex();
+
+    // Resume from the block the database was last synced to
+    bool Init();
+    void Start();
+    void Stop();
+    // Index the next block of chainActive; false once in sync or on error
+    bool SyncOne();
+    void Wake();
+
+    // Height of the last indexed block, -1 if none; cs_main must be held
+    int GetBestHeight() const;
+
+    bool LookupFilter(const uint256& hashBlock, CBlockFilter& filter);
+    bool LookupEntry(const uint256& hashBlock, CBlockFilterEntry& entry);
+};
+
+/** The block filter index, or NULL without -blockfilterindex */
+extern CBlockFilterIndex* pblockfilterindex;
+
+#endif // CARBONCOIN_BLOCKFILTER_H
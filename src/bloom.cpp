@@ -6,10 +6,14 @@
 
 #include "core.h"
 #include "script.h"
+#include "util.h"
 
 #include <math.h>
 #include <stdlib.h>
 
+#include <algorithm>
+#include <limits>
+
 #define LN2SQUARED 0.4804530139182014246671025263266649717305529515945455
 #define LN2 0.6931471805599453094172321214581765680755001343602552
 
@@ -31,40 +35,56 @@ nFlags(nFlagsIn)
 {
 }
 
-inline unsigned int CBloomFilter::Hash(unsigned int nHashNum, const std::vector<unsigned char>& vDataToHash) const
+inline unsigned int CBloomFilter::Hash(unsigned int nHashNum, const unsigned char* pchData, size_t nDataLen) const
 {
     // 0xFBA4C795 chosen as it guarantees a reasonable bit difference between nHashNum values.
-    return MurmurHash3(nHashNum * 0xFBA4C795 + nTweak, vDataToHash) % (vData.size() * 8);
+    return MurmurHash3(nHashNum * 0xFBA4C795 + nTweak, pchData, nDataLen) % (vData.size() * 8);
 }
 
-void CBloomFilter::insert(const vector<unsigned char>& vKey)
+// Size of a serialized COutPoint
+static const unsigned int OUTPOINT_SIZE = 36;
+
+// Serialize an outpoint as for the network, without a stream
+static inline void WriteOutPoint(const uint256& hash, unsigned int n, unsigned char* pch)
+{
+    memcpy(pch, hash.begin(), 32);
+    pch[32] = n & 0xff;
+    pch[33] = (n >> 8) & 0xff;
+    pch[34] = (n >> 16) & 0xff;
+    pch[35] = (n >> 24) & 0xff;
+}
+
+void CBloomFilter::insert(const unsigned char* pchKey, size_t nKeyLen)
 {
     if (isFull)
         return;
     for (unsigned int i = 0; i < nHashFuncs; i++)
     {
-        unsigned int nIndex = Hash(i, vKey);
+        unsigned int nIndex = Hash(i, pchKey, nKeyLen);
         // Sets bit nIndex of vData
         vData[nIndex >> 3] |= (1 << (7 & nIndex));
     }
     isEmpty = false;
 }
 
+void CBloomFilter::insert(const vector<unsigned char>& vKey)
+{
+    insert(vKey.empty() ? NULL : &vKey[0], vKey.size());
+}
+
 void CBloomFilter::insert(const COutPoint& outpoint)
 {
-    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
-    stream << outpoint;
-    vector<unsigned char> data(stream.begin(), stream.end());
-    insert(data);
+    unsigned char pch[OUTPOINT_SIZE];
+    WriteOutPoint(outpoint.hash, outpoint.n, pch);
+    insert(pch, sizeof(pch));
 }
 
 void CBloomFilter::insert(const uint256& hash)
 {
-    vector<unsigned char> data(hash.begin(), hash.end());
-    insert(data);
+    insert(hash.begin(), hash.size());
 }
 
-bool CBloomFilter::contains(const vector<unsigned char>& vKey) const
+bool CBloomFilter::contains(const unsigned char* pchKey, size_t nKeyLen) const
 {
     if (isFull)
         return true;
@@ -72,7 +92,7 @@ bool CBloomFilter::contains(const vector<unsigned char>& vKey) const
         return false;
     for (unsigned int i = 0; i < nHashFuncs; i++)
     {
-        unsigned int nIndex = Hash(i, vKey);
+        unsigned int nIndex = Hash(i, pchKey, nKeyLen);
         // Checks bit nIndex of vData
         if (!(vData[nIndex >> 3] & (1 << (7 & nIndex))))
             return false;
@@ -80,18 +100,21 @@ bool CBloomFilter::contains(const vector<unsigned char>& vKey) const
     return true;
 }
 
+bool CBloomFilter::contains(const vector<unsigned char>& vKey) const
+{
+    return contains(vKey.empty() ? NULL : &vKey[0], vKey.size());
+}
+
 bool CBloomFilter::contains(const COutPoint& outpoint) const
 {
-    CDataStream stream(SER_NETWORK, PROTOCOL_VERSION);
-    stream << outpoint;
-    vector<unsigned char> data(stream.begin(), stream.end());
-    return contains(data);
+    unsigned char pch[OUTPOINT_SIZE];
+    WriteOutPoint(outpoint.hash, outpoint.n, pch);
+    return contains(pch, sizeof(pch));
 }
 
 bool CBloomFilter::contains(const uint256& hash) const
 {
-    vector<unsigned char> data(hash.begin(), hash.end());
-    return contains(data);
+    return contains(hash.begin(), hash.size());
 }
 
 bool CBloomFilter::IsWithinSizeConstraints() const
@@ -99,7 +122,37 @@ bool CBloomFilter::IsWithinSizeConstraints() const
     return vData.size() <= MAX_BLOOM_FILTER_SIZE && nHashFuncs <= MAX_HASH_FUNCS;
 }
 
-bool CBloomFilter::IsRelevantAndUpdate(const CTransaction& tx, const uint256& hash)
+// Adds the pushed data of script to vElements, stopping where the script
+// can't be parsed further
+static void AddScriptElements(const CScript& script, unsigned int nIndex, vector<CBloomTxElements::Element>& vElements)
+{
+    CScript::const_iterator pc = script.begin();
+    while (pc < script.end())
+    {
+        opcodetype opcode;
+        CBloomTxElements::Element element;
+        if (!script.GetOp(pc, opcode, element.pch, element.nSize))
+            break;
+        if (element.nSize != 0)
+        {
+            element.nIndex = nIndex;
+            vElements.push_back(element);
+        }
+    }
+}
+
+CBloomTxElements::CBloomTxElements(const CTransaction& txIn, const uint256& hashIn) : tx(txIn), hash(hashIn)
+{
+    // Standard scripts push two or three elements at most
+    vElements.reserve(2 * (tx.vout.size() + tx.vin.size()));
+    for (unsigned int i = 0; i < tx.vout.size(); i++)
+        AddScriptElements(tx.vout[i].scriptPubKey, i, vElements);
+    nOutputElements = vElements.size();
+    for (unsigned int i = 0; i < tx.vin.size(); i++)
+        AddScriptElements(tx.vin[i].scriptSig, i, vElements);
+}
+
+bool CBloomFilter::IsRelevantAndUpdate(const CBloomTxElements& elements)
 {
     bool fFound = false;
     // Match if the filter contains the hash of tx
@@ -108,66 +161,66 @@ bool CBloomFilter::IsRelevantAndUpdate(const CTransaction& tx, const uint256& ha
         return true;
     if (isEmpty)
         return false;
-    if (contains(hash))
+    if (contains(elements.hash))
         fFound = true;
 
-    for (unsigned int i = 0; i < tx.vout.size(); i++)
+    // Match if the filter contains any arbitrary script data element in any scriptPubKey in tx
+    // If this matches, also add the specific output that was matched.
+    // This means clients don't have to update the filter themselves when a new relevant tx
+    // is discovered in order to find spending transactions, which avoids round-tripping and race conditions.
+    const CTransaction& tx = elements.tx;
+    for (unsigned int i = 0; i < elements.nOutputElements; i++)
     {
-        const CTxOut& txout = tx.vout[i];
-        // Match if the filter contains any arbitrary script data element in any scriptPubKey in tx
-        // If this matches, also add the specific output that was matched.
-        // This means clients don't have to update the filter themselves when a new relevant tx 
-        // is discovered in order to find spending transactions, which avoids round-tripping and race conditions.
-        CScript::const_iterator pc = txout.scriptPubKey.begin();
-        vector<unsigned char> data;
-        while (pc < txout.scriptPubKey.end())
+        const CBloomTxElements::Element& element = elements.vElements[i];
+        if (!contains(element.pch, element.nSize))
+            continue;
+
+        fFound = true;
+        unsigned int nOut = element.nIndex;
+        if ((nFlags & BLOOM_UPDATE_MASK) == BLOOM_UPDATE_ALL)
+            insert(COutPoint(elements.hash, nOut));
+        else if ((nFlags & BLOOM_UPDATE_MASK) == BLOOM_UPDATE_P2PUBKEY_ONLY)
         {
-            opcodetype opcode;
-            if (!txout.scriptPubKey.GetOp(pc, opcode, data))
-                break;
-            if (data.size() != 0 && contains(data))
-            {
-                fFound = true;
-                if ((nFlags & BLOOM_UPDATE_MASK) == BLOOM_UPDATE_ALL)
-                    insert(COutPoint(hash, i));
-                else if ((nFlags & BLOOM_UPDATE_MASK) == BLOOM_UPDATE_P2PUBKEY_ONLY)
-                {
-                    txnouttype type;
-                    vector<vector<unsigned char> > vSolutions;
-                    if (Solver(txout.scriptPubKey, type, vSolutions) &&
-                            (type == TX_PUBKEY || type == TX_MULTISIG))
-                        insert(COutPoint(hash, i));
-                }
-                break;
-            }
+            txnouttype type;
+            vector<vector<unsigned char> > vSolutions;
+            if (Solver(tx.vout[nOut].scriptPubKey, type, vSolutions) &&
+                    (type == TX_PUBKEY || type == TX_MULTISIG))
+                insert(COutPoint(elements.hash, nOut));
         }
+        // One match per output is enough, skip the rest of its elements
+        while (i + 1 < elements.nOutputElements && elements.vElements[i + 1].nIndex == nOut)
+            i++;
     }
 
     if (fFound)
         return true;
 
+    // Match if the filter contains an outpoint tx spends
+    unsigned char pchOutPoint[OUTPOINT_SIZE];
     BOOST_FOREACH(const CTxIn& txin, tx.vin)
     {
-        // Match if the filter contains an outpoint tx spends
-        if (contains(txin.prevout))
+        WriteOutPoint(txin.prevout.hash, txin.prevout.n, pchOutPoint);
+        if (contains(pchOutPoint, sizeof(pchOutPoint)))
             return true;
-
-        // Match if the filter contains any arbitrary script data element in any scriptSig in tx
-        CScript::const_iterator pc = txin.scriptSig.begin();
-        vector<unsigned char> data;
-        while (pc < txin.scriptSig.end())
-        {
-            opcodetype opcode;
-            if (!txin.scriptSig.GetOp(pc, opcode, data))
-                break;
-            if (data.size() != 0 && contains(data))
-                return true;
-        }
     }
 
+    // Match if the filter contains any arbitrary script data element in any scriptSig in tx
+    for (unsigned int i = elements.nOutputElements; i < elements.vElements.size(); i++)
+        if (contains(elements.vElements[i].pch, elements.vElements[i].nSize))
+            return true;
+
     return false;
 }
 
+bool CBloomFilter::IsRelevantAndUpdate(const CTransaction& tx, const uint256& hash)
+{
+    if (isFull)
+        return true;
+    if (isEmpty)
+        return false;
+    return IsRelevantAndUpdate(CBloomTxElements(tx, hash));
+}
+
 void CBloomFilter::UpdateEmptyFull()
 {
     bool full = true;
@@ -180,3 +233,91 @@ void CBloomFilter::UpdateEmptyFull()
     isFull = full;
     isEmpty = empty;
 }
+
+CRollingBloomFilter::CRollingBloomFilter(unsigned int nElements, double fpRate)
+{
+    double logFpRate = log(fpRate);
+    // The optimal number of hash functions is log(fpRate) / log(0.5), kept
+    // within 1-50
+    nHashFuncs = max(1, min((int)floor(logFpRate / log(0.5) + 0.5), (int)MAX_HASH_FUNCS));
+    // Between two and three generations of nElements / 2 entries are stored
+    nEntriesPerGeneration = (nElements + 1) / 2;
+    unsigned int nMaxElements = nEntriesPerGeneration * 3;
+    // The false positive rate at nMaxElements entries is
+    //   pow(1.0 - exp(-nHashFuncs * nMaxElements / nFilterBits), nHashFuncs)
+    // so solve that for nFilterBits
+    unsigned int nFilterBits = (unsigned int)ceil(-1.0 * nHashFuncs * nMaxElements / log(1.0 - exp(logFpRate / nHashFuncs)));
+    data.resize(((nFilterBits + 63) / 64) << 1);
+    reset();
+}
+
+static inline unsigned int RollingBloomHash(unsigned int nHashNum, unsigned int nTweak, const vector<unsigned char>& vDataToHash)
+{
+    return MurmurHash3(nHashNum * 0xFBA4C795 + nTweak, vDataToHash);
+}
+
+void CRollingBloomFilter::insert(const vector<unsigned char>& vKey)
+{
+    if (nEntriesThisGeneration == nEntriesPerGeneration)
+    {
+        nEntriesThisGeneration = 0;
+        nGeneration++;
+        if (nGeneration == 4)
+            nGeneration = 1;
+        uint64_t nGenerationMask1 = 0 - (uint64_t)(nGeneration & 1);
+        uint64_t nGenerationMask2 = 0 - (uint64_t)(nGeneration >> 1);
+        // Wipe the entries of the generation being reused
+        for (unsigned int p = 0; p < data.size(); p += 2)
+        {
+            uint64_t p1 = data[p], p2 = data[p + 1];
+            uint64_t mask = (p1 ^ nGenerationMask1) | (p2 ^ nGenerationMask2);
+            data[p] = p1 & mask;
+            data[p + 1] = p2 & mask;
+        }
+    }
+    nEntriesThisGeneration++;
+
+    for (unsigned int n = 0; n < nHashFuncs; n++)
+    {
+        unsigned int h = RollingBloomHash(n, nTweak, vKey);
+        int bit = h & 0x3F;
+        unsigned int pos = (h >> 6) % data.size();
+        // The lowest bit of pos is ignored; the pair is data[pos & ~1] and data[pos | 1]
+        data[pos & ~1] = (data[pos & ~1] & ~(((uint64_t)1) << bit)) | ((uint64_t)(nGeneration & 1)) << bit;
+        data[pos | 1] = (data[pos | 1] & ~(((uint64_t)1) << bit)) | ((uint64_t)(nGeneration >> 1)) << bit;
+    }
+}
+
+void CRollingBloomFilter::insert(const uint256& hash)
+{
+    vector<unsigned char> vData(hash.begin(), hash.end());
+    insert(vData);
+}
+
+bool CRollingBloomFilter::contains(const vector<unsigned char>& vKey) const
+{
+    for (unsigned int n = 0; n < nHashFuncs; n++)
+    {
+        unsigned int h = RollingBloomHash(n, nTweak, vKey);
+        int bit = h & 0x3F;
+        unsigned int pos = (h >> 6) % data.size();
+        // Set if either bit of the pair is
+        if (!(((data[pos & ~1] | data[pos | 1]) >> bit) & 1))
+            return false;
+    }
+    return true;
+}
+
+bool CRollingBloomFilter::contains(const uint256& hash) const
+{
+    vector<unsigned char> vData(hash.begin(), hash.end());
+    return contains(vData);
+}
+
+void CRollingBloomFilter::reset()
+{
+    nTweak = GetRand(std::numeric_limits<unsigned int>::max());
+    nEntriesThisGeneration = 0;
+    nGeneration = 1;
+    std::fill(data.begin(), data.end(), 0);
+}
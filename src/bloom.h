@@ -6,12 +6,37 @@
 #define CARBONCOIN_BLOOM_H
 
 #include "serialize.h"
+#include "uint256.h"
 
+#include <stdint.h>
 #include <vector>
 
 class COutPoint;
 class CTransaction;
-class uint256;
+
+/** The data a bloom filter matches a transaction on, found once per
+ * transaction so that relaying it to many filtered peers parses its scripts
+ * only once. Elements point into the transaction, which must outlive this.
+ */
+class CBloomTxElements
+{
+public:
+    struct Element
+    {
+        const unsigned char* pch;
+        unsigned int nSize;
+        // Index of the output or input whose script has the element
+        unsigned int nIndex;
+    };
+
+    const CTransaction& tx;
+    uint256 hash;
+    // Pushed data of all scriptPubKeys, by output, then of all scriptSigs
+    std::vector<Element> vElements;
+    unsigned int nOutputElements;
+
+    CBloomTxElements(const CTransaction& txIn, const uint256& hashIn);
+};
 
 // 20,000 items with fp rate < 0.1% or 10,000 items and <0.0001%
 static const unsigned int MAX_BLOOM_FILTER_SIZE = 36000; // bytes
@@ -49,7 +74,7 @@ private:
     unsigned int nTweak;
     unsigned char nFlags;
 
-    unsigned int Hash(unsigned int nHashNum, const std::vector<unsigned char>& vDataToHash) const;
+    unsigned int Hash(unsigned int nHashNum, const unsigned char* pchData, size_t nDataLen) const;
 
 public:
     // Creates a new bloom filter which will provide the given fp rate when filled with the given number of elements
@@ -70,10 +95,12 @@ public:
         READWRITE(nFlags);
     )
 
+    void insert(const unsigned char* pchKey, size_t nKeyLen);
     void insert(const std::vector<unsigned char>& vKey);
     void insert(const COutPoint& outpoint);
     void insert(const uint256& hash);
 
+    bool contains(const unsigned char* pchKey, size_t nKeyLen) const;
     bool contains(const std::vector<unsigned char>& vKey) const;
     bool contains(const COutPoint& outpoint) const;
     bool contains(const uint256& hash) const;
@@ -83,10 +110,52 @@ public:
     bool IsWithinSizeConstraints() const;
 
     // Also adds any outputs which match the filter to the filter (to match their spending txes)
+    bool IsRelevantAndUpdate(const CBloomTxElements& elements);
     bool IsRelevantAndUpdate(const CTransaction& tx, const uint256& hash);
 
     // Checks for empty and full filters to avoid wasting cpu
     void UpdateEmptyFull();
 };
 
+/**
+ * RollingBloomFilter is a probabilistic "keep track of most recently inserted" set.
+ * Construct it with the number of items to keep track of, and a false-positive
+ * rate. Unlike CBloomFilter, by default nTweak is set to a cryptographically
+ * secure random value for you. Similarly rather than clear() the method
+ * reset() is provided, which also changes nTweak to decrease the impact of
+ * false-positives.
+ *
+ * Entries are stamped with one of three generations of nElements / 2 items
+ * each; when a new generation starts the oldest one is wiped, so between
+ * nElements and 1.5 * nElements of the most recent items are remembered.
+ * Memory use is fixed at construction, about 2 * 1.5 * nElements *
+ * log2(1 / nFPRate) * 1.44 bits.
+ */
+class CRollingBloomFilter
+{
+public:
+    CRollingBloomFilter(unsigned int nElements, double nFPRate);
+
+    void insert(const std::vector<unsigned char>& vKey);
+    void insert(const uint256& hash);
+    bool contains(const std::vector<unsigned char>& vKey) const;
+    bool contains(const uint256& hash) const;
+
+    void reset();
+
+    // Bytes taken by the filter's bit array
+    size_t DynamicMemoryUsage() const { return data.size() * sizeof(uint64_t); }
+
+private:
+    unsigned int nEntriesPerGeneration;
+    unsigned int nEntriesThisGeneration;
+    unsigned int nGeneration;
+    // Two bits per position: both zero means unset, otherwise they hold the
+    // generation (1, 2 or 3) that set it. Position p uses bit (p & 63) of
+    // data[(p >> 6) * 2] and of data[(p >> 6) * 2 + 1].
+    std::vector<uint64_t> data;
+    unsigned int nTweak;
+    unsigned int nHashFuncs;
+};
+
 #endif /* CARBONCOIN_BLOOM_H */
@@ -0,0 +1,176 @@
+// Copyright (c) 2014 The Carboncoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "compactblock.h"
+
+#include "hash.h"
+#include "main.h"
+#include "txmempool.h"
+#include "util.h"
+
+#include <boost/unordered_map.hpp>
+
+using namespace std;
+
+CCompactBlock::CCompactBlock(const CBlock& block, uint64_t nonceIn) :
+    header(block.GetBlockHeader()), nonce(nonceIn)
+{
+    FillShortTxIDSelector();
+    if (block.vtx.empty())
+        return;
+
+    CPrefilledTransaction coinbase;
+    coinbase.index = 0;
+    coinbase.tx = block.vtx[0];
+    prefilledtxn.push_back(coinbase);
+
+    shorttxids.reserve(block.vtx.size() - 1);
+    for (unsigned int i = 1; i < block.vtx.size(); i++)
+        shorttxids.push_back(GetShortID(block.vtx[i].GetHash()));
+}
+
+void CCompactBlock::FillShortTxIDSelector()
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << header << nonce;
+    uint256 hashKey;
+    SHA256((unsigned char*)&ss[0], ss.size(), (unsigned char*)&hashKey);
+    k0 = hashKey.GetLow64();
+    k1 = (hashKey >> 64).GetLow64();
+}
+
+uint64_t CCompactBlock::GetShortID(const uint256& txhash) const
+{
+    return SipHashUint256(k0, k1, txhash) & 0xffffffffffffULL;
+}
+
+ReadStatus CPartialBlock::InitData(const CCompactBlock& cmpctblock, const vector<pair<uint256, const CTransaction*> >& vExtraTxn)
+{
+    if (cmpctblock.header.IsNull() || (cmpctblock.shorttxids.empty() && cmpctblock.prefilledtxn.empty()))
+        return READ_STATUS_INVALID;
+    if (cmpctblock.BlockTxCount() > MAX_BLOCK_SIZE / ::GetSerializeSize(CTransaction(), SER_NETWORK, PROTOCOL_VERSION))
+        return READ_STATUS_INVALID;
+
+    header = cmpctblock.header;
+    vtx.clear();
+    vtx.resize(cmpctblock.BlockTxCount());
+    vHave.assign(vtx.size(), false);
+    nPrefilled = 0;
+    nFromPool = 0;
+
+    BOOST_FOREACH(const CPrefilledTransaction& prefilled, cmpctblock.prefilledtxn)
+    {
+        if (prefilled.index >= vtx.size() || vHave[prefilled.index] || prefilled.tx.IsNull())
+            return READ_STATUS_INVALID;
+        vtx[prefilled.index] = prefilled.tx;
+        vHave[prefilled.index] = true;
+        nPrefilled++;
+    }
+
+    // Map each short id to the slot it fills. Two transactions of the same
+    // block sharing a short id can't be told apart, so fall back to the
+    // full block.
+    boost::unordered_map<uint64_t, unsigned int> mapShortIDs;
+    unsigned int nSlot = 0;
+    BOOST_FOREACH(uint64_t shortid, cmpctblock.shorttxids)
+    {
+        while (vHave[nSlot])
+            nSlot++;
+        if (!mapShortIDs.insert(make_pair(shortid, nSlot)).second)
+            return READ_STATUS_FAILED;
+        nSlot++;
+    }
+
+    // A pool transaction whose short id matches a slot another one already
+    // filled is ambiguous; leave the slot to be requested instead.
+    vector<bool> vCollision(vtx.size(), false);
+    unsigned int nMatched = 0;
+    if (pool)
+    {
+        LOCK(pool->cs);
+        for (map<uint256, CTxMemPoolEntry>::const_iterator it = pool->mapTx.begin(); it != pool->mapTx.end() && nMatched < mapShortIDs.size(); ++it)
+        {
+            boost::unordered_map<uint64_t, unsigned int>::const_iterator itID = mapShortIDs.find(cmpctblock.GetShortID(it->first));
+            if (itID == mapShortIDs.end() || vCollision[itID->second])
+                continue;
+            if (vHave[itID->second]) {
+                vHave[itID->second] = false;
+                vCollision[itID->second] = true;
+                nMatched--;
+                continue;
+            }
+            vtx[itID->second] = it->second.GetTx();
+            vHave[itID->second] = true;
+            nMatched++;
+        }
+    }
+    for (unsigned int i = 0; i < vExtraTxn.size() && nMatched < mapShortIDs.size(); i++)
+    {
+        boost::unordered_map<uint64_t, unsigned int>::const_iterator itID = mapShortIDs.find(cmpctblock.GetShortID(vExtraTxn[i].first));
+        if (itID == mapShortIDs.end() || vCollision[itID->second])
+            continue;
+        if (vHave[itID->second]) {
+            // The same transaction may be both in the pool and an orphan
+            if (vtx[itID->second].GetHash() != vExtraTxn[i].first) {
+                vHave[itID->second] = false;
+                vCollision[itID->second] = true;
+                nMatched--;
+            }
+            continue;
+        }
+        vtx[itID->second] = *vExtraTxn[i].second;
+        vHave[itID->second] = true;
+        nMatched++;
+    }
+    nFromPool = nMatched;
+
+    LogPrint("net", "Initialized compact block %s: %u prefilled, %u from pool, %u to request\n",
+             header.GetHash().ToString(), nPrefilled, nFromPool, vtx.size() - nPrefilled - nFromPool);
+    return READ_STATUS_OK;
+}
+
+bool CPartialBlock::IsTxAvailable(unsigned int index) const
+{
+    assert(!header.IsNull());
+    assert(index < vHave.size());
+    return vHave[index];
+}
+
+void CPartialBlock::GetMissing(vector<unsigned int>& vIndexes) const
+{
+    vIndexes.clear();
+    for (unsigned int i = 0; i < vHave.size(); i++)
+        if (!vHave[i])
+            vIndexes.push_back(i);
+}
+
+ReadStatus CPartialBlock::FillBlock(CBlock& block, const vector<CTransaction>& vtxMissing)
+{
+    assert(!header.IsNull());
+
+    unsigned int nMissing = 0;
+    for (unsigned int i = 0; i < vtx.size(); i++)
+    {
+        if (vHave[i])
+            continue;
+        if (nMissing >= vtxMissing.size())
+            return READ_STATUS_INVALID;
+        vtx[i] = vtxMissing[nMissing++];
+        vHave[i] = true;
+    }
+    if (nMissing != vtxMissing.size())
+        return READ_STATUS_INVALID;
+
+    block = CBlock(header);
+    block.vtx.swap(vtx);
+    vHave.clear();
+
+    // A short id collision with an unrelated transaction only shows up here
+    if (block.BuildMerkleTree() != block.hashMerkleRoot)
+        return READ_STATUS_FAILED;
+
+    LogPrint("net", "Reconstructed block %s: %u prefilled, %u from pool, %u requested\n",
+             block.GetHash().ToString(), nPrefilled, nFromPool, vtxMissing.size());
+    return READ_STATUS_OK;
+}
@@ -0,0 +1,200 @@
+// Copyright (c) 2014 The Carboncoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef CARBONCOIN_COMPACTBLOCK_H
+#define CARBONCOIN_COMPACTBLOCK_H
+
+#include "core.h"
+#include "serialize.h"
+
+#include <utility>
+#include <vector>
+
+class CTxMemPool;
+
+/** Bytes used for a short transaction id on the wire */
+static const unsigned int SHORTTXID_SIZE = 6;
+/** Highest transaction index a compact block or a getblocktxn request may refer to */
+static const unsigned int MAX_COMPACT_BLOCK_TXS = 0xffff;
+
+/** A transaction the sender of a compact block expects the receiver not to
+ * have (such as the coinbase), sent in full with its position in the block */
+class CPrefilledTransaction
+{
+public:
+    unsigned int index;
+    CTransaction tx;
+};
+
+/** A block relayed as its header, a short salted id for each transaction
+ * and a few transactions in full. The receiver fills in the rest from its
+ * memory pool and asks for whatever is left with getblocktxn.
+ */
+class CCompactBlock
+{
+private:
+    // siphash keys derived from the header and nonce
+    uint64_t k0, k1;
+
+    void FillShortTxIDSelector();
+
+public:
+    CBlockHeader header;
+    uint64_t nonce;
+    std::vector<uint64_t> shorttxids;
+    // Sorted by index; sent with each index relative to the previous one
+    std::vector<CPrefilledTransaction> prefilledtxn;
+
+    CCompactBlock() : k0(0), k1(0), nonce(0) {}
+
+    // Build from a full block, prefilling only the coinbase
+    CCompactBlock(const CBlock& block, uint64_t nonceIn);
+
+    uint64_t GetShortID(const uint256& txhash) const;
+
+    unsigned int BlockTxCount() const { return shorttxids.size() + prefilledtxn.size(); }
+
+    IMPLEMENT_SERIALIZE
+    (
+        CCompactBlock &us = *(const_cast<CCompactBlock*>(this));
+        READWRITE(header);
+        READWRITE(nonce);
+
+        std::vector<unsigned char> vBytes;
+        if (fRead) {
+            READWRITE(vBytes);
+            if (vBytes.size() % SHORTTXID_SIZE != 0)
+                throw std::ios_base::failure("CCompactBlock : short ids not a multiple of their size");
+            us.shorttxids.resize(vBytes.size() / SHORTTXID_SIZE);
+            for (unsigned int i = 0; i < us.shorttxids.size(); i++) {
+                uint64_t nShortID = 0;
+                for (int j = SHORTTXID_SIZE - 1; j >= 0; j--)
+                    nShortID = (nShortID << 8) | vBytes[i * SHORTTXID_SIZE + j];
+                us.shorttxids[i] = nShortID;
+            }
+        } else {
+            vBytes.resize(shorttxids.size() * SHORTTXID_SIZE);
+            for (unsigned int i = 0; i < shorttxids.size(); i++)
+                for (unsigned int j = 0; j < SHORTTXID_SIZE; j++)
+                    vBytes[i * SHORTTXID_SIZE + j] = (shorttxids[i] >> (8 * j)) & 0xff;
+            READWRITE(vBytes);
+        }
+
+        unsigned int nPrefilled = prefilledtxn.size();
+        READWRITE(VARINT(nPrefilled));
+        if (fRead) {
+            if (nPrefilled > MAX_COMPACT_BLOCK_TXS)
+                throw std::ios_base::failure("CCompactBlock : too many prefilled transactions");
+            us.prefilledtxn.resize(nPrefilled);
+        }
+        unsigned int nNextIndex = 0;
+        for (unsigned int i = 0; i < nPrefilled; i++) {
+            unsigned int nOffset = us.prefilledtxn[i].index - nNextIndex;
+            READWRITE(VARINT(nOffset));
+            if (fRead) {
+                if (nOffset > MAX_COMPACT_BLOCK_TXS - nNextIndex)
+                    throw std::ios_base::failure("CCompactBlock : prefilled index out of range");
+                us.prefilledtxn[i].index = nNextIndex + nOffset;
+            }
+            nNextIndex = us.prefilledtxn[i].index + 1;
+            READWRITE(us.prefilledtxn[i].tx);
+        }
+
+        if (fRead)
+            us.FillShortTxIDSelector();
+    )
+};
+
+/** getblocktxn: the positions of the transactions of a compact block that
+ * the requester could not fill in itself */
+class CBlockTransactionsRequest
+{
+public:
+    uint256 blockhash;
+    // Sorted ascending; sent with each index relative to the previous one
+    std::vector<unsigned int> indexes;
+
+    IMPLEMENT_SERIALIZE
+    (
+        CBlockTransactionsRequest &us = *(const_cast<CBlockTransactionsRequest*>(this));
+        READWRITE(blockhash);
+        unsigned int nIndexes = indexes.size();
+        READWRITE(VARINT(nIndexes));
+        if (fRead) {
+            if (nIndexes > MAX_COMPACT_BLOCK_TXS)
+                throw std::ios_base::failure("CBlockTransactionsRequest : too many indexes");
+            us.indexes.resize(nIndexes);
+        }
+        unsigned int nNextIndex = 0;
+        for (unsigned int i = 0; i < nIndexes; i++) {
+            unsigned int nOffset = us.indexes[i] - nNextIndex;
+            READWRITE(VARINT(nOffset));
+            if (fRead) {
+                if (nOffset > MAX_COMPACT_BLOCK_TXS - nNextIndex)
+                    throw std::ios_base::failure("CBlockTransactionsRequest : index out of range");
+                us.indexes[i] = nNextIndex + nOffset;
+            }
+            nNextIndex = us.indexes[i] + 1;
+        }
+    )
+};
+
+/** blocktxn: the transactions asked for by a getblocktxn, in request order */
+class CBlockTransactions
+{
+public:
+    uint256 blockhash;
+    std::vector<CTransaction> txn;
+
+    CBlockTransactions() {}
+    CBlockTransactions(const CBlockTransactionsRequest& req) : blockhash(req.blockhash), txn(req.indexes.size()) {}
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(blockhash);
+        READWRITE(txn);
+    )
+};
+
+enum ReadStatus
+{
+    READ_STATUS_OK,
+    // The peer sent something malformed
+    READ_STATUS_INVALID,
+    // Reconstruction failed (short id collision); fetch the full block
+    READ_STATUS_FAILED,
+};
+
+/** A block being rebuilt from a compact block and the transactions we
+ * already have. Transactions still missing after InitData are fetched with
+ * getblocktxn and handed to FillBlock.
+ */
+class CPartialBlock
+{
+private:
+    const CTxMemPool* pool;
+    CBlockHeader header;
+    std::vector<CTransaction> vtx;
+    std::vector<bool> vHave;
+    unsigned int nPrefilled;
+    unsigned int nFromPool;
+
+public:
+    CPartialBlock(const CTxMemPool* poolIn) : pool(poolIn), nPrefilled(0), nFromPool(0) {}
+
+    // vExtraTxn are transactions outside the memory pool (orphans) that may
+    // be in the block as well.
+    ReadStatus InitData(const CCompactBlock& cmpctblock, const std::vector<std::pair<uint256, const CTransaction*> >& vExtraTxn);
+    bool IsTxAvailable(unsigned int index) const;
+    // Indexes to request with getblocktxn
+    void GetMissing(std::vector<unsigned int>& vIndexes) const;
+    // Completes the block with vtxMissing, which must be in GetMissing order.
+    // Fails if the result does not match the header's merkle root.
+    ReadStatus FillBlock(CBlock& block, const std::vector<CTransaction>& vtxMissing);
+
+    unsigned int GetPrefilledCount() const { return nPrefilled; }
+    unsigned int GetFromPoolCount() const { return nFromPool; }
+};
+
+#endif // CARBONCOIN_COMPACTBLOCK_H
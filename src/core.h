@@ -386,6 +386,7 @@ public:
     }
 
     uint256 GetHash() const;
+    uint256 GetPoWHash() const;
 
     int64_t GetBlockTime() const
     {
@@ -439,7 +440,6 @@ public:
         return block;
     }
 
-    uint256 GetPoWHash() const;
     uint256 BuildMerkleTree() const;
 
     const uint256 &GetTxHash(unsigned int nIndex) const {
@@ -5,39 +5,39 @@ inline uint32_t ROTL32 ( uint32_t x, int8_t r )
     return (x << r) | (x >> (32 - r));
 }
 
-unsigned int MurmurHash3(unsigned int nHashSeed, const std::vector<unsigned char>& vDataToHash)
+unsigned int MurmurHash3(unsigned int nHashSeed, const unsigned char* pchData, size_t nDataLen)
 {
     // The following is MurmurHash3 (x86_32), see http://code.google.com/p/smhasher/source/browse/trunk/MurmurHash3.cpp
     uint32_t h1 = nHashSeed;
     const uint32_t c1 = 0xcc9e2d51;
     const uint32_t c2 = 0x1b873593;
 
-    const int nblocks = vDataToHash.size() / 4;
+    const size_t nblocks = nDataLen / 4;
 
     //----------
     // body
-    const uint32_t * blocks = (const uint32_t *)(&vDataToHash[0] + nblocks*4);
-
-    for(int i = -nblocks; i; i++)
+    for (size_t i = 0; i < nblocks; i++)
     {
-        uint32_t k1 = blocks[i];
+        // memcpy rather than a cast, the data need not be aligned
+        uint32_t k1;
+        memcpy(&k1, pchData + i*4, 4);
 
         k1 *= c1;
         k1 = ROTL32(k1,15);
         k1 *= c2;
 
         h1 ^= k1;
-        h1 = ROTL32(h1,13); 
+        h1 = ROTL32(h1,13);
         h1 = h1*5+0xe6546b64;
     }
 
     //----------
     // tail
-    const uint8_t * tail = (const uint8_t*)(&vDataToHash[0] + nblocks*4);
+    const uint8_t * tail = pchData + nblocks*4;
 
     uint32_t k1 = 0;
 
-    switch(vDataToHash.size() & 3)
+    switch(nDataLen & 3)
     {
     case 3: k1 ^= tail[2] << 16;
     case 2: k1 ^= tail[1] << 8;
@@ -47,7 +47,7 @@ unsigned int MurmurHash3(unsigned int nHashSeed, const std::vector<unsigned char
 
     //----------
     // finalization
-    h1 ^= vDataToHash.size();
+    h1 ^= nDataLen;
     h1 ^= h1 >> 16;
     h1 *= 0x85ebca6b;
     h1 ^= h1 >> 13;
@@ -57,6 +57,88 @@ unsigned int MurmurHash3(unsigned int nHashSeed, const std::vector<unsigned char
     return h1;
 }
 
+#define ROTL64(x, b) (uint64_t)(((x) << (b)) | ((x) >> (64 - (b))))
+
+#define SIPROUND do { \
+    v0 += v1; v1 = ROTL64(v1, 13); v1 ^= v0; \
+    v0 = ROTL64(v0, 32); \
+    v2 += v3; v3 = ROTL64(v3, 16); v3 ^= v2; \
+    v0 += v3; v3 = ROTL64(v3, 21); v3 ^= v0; \
+    v2 += v1; v1 = ROTL64(v1, 17); v1 ^= v2; \
+    v2 = ROTL64(v2, 32); \
+} while (0)
+
+uint64_t SipHashUint256(uint64_t k0, uint64_t k1, const uint256& val)
+{
+    // SipHash-2-4 specialized to a 32 byte message, see https://131002.net/siphash/
+    uint64_t v0 = 0x736f6d6570736575ULL ^ k0;
+    uint64_t v1 = 0x646f72616e646f6dULL ^ k1;
+    uint64_t v2 = 0x6c7967656e657261ULL ^ k0;
+    uint64_t v3 = 0x7465646279746573ULL ^ k1;
+
+    const unsigned char* pch = val.begin();
+    for (int i = 0; i < 4; i++, pch += 8)
+    {
+        uint64_t m = 0;
+        for (int j = 7; j >= 0; j--)
+            m = (m << 8) | pch[j];
+        v3 ^= m;
+        SIPROUND;
+        SIPROUND;
+        v0 ^= m;
+    }
+
+    // Final block holds only the message length
+    v3 ^= ((uint64_t)32) << 56;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= ((uint64_t)32) << 56;
+    v2 ^= 0xFF;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+uint64_t SipHash(uint64_t k0, uint64_t k1, const unsigned char* pchData, size_t nDataLen)
+{
+    uint64_t v0 = 0x736f6d6570736575ULL ^ k0;
+    uint64_t v1 = 0x646f72616e646f6dULL ^ k1;
+    uint64_t v2 = 0x6c7967656e657261ULL ^ k0;
+    uint64_t v3 = 0x7465646279746573ULL ^ k1;
+
+    const unsigned char* pch = pchData;
+    for (size_t nBlocks = nDataLen / 8; nBlocks > 0; nBlocks--, pch += 8)
+    {
+        uint64_t m = 0;
+        for (int j = 7; j >= 0; j--)
+            m = (m << 8) | pch[j];
+        v3 ^= m;
+        SIPROUND;
+        SIPROUND;
+        v0 ^= m;
+    }
+
+    // Final block holds the remaining bytes and the low byte of the length
+    uint64_t m = ((uint64_t)nDataLen) << 56;
+    for (int j = (nDataLen & 7) - 1; j >= 0; j--)
+        m |= ((uint64_t)pch[j]) << (8 * j);
+    v3 ^= m;
+    SIPROUND;
+    SIPROUND;
+    v0 ^= m;
+    v2 ^= 0xFF;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    SIPROUND;
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+#undef SIPROUND
+#undef ROTL64
+
 int HMAC_SHA512_Init(HMAC_SHA512_CTX *pctx, const void *pkey, size_t len)
 {
     unsigned char key[128];
@@ -124,7 +124,16 @@ inline uint160 Hash160(const std::vector<unsigned char>& vch)
     return Hash160(vch.begin(), vch.end());
 }
 
-unsigned int MurmurHash3(unsigned int nHashSeed, const std::vector<unsigned char>& vDataToHash);
+unsigned int MurmurHash3(unsigned int nHashSeed, const unsigned char* pchData, size_t nDataLen);
+inline unsigned int MurmurHash3(unsigned int nHashSeed, const std::vector<unsigned char>& vDataToHash)
+{
+    return MurmurHash3(nHashSeed, vDataToHash.empty() ? NULL : &vDataToHash[0], vDataToHash.size());
+}
+
+/** SipHash-2-4 of a 256-bit value with the 128-bit key (k0, k1) */
+uint64_t SipHashUint256(uint64_t k0, uint64_t k1, const uint256& val);
+/** SipHash-2-4 of an arbitrary byte string with the 128-bit key (k0, k1) */
+uint64_t SipHash(uint64_t k0, uint64_t k1, const unsigned char* pchData, size_t nDataLen);
 
 typedef struct
 {
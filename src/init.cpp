@@ -10,12 +10,14 @@
 #include "init.h"
 
 #include "addrman.h"
+#include "blockfilter.h"
 #include "checkpoints.h"
 #include "key.h"
 #include "main.h"
 #include "miner.h"
 #include "net.h"
 #include "rpcserver.h"
+#include "stratum.h"
 #include "txdb.h"
 #include "ui_interface.h"
 #include "util.h"
@@ -115,6 +117,7 @@ void Shutdown()
     RenameThread("carboncoin-shutoff");
     mempool.AddTransactionsUpdated(1);
     StopRPCThreads();
+    StopStratumServer();
     ShutdownRPCMining();
 #ifdef ENABLE_WALLET
     if (pwalletMain)
@@ -123,6 +126,8 @@ void Shutdown()
 #endif
     StopNode();
     UnregisterNodeSignals(GetNodeSignals());
+    // Joins the index thread, which takes cs_main
+    delete pblockfilterindex; pblockfilterindex = NULL;
     {
         LOCK(cs_main);
 #ifdef ENABLE_WALLET
@@ -204,10 +209,13 @@ std::string HelpMessage(HelpMessageMode hmm)
 #endif
     }
     strUsage += "  -datadir=<dir>         " + _("Specify data directory") + "\n";
+    strUsage += "  -blockfilterindex      " + _("Maintain compact filters of all blocks and serve them to light clients (default: 0)") + "\n";
     strUsage += "  -dbcache=<n>           " + strprintf(_("Set database cache size in megabytes (%d to %d, default: %d)"), nMinDbCache, nMaxDbCache, nDefaultDbCache) + "\n";
     strUsage += "  -loadblock=<file>      " + _("Imports blocks from external blk000??.dat file") + " " + _("on startup") + "\n";
     strUsage += "  -maxorphanblocks=<n>   " + strprintf(_("Keep at most <n> unconnectable blocks in memory (default: %u)"), DEFAULT_MAX_ORPHAN_BLOCKS) + "\n";
     strUsage += "  -maxorphantx=<n>       " + strprintf(_("Keep at most <n> unconnectable transactions in memory (default: %u)"), DEFAULT_MAX_ORPHAN_TRANSACTIONS) + "\n";
+    strUsage += "  -maxorphantxperpeer=<n> " + strprintf(_("Keep at most <n> unconnectable transactions from a single peer in memory (default: %u)"), DEFAULT_MAX_ORPHAN_TRANSACTIONS_PER_PEER) + "\n";
+    strUsage += "  -maxorphantxsize=<n>   " + strprintf(_("Keep at most <n> bytes of unconnectable transactions in memory (default: %u)"), DEFAULT_MAX_ORPHAN_TRANSACTIONS_SIZE) + "\n";
     strUsage += "  -par=<n>               " + strprintf(_("Set the number of script verification threads (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"), -(int)boost::thread::hardware_concurrency(), MAX_SCRIPTCHECK_THREADS, DEFAULT_SCRIPTCHECK_THREADS) + "\n";
     strUsage += "  -pid=<file>            " + _("Specify pid file (default: carboncoind.pid)") + "\n";
     strUsage += "  -reindex               " + _("Rebuild block chain index from current blk000??.dat files") + " " + _("on startup") + "\n";
@@ -228,6 +236,7 @@ std::string HelpMessage(HelpMessageMode hmm)
     strUsage += "  -maxconnections=<n>    " + _("Maintain at most <n> connections to peers (default: 125)") + "\n";
     strUsage += "  -maxreceivebuffer=<n>  " + _("Maximum per-connection receive buffer, <n>*1000 bytes (default: 5000)") + "\n";
     strUsage += "  -maxsendbuffer=<n>     " + _("Maximum per-connection send buffer, <n>*1000 bytes (default: 1000)") + "\n";
+    strUsage += "  -msgthreads=<n>        " + strprintf(_("Set the number of threads serving peer messages that don't need the block chain (%u to %d, 0 = auto, <0 = leave that many cores free, default: %d)"), -(int)boost::thread::hardware_concurrency(), MAX_MSGWORKER_THREADS, DEFAULT_MSGWORKER_THREADS) + "\n";
     strUsage += "  -onion=<ip:port>       " + _("Use separate SOCKS5 proxy to reach peers via Tor hidden services (default: -proxy)") + "\n";
     strUsage += "  -onlynet=<net>         " + _("Only connect to nodes in network <net> (IPv4, IPv6 or Tor)") + "\n";
     strUsage += "  -port=<port>           " + _("Listen for connections on <port> (default: 8333 or testnet: 18333)") + "\n";
@@ -272,7 +281,7 @@ std::string HelpMessage(HelpMessageMode hmm)
     strUsage += "  -debug=<category>      " + _("Output debugging information (default: 0, supplying <category> is optional)") + "\n";
     strUsage += "                         " + _("If <category> is not supplied, output all debugging information.") + "\n";
     strUsage += "                         " + _("<category> can be:");
-    strUsage +=                                 " addrman, alert, coindb, db, lock, rand, rpc, selectcoins, mempool, net"; // Don't translate these and qt below
+    strUsage +=                                 " addrman, alert, coindb, db, lock, rand, rpc, selectcoins, mempool, net, stratum"; // Don't translate these and qt below
     if (hmm == HMM_CARBONCOIN_QT)
         strUsage += ", qt";
     strUsage += ".\n";
@@ -308,13 +317,23 @@ std::string HelpMessage(HelpMessageMode hmm)
     strUsage += "  -blockmaxsize=<n>      " + strprintf(_("Set maximum block size in bytes (default: %d)"), DEFAULT_BLOCK_MAX_SIZE) + "\n";
     strUsage += "  -blockprioritysize=<n> " + strprintf(_("Set maximum size of high-priority/low-fee transactions in bytes (default: %d)"), DEFAULT_BLOCK_PRIORITY_SIZE) + "\n";
 
+    strUsage += "\n" + _("Stratum server options:") + "\n";
+    strUsage += "  -stratumport=<port>    " + _("Serve stratum mining jobs on <port> (default: disabled)") + "\n";
+    strUsage += "  -stratumbind=<addr>    " + _("Bind the stratum server to given address. This option can be specified multiple times (default: localhost)") + "\n";
+    strUsage += "  -stratumaddress=<addr> " + _("Pay stratum mined blocks to <addr> (default: a new wallet key)") + "\n";
+    strUsage += "  -stratumdifficulty=<n> " + strprintf(_("Share difficulty for stratum miners (default: %d)"), DEFAULT_STRATUM_DIFFICULTY) + "\n";
+
     strUsage += "\n" + _("RPC server options:") + "\n";
     strUsage += "  -server                " + _("Accept command line and JSON-RPC commands") + "\n";
     strUsage += "  -rpcuser=<user>        " + _("Username for JSON-RPC connections") + "\n";
     strUsage += "  -rpcpassword=<pw>      " + _("Password for JSON-RPC connections") + "\n";
     strUsage += "  -rpcport=<port>        " + _("Listen for JSON-RPC connections on <port> (default: 8332 or testnet: 18332)") + "\n";
     strUsage += "  -rpcallowip=<ip>       " + _("Allow JSON-RPC connections from specified IP address") + "\n";
-    strUsage += "  -rpcthreads=<n>        " + _("Set the number of threads to service RPC calls (default: 4)") + "\n";
+    strUsage += "  -rpcthreads=<n>        " + strprintf(_("Set the number of threads to service RPC calls (default: %d)"), DEFAULT_RPC_THREADS) + "\n";
+    strUsage += "  -rpcworkqueue=<n>      " + strprintf(_("Set the depth of the queue of RPC calls waiting for a thread; connections beyond it are not read from until there is room (default: %d)"), DEFAULT_RPC_WORK_QUEUE) + "\n";
+    strUsage += "  -rpcclientinflight=<n> " + strprintf(_("Set how many RPC calls from one address may be queued or executing at once (default: %d)"), DEFAULT_RPC_CLIENT_IN_FLIGHT) + "\n";
+    strUsage += "  -rpcbatchparallel=<n>  " + strprintf(_("Set how many calls of one JSON-RPC batch may execute at once, in any order (default: %d)"), DEFAULT_RPC_BATCH_PARALLEL) + "\n";
+    strUsage += "  -rest                  " + _("Accept public REST requests, which are read-only and need no password (default: 0)") + "\n";
 
     strUsage += "\n" + _("RPC SSL options: (see the Carboncoin Wiki for SSL setup instructions)") + "\n";
     strUsage += "  -rpcssl                                  " + _("Use OpenSSL (https) for JSON-RPC connections") + "\n";
@@ -517,9 +536,14 @@ bool AppInit2(boost::thread_group& threadGroup)
     }
 
     // Make sure enough file descriptors are available
-    int nBind = std::max((int)mapArgs.count("-bind"), 1);
     nMaxConnections = GetArg("-maxconnections", 125);
+#ifdef USE_EPOLL
+    // epoll has no FD_SETSIZE limit, only the process file descriptor limit applies
+    nMaxConnections = std::max(nMaxConnections, 0);
+#else
+    int nBind = std::max((int)mapArgs.count("-bind"), 1);
     nMaxConnections = std::max(std::min(nMaxConnections, (int)(FD_SETSIZE - nBind - MIN_CORE_FILEDESCRIPTORS)), 0);
+#endif
     int nFD = RaiseFileDescriptorLimit(nMaxConnections + MIN_CORE_FILEDESCRIPTORS);
     if (nFD < MIN_CORE_FILEDESCRIPTORS)
         return InitError(_("Not enough file descriptors available."));
@@ -551,6 +575,16 @@ bool AppInit2(boost::thread_group& threadGroup)
     else if (nScriptCheckThreads > MAX_SCRIPTCHECK_THREADS)
         nScriptCheckThreads = MAX_SCRIPTCHECK_THREADS;
 
+    // -msgthreads=0 means autodetect; with no workers every message is
+    // handled on the message handler thread
+    nMessageWorkerThreads = GetArg("-msgthreads", DEFAULT_MSGWORKER_THREADS);
+    if (nMessageWorkerThreads <= 0)
+        nMessageWorkerThreads += boost::thread::hardware_concurrency();
+    if (nMessageWorkerThreads < 0)
+        nMessageWorkerThreads = 0;
+    else if (nMessageWorkerThreads > MAX_MSGWORKER_THREADS)
+        nMessageWorkerThreads = MAX_MSGWORKER_THREADS;
+
     fServer = GetBoolArg("-server", false);
     fPrintToConsole = GetBoolArg("-printtoconsole", false);
     fLogTimestamps = GetBoolArg("-logtimestamps", true);
@@ -839,6 +873,10 @@ bool AppInit2(boost::thread_group& threadGroup)
     if (nBlockTreeDBCache > (1 << 21) && !GetBoolArg("-txindex", false))
         nBlockTreeDBCache = (1 << 21); // block tree db cache shouldn't be larger than 2 MiB
     nTotalCache -= nBlockTreeDBCache;
+    size_t nBlockFilterIndexCache = 0;
+    if (GetBoolArg("-blockfilterindex", false))
+        nBlockFilterIndexCache = std::min(nTotalCache / 8, (size_t)(1 << 23)); // filter index db cache shouldn't be larger than 8 MiB
+    nTotalCache -= nBlockFilterIndexCache;
     size_t nCoinDBCache = nTotalCache / 2; // use half of the remaining cache for coindb cache
     nTotalCache -= nCoinDBCache;
     nCoinCacheSize = nTotalCache / 300; // coins in memory require around 300 bytes
@@ -960,6 +998,20 @@ bool AppInit2(boost::thread_group& threadGroup)
         return false;
     }
 
+    if (GetBoolArg("-blockfilterindex", false))
+    {
+        try {
+            filesystem::create_directories(GetDataDir() / "indexes" / "blockfilter");
+            pblockfilterindex = new CBlockFilterIndex(nBlockFilterIndexCache, false, fReindex);
+        } catch(std::exception &e) {
+            if (fDebug) LogPrintf("%s\n", e.what());
+            return InitError(_("Error opening block filter index"));
+        }
+        if (!pblockfilterindex->Init())
+            return InitError(_("Error loading block filter index"));
+        nLocalServices |= NODE_COMPACT_FILTERS;
+    }
+
     // ********************************************************* Step 8: load wallet
 #ifdef ENABLE_WALLET
     if (fDisableWallet) {
@@ -1085,6 +1137,10 @@ bool AppInit2(boost::thread_group& threadGroup)
     }
     threadGroup.create_thread(boost::bind(&ThreadImport, vImportFiles));
 
+    // Build block filters from the blk and rev files in the background
+    if (pblockfilterindex)
+        pblockfilterindex->Start();
+
     // ********************************************************* Step 10: load peers
 
     uiInterface.InitMessage(_("Loading addresses..."));
@@ -1125,6 +1181,13 @@ bool AppInit2(boost::thread_group& threadGroup)
     if (fServer)
         StartRPCThreads();
 
+    if (mapArgs.count("-stratumport"))
+    {
+        std::string strError;
+        if (!StartStratumServer(strError))
+            return InitError(strError);
+    }
+
 #ifdef ENABLE_WALLET
     // Generate coins in the background
     if (pwalletMain)
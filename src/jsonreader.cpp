@@ -0,0 +1,400 @@
+// Copyright (c) 2014 The Carboncoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "jsonreader.h"
+
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+using namespace json_spirit;
+using namespace std;
+
+namespace {
+
+// Same characters as isspace in the C locale, which json_spirit skips
+inline bool IsSpace(char c)
+{
+    return c == ' ' || (c >= '\t' && c <= '\r');
+}
+
+inline void SkipSpace(const char*& p, const char* pend)
+{
+    while (p != pend && IsSpace(*p))
+        p++;
+}
+
+inline bool IsDigit(char c)
+{
+    return c >= '0' && c <= '9';
+}
+
+inline int HexDigit(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// The numbers are read exactly the way the boost::spirit parsers behind
+// json_spirit read them, so that the same text gives the same value down to
+// the last bit of a double. Like them, these return false on overflow and
+// leave p at the digit that overflowed.
+
+bool ReadDigits(const char*& p, const char* pend, double& d, bool fNegative, size_t& nDigits)
+{
+    static const double dMax = numeric_limits<double>::max();
+    for (nDigits = 0; p != pend && IsDigit(*p); p++, nDigits++)
+    {
+        double dDigit = *p - '0';
+        if (fNegative)
+        {
+            if (d < -dMax / 10)
+                return false;
+            d *= 10;
+            if (d < -dMax + dDigit)
+                return false;
+            d -= dDigit;
+        }
+        else
+        {
+            if (d > dMax / 10)
+                return false;
+            d *= 10;
+            if (d > dMax - dDigit)
+                return false;
+            d += dDigit;
+        }
+    }
+    return true;
+}
+
+template <typename T>
+bool ReadDigits(const char*& p, const char* pend, T& n, bool fNegative, size_t& nDigits)
+{
+    static const T nMax = numeric_limits<T>::max();
+    static const T nMin = numeric_limits<T>::min();
+    for (nDigits = 0; p != pend && IsDigit(*p); p++, nDigits++)
+    {
+        T nDigit = *p - '0';
+        if (fNegative)
+        {
+            if (n < nMin / 10)
+                return false;
+            n *= 10;
+            if (n < nMin + nDigit)
+                return false;
+            n -= nDigit;
+        }
+        else
+        {
+            if (n > nMax / 10)
+                return false;
+            n *= 10;
+            if (n > nMax - nDigit)
+                return false;
+            n += nDigit;
+        }
+    }
+    return true;
+}
+
+inline bool ReadSign(const char*& p, const char* pend)
+{
+    if (p != pend && (*p == '+' || *p == '-'))
+        return *p++ == '-';
+    return false;
+}
+
+// A number with a decimal point or an exponent, or both
+bool ReadReal(const char*& pIn, const char* pend, double& dResult)
+{
+    const char* p = pIn;
+    bool fNegative = ReadSign(p, pend);
+    double d = 0;
+    size_t nDigits;
+    bool fNumber = ReadDigits(p, pend, d, false, nDigits) && nDigits > 0;
+    if (fNegative)
+        d = -d;
+
+    bool fExponent;
+    if (p != pend && *p == '.')
+    {
+        p++;
+        double dFraction = 0;
+        if (ReadDigits(p, pend, dFraction, false, nDigits) && nDigits > 0)
+        {
+            dFraction *= pow(10.0, -(double)nDigits);
+            if (fNegative)
+                d -= dFraction;
+            else
+                d += dFraction;
+        }
+        else if (!fNumber)
+            return false;
+        fExponent = (p != pend && (*p == 'e' || *p == 'E'));
+    }
+    else
+    {
+        fExponent = (p != pend && (*p == 'e' || *p == 'E'));
+        if (!fNumber || !fExponent)
+            return false;
+    }
+
+    if (fExponent)
+    {
+        p++;
+        bool fExponentNegative = ReadSign(p, pend);
+        double dExponent = 0;
+        if (!ReadDigits(p, pend, dExponent, fExponentNegative, nDigits) || nDigits == 0)
+            return false;
+        d *= pow(10.0, dExponent);
+    }
+
+    pIn = p;
+    dResult = d;
+    return true;
+}
+
+template <typename T>
+bool ReadInteger(const char*& pIn, const char* pend, T& nResult, bool fSigned)
+{
+    const char* p = pIn;
+    bool fNegative = fSigned && ReadSign(p, pend);
+    T n = 0;
+    size_t nDigits;
+    if (!ReadDigits(p, pend, n, fNegative, nDigits) || nDigits == 0)
+        return false;
+    pIn = p;
+    nResult = n;
+    return true;
+}
+
+// p is just past the opening quote
+bool ReadString(const char*& p, const char* pend, string& str)
+{
+    str.clear();
+    while (true)
+    {
+        const char* pStart = p;
+        while (p != pend && *p != '"' && *p != '\\')
+            p++;
+        str.append(pStart, p);
+        if (p == pend)
+            return false;
+        if (*p++ == '"')
+            return true;
+        if (p == pend)
+            return false;
+
+        switch (*p++)
+        {
+        case '"':  str += '"';  break;
+        case '\\': str += '\\'; break;
+        case '/':  str += '/';  break;
+        case 'b':  str += '\b'; break;
+        case 'f':  str += '\f'; break;
+        case 'n':  str += '\n'; break;
+        case 'r':  str += '\r'; break;
+        case 't':  str += '\t'; break;
+        case 'u':
+        {
+            if (pend - p < 4)
+                return false;
+            int n = 0;
+            for (int i = 0; i < 4; i++)
+            {
+                int nDigit = HexDigit(*p++);
+                if (nDigit < 0)
+                    return false;
+                n = (n << 4) | nDigit;
+            }
+            // json_spirit's reader keeps only the low byte
+            str += (char)n;
+            break;
+        }
+        default:
+            return false;
+        }
+    }
+}
+
+inline bool ReadLiteral(const char*& p, const char* pend, const char* psz, size_t nLen)
+{
+    if ((size_t)(pend - p) < nLen || memcmp(p, psz, nLen) != 0)
+        return false;
+    p += nLen;
+    return true;
+}
+
+// Builds the Value tree the same way json_spirit's reader does
+class CJSONValueBuilder : public CJSONHandler
+{
+private:
+    Value& value;
+    // Open objects and arrays, innermost last
+    vector<Value*> vStack;
+    string strKey;
+
+    Value* Add(const Value& valueNew)
+    {
+        if (vStack.empty())
+        {
+            value = valueNew;
+            return &value;
+        }
+        Value* pcurrent = vStack.back();
+        if (pcurrent->type() == array_type)
+        {
+            Array& arr = pcurrent->get_array();
+            arr.push_back(valueNew);
+            return &arr.back();
+        }
+        Object& obj = pcurrent->get_obj();
+        obj.push_back(json_spirit::Pair(strKey, valueNew));
+        return &obj.back().value_;
+    }
+
+public:
+    CJSONValueBuilder(Value& valueIn) : value(valueIn) {}
+
+    void BeginObject() { vStack.push_back(Add(Object())); }
+    void EndObject() { vStack.pop_back(); }
+    void BeginArray() { vStack.push_back(Add(Array())); }
+    void EndArray() { vStack.pop_back(); }
+    void Key(const string& strKeyIn) { strKey = strKeyIn; }
+
+    void String(const string& str) { Add(str); }
+    void Int(int64_t n) { Add(n); }
+    void Uint(uint64_t n) { Add(n); }
+    void Real(double d) { Add(d); }
+    void Bool(bool f) { Add(f); }
+    void Null() { Add(Value::null); }
+};
+
+} // anon namespace
+
+bool ParseJSON(const string& strJSON, CJSONHandler& handler)
+{
+    const char* p = strJSON.data();
+    const char* pend = p + strJSON.size();
+    // Open objects and arrays, true for an object
+    vector<bool> vInObject;
+    string str;
+
+    while (true)
+    {
+        // A value, or the end of the object or array just opened
+        SkipSpace(p, pend);
+        if (p == pend)
+            return false;
+        char c = *p;
+        if (c == '{' || c == '[')
+        {
+            if (vInObject.size() >= MAX_JSON_DEPTH)
+                return false;
+            p++;
+            bool fObject = (c == '{');
+            if (fObject)
+                handler.BeginObject();
+            else
+                handler.BeginArray();
+            vInObject.push_back(fObject);
+
+            SkipSpace(p, pend);
+            if (p != pend && *p == (fObject ? '}' : ']'))
+            {
+                // Empty, closed below
+            }
+            else if (fObject)
+            {
+                if (p == pend || *p++ != '"' || !ReadString(p, pend, str))
+                    return false;
+                handler.Key(str);
+                SkipSpace(p, pend);
+                if (p == pend || *p++ != ':')
+                    return false;
+                continue;
+            }
+            else
+                continue;
+        }
+        else if (c == '"')
+        {
+            p++;
+            if (!ReadString(p, pend, str))
+                return false;
+            handler.String(str);
+        }
+        else if (c == 't' || c == 'f' || c == 'n')
+        {
+            if (ReadLiteral(p, pend, "true", 4))
+                handler.Bool(true);
+            else if (ReadLiteral(p, pend, "false", 5))
+                handler.Bool(false);
+            else if (ReadLiteral(p, pend, "null", 4))
+                handler.Null();
+            else
+                return false;
+        }
+        else
+        {
+            // Tried in the order json_spirit's grammar does
+            double d;
+            int64_t n;
+            uint64_t u;
+            if (ReadReal(p, pend, d))
+                handler.Real(d);
+            else if (ReadInteger(p, pend, n, true))
+                handler.Int(n);
+            else if (ReadInteger(p, pend, u, false))
+                handler.Uint(u);
+            else
+                return false;
+        }
+
+        // After a value: close objects and arrays until there is a next value
+        while (true)
+        {
+            // Like json_spirit, ignore whatever follows the top level value
+            if (vInObject.empty())
+                return true;
+            SkipSpace(p, pend);
+            if (p == pend)
+                return false;
+            bool fObject = vInObject.back();
+            if (*p == (fObject ? '}' : ']'))
+            {
+                p++;
+                vInObject.pop_back();
+                if (fObject)
+                    handler.EndObject();
+                else
+                    handler.EndArray();
+                continue;
+            }
+            if (*p++ != ',')
+                return false;
+            if (fObject)
+            {
+                SkipSpace(p, pend);
+                if (p == pend || *p++ != '"' || !ReadString(p, pend, str))
+                    return false;
+                handler.Key(str);
+                SkipSpace(p, pend);
+                if (p == pend || *p++ != ':')
+                    return false;
+            }
+            break;
+        }
+    }
+}
+
+bool ParseJSON(const string& strJSON, Value& value)
+{
+    CJSONValueBuilder builder(value);
+    return ParseJSON(strJSON, builder);
+}
@@ -0,0 +1,54 @@
+// Copyright (c) 2014 The Carboncoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef CARBONCOIN_JSONREADER_H
+#define CARBONCOIN_JSONREADER_H
+
+#include <stdint.h>
+#include <string>
+
+#include "json/json_spirit_value.h"
+
+/** Deepest nesting of objects and arrays ParseJSON accepts */
+static const unsigned int MAX_JSON_DEPTH = 512;
+
+/** Receives the parts of a JSON text from ParseJSON, in the order they appear.
+ * Members of an object come as Key followed by one value.
+ */
+class CJSONHandler
+{
+public:
+    virtual ~CJSONHandler() {}
+
+    virtual void BeginObject() = 0;
+    virtual void EndObject() = 0;
+    virtual void BeginArray() = 0;
+    virtual void EndArray() = 0;
+    virtual void Key(const std::string& strKey) = 0;
+
+    virtual void String(const std::string& str) = 0;
+    virtual void Int(int64_t n) = 0;
+    virtual void Uint(uint64_t n) = 0;
+    virtual void Real(double d) = 0;
+    virtual void Bool(bool f) = 0;
+    virtual void Null() = 0;
+};
+
+/** Parses JSON text without recursing, handing its parts to handler. This
+ * replaces json_spirit's read_string and accepts what it accepts, giving the
+ * same values: numbers may have a sign, leading zeros and a leading or
+ * trailing decimal point, \u escapes give the low byte of the code point, and
+ * text after the first complete value is ignored. Unlike read_string it
+ * rejects string escapes JSON doesn't have, which json_spirit dropped or
+ * garbled, and nesting deeper than MAX_JSON_DEPTH.
+ *
+ * Returns false if the text is malformed; the handler may have been given
+ * the part before the error.
+ */
+bool ParseJSON(const std::string& strJSON, CJSONHandler& handler);
+
+/** Parses JSON text into a json_spirit Value, like read_string */
+bool ParseJSON(const std::string& strJSON, json_spirit::Value& value);
+
+#endif // CARBONCOIN_JSONREADER_H
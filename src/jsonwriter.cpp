@@ -0,0 +1,179 @@
+// Copyright (c) 2014 The Carboncoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "jsonwriter.h"
+
+#include <cassert>
+#include <iomanip>
+#include <sstream>
+
+#include <boost/foreach.hpp>
+
+#include "json/json_spirit_writer_template.h"
+
+using namespace json_spirit;
+using namespace std;
+
+CJSONWriter::CJSONWriter(const Sink& sinkIn, size_t nFlushSizeIn) :
+    sink(sinkIn), nFlushSize(nFlushSizeIn), fAfterKey(false)
+{
+}
+
+void CJSONWriter::BeginValue()
+{
+    if (fAfterKey)
+    {
+        fAfterKey = false;
+        return;
+    }
+    if (vFirst.empty())
+        return;
+    if (!vFirst.back())
+        strBuffer += ',';
+    vFirst.back() = false;
+}
+
+void CJSONWriter::MaybeFlush()
+{
+    if (sink && strBuffer.size() >= nFlushSize)
+        Flush();
+}
+
+void CJSONWriter::Flush()
+{
+    if (!sink || strBuffer.empty())
+        return;
+    // Swap out first, the sink may throw
+    string str;
+    str.swap(strBuffer);
+    sink(str);
+}
+
+void CJSONWriter::BeginObject()
+{
+    BeginValue();
+    strBuffer += '{';
+    vFirst.push_back(true);
+}
+
+void CJSONWriter::EndObject()
+{
+    assert(!vFirst.empty() && !fAfterKey);
+    vFirst.pop_back();
+    strBuffer += '}';
+    MaybeFlush();
+}
+
+void CJSONWriter::BeginArray()
+{
+    BeginValue();
+    strBuffer += '[';
+    vFirst.push_back(true);
+}
+
+void CJSONWriter::EndArray()
+{
+    assert(!vFirst.empty() && !fAfterKey);
+    vFirst.pop_back();
+    strBuffer += ']';
+    MaybeFlush();
+}
+
+void CJSONWriter::Key(const string& strKey)
+{
+    assert(!fAfterKey);
+    BeginValue();
+    strBuffer += '"';
+    strBuffer += add_esc_chars(strKey);
+    strBuffer += "\":";
+    fAfterKey = true;
+}
+
+void CJSONWriter::String(const string& str)
+{
+    BeginValue();
+    strBuffer += '"';
+    strBuffer += add_esc_chars(str);
+    strBuffer += '"';
+    MaybeFlush();
+}
+
+void CJSONWriter::WriteNumber(const string& str)
+{
+    BeginValue();
+    strBuffer += str;
+    MaybeFlush();
+}
+
+void CJSONWriter::Int(int64_t n)
+{
+    ostringstream os;
+    os << n;
+    WriteNumber(os.str());
+}
+
+void CJSONWriter::Uint(uint64_t n)
+{
+    ostringstream os;
+    os << n;
+    WriteNumber(os.str());
+}
+
+void CJSONWriter::Real(double d)
+{
+    // Formatted like json_spirit's writer does
+    ostringstream os;
+    os << showpoint << fixed << setprecision(8) << d;
+    WriteNumber(os.str());
+}
+
+void CJSONWriter::Bool(bool f)
+{
+    WriteNumber(f ? "true" : "false");
+}
+
+void CJSONWriter::Null()
+{
+    WriteNumber("null");
+}
+
+void CJSONWriter::Write(const Value& value)
+{
+    switch (value.type())
+    {
+    case obj_type:
+        BeginObject();
+        BOOST_FOREACH(const json_spirit::Pair& pair, value.get_obj())
+        {
+            Key(pair.name_);
+            Write(pair.value_);
+        }
+        EndObject();
+        break;
+    case array_type:
+        BeginArray();
+        BOOST_FOREACH(const Value& element, value.get_array())
+            Write(element);
+        EndArray();
+        break;
+    case str_type:
+        String(value.get_str());
+        break;
+    case bool_type:
+        Bool(value.get_bool());
+        break;
+    case int_type:
+        if (value.is_uint64())
+            Uint(value.get_uint64());
+        else
+            Int(value.get_int64());
+        break;
+    case real_type:
+        Real(value.get_real());
+        break;
+    case null_type:
+        Null();
+        break;
+    }
+}
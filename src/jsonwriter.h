@@ -0,0 +1,69 @@
+// Copyright (c) 2014 The Carboncoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef CARBONCOIN_JSONWRITER_H
+#define CARBONCOIN_JSONWRITER_H
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include <boost/function.hpp>
+
+#include "json/json_spirit_value.h"
+
+/** Writes JSON text as it is produced instead of building a json_spirit
+ * Value tree first. The text is the same, byte for byte, as write_string
+ * gives for the equivalent Value without pretty printing. It is handed to
+ * the sink in pieces of about nFlushSize bytes; without a sink it all stays
+ * in the buffer.
+ *
+ * Separators are inserted by the writer: members are written as Key
+ * followed by one value, array elements as values one after another.
+ */
+class CJSONWriter
+{
+public:
+    typedef boost::function<void(const std::string&)> Sink;
+
+private:
+    Sink sink;
+    size_t nFlushSize;
+    std::string strBuffer;
+    // One entry per open object or array, true until it has a first element
+    std::vector<bool> vFirst;
+    bool fAfterKey;
+
+    void BeginValue();
+    void WriteNumber(const std::string& str);
+    void MaybeFlush();
+
+public:
+    CJSONWriter(const Sink& sinkIn = Sink(), size_t nFlushSizeIn = 64 * 1024);
+
+    void BeginObject();
+    void EndObject();
+    void BeginArray();
+    void EndArray();
+    void Key(const std::string& strKey);
+
+    void String(const std::string& str);
+    void Int(int64_t n);
+    void Uint(uint64_t n);
+    void Real(double d);
+    void Bool(bool f);
+    void Null();
+    void Write(const json_spirit::Value& value);
+
+    void Pair(const std::string& strKey, const json_spirit::Value& value) { Key(strKey); Write(value); }
+    void Pair(const std::string& strKey, const std::string& str) { Key(strKey); String(str); }
+
+    // Hands everything written so far to the sink
+    void Flush();
+    // Text not handed to the sink yet
+    const std::string& GetBuffer() const { return strBuffer; }
+    void ClearBuffer() { strBuffer.clear(); }
+};
+
+#endif // CARBONCOIN_JSONWRITER_H
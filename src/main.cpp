@@ -7,9 +7,11 @@
 
 #include "addrman.h"
 #include "alert.h"
+#include "blockfilter.h"
 #include "chainparams.h"
 #include "checkpoints.h"
 #include "checkqueue.h"
+#include "compactblock.h"
 #include "init.h"
 #include "net.h"
 #include "txdb.h"
@@ -43,6 +45,8 @@ CTxMemPool mempool;
 map<uint256, CBlockIndex*> mapBlockIndex;
 CChain chainActive;
 CChain chainMostWork;
+static CCriticalSection cs_tipSnapshot;
+static CBlockIndex* pindexTipSnapshot = NULL;
 int64_t nTimeBestReceived = 0;
 int nScriptCheckThreads = 0;
 bool fImporting = false;
@@ -67,9 +71,22 @@ multimap<uint256, COrphanBlock*> mapOrphanBlocksByPrev;
 struct COrphanTx {
     CTransaction tx;
     NodeId fromPeer;
+    int64_t nTimeExpire;
+    unsigned int nTxSize;
+};
+struct COrphanPeer {
+    set<uint256> setOrphans;
+    size_t nOrphanBytes;
+
+    COrphanPeer() : nOrphanBytes(0) {}
 };
 map<uint256, COrphanTx> mapOrphanTransactions;
-map<uint256, set<uint256> > mapOrphanTransactionsByPrev;
+// Orphans indexed by the specific outpoint they are missing
+map<COutPoint, set<uint256> > mapOrphanTransactionsByPrev;
+// Per-peer accounting of the orphans each peer has given us
+map<NodeId, COrphanPeer> mapOrphanTransactionsByPeer;
+size_t nOrphanTransactionsSize = 0;
+int64_t nNextOrphanSweep = 0;
 void EraseOrphansFor(NodeId peer);
 
 // Constant stuff for coinbase transactions we create:
@@ -124,9 +141,28 @@ namespace {
         uint256 hash;
         int64_t nTime;  // Time of "getdata" request in microseconds.
         int nQueuedBefore;  // Number of blocks in flight at the time of request.
+        // Set while waiting for the missing transactions of a compact block.
+        boost::shared_ptr<CPartialBlock> partialBlock;
     };
     map<uint256, pair<NodeId, list<QueuedBlock>::iterator> > mapBlocksInFlight;
     map<uint256, pair<NodeId, list<uint256>::iterator> > mapBlocksToDownload;
+
+    // The block last sent as a compact block, kept for the getblocktxn
+    // requests that follow it. Protected by cs_main.
+    CBlock blockLastCompact;
+    CSharedMessage pLastCompactMsg;
+
+    // Headers-first sync. mapHeaderIndex holds the headers of blocks we don't
+    // have yet; its entries are not in mapBlockIndex, but their pprev may
+    // point into either map. chainHeaders is the most-work chain of known
+    // headers that blocks are scheduled from. Protected by cs_main.
+    map<uint256, CBlockIndex*> mapHeaderIndex;
+    CChain chainHeaders;
+
+    // Blocks of the header chain that arrived before their parent, kept on
+    // disk until it is connected. Protected by cs_main.
+    map<uint256, CDiskBlockPos> mapUnconnectedBlocks;
+    multimap<uint256, uint256> mapUnconnectedBlocksByPrev;
 }
 
 //////////////////////////////////////////////////////////////////////////////
@@ -216,6 +252,10 @@ struct CNodeState {
     int nBlocksToDownload;
     int64_t nLastBlockReceive;
     int64_t nLastBlockProcess;
+    // Height of the best header this peer is known to have.
+    int nSyncHeight;
+    // Since when this peer has been holding up the block download window.
+    int64_t nStallingSince;
 
     CNodeState() {
         nMisbehavior = 0;
@@ -224,6 +264,8 @@ struct CNodeState {
         nBlocksInFlight = 0;
         nLastBlockReceive = 0;
         nLastBlockProcess = 0;
+        nSyncHeight = -1;
+        nStallingSince = 0;
     }
 };
 
@@ -278,8 +320,10 @@ void MarkBlockAsReceived(const uint256 &hash, NodeId nodeFrom = -1) {
         CNodeState *state = State(itInFlight->second.first);
         state->vBlocksInFlight.erase(itInFlight->second.second);
         state->nBlocksInFlight--;
-        if (itInFlight->second.first == nodeFrom)
+        if (itInFlight->second.first == nodeFrom) {
             state->nLastBlockReceive = GetTimeMicros();
+            state->nStallingSince = 0;
+        }
         mapBlocksInFlight.erase(itInFlight);
     }
 
@@ -326,6 +370,8 @@ bool GetNodeStateStats(NodeId nodeid, CNodeStateStats &stats) {
     if (state == NULL)
         return false;
     stats.nMisbehavior = state->nMisbehavior;
+    stats.nSyncHeight = state->nSyncHeight;
+    stats.nBlocksInFlight = state->nBlocksInFlight;
     return true;
 }
 
@@ -333,6 +379,7 @@ void RegisterNodeSignals(CNodeSignals& nodeSignals)
 {
     nodeSignals.GetHeight.connect(&GetHeight);
     nodeSignals.ProcessMessages.connect(&ProcessMessages);
+    nodeSignals.ProcessWorkerMessages.connect(&ProcessWorkerMessages);
     nodeSignals.SendMessages.connect(&SendMessages);
     nodeSignals.InitializeNode.connect(&InitializeNode);
     nodeSignals.FinalizeNode.connect(&FinalizeNode);
@@ -342,6 +389,7 @@ void UnregisterNodeSignals(CNodeSignals& nodeSignals)
 {
     nodeSignals.GetHeight.disconnect(&GetHeight);
     nodeSignals.ProcessMessages.disconnect(&ProcessMessages);
+    nodeSignals.ProcessWorkerMessages.disconnect(&ProcessWorkerMessages);
     nodeSignals.SendMessages.disconnect(&SendMessages);
     nodeSignals.InitializeNode.disconnect(&InitializeNode);
     nodeSignals.FinalizeNode.disconnect(&FinalizeNode);
@@ -623,6 +671,32 @@ CBlockTreeDB *pblocktree = NULL;
 // mapOrphanTransactions
 //
 
+void static EraseOrphanTx(uint256 hash)
+{
+    map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.find(hash);
+    if (it == mapOrphanTransactions.end())
+        return;
+    BOOST_FOREACH(const CTxIn& txin, it->second.tx.vin)
+    {
+        map<COutPoint, set<uint256> >::iterator itPrev = mapOrphanTransactionsByPrev.find(txin.prevout);
+        if (itPrev == mapOrphanTransactionsByPrev.end())
+            continue;
+        itPrev->second.erase(hash);
+        if (itPrev->second.empty())
+            mapOrphanTransactionsByPrev.erase(itPrev);
+    }
+    map<NodeId, COrphanPeer>::iterator itPeer = mapOrphanTransactionsByPeer.find(it->second.fromPeer);
+    if (itPeer != mapOrphanTransactionsByPeer.end())
+    {
+        itPeer->second.setOrphans.erase(hash);
+        itPeer->second.nOrphanBytes -= it->second.nTxSize;
+        if (itPeer->second.setOrphans.empty())
+            mapOrphanTransactionsByPeer.erase(itPeer);
+    }
+    nOrphanTransactionsSize -= it->second.nTxSize;
+    mapOrphanTransactions.erase(it);
+}
+
 bool AddOrphanTx(const CTransaction& tx, NodeId peer)
 {
     uint256 hash = tx.GetHash();
@@ -634,63 +708,87 @@ bool AddOrphanTx(const CTransaction& tx, NodeId peer)
     // large transaction with a missing parent then we assume
     // it will rebroadcast it later, after the parent transaction(s)
     // have been mined or received.
-    // 10,000 orphans, each of which is at most 5,000 bytes big is
-    // at most 500 megabytes of orphans:
+    // The total size of all orphans is additionally bounded by
+    // -maxorphantxsize, see LimitOrphanTxSize.
     unsigned int sz = tx.GetSerializeSize(SER_NETWORK, CTransaction::CURRENT_VERSION);
-    if (sz > 5000)
+    if (sz > MAX_ORPHAN_TX_SIZE)
     {
         LogPrint("mempool", "ignoring large orphan tx (size: %u, hash: %s)\n", sz, hash.ToString());
         return false;
     }
 
-    mapOrphanTransactions[hash].tx = tx;
-    mapOrphanTransactions[hash].fromPeer = peer;
+    // A single peer may only occupy a limited share of the orphan pool: make
+    // room by evicting one of its own orphans rather than someone else's.
+    unsigned int nMaxOrphansPerPeer = (unsigned int)std::max((int64_t)1, GetArg("-maxorphantxperpeer", DEFAULT_MAX_ORPHAN_TRANSACTIONS_PER_PEER));
+    map<NodeId, COrphanPeer>::iterator itPeer;
+    while ((itPeer = mapOrphanTransactionsByPeer.find(peer)) != mapOrphanTransactionsByPeer.end() &&
+           itPeer->second.setOrphans.size() >= nMaxOrphansPerPeer)
+    {
+        set<uint256>& setOrphans = itPeer->second.setOrphans;
+        set<uint256>::iterator it = setOrphans.lower_bound(GetRandHash());
+        if (it == setOrphans.end())
+            it = setOrphans.begin();
+        uint256 hashEvict = *it;
+        LogPrint("mempool", "orphan limit reached for peer %d, removed orphan tx %s\n", peer, hashEvict.ToString());
+        EraseOrphanTx(hashEvict);
+    }
+
+    COrphanTx& orphan = mapOrphanTransactions[hash];
+    orphan.tx = tx;
+    orphan.fromPeer = peer;
+    orphan.nTimeExpire = GetTime() + ORPHAN_TX_EXPIRE_TIME;
+    orphan.nTxSize = sz;
     BOOST_FOREACH(const CTxIn& txin, tx.vin)
-        mapOrphanTransactionsByPrev[txin.prevout.hash].insert(hash);
-
-    LogPrint("mempool", "stored orphan tx %s (mapsz %u prevsz %u)\n", hash.ToString(),
-             mapOrphanTransactions.size(), mapOrphanTransactionsByPrev.size());
+        mapOrphanTransactionsByPrev[txin.prevout].insert(hash);
+    COrphanPeer& orphanPeer = mapOrphanTransactionsByPeer[peer];
+    orphanPeer.setOrphans.insert(hash);
+    orphanPeer.nOrphanBytes += sz;
+    nOrphanTransactionsSize += sz;
+
+    LogPrint("mempool", "stored orphan tx %s (mapsz %u prevsz %u bytes %u)\n", hash.ToString(),
+             mapOrphanTransactions.size(), mapOrphanTransactionsByPrev.size(), nOrphanTransactionsSize);
     return true;
 }
 
-void static EraseOrphanTx(uint256 hash)
+void EraseOrphansFor(NodeId peer)
 {
-    map<uint256, COrphanTx>::iterator it = mapOrphanTransactions.find(hash);
-    if (it == mapOrphanTransactions.end())
+    map<NodeId, COrphanPeer>::iterator itPeer = mapOrphanTransactionsByPeer.find(peer);
+    if (itPeer == mapOrphanTransactionsByPeer.end())
         return;
-    BOOST_FOREACH(const CTxIn& txin, it->second.tx.vin)
-    {
-        map<uint256, set<uint256> >::iterator itPrev = mapOrphanTransactionsByPrev.find(txin.prevout.hash);
-        if (itPrev == mapOrphanTransactionsByPrev.end())
-            continue;
-        itPrev->second.erase(hash);
-        if (itPrev->second.empty())
-            mapOrphanTransactionsByPrev.erase(itPrev);
-    }
-    mapOrphanTransactions.erase(it);
+    // Copy, as EraseOrphanTx removes the entry once its last orphan is gone
+    set<uint256> setErase = itPeer->second.setOrphans;
+    BOOST_FOREACH(const uint256& hash, setErase)
+        EraseOrphanTx(hash);
+    LogPrint("mempool", "Erased %d orphan tx from peer %d\n", setErase.size(), peer);
 }
 
-void EraseOrphansFor(NodeId peer)
+
+unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans, size_t nMaxOrphanBytes)
 {
-    int nErased = 0;
-    map<uint256, COrphanTx>::iterator iter = mapOrphanTransactions.begin();
-    while (iter != mapOrphanTransactions.end())
+    unsigned int nEvicted = 0;
+    int64_t nNow = GetTime();
+    if (nNextOrphanSweep <= nNow)
     {
-        map<uint256, COrphanTx>::iterator maybeErase = iter++; // increment to avoid iterator becoming invalid
-        if (maybeErase->second.fromPeer == peer)
+        // Sweep out expired orphans
+        int64_t nMinExpire = nNow + ORPHAN_TX_EXPIRE_TIME;
+        map<uint256, COrphanTx>::iterator iter = mapOrphanTransactions.begin();
+        while (iter != mapOrphanTransactions.end())
         {
-            EraseOrphanTx(maybeErase->second.tx.GetHash());
-            ++nErased;
+            map<uint256, COrphanTx>::iterator maybeErase = iter++; // increment to avoid iterator becoming invalid
+            if (maybeErase->second.nTimeExpire <= nNow)
+            {
+                EraseOrphanTx(maybeErase->first);
+                ++nEvicted;
+            }
+            else
+                nMinExpire = std::min(nMinExpire, maybeErase->second.nTimeExpire);
         }
+        // Sweep again a little after the next entry that will expire
+        nNextOrphanSweep = nMinExpire + ORPHAN_TX_EXPIRE_INTERVAL;
+        if (nEvicted > 0)
+            LogPrint("mempool", "Erased %u orphan tx due to expiration\n", nEvicted);
     }
-    if (nErased > 0) LogPrint("mempool", "Erased %d orphan tx from peer %d\n", nErased, peer);
-}
-
-
-unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans)
-{
-    unsigned int nEvicted = 0;
-    while (mapOrphanTransactions.size() > nMaxOrphans)
+    while (mapOrphanTransactions.size() > nMaxOrphans || nOrphanTransactionsSize > nMaxOrphanBytes)
     {
         // Evict a random orphan:
         uint256 randomhash = GetRandHash();
@@ -703,6 +801,69 @@ unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans)
     return nEvicted;
 }
 
+// Requires cs_main. Queue, on the peer that gave us tx, the orphans that
+// spend one of its outputs.
+void static AddOrphanWorkFor(CNode* pfrom, const CTransaction& tx, const uint256& hash)
+{
+    for (unsigned int i = 0; i < tx.vout.size(); i++)
+    {
+        map<COutPoint, set<uint256> >::iterator itByPrev = mapOrphanTransactionsByPrev.find(COutPoint(hash, i));
+        if (itByPrev == mapOrphanTransactionsByPrev.end())
+            continue;
+        pfrom->setOrphanWorkSet.insert(itByPrev->second.begin(), itByPrev->second.end());
+    }
+}
+
+// Requires cs_main. Retry orphans from pfrom's work set until one of them is
+// accepted or rejected. Long orphan chains are thereby resolved a step per
+// message handler pass, interleaved with other peers' messages.
+void static ProcessOrphanTx(CNode* pfrom)
+{
+    while (!pfrom->setOrphanWorkSet.empty())
+    {
+        const uint256 orphanHash = *pfrom->setOrphanWorkSet.begin();
+        pfrom->setOrphanWorkSet.erase(pfrom->setOrphanWorkSet.begin());
+
+        map<uint256, COrphanTx>::iterator itOrphan = mapOrphanTransactions.find(orphanHash);
+        if (itOrphan == mapOrphanTransactions.end())
+            continue;
+        const CTransaction orphanTx = itOrphan->second.tx;
+        NodeId fromPeer = itOrphan->second.fromPeer;
+        bool fMissingInputs2 = false;
+        // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
+        // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
+        // anyone relaying LegitTxX banned)
+        CValidationState stateDummy;
+
+        if (AcceptToMemoryPool(mempool, stateDummy, orphanTx, true, &fMissingInputs2))
+        {
+            LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
+            RelayTransaction(orphanTx, orphanHash);
+            mapAlreadyAskedFor.erase(CInv(MSG_TX, orphanHash));
+            AddOrphanWorkFor(pfrom, orphanTx, orphanHash);
+            EraseOrphanTx(orphanHash);
+            mempool.check(pcoinsTip);
+            break;
+        }
+        else if (!fMissingInputs2)
+        {
+            int nDos = 0;
+            if (stateDummy.IsInvalid(nDos) && nDos > 0)
+            {
+                // Punish peer that gave us an invalid orphan tx
+                Misbehaving(fromPeer, nDos);
+                LogPrint("mempool", "   invalid orphan tx %s\n", orphanHash.ToString());
+            }
+            // too-little-fee orphan
+            LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
+            EraseOrphanTx(orphanHash);
+            mempool.check(pcoinsTip);
+            break;
+        }
+        // Still missing other inputs: leave it in the pool.
+    }
+}
+
 
 
 
@@ -1380,6 +1541,42 @@ bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex)
     return true;
 }
 
+bool ReadRawBlockFromDisk(std::vector<unsigned char>& vchBlock, const CBlockIndex* pindex)
+{
+    // The block follows the message start and its size, as written by
+    // WriteBlockToDisk
+    CDiskBlockPos pos = pindex->GetBlockPos();
+    if (pos.nPos < 8)
+        return error("%s : bad block position", __func__);
+    pos.nPos -= 8;
+
+    CAutoFile filein = CAutoFile(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
+    if (!filein)
+        return error("%s : OpenBlockFile failed", __func__);
+
+    try {
+        MessageStartChars pchMessageStart;
+        unsigned int nSize;
+        filein >> FLATDATA(pchMessageStart) >> nSize;
+        if (memcmp(pchMessageStart, Params().MessageStart(), sizeof(pchMessageStart)) != 0 ||
+            nSize < 80 || nSize > MAX_BLOCK_SIZE)
+            return error("%s : no block at %d:%u", __func__, pindex->nFile, pindex->nDataPos);
+        vchBlock.resize(nSize);
+        filein.read((char*)&vchBlock[0], nSize);
+    }
+    catch (std::exception &e) {
+        return error("%s : I/O error - %s", __func__, e.what());
+    }
+
+    // Only the header is decoded, to check it is the right block
+    CBlockHeader header;
+    CDataStream ssHeader((const char*)&vchBlock[0], (const char*)&vchBlock[0] + 80, SER_DISK, CLIENT_VERSION);
+    ssHeader >> header;
+    if (header.GetHash() != pindex->GetBlockHash())
+        return error("%s : GetHash() doesn't match index", __func__);
+    return true;
+}
+
 uint256 static GetOrphanRoot(const uint256& hash)
 {
     map<uint256, COrphanBlock*>::iterator it = mapOrphanBlocks.find(hash);
@@ -1697,6 +1894,7 @@ void Misbehaving(NodeId pnode, int howmuch)
     if (howmuch == 0)
         return;
 
+    LOCK(cs_main);
     CNodeState *state = State(pnode);
     if (state == NULL)
         return;
@@ -2201,9 +2399,22 @@ bool static WriteChainState(CValidationState &state) {
     return true;
 }
 
+static void SetChainTipSnapshot(CBlockIndex* pindex)
+{
+    LOCK(cs_tipSnapshot);
+    pindexTipSnapshot = pindex;
+}
+
+CBlockIndex* GetChainTipSnapshot()
+{
+    LOCK(cs_tipSnapshot);
+    return pindexTipSnapshot;
+}
+
 // Update chainActive and related internal data structures.
 void static UpdateTip(CBlockIndex *pindexNew) {
     chainActive.SetTip(pindexNew);
+    SetChainTipSnapshot(pindexNew);
 
     // Update best block in wallet (so we can detect restored wallets)
     bool fIsInitialDownload = IsInitialBlockDownload();
@@ -2614,6 +2825,21 @@ bool FindUndoPos(CValidationState &state, int nFile, CDiskBlockPos &pos, unsigne
 }
 
 
+bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state, bool fCheckPOW)
+{
+    // Check proof of work matches claimed amount
+    if (fCheckPOW && !CheckProofOfWork(block.GetPoWHash(), block.nBits))
+        return state.DoS(50, error("CheckBlockHeader() : proof of work failed"),
+                         REJECT_INVALID, "high-hash");
+
+    // Check timestamp
+    if (block.GetBlockTime() > GetAdjustedTime() + 2 * 60 * 60)
+        return state.Invalid(error("CheckBlockHeader() : block timestamp too far in the future"),
+                             REJECT_INVALID, "time-too-new");
+
+    return true;
+}
+
 bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bool fCheckMerkleRoot)
 {
     // These are checks that are independent of context
@@ -2624,15 +2850,8 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
         return state.DoS(100, error("CheckBlock() : size limits failed"),
                          REJECT_INVALID, "bad-blk-length");
 
-    // Check proof of work matches claimed amount
-    if (fCheckPOW && !CheckProofOfWork(block.GetPoWHash(), block.nBits))
-        return state.DoS(50, error("CheckBlock() : proof of work failed"),
-                         REJECT_INVALID, "high-hash");
-
-    // Check timestamp
-    if (block.GetBlockTime() > GetAdjustedTime() + 2 * 60 * 60)
-        return state.Invalid(error("CheckBlock() : block timestamp too far in the future"),
-                             REJECT_INVALID, "time-too-new");
+    if (!CheckBlockHeader(block, state, fCheckPOW))
+        return false;
 
     // First transaction must be coinbase, the rest must not be
     if (block.vtx.empty() || !block.vtx[0].IsCoinBase())
@@ -2680,7 +2899,7 @@ bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW, bo
     return true;
 }
 
-bool AcceptBlock(CBlock& block, CValidationState& state, CDiskBlockPos* dbp)
+bool AcceptBlock(CBlock& block, CValidationState& state, CDiskBlockPos* dbp, bool fStored)
 {
     AssertLockHeld(cs_main);
     // Check for duplicate
@@ -2766,7 +2985,7 @@ bool AcceptBlock(CBlock& block, CValidationState& state, CDiskBlockPos* dbp)
         CDiskBlockPos blockPos;
         if (dbp != NULL)
             blockPos = *dbp;
-        if (!FindBlockPos(state, blockPos, nBlockSize+8, nHeight, block.nTime, dbp != NULL))
+        if (!fStored && !FindBlockPos(state, blockPos, nBlockSize+8, nHeight, block.nTime, dbp != NULL))
             return error("AcceptBlock() : FindBlockPos failed");
         if (dbp == NULL)
             if (!WriteBlockToDisk(block, blockPos))
@@ -2827,6 +3046,190 @@ void PushGetBlocks(CNode* pnode, CBlockIndex* pindexBegin, uint256 hashEnd)
     pnode->PushMessage("getblocks", chainActive.GetLocator(pindexBegin), hashEnd);
 }
 
+// Requires cs_main. Looks a hash up among both the blocks and the headers we
+// know about.
+static CBlockIndex* LookupHeader(const uint256& hash)
+{
+    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+    if (mi != mapBlockIndex.end())
+        return mi->second;
+    mi = mapHeaderIndex.find(hash);
+    if (mi != mapHeaderIndex.end())
+        return mi->second;
+    return NULL;
+}
+
+// Requires cs_main. Returns the tip of the best header chain. Once the active
+// chain has caught up with it, the header chain follows the active chain and
+// the headers kept for the sync are dropped.
+static CBlockIndex* UpdateBestHeader()
+{
+    if (chainActive.Tip() == NULL)
+        return chainHeaders.Tip();
+    if (chainHeaders.Tip() == NULL || chainActive.Tip()->nChainWork >= chainHeaders.Tip()->nChainWork)
+    {
+        chainHeaders.SetTip(chainActive.Tip());
+        if (!mapHeaderIndex.empty())
+        {
+            LogPrint("net", "headers sync caught up at height %d, dropping %u headers\n", chainActive.Height(), mapHeaderIndex.size());
+            for (map<uint256, CBlockIndex*>::iterator it = mapHeaderIndex.begin(); it != mapHeaderIndex.end(); ++it)
+                delete it->second;
+            mapHeaderIndex.clear();
+            mapUnconnectedBlocks.clear();
+            mapUnconnectedBlocksByPrev.clear();
+        }
+    }
+    return chainHeaders.Tip();
+}
+
+// Requires cs_main.
+void static PushGetHeaders(CNode* pnode, const uint256& hashStop)
+{
+    pnode->PushMessage("getheaders", chainHeaders.GetLocator(UpdateBestHeader()), hashStop);
+}
+
+// Requires cs_main. Contextual checks of a header whose proof of work has
+// been checked already. Headers of blocks we don't have are added to
+// mapHeaderIndex.
+bool static AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, CBlockIndex** ppindex)
+{
+    AssertLockHeld(cs_main);
+    uint256 hash = block.GetHash();
+    CBlockIndex* pindex = LookupHeader(hash);
+    if (pindex)
+    {
+        if (pindex->nStatus & BLOCK_FAILED_MASK)
+            return state.Invalid(error("AcceptBlockHeader() : block %s is marked invalid", hash.ToString()), 0, "duplicate");
+        *ppindex = pindex;
+        return true;
+    }
+
+    CBlockIndex* pindexPrev = LookupHeader(block.hashPrevBlock);
+    if (pindexPrev == NULL)
+        return state.DoS(10, error("AcceptBlockHeader() : prev block not found"), 0, "bad-prevblk");
+    if (pindexPrev->nStatus & BLOCK_FAILED_MASK)
+        return state.DoS(100, error("AcceptBlockHeader() : prev block invalid"), REJECT_INVALID, "bad-prevblk");
+    int nHeight = pindexPrev->nHeight + 1;
+
+    if (block.nBits != GetNextWorkRequired(pindexPrev, &block))
+        return state.DoS(100, error("AcceptBlockHeader() : incorrect proof of work"),
+                         REJECT_INVALID, "bad-diffbits");
+
+    if (block.GetBlockTime() <= pindexPrev->GetMedianTimePast())
+        return state.Invalid(error("AcceptBlockHeader() : block's timestamp is too early"),
+                             REJECT_INVALID, "time-too-old");
+
+    if (!Checkpoints::CheckBlock(nHeight, hash))
+        return state.DoS(100, error("AcceptBlockHeader() : rejected by checkpoint lock-in at %d", nHeight),
+                         REJECT_CHECKPOINT, "checkpoint mismatch");
+
+    CBlockIndex* pcheckpoint = Checkpoints::GetLastCheckpoint(mapBlockIndex);
+    if (pcheckpoint && nHeight < pcheckpoint->nHeight)
+        return state.DoS(100, error("AcceptBlockHeader() : forked chain older than last checkpoint (height %d)", nHeight));
+
+    CBlockHeader header = block;
+    CBlockIndex* pindexNew = new CBlockIndex(header);
+    map<uint256, CBlockIndex*>::iterator mi = mapHeaderIndex.insert(make_pair(hash, pindexNew)).first;
+    pindexNew->phashBlock = &((*mi).first);
+    pindexNew->pprev = pindexPrev;
+    pindexNew->nHeight = nHeight;
+    pindexNew->nChainWork = pindexPrev->nChainWork + pindexNew->GetBlockWork().getuint256();
+    pindexNew->nStatus = BLOCK_VALID_TREE;
+    *ppindex = pindexNew;
+    return true;
+}
+
+// Requires cs_main. Picks up to nCount blocks of the header chain for pto to
+// download, lowest first and no further than BLOCK_DOWNLOAD_WINDOW beyond the
+// point where the header chain leaves the active chain. When the window is
+// used up waiting for a block from another peer, that peer is returned in
+// nodeStaller.
+void static FindNextBlocksToDownload(CNode* pto, unsigned int nCount, vector<CBlockIndex*>& vBlocks, NodeId& nodeStaller)
+{
+    vBlocks.clear();
+    nodeStaller = -1;
+    if (UpdateBestHeader() == chainActive.Tip() || nCount == 0)
+        return;
+
+    CNodeState *state = State(pto->GetId());
+    int nPeerHeight = std::max(state->nSyncHeight, pto->nStartingHeight);
+
+    // Header entries are separate objects from the block index, compare hashes
+    int nFork = std::min(chainActive.Height(), chainHeaders.Height());
+    while (nFork >= 0 && chainHeaders[nFork]->GetBlockHash() != chainActive[nFork]->GetBlockHash())
+        nFork--;
+
+    int nWindowEnd = std::min(nFork + BLOCK_DOWNLOAD_WINDOW, chainHeaders.Height());
+    NodeId nodeWaitingFor = -1;
+    for (int nHeight = nFork + 1; nHeight <= nWindowEnd; nHeight++)
+    {
+        CBlockIndex* pindex = chainHeaders[nHeight];
+        const uint256& hash = pindex->GetBlockHash();
+
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+        if (mi != mapBlockIndex.end())
+        {
+            if (mi->second->nStatus & BLOCK_FAILED_MASK)
+            {
+                // The header chain runs through an invalid block; forget the
+                // rest of it until a better one comes along
+                LogPrintf("FindNextBlocksToDownload() : header chain contains invalid block %s\n", hash.ToString());
+                for (int i = nHeight; i <= chainHeaders.Height(); i++)
+                    if (!(chainHeaders[i]->nStatus & BLOCK_HAVE_DATA))
+                        chainHeaders[i]->nStatus |= BLOCK_FAILED_CHILD;
+                chainHeaders.SetTip(chainActive.Tip());
+                vBlocks.clear();
+                return;
+            }
+            continue;
+        }
+        if (mapUnconnectedBlocks.count(hash) || mapOrphanBlocks.count(hash))
+            continue;
+
+        map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
+        if (itInFlight != mapBlocksInFlight.end())
+        {
+            if (nodeWaitingFor == -1)
+                nodeWaitingFor = itInFlight->second.first;
+            continue;
+        }
+
+        if (nHeight > nPeerHeight)
+            return;
+        vBlocks.push_back(pindex);
+        if (vBlocks.size() == nCount)
+            return;
+    }
+
+    if (vBlocks.empty() && nWindowEnd < chainHeaders.Height() && nodeWaitingFor != pto->GetId())
+        nodeStaller = nodeWaitingFor;
+}
+
+// Requires cs_main. Writes a block of the header chain that arrived before
+// its parent to disk, to be connected by ProcessBlock once the parent is.
+bool static StoreUnconnectedBlock(CValidationState& state, CBlock& block, const CBlockIndex* pindex)
+{
+    uint256 hash = block.GetHash();
+    if (mapUnconnectedBlocks.count(hash))
+        return true;
+
+    try {
+        unsigned int nBlockSize = ::GetSerializeSize(block, SER_DISK, CLIENT_VERSION);
+        CDiskBlockPos blockPos;
+        if (!FindBlockPos(state, blockPos, nBlockSize+8, pindex->nHeight, block.nTime))
+            return error("StoreUnconnectedBlock() : FindBlockPos failed");
+        if (!WriteBlockToDisk(block, blockPos))
+            return state.Abort(_("Failed to write block"));
+        mapUnconnectedBlocks[hash] = blockPos;
+        mapUnconnectedBlocksByPrev.insert(make_pair(block.hashPrevBlock, hash));
+    } catch(std::runtime_error &e) {
+        return state.Abort(_("System error: ") + e.what());
+    }
+
+    LogPrint("net", "stored block %s (height %d) until its parent is connected\n", hash.ToString(), pindex->nHeight);
+    return true;
+}
+
 bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBlockPos *dbp)
 {
     AssertLockHeld(cs_main);
@@ -2867,6 +3270,11 @@ bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBl
     // If we don't already have its previous block, shunt it off to holding area until we get it
     if (pblock->hashPrevBlock != 0 && !mapBlockIndex.count(pblock->hashPrevBlock))
     {
+        // Blocks of the header chain come in out of order from several peers
+        map<uint256, CBlockIndex*>::iterator miHeader = mapHeaderIndex.find(hash);
+        if (miHeader != mapHeaderIndex.end())
+            return StoreUnconnectedBlock(state, *pblock, miHeader->second);
+
         LogPrintf("ProcessBlock: ORPHAN BLOCK %lu, prev=%s\n", (unsigned long)mapOrphanBlocks.size(), pblock->hashPrevBlock.ToString());
 
         // Accept orphans as long as there is a node to request its parents from
@@ -2917,6 +3325,25 @@ bool ProcessBlock(CValidationState &state, CNode* pfrom, CBlock* pblock, CDiskBl
             delete mi->second;
         }
         mapOrphanBlocksByPrev.erase(hashPrev);
+
+        for (multimap<uint256, uint256>::iterator mi = mapUnconnectedBlocksByPrev.lower_bound(hashPrev);
+             mi != mapUnconnectedBlocksByPrev.upper_bound(hashPrev);
+             ++mi)
+        {
+            map<uint256, CDiskBlockPos>::iterator itPos = mapUnconnectedBlocks.find(mi->second);
+            if (itPos == mapUnconnectedBlocks.end())
+                continue;
+            CDiskBlockPos pos = itPos->second;
+            mapUnconnectedBlocks.erase(itPos);
+            CBlock block;
+            if (!ReadBlockFromDisk(block, pos))
+                continue;
+            block.BuildMerkleTree();
+            CValidationState stateDummy;
+            if (AcceptBlock(block, stateDummy, &pos, true))
+                vWorkQueue.push_back(mi->second);
+        }
+        mapUnconnectedBlocksByPrev.erase(hashPrev);
     }
 
     LogPrintf("ProcessBlock: ACCEPTED block %s\n", hash.ToString());
@@ -3209,6 +3636,7 @@ bool static LoadBlockIndexDB()
     if (it == mapBlockIndex.end())
         return true;
     chainActive.SetTip(it->second);
+    SetChainTipSnapshot(it->second);
     LogPrintf("LoadBlockIndexDB(): hashBestChain=%s height=%d date=%s progress=%f\n",
         chainActive.Tip()->GetBlockHash().ToString(), chainActive.Height(),
         DateTimeStrFormat("%Y-%m-%d %H:%M:%S", chainActive.Tip()->GetBlockTime()),
@@ -3296,6 +3724,7 @@ void UnloadBlockIndex()
     mapBlockIndex.clear();
     setBlockIndexValid.clear();
     chainActive.SetTip(NULL);
+    SetChainTipSnapshot(NULL);
     pindexBestInvalid = NULL;
 }
 
@@ -3581,7 +4010,8 @@ bool static AlreadyHave(const CInv& inv)
         }
     case MSG_BLOCK:
         return mapBlockIndex.count(inv.hash) ||
-               mapOrphanBlocks.count(inv.hash);
+               mapOrphanBlocks.count(inv.hash) ||
+               mapUnconnectedBlocks.count(inv.hash);
     }
     // Don't know what it is, just say we already got one
     return true;
@@ -3594,8 +4024,6 @@ void static ProcessGetData(CNode* pfrom)
 
     vector<CInv> vNotFound;
 
-    LOCK(cs_main);
-
     while (it != pfrom->vRecvGetData.end()) {
         // Don't bother if send buffer is too full to respond anyway
         if (pfrom->nSendSize >= SendBufferSize())
@@ -3606,8 +4034,9 @@ void static ProcessGetData(CNode* pfrom)
             boost::this_thread::interruption_point();
             it++;
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
             {
+                LOCK(cs_main);
                 bool send = false;
                 map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(inv.hash);
                 if (mi != mapBlockIndex.end())
@@ -3629,13 +4058,39 @@ void static ProcessGetData(CNode* pfrom)
                 }
                 if (send)
                 {
-                    // Send block from disk
-                    CBlock block;
-                    ReadBlockFromDisk(block, (*mi).second);
-                    if (inv.type == MSG_BLOCK)
-                        pfrom->PushMessage("block", block);
+                    // Only recent blocks are worth reconstructing from the mempool
+                    bool fCompact = inv.type == MSG_CMPCT_BLOCK &&
+                                    mi->second->nHeight >= chainActive.Height() - MAX_CMPCTBLOCK_DEPTH;
+                    if (inv.type == MSG_BLOCK || (inv.type == MSG_CMPCT_BLOCK && !fCompact))
+                    {
+                        // Most peers ask for the same new block, so keep the
+                        // last one served ready to be queued as it is
+                        static uint256 hashLastBlockMsg;
+                        static CSharedMessage pLastBlockMsg;
+                        if (!pLastBlockMsg || hashLastBlockMsg != inv.hash)
+                        {
+                            CBlock block;
+                            ReadBlockFromDisk(block, (*mi).second);
+                            pLastBlockMsg = MakeSharedMessage("block", block);
+                            hashLastBlockMsg = inv.hash;
+                        }
+                        pfrom->PushSharedMessage(pLastBlockMsg);
+                    }
+                    else if (fCompact)
+                    {
+                        if (!pLastCompactMsg || blockLastCompact.GetHash() != inv.hash)
+                        {
+                            ReadBlockFromDisk(blockLastCompact, (*mi).second);
+                            CCompactBlock cmpctblock(blockLastCompact, GetRand(std::numeric_limits<uint64_t>::max()));
+                            pLastCompactMsg = MakeSharedMessage("cmpctblock", cmpctblock);
+                        }
+                        pfrom->PushSharedMessage(pLastCompactMsg);
+                    }
                     else // MSG_FILTERED_BLOCK)
                     {
+                        // Send block from disk
+                        CBlock block;
+                        ReadBlockFromDisk(block, (*mi).second);
                         LOCK(pfrom->cs_filter);
                         if (pfrom->pfilter)
                         {
@@ -3649,7 +4104,7 @@ void static ProcessGetData(CNode* pfrom)
                             // however we MUST always provide at least what the remote peer needs
                             typedef std::pair<unsigned int, uint256> PairType;
                             BOOST_FOREACH(PairType& pair, merkleBlock.vMatchedTxn)
-                                if (!pfrom->setInventoryKnown.count(CInv(MSG_TX, pair.second)))
+                                if (!pfrom->filterInventoryKnown.contains(pair.second))
                                     pfrom->PushMessage("tx", block.vtx[pair.first]);
                         }
                         // else
@@ -3675,9 +4130,9 @@ void static ProcessGetData(CNode* pfrom)
                 bool pushed = false;
                 {
                     LOCK(cs_mapRelay);
-                    map<CInv, CDataStream>::iterator mi = mapRelay.find(inv);
+                    map<CInv, CSharedMessage>::iterator mi = mapRelay.find(inv);
                     if (mi != mapRelay.end()) {
-                        pfrom->PushMessage(inv.GetCommand(), (*mi).second);
+                        pfrom->PushSharedMessage((*mi).second);
                         pushed = true;
                     }
                 }
@@ -3699,7 +4154,7 @@ void static ProcessGetData(CNode* pfrom)
             // Track requests for our stuff.
             g_signals.Inventory(inv.hash);
 
-            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK)
+            if (inv.type == MSG_BLOCK || inv.type == MSG_FILTERED_BLOCK || inv.type == MSG_CMPCT_BLOCK)
                 break;
         }
     }
@@ -3718,6 +4173,40 @@ void static ProcessGetData(CNode* pfrom)
     }
 }
 
+// Check a getcfilters or getcfheaders request and collect the hashes of the
+// blocks it covers: hashStop and its ancestors down to nStartHeight.
+static bool PrepareBlockFilterRequest(CNode* pfrom, unsigned char filterType, uint32_t nStartHeight, const uint256& hashStop,
+                                      uint32_t nMaxCount, vector<uint256>& vHashes, uint256& hashPrev)
+{
+    if (!pblockfilterindex || filterType != BLOCK_FILTER_BASIC)
+    {
+        LogPrint("net", "peer=%s requested unsupported block filter type %d\n", pfrom->addr.ToString(), filterType);
+        pfrom->fDisconnect = true;
+        return false;
+    }
+
+    LOCK(cs_main);
+    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashStop);
+    if (mi == mapBlockIndex.end())
+    {
+        LogPrint("net", "peer=%s requested block filters up to unknown block %s\n", pfrom->addr.ToString(), hashStop.ToString());
+        return false;
+    }
+    const CBlockIndex* pindex = mi->second;
+    if (nStartHeight > (uint32_t)pindex->nHeight || pindex->nHeight - nStartHeight >= nMaxCount)
+    {
+        LogPrint("net", "peer=%s requested too many block filters (%u to %d)\n", pfrom->addr.ToString(), nStartHeight, pindex->nHeight);
+        pfrom->fDisconnect = true;
+        return false;
+    }
+
+    vHashes.resize(pindex->nHeight - nStartHeight + 1);
+    for (int i = vHashes.size() - 1; i >= 0; i--, pindex = pindex->pprev)
+        vHashes[i] = pindex->GetBlockHash();
+    hashPrev = pindex ? pindex->GetBlockHash() : 0;
+    return true;
+}
+
 bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 {
     RandAddSeedPerfmon();
@@ -3728,13 +4217,6 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         return true;
     }
 
-    {
-        LOCK(cs_main);
-        State(pfrom->GetId())->nLastBlockProcess = GetTimeMicros();
-    }
-
-
-
     if (strCommand == "version")
     {
         // Each connection can only send one version message
@@ -3893,7 +4375,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
                 {
                     LOCK(cs_vNodes);
                     // Use deterministic randomness to send to the same nodes for 24 hours
-                    // at a time so the setAddrKnowns of the chosen nodes prevent repeats
+                    // at a time so the addrKnown filters of the chosen nodes prevent repeats
                     static uint256 hashSalt;
                     if (hashSalt == 0)
                         hashSalt = GetRandHash();
@@ -3950,10 +4432,24 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             bool fAlreadyHave = AlreadyHave(inv);
             LogPrint("net", "  got inventory: %s  %s\n", inv.ToString(), fAlreadyHave ? "have" : "new");
 
+            if (inv.type == MSG_BLOCK) {
+                CBlockIndex* pindex = LookupHeader(inv.hash);
+                if (pindex) {
+                    CNodeState *state = State(pfrom->GetId());
+                    state->nSyncHeight = std::max(state->nSyncHeight, pindex->nHeight);
+                }
+            }
+
             if (!fAlreadyHave) {
                 if (!fImporting && !fReindex) {
-                    if (inv.type == MSG_BLOCK)
-                        AddBlockToQueue(pfrom->GetId(), inv.hash);
+                    if (inv.type == MSG_BLOCK) {
+                        // While syncing, blocks are scheduled from the header
+                        // chain; fetch the headers leading up to this one
+                        if (!IsInitialBlockDownload() && mapHeaderIndex.empty())
+                            AddBlockToQueue(pfrom->GetId(), inv.hash);
+                        else if (!mapHeaderIndex.count(inv.hash))
+                            PushGetHeaders(pfrom, inv.hash);
+                    }
                     else
                         pfrom->AskFor(inv);
                 }
@@ -4056,7 +4552,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
         // we must use CBlocks, as CBlockHeaders won't include the 0x00 nTx count at the end
         vector<CBlock> vHeaders;
-        int nLimit = 2000;
+        int nLimit = MAX_HEADERS_RESULTS;
         LogPrint("net", "getheaders %d to %s\n", (pindex ? pindex->nHeight : -1), hashStop.ToString());
         for (; pindex; pindex = chainActive.Next(pindex))
         {
@@ -4068,84 +4564,106 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     }
 
 
-    else if (strCommand == "tx")
+    else if (strCommand == "headers" && !fImporting && !fReindex)
     {
-        vector<uint256> vWorkQueue;
-        vector<uint256> vEraseQueue;
-        CTransaction tx;
-        vRecv >> tx;
+        // Sent as CBlocks without transactions, see "getheaders"
+        unsigned int nCount = ReadCompactSize(vRecv);
+        if (nCount > MAX_HEADERS_RESULTS)
+        {
+            Misbehaving(pfrom->GetId(), 20);
+            return error("headers message size = %u", nCount);
+        }
+        vector<CBlockHeader> vHeaders(nCount);
+        for (unsigned int n = 0; n < nCount; n++)
+        {
+            vRecv >> vHeaders[n];
+            ReadCompactSize(vRecv);
+        }
 
-        CInv inv(MSG_TX, tx.GetHash());
-        pfrom->AddInventoryKnown(inv);
+        // Check proof of work before taking cs_main, scrypt is slow
+        BOOST_FOREACH(const CBlockHeader& header, vHeaders)
+        {
+            CValidationState state;
+            if (!CheckBlockHeader(header, state))
+            {
+                int nDoS;
+                if (state.IsInvalid(nDoS) && nDoS > 0)
+                    Misbehaving(pfrom->GetId(), nDoS);
+                return error("invalid header received from %s", pfrom->addr.ToString());
+            }
+        }
 
         LOCK(cs_main);
-
-        bool fMissingInputs = false;
-        CValidationState state;
-        if (AcceptToMemoryPool(mempool, state, tx, true, &fMissingInputs))
+        // Settle the header chain first, this may drop stale headers
+        CBlockIndex* pindexBestHeader = UpdateBestHeader();
+        CBlockIndex* pindexLast = NULL;
+        BOOST_FOREACH(const CBlockHeader& header, vHeaders)
         {
-            mempool.check(pcoinsTip);
-            RelayTransaction(tx, inv.hash);
-            mapAlreadyAskedFor.erase(inv);
-            vWorkQueue.push_back(inv.hash);
-            vEraseQueue.push_back(inv.hash);
-
-
-            LogPrint("mempool", "AcceptToMemoryPool: %s %s : accepted %s (poolsz %u)\n",
-                pfrom->addr.ToString(), pfrom->cleanSubVer,
-                tx.GetHash().ToString(),
-                mempool.mapTx.size());
-
-            // Recursively process any orphan transactions that depended on this one
-            set<NodeId> setMisbehaving;
-            for (unsigned int i = 0; i < vWorkQueue.size(); i++)
+            if (pindexLast && header.hashPrevBlock != pindexLast->GetBlockHash())
             {
-                map<uint256, set<uint256> >::iterator itByPrev = mapOrphanTransactionsByPrev.find(vWorkQueue[i]);
-                if (itByPrev == mapOrphanTransactionsByPrev.end())
-                    continue;
-                for (set<uint256>::iterator mi = itByPrev->second.begin();
-                     mi != itByPrev->second.end();
-                     ++mi)
-                {
-                    const uint256& orphanHash = *mi;
-                    const CTransaction& orphanTx = mapOrphanTransactions[orphanHash].tx;
-                    NodeId fromPeer = mapOrphanTransactions[orphanHash].fromPeer;
-                    bool fMissingInputs2 = false;
-                    // Use a dummy CValidationState so someone can't setup nodes to counter-DoS based on orphan
-                    // resolution (that is, feeding people an invalid transaction based on LegitTxX in order to get
-                    // anyone relaying LegitTxX banned)
-                    CValidationState stateDummy;
-
-                    vEraseQueue.push_back(orphanHash);
-
-                    if (setMisbehaving.count(fromPeer))
-                        continue;
-                    if (AcceptToMemoryPool(mempool, stateDummy, orphanTx, true, &fMissingInputs2))
-                    {
-                        LogPrint("mempool", "   accepted orphan tx %s\n", orphanHash.ToString());
-                        RelayTransaction(orphanTx, orphanHash);
-                        mapAlreadyAskedFor.erase(CInv(MSG_TX, orphanHash));
-                        vWorkQueue.push_back(orphanHash);
-                    }
-                    else if (!fMissingInputs2)
-                    {
-                        int nDos = 0;
-                        if (stateDummy.IsInvalid(nDos) && nDos > 0)
-                        {
-                            // Punish peer that gave us an invalid orphan tx
-                            Misbehaving(fromPeer, nDos);
-                            setMisbehaving.insert(fromPeer);
-                            LogPrint("mempool", "   invalid orphan tx %s\n", orphanHash.ToString());
-                        }
-                        // too-little-fee orphan
-                        LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
-                    }
-                    mempool.check(pcoinsTip);
-                }
+                Misbehaving(pfrom->GetId(), 20);
+                return error("non-continuous headers sequence from %s", pfrom->addr.ToString());
+            }
+            if (pindexLast == NULL && !LookupHeader(header.hashPrevBlock))
+            {
+                // Probably an announcement past what we know; ask for the headers in between
+                PushGetHeaders(pfrom, uint256(0));
+                return true;
             }
+            CValidationState state;
+            if (!AcceptBlockHeader(header, state, &pindexLast))
+            {
+                int nDoS;
+                if (state.IsInvalid(nDoS) && nDoS > 0)
+                    Misbehaving(pfrom->GetId(), nDoS);
+                return error("invalid header received from %s", pfrom->addr.ToString());
+            }
+        }
 
-            BOOST_FOREACH(uint256 hash, vEraseQueue)
-                EraseOrphanTx(hash);
+        if (pindexLast)
+        {
+            CNodeState *state = State(pfrom->GetId());
+            state->nSyncHeight = std::max(state->nSyncHeight, pindexLast->nHeight);
+            if (pindexLast->nChainWork > pindexBestHeader->nChainWork)
+                chainHeaders.SetTip(pindexLast);
+            LogPrint("net", "received %u headers from %s, best header %d, active chain %d\n",
+                     nCount, pfrom->addr.ToString(), chainHeaders.Height(), chainActive.Height());
+
+            // A full message means there are probably more
+            if (nCount == MAX_HEADERS_RESULTS)
+                pfrom->PushMessage("getheaders", chainHeaders.GetLocator(pindexLast), uint256(0));
+        }
+    }
+
+
+    else if (strCommand == "tx")
+    {
+        CTransaction tx;
+        vRecv >> tx;
+
+        CInv inv(MSG_TX, tx.GetHash());
+        pfrom->AddInventoryKnown(inv);
+
+        LOCK(cs_main);
+
+        bool fMissingInputs = false;
+        CValidationState state;
+        if (AcceptToMemoryPool(mempool, state, tx, true, &fMissingInputs))
+        {
+            mempool.check(pcoinsTip);
+            RelayTransaction(tx, inv.hash);
+            mapAlreadyAskedFor.erase(inv);
+
+            LogPrint("mempool", "AcceptToMemoryPool: %s %s : accepted %s (poolsz %u)\n",
+                pfrom->addr.ToString(), pfrom->cleanSubVer,
+                tx.GetHash().ToString(),
+                mempool.mapTx.size());
+
+            // Queue the orphans that spend this transaction's outputs and
+            // start resolving them; ProcessMessages continues with the rest.
+            EraseOrphanTx(inv.hash);
+            AddOrphanWorkFor(pfrom, tx, inv.hash);
+            ProcessOrphanTx(pfrom);
         }
         else if (fMissingInputs)
         {
@@ -4153,7 +4671,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
             // DoS prevention: do not allow mapOrphanTransactions to grow unbounded
             unsigned int nMaxOrphanTx = (unsigned int)std::max((int64_t)0, GetArg("-maxorphantx", DEFAULT_MAX_ORPHAN_TRANSACTIONS));
-            unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx);
+            size_t nMaxOrphanTxSize = (size_t)std::max((int64_t)0, GetArg("-maxorphantxsize", DEFAULT_MAX_ORPHAN_TRANSACTIONS_SIZE));
+            unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx, nMaxOrphanTxSize);
             if (nEvicted > 0)
                 LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
         }
@@ -4192,9 +4711,277 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     }
 
 
+    else if (strCommand == "cmpctblock" && !fImporting && !fReindex)
+    {
+        CCompactBlock cmpctblock;
+        vRecv >> cmpctblock;
+
+        uint256 hash = cmpctblock.header.GetHash();
+        LogPrint("net", "received compact block %s\n", hash.ToString());
+        pfrom->AddInventoryKnown(CInv(MSG_BLOCK, hash));
+
+        LOCK(cs_main);
+        // Compact blocks are only sent in reply to our getdata
+        map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(hash);
+        if (itInFlight == mapBlocksInFlight.end() || itInFlight->second.first != pfrom->GetId())
+        {
+            LogPrint("net", "ignoring unrequested compact block %s from peer=%s\n", hash.ToString(), pfrom->addr.ToString());
+            return true;
+        }
+
+        // Orphans are often the transactions a block was waiting on
+        vector<pair<uint256, const CTransaction*> > vOrphans;
+        vOrphans.reserve(mapOrphanTransactions.size());
+        for (map<uint256, COrphanTx>::const_iterator it = mapOrphanTransactions.begin(); it != mapOrphanTransactions.end(); ++it)
+            vOrphans.push_back(make_pair(it->first, &it->second.tx));
+
+        boost::shared_ptr<CPartialBlock> partialBlock(new CPartialBlock(&mempool));
+        ReadStatus status = partialBlock->InitData(cmpctblock, vOrphans);
+        if (status == READ_STATUS_INVALID)
+        {
+            MarkBlockAsReceived(hash);
+            Misbehaving(pfrom->GetId(), 100);
+            return error("invalid compact block %s from peer=%s", hash.ToString(), pfrom->addr.ToString());
+        }
+
+        vector<unsigned int> vMissing;
+        if (status == READ_STATUS_OK)
+            partialBlock->GetMissing(vMissing);
+        if (status == READ_STATUS_OK && vMissing.empty())
+        {
+            CBlock block;
+            status = partialBlock->FillBlock(block, vector<CTransaction>());
+            if (status == READ_STATUS_OK)
+            {
+                mapBlockSource[hash] = pfrom->GetId();
+                MarkBlockAsReceived(hash, pfrom->GetId());
+                CValidationState state;
+                ProcessBlock(state, pfrom, &block);
+                return true;
+            }
+        }
+
+        if (status != READ_STATUS_OK)
+        {
+            // Short id collision, fall back to the full block
+            LogPrint("net", "failed to reconstruct compact block %s, requesting full block from peer=%s\n", hash.ToString(), pfrom->addr.ToString());
+            pfrom->PushMessage("getdata", vector<CInv>(1, CInv(MSG_BLOCK, hash)));
+            return true;
+        }
+
+        itInFlight->second.second->partialBlock = partialBlock;
+        CBlockTransactionsRequest req;
+        req.blockhash = hash;
+        req.indexes.swap(vMissing);
+        pfrom->PushMessage("getblocktxn", req);
+    }
+
+
+    else if (strCommand == "getblocktxn")
+    {
+        CBlockTransactionsRequest req;
+        vRecv >> req;
+
+        LOCK(cs_main);
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(req.blockhash);
+        if (mi == mapBlockIndex.end() || !(mi->second->nStatus & BLOCK_HAVE_DATA))
+        {
+            LogPrint("net", "peer=%s asked for transactions of unknown block %s\n", pfrom->addr.ToString(), req.blockhash.ToString());
+            return true;
+        }
+
+        if (mi->second->nHeight < chainActive.Height() - MAX_BLOCKTXN_DEPTH)
+        {
+            // Not one we would have sent as a compact block, send all of it
+            pfrom->vRecvGetData.push_back(CInv(MSG_BLOCK, req.blockhash));
+            ProcessGetData(pfrom);
+            return true;
+        }
+
+        CBlock blockRead;
+        const CBlock* pblock = &blockLastCompact;
+        if (blockLastCompact.GetHash() != req.blockhash)
+        {
+            if (!ReadBlockFromDisk(blockRead, mi->second))
+                return error("getblocktxn : failed to read block %s", req.blockhash.ToString());
+            pblock = &blockRead;
+        }
+
+        CBlockTransactions resp(req);
+        for (unsigned int i = 0; i < req.indexes.size(); i++)
+        {
+            if (req.indexes[i] >= pblock->vtx.size())
+            {
+                Misbehaving(pfrom->GetId(), 100);
+                return error("peer=%s sent getblocktxn with out-of-bounds indexes", pfrom->addr.ToString());
+            }
+            resp.txn[i] = pblock->vtx[req.indexes[i]];
+        }
+        pfrom->PushMessage("blocktxn", resp);
+    }
+
+
+    else if (strCommand == "getcfilters")
+    {
+        unsigned char filterType;
+        uint32_t nStartHeight;
+        uint256 hashStop;
+        vRecv >> filterType >> nStartHeight >> hashStop;
+
+        vector<uint256> vHashes;
+        uint256 hashPrev;
+        if (!PrepareBlockFilterRequest(pfrom, filterType, nStartHeight, hashStop, MAX_GETCFILTERS_SIZE, vHashes, hashPrev))
+            return true;
+
+        // Filters are read from the index without cs_main
+        BOOST_FOREACH(const uint256& hash, vHashes)
+        {
+            CBlockFilter filter;
+            if (!pblockfilterindex->LookupFilter(hash, filter))
+            {
+                LogPrint("net", "peer=%s requested the filter of block %s, which is not indexed\n", pfrom->addr.ToString(), hash.ToString());
+                break;
+            }
+            pfrom->PushMessage("cfilter", filterType, hash, filter.GetEncodedFilter());
+        }
+    }
+
+
+    else if (strCommand == "getcfheaders")
+    {
+        unsigned char filterType;
+        uint32_t nStartHeight;
+        uint256 hashStop;
+        vRecv >> filterType >> nStartHeight >> hashStop;
+
+        vector<uint256> vHashes;
+        uint256 hashPrev;
+        if (!PrepareBlockFilterRequest(pfrom, filterType, nStartHeight, hashStop, MAX_GETCFHEADERS_SIZE, vHashes, hashPrev))
+            return true;
+
+        CBlockFilterEntry entry;
+        uint256 hashPrevHeader = 0;
+        if (hashPrev != 0)
+        {
+            if (!pblockfilterindex->LookupEntry(hashPrev, entry))
+            {
+                LogPrint("net", "peer=%s requested filter headers from block %s, which is not indexed\n", pfrom->addr.ToString(), hashPrev.ToString());
+                return true;
+            }
+            hashPrevHeader = entry.header;
+        }
+
+        vector<uint256> vFilterHashes;
+        vFilterHashes.reserve(vHashes.size());
+        BOOST_FOREACH(const uint256& hash, vHashes)
+        {
+            if (!pblockfilterindex->LookupEntry(hash, entry))
+            {
+                LogPrint("net", "peer=%s requested the filter header of block %s, which is not indexed\n", pfrom->addr.ToString(), hash.ToString());
+                return true;
+            }
+            vFilterHashes.push_back(entry.hash);
+        }
+        pfrom->PushMessage("cfheaders", filterType, hashStop, hashPrevHeader, vFilterHashes);
+    }
+
+
+    else if (strCommand == "getcfcheckpt")
+    {
+        unsigned char filterType;
+        uint256 hashStop;
+        vRecv >> filterType >> hashStop;
+
+        if (!pblockfilterindex || filterType != BLOCK_FILTER_BASIC)
+        {
+            LogPrint("net", "peer=%s requested unsupported block filter type %d\n", pfrom->addr.ToString(), filterType);
+            pfrom->fDisconnect = true;
+            return true;
+        }
+
+        // Every CFCHECKPT_INTERVAL-th ancestor of hashStop
+        vector<uint256> vHashes;
+        {
+            LOCK(cs_main);
+            map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashStop);
+            if (mi == mapBlockIndex.end())
+            {
+                LogPrint("net", "peer=%s requested filter checkpoints up to unknown block %s\n", pfrom->addr.ToString(), hashStop.ToString());
+                return true;
+            }
+            const CBlockIndex* pindex = mi->second;
+            vHashes.resize(pindex->nHeight / CFCHECKPT_INTERVAL);
+            for (int i = vHashes.size() - 1; i >= 0; i--)
+            {
+                int nHeight = (i + 1) * CFCHECKPT_INTERVAL;
+                while (pindex->nHeight > nHeight && !chainActive.Contains(pindex))
+                    pindex = pindex->pprev;
+                if (chainActive.Contains(pindex))
+                    pindex = chainActive[nHeight];
+                vHashes[i] = pindex->GetBlockHash();
+            }
+        }
+
+        vector<uint256> vHeaders;
+        vHeaders.reserve(vHashes.size());
+        BOOST_FOREACH(const uint256& hash, vHashes)
+        {
+            CBlockFilterEntry entry;
+            if (!pblockfilterindex->LookupEntry(hash, entry))
+            {
+                LogPrint("net", "peer=%s requested the filter header of block %s, which is not indexed\n", pfrom->addr.ToString(), hash.ToString());
+                return true;
+            }
+            vHeaders.push_back(entry.header);
+        }
+        pfrom->PushMessage("cfcheckpt", filterType, hashStop, vHeaders);
+    }
+
+
+    else if (strCommand == "blocktxn" && !fImporting && !fReindex)
+    {
+        CBlockTransactions resp;
+        vRecv >> resp;
+
+        LOCK(cs_main);
+        map<uint256, pair<NodeId, list<QueuedBlock>::iterator> >::iterator itInFlight = mapBlocksInFlight.find(resp.blockhash);
+        if (itInFlight == mapBlocksInFlight.end() || itInFlight->second.first != pfrom->GetId() ||
+            !itInFlight->second.second->partialBlock)
+        {
+            LogPrint("net", "ignoring unrequested blocktxn for %s from peer=%s\n", resp.blockhash.ToString(), pfrom->addr.ToString());
+            return true;
+        }
+
+        boost::shared_ptr<CPartialBlock> partialBlock;
+        partialBlock.swap(itInFlight->second.second->partialBlock);
+        CBlock block;
+        ReadStatus status = partialBlock->FillBlock(block, resp.txn);
+        if (status == READ_STATUS_INVALID)
+        {
+            MarkBlockAsReceived(resp.blockhash);
+            Misbehaving(pfrom->GetId(), 100);
+            return error("peer=%s sent blocktxn that does not match its request", pfrom->addr.ToString());
+        }
+        if (status == READ_STATUS_FAILED)
+        {
+            LogPrint("net", "failed to reconstruct compact block %s, requesting full block from peer=%s\n", resp.blockhash.ToString(), pfrom->addr.ToString());
+            pfrom->PushMessage("getdata", vector<CInv>(1, CInv(MSG_BLOCK, resp.blockhash)));
+            return true;
+        }
+
+        mapBlockSource[resp.blockhash] = pfrom->GetId();
+        MarkBlockAsReceived(resp.blockhash, pfrom->GetId());
+        CValidationState state;
+        ProcessBlock(state, pfrom, &block);
+    }
+
+
     else if (strCommand == "getaddr")
     {
-        pfrom->vAddrToSend.clear();
+        {
+            LOCK(pfrom->cs_vAddrToSend);
+            pfrom->vAddrToSend.clear();
+        }
         vector<CAddress> vAddr = addrman.GetAddr();
         BOOST_FOREACH(const CAddress &addr, vAddr)
             pfrom->PushAddress(addr);
@@ -4256,6 +5043,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
         bool bPingFinished = false;
         std::string sProblem;
 
+        // SendMessages sets up pings under cs_vSend
+        LOCK(pfrom->cs_vSend);
         if (nAvail >= sizeof(nonce)) {
             vRecv >> nonce;
 
@@ -4368,8 +5157,8 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
             delete pfrom->pfilter;
             pfrom->pfilter = new CBloomFilter(filter);
             pfrom->pfilter->UpdateEmptyFull();
+            pfrom->fRelayTxes = true;
         }
-        pfrom->fRelayTxes = true;
     }
 
 
@@ -4380,16 +5169,17 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
 
         // Nodes must NEVER send a data item > 520 bytes (the max size for a script data object,
         // and thus, the maximum size any matched object can have) in a filteradd message
-        if (vData.size() > MAX_SCRIPT_ELEMENT_SIZE)
-        {
-            Misbehaving(pfrom->GetId(), 100);
-        } else {
+        bool fBad = vData.size() > MAX_SCRIPT_ELEMENT_SIZE;
+        if (!fBad) {
             LOCK(pfrom->cs_filter);
             if (pfrom->pfilter)
                 pfrom->pfilter->insert(vData);
             else
-                Misbehaving(pfrom->GetId(), 100);
+                fBad = true;
         }
+        // Misbehaving takes cs_main, which must not be taken under cs_filter
+        if (fBad)
+            Misbehaving(pfrom->GetId(), 100);
     }
 
 
@@ -4437,6 +5227,124 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv)
     return true;
 }
 
+// Whether a message reads or changes chain state, and so has to be handled by
+// the message handler thread under cs_main. The others only touch the peer
+// itself, addrman, mapRelay or the mempool, and are also served by the
+// message worker threads.
+static bool NeedsMainLock(CNode* pfrom, CNetMessage& msg)
+{
+    // Nothing is handed off before the version handshake
+    if (pfrom->nVersion == 0)
+        return true;
+
+    string strCommand = msg.hdr.GetCommand();
+    if (strCommand == "ping" || strCommand == "pong" || strCommand == "addr" || strCommand == "getaddr" ||
+        strCommand == "filterload" || strCommand == "filteradd" || strCommand == "filterclear")
+        return false;
+
+    if (strCommand == "getdata")
+    {
+        // Transactions come from mapRelay and the mempool, blocks need cs_main
+        try
+        {
+            CDataStream vRecv(msg.vRecv.begin(), msg.vRecv.end(), msg.vRecv.GetType(), msg.vRecv.GetVersion());
+            vector<CInv> vInv;
+            vRecv >> vInv;
+            BOOST_FOREACH(const CInv& inv, vInv)
+                if (inv.type != MSG_TX)
+                    return true;
+            return false;
+        }
+        catch (std::exception&) {
+            // Leave it to ProcessMessage to reject
+            return true;
+        }
+    }
+
+    return true;
+}
+
+// Check a complete message and process it. Returns false if the stream is out
+// of sync and the peer has to be disconnected.
+static bool HandleMessage(CNode* pfrom, CNetMessage& msg)
+{
+    //if (fDebug)
+    //    LogPrintf("ProcessMessages(message %u msgsz, %u bytes, complete:%s)\n",
+    //            msg.hdr.nMessageSize, msg.vRecv.size(),
+    //            msg.complete() ? "Y" : "N");
+
+    // Scan for message start
+    if (memcmp(msg.hdr.pchMessageStart, Params().MessageStart(), MESSAGE_START_SIZE) != 0) {
+        LogPrintf("PROCESSMESSAGE: INVALID MESSAGESTART %s\n", SanitizeString(msg.hdr.GetCommand()));
+        return false;
+    }
+
+    // Read header
+    CMessageHeader& hdr = msg.hdr;
+    if (!hdr.IsValid())
+    {
+        LogPrintf("PROCESSMESSAGE: ERRORS IN HEADER %s\n", SanitizeString(hdr.GetCommand()));
+        return true;
+    }
+    string strCommand = hdr.GetCommand();
+
+    // Message size
+    unsigned int nMessageSize = hdr.nMessageSize;
+
+    // Checksum, hashed as the data arrived
+    CDataStream& vRecv = msg.vRecv;
+    uint256 hash = msg.GetMessageHash();
+    unsigned int nChecksum = 0;
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    if (nChecksum != hdr.nChecksum)
+    {
+        LogPrintf("ProcessMessages(%s, %u bytes): CHECKSUM ERROR nChecksum=%08x hdr.nChecksum=%08x\n",
+           SanitizeString(strCommand), nMessageSize, nChecksum, hdr.nChecksum);
+        return true;
+    }
+
+    // Process message
+    bool fRet = false;
+    int64_t nStart = GetTimeMicros();
+    try
+    {
+        fRet = ProcessMessage(pfrom, strCommand, vRecv);
+        boost::this_thread::interruption_point();
+    }
+    catch (std::ios_base::failure& e)
+    {
+        pfrom->PushMessage("reject", strCommand, REJECT_MALFORMED, string("error parsing message"));
+        if (strstr(e.what(), "end of data"))
+        {
+            // Allow exceptions from under-length message on vRecv
+            LogPrintf("ProcessMessages(%s, %u bytes): Exception '%s' caught, normally caused by a message being shorter than its stated length\n", SanitizeString(strCommand), nMessageSize, e.what());
+        }
+        else if (strstr(e.what(), "size too large"))
+        {
+            // Allow exceptions from over-long size
+            LogPrintf("ProcessMessages(%s, %u bytes): Exception '%s' caught\n", SanitizeString(strCommand), nMessageSize, e.what());
+        }
+        else
+        {
+            PrintExceptionContinue(&e, "ProcessMessages()");
+        }
+    }
+    catch (boost::thread_interrupted) {
+        throw;
+    }
+    catch (std::exception& e) {
+        PrintExceptionContinue(&e, "ProcessMessages()");
+    } catch (...) {
+        PrintExceptionContinue(NULL, "ProcessMessages()");
+    }
+    pfrom->RecordMessageHandled(strCommand, GetTimeMicros() - nStart);
+
+    if (!fRet)
+        LogPrintf("ProcessMessage(%s, %u bytes) FAILED\n", SanitizeString(strCommand), nMessageSize);
+
+    return true;
+}
+
 // requires LOCK(cs_vRecvMsg)
 bool ProcessMessages(CNode* pfrom)
 {
@@ -4456,105 +5364,74 @@ bool ProcessMessages(CNode* pfrom)
     if (!pfrom->vRecvGetData.empty())
         ProcessGetData(pfrom);
 
+    if (!pfrom->setOrphanWorkSet.empty())
+    {
+        LOCK(cs_main);
+        ProcessOrphanTx(pfrom);
+    }
+
     // this maintains the order of responses
     if (!pfrom->vRecvGetData.empty()) return fOk;
 
-    std::deque<CNetMessage>::iterator it = pfrom->vRecvMsg.begin();
-    while (!pfrom->fDisconnect && it != pfrom->vRecvMsg.end()) {
-        // Don't bother if send buffer is too full to respond anyway
-        if (pfrom->nSendSize >= SendBufferSize())
-            break;
+    // finish resolving orphans before looking at this peer's next message
+    if (!pfrom->setOrphanWorkSet.empty()) return fOk;
 
-        // get next message
-        CNetMessage& msg = *it;
+    // Don't bother if send buffer is too full to respond anyway
+    if (pfrom->fDisconnect || pfrom->nSendSize >= SendBufferSize())
+        return fOk;
 
-        //if (fDebug)
-        //    LogPrintf("ProcessMessages(message %u msgsz, %u bytes, complete:%s)\n",
-        //            msg.hdr.nMessageSize, msg.vRecv.size(),
-        //            msg.complete() ? "Y" : "N");
+    // Process the next message, if it is complete
+    if (pfrom->vRecvMsg.empty() || !pfrom->vRecvMsg.front().complete())
+        return fOk;
 
-        // end, if an incomplete message is found
-        if (!msg.complete())
-            break;
+    {
+        LOCK(cs_main);
+        State(pfrom->GetId())->nLastBlockProcess = GetTimeMicros();
+    }
 
-        // at this point, any failure means we can delete the current message
-        it++;
+    // at this point, any failure means we can delete the current message
+    fOk = HandleMessage(pfrom, pfrom->vRecvMsg.front());
 
-        // Scan for message start
-        if (memcmp(msg.hdr.pchMessageStart, Params().MessageStart(), MESSAGE_START_SIZE) != 0) {
-            LogPrintf("PROCESSMESSAGE: INVALID MESSAGESTART %s\n", SanitizeString(msg.hdr.GetCommand()));
-            fOk = false;
-            break;
-        }
+    // In case the connection got shut down, its receive buffer was wiped
+    if (!pfrom->fDisconnect)
+        pfrom->PopRecvMsg();
 
-        // Read header
-        CMessageHeader& hdr = msg.hdr;
-        if (!hdr.IsValid())
-        {
-            LogPrintf("PROCESSMESSAGE: ERRORS IN HEADER %s\n", SanitizeString(hdr.GetCommand()));
-            continue;
-        }
-        string strCommand = hdr.GetCommand();
+    return fOk;
+}
 
-        // Message size
-        unsigned int nMessageSize = hdr.nMessageSize;
+// Process the messages at the front of the queue that don't need cs_main,
+// stopping at the first one that does. Runs on the message worker threads.
+// requires LOCK(cs_vRecvMsg)
+bool ProcessWorkerMessages(CNode* pfrom)
+{
+    bool fOk = true;
 
-        // Checksum
-        CDataStream& vRecv = msg.vRecv;
-        uint256 hash = Hash(vRecv.begin(), vRecv.begin() + nMessageSize);
-        unsigned int nChecksum = 0;
-        memcpy(&nChecksum, &hash, sizeof(nChecksum));
-        if (nChecksum != hdr.nChecksum)
-        {
-            LogPrintf("ProcessMessages(%s, %u bytes): CHECKSUM ERROR nChecksum=%08x hdr.nChecksum=%08x\n",
-               SanitizeString(strCommand), nMessageSize, nChecksum, hdr.nChecksum);
-            continue;
-        }
+    // Outstanding getdata is answered by the message handler first. Orphan
+    // resolution sends nothing back, so it need not hold these messages up.
+    while (fOk && !pfrom->fDisconnect && pfrom->vRecvGetData.empty() && !pfrom->vRecvMsg.empty()) {
+        // Don't bother if send buffer is too full to respond anyway
+        if (pfrom->nSendSize >= SendBufferSize())
+            break;
+
+        CNetMessage& msg = pfrom->vRecvMsg.front();
+        if (!msg.complete() || NeedsMainLock(pfrom, msg))
+            break;
 
-        // Process message
-        bool fRet = false;
-        try
         {
-            fRet = ProcessMessage(pfrom, strCommand, vRecv);
-            boost::this_thread::interruption_point();
-        }
-        catch (std::ios_base::failure& e)
-        {
-            pfrom->PushMessage("reject", strCommand, REJECT_MALFORMED, string("error parsing message"));
-            if (strstr(e.what(), "end of data"))
-            {
-                // Allow exceptions from under-length message on vRecv
-                LogPrintf("ProcessMessages(%s, %u bytes): Exception '%s' caught, normally caused by a message being shorter than its stated length\n", SanitizeString(strCommand), nMessageSize, e.what());
-            }
-            else if (strstr(e.what(), "size too large"))
-            {
-                // Allow exceptions from over-long size
-                LogPrintf("ProcessMessages(%s, %u bytes): Exception '%s' caught\n", SanitizeString(strCommand), nMessageSize, e.what());
-            }
-            else
-            {
-                PrintExceptionContinue(&e, "ProcessMessages()");
-            }
-        }
-        catch (boost::thread_interrupted) {
-            throw;
-        }
-        catch (std::exception& e) {
-            PrintExceptionContinue(&e, "ProcessMessages()");
-        } catch (...) {
-            PrintExceptionContinue(NULL, "ProcessMessages()");
+            // If cs_main is taken the message handler is busy and had no
+            // chance to process blocks from this peer either
+            TRY_LOCK(cs_main, lockMain);
+            if (lockMain)
+                State(pfrom->GetId())->nLastBlockProcess = GetTimeMicros();
         }
 
-        if (!fRet)
-            LogPrintf("ProcessMessage(%s, %u bytes) FAILED\n", SanitizeString(strCommand), nMessageSize);
+        fOk = HandleMessage(pfrom, msg);
 
-        break;
+        // In case the connection got shut down, its receive buffer was wiped
+        if (!pfrom->fDisconnect)
+            pfrom->PopRecvMsg();
     }
 
-    // In case the connection got shut down, its receive buffer was wiped
-    if (!pfrom->fDisconnect)
-        pfrom->vRecvMsg.erase(pfrom->vRecvMsg.begin(), it);
-
     return fOk;
 }
 
@@ -4608,9 +5485,12 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                 LOCK(cs_vNodes);
                 BOOST_FOREACH(CNode* pnode, vNodes)
                 {
-                    // Periodically clear setAddrKnown to allow refresh broadcasts
+                    // Periodically clear addrKnown to allow refresh broadcasts
                     if (nLastRebroadcast)
-                        pnode->setAddrKnown.clear();
+                    {
+                        LOCK(pnode->cs_vAddrToSend);
+                        pnode->addrKnown.reset();
+                    }
 
                     // Rebroadcast our address
                     if (!fNoListen)
@@ -4629,23 +5509,31 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
         //
         if (fSendTrickle)
         {
-            vector<CAddress> vAddr;
-            vAddr.reserve(pto->vAddrToSend.size());
-            BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
+            vector<CAddress> vAddrToSend;
             {
-                // returns true if wasn't already contained in the set
-                if (pto->setAddrKnown.insert(addr).second)
+                LOCK(pto->cs_vAddrToSend);
+                vAddrToSend.reserve(pto->vAddrToSend.size());
+                BOOST_FOREACH(const CAddress& addr, pto->vAddrToSend)
                 {
-                    vAddr.push_back(addr);
-                    // receiver rejects addr messages larger than 1000
-                    if (vAddr.size() >= 1000)
+                    if (!pto->addrKnown.contains(addr.GetKey()))
                     {
-                        pto->PushMessage("addr", vAddr);
-                        vAddr.clear();
+                        pto->addrKnown.insert(addr.GetKey());
+                        vAddrToSend.push_back(addr);
                     }
                 }
+                pto->vAddrToSend.clear();
+            }
+            vector<CAddress> vAddr;
+            BOOST_FOREACH(const CAddress& addr, vAddrToSend)
+            {
+                vAddr.push_back(addr);
+                // receiver rejects addr messages larger than 1000
+                if (vAddr.size() >= 1000)
+                {
+                    pto->PushMessage("addr", vAddr);
+                    vAddr.clear();
+                }
             }
-            pto->vAddrToSend.clear();
             if (!vAddr.empty())
                 pto->PushMessage("addr", vAddr);
         }
@@ -4665,10 +5553,11 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             pto->PushMessage("reject", (string)"block", reject.chRejectCode, reject.strRejectReason, reject.hashBlock);
         state.rejects.clear();
 
-        // Start block sync
+        // Start block sync with the headers; the blocks are then fetched
+        // from all peers
         if (pto->fStartSync && !fImporting && !fReindex) {
             pto->fStartSync = false;
-            PushGetBlocks(pto, chainActive.Tip(), uint256(0));
+            PushGetHeaders(pto, uint256(0));
         }
 
         // Resend wallet transactions that haven't gotten in a block yet
@@ -4690,7 +5579,7 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             vInvWait.reserve(pto->vInventoryToSend.size());
             BOOST_FOREACH(const CInv& inv, pto->vInventoryToSend)
             {
-                if (pto->setInventoryKnown.count(inv))
+                if (pto->filterInventoryKnown.contains(inv.hash))
                     continue;
 
                 // trickle out tx inv to protect privacy
@@ -4711,15 +5600,12 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                     }
                 }
 
-                // returns true if wasn't already contained in the set
-                if (pto->setInventoryKnown.insert(inv).second)
+                pto->filterInventoryKnown.insert(inv.hash);
+                vInv.push_back(inv);
+                if (vInv.size() >= 1000)
                 {
-                    vInv.push_back(inv);
-                    if (vInv.size() >= 1000)
-                    {
-                        pto->PushMessage("inv", vInv);
-                        vInv.clear();
-                    }
+                    pto->PushMessage("inv", vInv);
+                    vInv.clear();
                 }
             }
             pto->vInventoryToSend = vInvWait;
@@ -4739,14 +5625,40 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             LogPrintf("Peer %s is stalling block download, disconnecting\n", state.name.c_str());
             pto->fDisconnect = true;
         }
+        if (!pto->fDisconnect && state.nStallingSince && state.nStallingSince < nNow - 1000000 * BLOCK_STALLING_TIMEOUT) {
+            // Only set while the download window can't move past this peer's blocks
+            LogPrintf("Peer %s is holding up the block download window, disconnecting\n", state.name.c_str());
+            pto->fDisconnect = true;
+        }
 
         //
         // Message: getdata (blocks)
         //
         vector<CInv> vGetData;
+        if (!pto->fDisconnect && !pto->fClient && (!pto->fInbound || state.nSyncHeight >= 0) &&
+            !fImporting && !fReindex && state.nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
+            vector<CBlockIndex*> vToDownload;
+            NodeId staller = -1;
+            FindNextBlocksToDownload(pto, MAX_BLOCKS_IN_TRANSIT_PER_PEER - state.nBlocksInFlight, vToDownload, staller);
+            BOOST_FOREACH(CBlockIndex* pindex, vToDownload) {
+                vGetData.push_back(CInv(MSG_BLOCK, pindex->GetBlockHash()));
+                MarkBlockAsInFlight(pto->GetId(), pindex->GetBlockHash());
+                LogPrint("net", "Requesting block %s (%d) from %s\n", pindex->GetBlockHash().ToString(), pindex->nHeight, state.name.c_str());
+            }
+            if (staller != -1) {
+                CNodeState *stateStaller = State(staller);
+                if (stateStaller && stateStaller->nStallingSince == 0) {
+                    stateStaller->nStallingSince = nNow;
+                    LogPrint("net", "Stall started on %s\n", stateStaller->name.c_str());
+                }
+            }
+        }
+        // New blocks are mostly made of transactions already in our mempool,
+        // so ask for them as compact blocks once we are caught up.
+        int nBlockInvType = (pto->nVersion >= COMPACT_BLOCKS_VERSION && !IsInitialBlockDownload()) ? MSG_CMPCT_BLOCK : MSG_BLOCK;
         while (!pto->fDisconnect && state.nBlocksToDownload && state.nBlocksInFlight < MAX_BLOCKS_IN_TRANSIT_PER_PEER) {
             uint256 hash = state.vBlocksToDownload.front();
-            vGetData.push_back(CInv(MSG_BLOCK, hash));
+            vGetData.push_back(CInv(nBlockInvType, hash));
             MarkBlockAsInFlight(pto->GetId(), hash);
             LogPrint("net", "Requesting block %s from %s\n", hash.ToString().c_str(), state.name.c_str());
             if (vGetData.size() >= 1000)
@@ -4807,5 +5719,7 @@ public:
         // orphan transactions
         mapOrphanTransactions.clear();
         mapOrphanTransactionsByPrev.clear();
+        mapOrphanTransactionsByPeer.clear();
+        nOrphanTransactionsSize = 0;
     }
 } instance_of_cmaincleanup;
@@ -47,6 +47,16 @@ static const unsigned int MAX_STANDARD_TX_SIZE = 100000;
 static const unsigned int MAX_BLOCK_SIGOPS = MAX_BLOCK_SIZE/50;
 /** Default for -maxorphantx, maximum number of orphan transactions kept in memory */
 static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS = 100;
+/** Default for -maxorphantxsize, maximum total size in bytes of orphan transactions kept in memory */
+static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS_SIZE = 250000;
+/** Default for -maxorphantxperpeer, maximum number of orphan transactions kept from a single peer */
+static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS_PER_PEER = 25;
+/** Maximum serialized size of a single orphan transaction, in bytes */
+static const unsigned int MAX_ORPHAN_TX_SIZE = 5000;
+/** Expiration time for orphan transactions, in seconds */
+static const int64_t ORPHAN_TX_EXPIRE_TIME = 20 * 60;
+/** Minimum time between orphan transaction expire sweeps, in seconds */
+static const int64_t ORPHAN_TX_EXPIRE_INTERVAL = 5 * 60;
 /** Default for -maxorphanblocks, maximum number of orphan blocks kept in memory */
 static const unsigned int DEFAULT_MAX_ORPHAN_BLOCKS = 750;
 /** The maximum size of a blk?????.dat file (since 0.8) */
@@ -67,6 +77,16 @@ static const int DEFAULT_SCRIPTCHECK_THREADS = 0;
 static const int MAX_BLOCKS_IN_TRANSIT_PER_PEER = 128;
 /** Timeout in seconds before considering a block download peer unresponsive. */
 static const unsigned int BLOCK_DOWNLOAD_TIMEOUT = 60;
+/** How far ahead of the active chain blocks of the header chain are fetched. */
+static const int BLOCK_DOWNLOAD_WINDOW = 1024;
+/** Seconds a peer may hold up the download window before it is disconnected. */
+static const unsigned int BLOCK_STALLING_TIMEOUT = 2;
+/** Number of headers sent in one "headers" message. */
+static const unsigned int MAX_HEADERS_RESULTS = 2000;
+/** Blocks deeper than this below the tip are sent in full, even if asked for as compact blocks. */
+static const int MAX_CMPCTBLOCK_DEPTH = 5;
+/** getblocktxn requests for blocks deeper than this below the tip are answered with the full block. */
+static const int MAX_BLOCKTXN_DEPTH = 10;
 
 #ifdef USE_UPNP
 static const int fHaveUPnP = true;
@@ -153,6 +173,8 @@ bool VerifyDB(int nCheckLevel, int nCheckDepth);
 void PrintBlockTree();
 /** Process protocol messages received from a given node */
 bool ProcessMessages(CNode* pfrom);
+/** Process the leading protocol messages from a node that don't need cs_main */
+bool ProcessWorkerMessages(CNode* pfrom);
 /** Send queued protocol messages to be sent to a give node */
 bool SendMessages(CNode* pto, bool fSendTrickle);
 /** Run an instance of the script checking thread */
@@ -199,6 +221,8 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
 
 struct CNodeStateStats {
     int nMisbehavior;
+    int nSyncHeight;
+    int nBlocksInFlight;
 };
 
 struct CDiskBlockPos
@@ -585,6 +609,8 @@ public:
 bool WriteBlockToDisk(CBlock& block, CDiskBlockPos& pos);
 bool ReadBlockFromDisk(CBlock& block, const CDiskBlockPos& pos);
 bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex);
+/** Reads a block as it is serialized in its block file, without decoding it */
+bool ReadRawBlockFromDisk(std::vector<unsigned char>& vchBlock, const CBlockIndex* pindex);
 
 
 /** Functions for validating blocks and updating the block tree */
@@ -601,12 +627,16 @@ bool ConnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex, C
 // Add this block to the block index, and if necessary, switch the active block chain to this
 bool AddToBlockIndex(CBlock& block, CValidationState& state, const CDiskBlockPos& pos);
 
+// Context-independent validity checks of a header: proof of work and timestamp
+bool CheckBlockHeader(const CBlockHeader& block, CValidationState& state, bool fCheckPOW = true);
+
 // Context-independent validity checks
 bool CheckBlock(const CBlock& block, CValidationState& state, bool fCheckPOW = true, bool fCheckMerkleRoot = true);
 
 // Store block on disk
-// if dbp is provided, the file is known to already reside on disk
-bool AcceptBlock(CBlock& block, CValidationState& state, CDiskBlockPos* dbp = NULL);
+// if dbp is provided, the file is known to already reside on disk; fStored
+// means its space in the block file was already accounted for as well
+bool AcceptBlock(CBlock& block, CValidationState& state, CDiskBlockPos* dbp = NULL, bool fStored = false);
 
 
 
@@ -1058,6 +1088,13 @@ public:
 /** The currently-connected chain of blocks. */
 extern CChain chainActive;
 
+/** The tip of chainActive as of the last block connected or disconnected.
+ * Readable without cs_main, for callers that only need the tip and not a
+ * consistent view of the rest of the chain; block index entries are never
+ * freed while the node runs.
+ */
+CBlockIndex* GetChainTipSnapshot();
+
 /** The currently best known chain of headers (some of which may be invalid). */
 extern CChain chainMostWork;
 
@@ -52,57 +52,180 @@ void SHA256Transform(void* pstate, void* pinput, const void* pinit)
         ((uint32_t*)pstate)[i] = ctx.h[i];
 }
 
-// Some explaining would be appreciated
-class COrphan
+// A mempool transaction considered for inclusion in a new block. Tracks the
+// in-mempool transactions it depends on and the aggregate size, fees and
+// sigops of itself plus all its ancestors that are not yet in the block
+// (its "ancestor package"), which is what fee-based selection is scored on.
+class CBlockCandidate
 {
 public:
     const CTransaction* ptx;
-    set<uint256> setDependsOn;
+    uint256 hash;
+    unsigned int nTxSize;
+    int64_t nFee;
     double dPriority;
-    double dFeePerKb;
+    unsigned int nSigOps; // legacy sigops only
+    std::vector<CBlockCandidate*> vParents; // in-mempool parents
+    std::vector<CBlockCandidate*> vChildren; // in-mempool children
+    unsigned int nParentsNotInBlock;
 
-    COrphan(const CTransaction* ptxIn)
+    uint64_t nSizeWithAncestors;
+    int64_t nFeesWithAncestors;
+    unsigned int nSigOpsWithAncestors;
+    unsigned int nAncestors;
+
+    bool fInBlock;
+    bool fInvalid;
+
+    CBlockCandidate(const CTransaction* ptxIn, const uint256& hashIn)
     {
         ptx = ptxIn;
-        dPriority = dFeePerKb = 0;
+        hash = hashIn;
+        nTxSize = 0;
+        nFee = 0;
+        dPriority = 0;
+        nSigOps = 0;
+        nParentsNotInBlock = 0;
+        nSizeWithAncestors = 0;
+        nFeesWithAncestors = 0;
+        nSigOpsWithAncestors = 0;
+        nAncestors = 0;
+        fInBlock = false;
+        fInvalid = false;
     }
 
-    void print() const
+    double GetAncestorFeePerKb() const
     {
-        LogPrintf("COrphan(hash=%s, dPriority=%.1f, dFeePerKb=%.1f)\n",
-               ptx->GetHash().ToString(), dPriority, dFeePerKb);
-        BOOST_FOREACH(uint256 hash, setDependsOn)
-            LogPrintf("   setDependsOn %s\n", hash.ToString());
+        return double(nFeesWithAncestors) / (double(nSizeWithAncestors)/1000.0);
     }
 };
 
+// Orders candidates by ancestor package fee rate, best first
+class CompareCandidateByAncestorFee
+{
+public:
+    bool operator()(const CBlockCandidate* a, const CBlockCandidate* b) const
+    {
+        double f1 = (double)a->nFeesWithAncestors * b->nSizeWithAncestors;
+        double f2 = (double)b->nFeesWithAncestors * a->nSizeWithAncestors;
+        if (f1 == f2)
+            return a->hash < b->hash;
+        return f1 > f2;
+    }
+};
+
+// Collect the not yet included in-mempool ancestors of pcand, including
+// pcand itself.
+static void GetPackage(CBlockCandidate* pcand, std::set<CBlockCandidate*>& setPackage)
+{
+    std::vector<CBlockCandidate*> vStack;
+    vStack.push_back(pcand);
+    while (!vStack.empty())
+    {
+        CBlockCandidate* p = vStack.back();
+        vStack.pop_back();
+        if (p->fInBlock || !setPackage.insert(p).second)
+            continue;
+        BOOST_FOREACH(CBlockCandidate* pparent, p->vParents)
+            vStack.push_back(pparent);
+    }
+}
+
+// Collect the not yet included in-mempool descendants of pcand, excluding
+// pcand itself.
+static void GetDescendants(CBlockCandidate* pcand, std::set<CBlockCandidate*>& setDescendants)
+{
+    std::vector<CBlockCandidate*> vStack(pcand->vChildren.begin(), pcand->vChildren.end());
+    while (!vStack.empty())
+    {
+        CBlockCandidate* p = vStack.back();
+        vStack.pop_back();
+        if (p->fInBlock || !setDescendants.insert(p).second)
+            continue;
+        BOOST_FOREACH(CBlockCandidate* pchild, p->vChildren)
+            vStack.push_back(pchild);
+    }
+}
+
+// A parent always has fewer ancestors than any of its children
+static bool CompareCandidateByAncestorCount(const CBlockCandidate* a, const CBlockCandidate* b)
+{
+    if (a->nAncestors == b->nAncestors)
+        return a->hash < b->hash;
+    return a->nAncestors < b->nAncestors;
+}
 
 uint64_t nLastBlockTx = 0;
 uint64_t nLastBlockSize = 0;
 
-// We want to sort transactions by priority and fee, so:
-typedef boost::tuple<double, double, const CTransaction*> TxPriority;
-class TxPriorityCompare
+// Once the block is this close to full, give up on package selection after
+// this many consecutive packages failed to fit.
+static const unsigned int MAX_CONSECUTIVE_FAILURES = 1000;
+
+// Checks and applies a set of candidates (sorted parents first) to view and
+// appends them to the block template. Either all of them are added or, if
+// any fails validation or the sigop limit, none is.
+static bool AddToBlock(const std::vector<CBlockCandidate*>& vAdd, CCoinsViewCache& view, CBlockIndex* pindexPrev,
+                       CBlockTemplate* pblocktemplate, uint64_t& nBlockSize, uint64_t& nBlockTx, int& nBlockSigOps,
+                       int64_t& nFees, bool fPrintPriority)
 {
-    bool byFee;
-public:
-    TxPriorityCompare(bool _byFee) : byFee(_byFee) { }
-    bool operator()(const TxPriority& a, const TxPriority& b)
+    CCoinsViewCache viewPackage(view, true);
+    std::vector<int64_t> vTxFees;
+    std::vector<int64_t> vTxSigOps;
+    int nPackageSigOps = 0;
+    BOOST_FOREACH(CBlockCandidate* pcand, vAdd)
     {
-        if (byFee)
+        const CTransaction& tx = *pcand->ptx;
+        if (!viewPackage.HaveInputs(tx))
         {
-            if (a.get<1>() == b.get<1>())
-                return a.get<0>() < b.get<0>();
-            return a.get<1>() < b.get<1>();
+            pcand->fInvalid = true;
+            return false;
         }
-        else
+
+        int64_t nTxFees = viewPackage.GetValueIn(tx)-tx.GetValueOut();
+
+        unsigned int nTxSigOps = pcand->nSigOps + GetP2SHSigOpCount(tx, viewPackage);
+        nPackageSigOps += nTxSigOps;
+        if (nBlockSigOps + nPackageSigOps >= MAX_BLOCK_SIGOPS)
+            return false;
+
+        CValidationState state;
+        if (!CheckInputs(tx, state, viewPackage, true, SCRIPT_VERIFY_P2SH))
+        {
+            pcand->fInvalid = true;
+            return false;
+        }
+
+        CTxUndo txundo;
+        UpdateCoins(tx, state, viewPackage, txundo, pindexPrev->nHeight+1, pcand->hash);
+        vTxFees.push_back(nTxFees);
+        vTxSigOps.push_back(nTxSigOps);
+    }
+    viewPackage.Flush();
+
+    CBlock *pblock = &pblocktemplate->block;
+    for (unsigned int i = 0; i < vAdd.size(); i++)
+    {
+        CBlockCandidate* pcand = vAdd[i];
+        pblock->vtx.push_back(*pcand->ptx);
+        pblocktemplate->vTxFees.push_back(vTxFees[i]);
+        pblocktemplate->vTxSigOps.push_back(vTxSigOps[i]);
+        nBlockSize += pcand->nTxSize;
+        ++nBlockTx;
+        nBlockSigOps += vTxSigOps[i];
+        nFees += vTxFees[i];
+        pcand->fInBlock = true;
+        BOOST_FOREACH(CBlockCandidate* pchild, pcand->vChildren)
+            pchild->nParentsNotInBlock--;
+
+        if (fPrintPriority)
         {
-            if (a.get<0>() == b.get<0>())
-                return a.get<1>() < b.get<1>();
-            return a.get<0>() < b.get<0>();
+            LogPrintf("priority %.1f feeperkb %.1f txid %s\n",
+                   pcand->dPriority, double(pcand->nFee) / (double(pcand->nTxSize)/1000.0), pcand->hash.ToString());
         }
     }
-};
+    return true;
+}
 
 CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
 {
@@ -146,24 +269,26 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
         CBlockIndex* pindexPrev = chainActive.Tip();
         CCoinsViewCache view(*pcoinsTip, true);
 
-        // Priority order to process transactions
-        list<COrphan> vOrphan; // list memory doesn't move
-        map<uint256, vector<COrphan*> > mapDependers;
         bool fPrintPriority = GetBoolArg("-printpriority", false);
 
-        // This vector will be sorted into a priority queue:
-        vector<TxPriority> vecPriority;
-        vecPriority.reserve(mempool.mapTx.size());
+        // Build the candidate graph. list memory doesn't move.
+        list<CBlockCandidate> lCandidates;
+        map<uint256, CBlockCandidate*> mapCandidates;
         for (map<uint256, CTxMemPoolEntry>::iterator mi = mempool.mapTx.begin();
              mi != mempool.mapTx.end(); ++mi)
         {
             const CTransaction& tx = mi->second.GetTx();
             if (tx.IsCoinBase() || !IsFinalTx(tx, pindexPrev->nHeight + 1))
                 continue;
+            lCandidates.push_back(CBlockCandidate(&tx, mi->first));
+            mapCandidates[mi->first] = &lCandidates.back();
+        }
 
-            COrphan* porphan = NULL;
+        for (list<CBlockCandidate>::iterator it = lCandidates.begin(); it != lCandidates.end(); )
+        {
+            CBlockCandidate& cand = *it;
+            const CTransaction& tx = *cand.ptx;
             double dPriority = 0;
-            int64_t nTotalIn = 0;
             bool fMissingInputs = false;
             BOOST_FOREACH(const CTxIn& txin, tx.vin)
             {
@@ -178,141 +303,167 @@ CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
                         LogPrintf("ERROR: mempool transaction missing input\n");
                         if (fDebug) assert("mempool transaction missing input" == 0);
                         fMissingInputs = true;
-                        if (porphan)
-                            vOrphan.pop_back();
                         break;
                     }
 
-                    // Has to wait for dependencies
-                    if (!porphan)
+                    // Has to wait for dependencies. A parent that is not a
+                    // candidate itself (e.g. non-final) makes this one unminable.
+                    map<uint256, CBlockCandidate*>::iterator itParent = mapCandidates.find(txin.prevout.hash);
+                    if (itParent == mapCandidates.end())
                     {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
+                        fMissingInputs = true;
+                        break;
                     }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].GetTx().vout[txin.prevout.n].nValue;
+                    if (std::find(cand.vParents.begin(), cand.vParents.end(), itParent->second) == cand.vParents.end())
+                        cand.vParents.push_back(itParent->second);
                     continue;
                 }
                 const CCoins &coins = view.GetCoins(txin.prevout.hash);
 
                 int64_t nValueIn = coins.vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
-
                 int nConf = pindexPrev->nHeight - coins.nHeight + 1;
 
                 dPriority += (double)nValueIn * nConf;
             }
-            if (fMissingInputs) continue;
-
-            // Priority is sum(valuein * age) / modified_txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            dPriority = tx.ComputePriority(dPriority, nTxSize);
-
-            // This is a more accurate fee-per-kilobyte than is used by the client code, because the
-            // client code rounds up the size to the nearest 1K. That's good, because it gives an
-            // incentive to create smaller transactions.
-            double dFeePerKb =  double(nTotalIn-tx.GetValueOut()) / (double(nTxSize)/1000.0);
-
-            if (porphan)
+            if (fMissingInputs)
             {
-                porphan->dPriority = dPriority;
-                porphan->dFeePerKb = dFeePerKb;
+                cand.fInvalid = true;
+                ++it;
+                continue;
             }
-            else
-                vecPriority.push_back(TxPriority(dPriority, dFeePerKb, &mi->second.GetTx()));
+
+            // Priority is sum(valuein * age) / modified_txsize
+            cand.nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
+            cand.dPriority = tx.ComputePriority(dPriority, cand.nTxSize);
+            cand.nFee = mempool.mapTx[cand.hash].GetFee();
+            cand.nSigOps = GetLegacySigOpCount(tx);
+            cand.nParentsNotInBlock = cand.vParents.size();
+            BOOST_FOREACH(CBlockCandidate* pparent, cand.vParents)
+                pparent->vChildren.push_back(&cand);
+            ++it;
         }
 
         // Collect transactions into block
         uint64_t nBlockSize = 1000;
         uint64_t nBlockTx = 0;
         int nBlockSigOps = 100;
-        bool fSortedByFee = (nBlockPrioritySize <= 0);
-
-        TxPriorityCompare comparer(fSortedByFee);
-        std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
 
-        while (!vecPriority.empty())
+        // First fill the space reserved for high-priority transactions,
+        // included regardless of the fees they pay. A transaction only
+        // becomes eligible once all its in-mempool parents are included.
+        if (nBlockPrioritySize > 0)
         {
-            // Take highest priority transaction off the priority queue:
-            double dPriority = vecPriority.front().get<0>();
-            double dFeePerKb = vecPriority.front().get<1>();
-            const CTransaction& tx = *(vecPriority.front().get<2>());
+            vector<pair<double, CBlockCandidate*> > vecPriority;
+            BOOST_FOREACH(CBlockCandidate& cand, lCandidates)
+                if (!cand.fInvalid && cand.nParentsNotInBlock == 0)
+                    vecPriority.push_back(make_pair(cand.dPriority, &cand));
+            std::make_heap(vecPriority.begin(), vecPriority.end());
 
-            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            vecPriority.pop_back();
+            while (!vecPriority.empty())
+            {
+                // Take highest priority transaction off the priority queue:
+                CBlockCandidate* pcand = vecPriority.front().second;
+                std::pop_heap(vecPriority.begin(), vecPriority.end());
+                vecPriority.pop_back();
+
+                // Continue by fee once past the priority size or we run out of
+                // high-priority transactions:
+                if (nBlockSize + pcand->nTxSize >= nBlockPrioritySize || !AllowFree(pcand->dPriority))
+                    break;
 
-            // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            if (nBlockSize + nTxSize >= nBlockMaxSize)
-                continue;
+                if (nBlockSigOps + pcand->nSigOps >= MAX_BLOCK_SIGOPS)
+                    continue;
 
-            // Legacy limits on sigOps:
-            unsigned int nTxSigOps = GetLegacySigOpCount(tx);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
+                if (!AddToBlock(vector<CBlockCandidate*>(1, pcand), view, pindexPrev, pblocktemplate.get(),
+                                nBlockSize, nBlockTx, nBlockSigOps, nFees, fPrintPriority))
+                    continue;
 
-            // Skip free transactions if we're past the minimum block size:
-            if (fSortedByFee && (dFeePerKb < CTransaction::nMinRelayTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
-                continue;
+                BOOST_FOREACH(CBlockCandidate* pchild, pcand->vChildren)
+                {
+                    if (!pchild->fInvalid && pchild->nParentsNotInBlock == 0)
+                    {
+                        vecPriority.push_back(make_pair(pchild->dPriority, pchild));
+                        std::push_heap(vecPriority.begin(), vecPriority.end());
+                    }
+                }
+            }
+        }
 
-            // Prioritize by fee once past the priority size or we run out of high-priority
-            // transactions:
-            if (!fSortedByFee &&
-                ((nBlockSize + nTxSize >= nBlockPrioritySize) || !AllowFree(dPriority)))
+        // Then select by ancestor package fee rate, so that a high-fee child
+        // pulls in its low-fee parents.
+        std::set<CBlockCandidate*, CompareCandidateByAncestorFee> setByAncestorFee;
+        BOOST_FOREACH(CBlockCandidate& cand, lCandidates)
+        {
+            if (cand.fInBlock || cand.fInvalid)
+                continue;
+            std::set<CBlockCandidate*> setPackage;
+            GetPackage(&cand, setPackage);
+            cand.nAncestors = setPackage.size();
+            BOOST_FOREACH(CBlockCandidate* p, setPackage)
             {
-                fSortedByFee = true;
-                comparer = TxPriorityCompare(fSortedByFee);
-                std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
+                cand.nSizeWithAncestors += p->nTxSize;
+                cand.nFeesWithAncestors += p->nFee;
+                cand.nSigOpsWithAncestors += p->nSigOps;
             }
+            setByAncestorFee.insert(&cand);
+        }
 
-            if (!view.HaveInputs(tx))
+        unsigned int nConsecutiveFailed = 0;
+        while (!setByAncestorFee.empty())
+        {
+            CBlockCandidate* pcand = *setByAncestorFee.begin();
+            setByAncestorFee.erase(setByAncestorFee.begin());
+            if (pcand->fInBlock || pcand->fInvalid)
                 continue;
 
-            int64_t nTxFees = view.GetValueIn(tx)-tx.GetValueOut();
-
-            nTxSigOps += GetP2SHSigOpCount(tx, view);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
+            // Stop once past the minimum block size and packages no longer
+            // pay the relay fee:
+            if (pcand->GetAncestorFeePerKb() < CTransaction::nMinRelayTxFee &&
+                nBlockSize + pcand->nSizeWithAncestors >= nBlockMinSize)
+                break;
 
-            CValidationState state;
-            if (!CheckInputs(tx, state, view, true, SCRIPT_VERIFY_P2SH))
+            if (nBlockSize + pcand->nSizeWithAncestors >= nBlockMaxSize ||
+                nBlockSigOps + pcand->nSigOpsWithAncestors >= MAX_BLOCK_SIGOPS)
+            {
+                if (nBlockSize > nBlockMaxSize - 4000 && ++nConsecutiveFailed > MAX_CONSECUTIVE_FAILURES)
+                    break;
                 continue;
+            }
 
-            CTxUndo txundo;
-            uint256 hash = tx.GetHash();
-            UpdateCoins(tx, state, view, txundo, pindexPrev->nHeight+1, hash);
-
-            // Added
-            pblock->vtx.push_back(tx);
-            pblocktemplate->vTxFees.push_back(nTxFees);
-            pblocktemplate->vTxSigOps.push_back(nTxSigOps);
-            nBlockSize += nTxSize;
-            ++nBlockTx;
-            nBlockSigOps += nTxSigOps;
-            nFees += nTxFees;
-
-            if (fPrintPriority)
+            std::set<CBlockCandidate*> setPackage;
+            GetPackage(pcand, setPackage);
+            vector<CBlockCandidate*> vPackage;
+            bool fInvalidAncestor = false;
+            BOOST_FOREACH(CBlockCandidate* p, setPackage)
             {
-                LogPrintf("priority %.1f feeperkb %.1f txid %s\n",
-                       dPriority, dFeePerKb, tx.GetHash().ToString());
+                fInvalidAncestor |= p->fInvalid;
+                vPackage.push_back(p);
             }
+            if (fInvalidAncestor)
+            {
+                pcand->fInvalid = true;
+                continue;
+            }
+            std::sort(vPackage.begin(), vPackage.end(), CompareCandidateByAncestorCount);
+
+            if (!AddToBlock(vPackage, view, pindexPrev, pblocktemplate.get(),
+                            nBlockSize, nBlockTx, nBlockSigOps, nFees, fPrintPriority))
+                continue;
+            nConsecutiveFailed = 0;
 
-            // Add transactions that depend on this one to the priority queue
-            if (mapDependers.count(hash))
+            // Descendants of the package no longer need to pay for it
+            BOOST_FOREACH(CBlockCandidate* p, vPackage)
             {
-                BOOST_FOREACH(COrphan* porphan, mapDependers[hash])
+                std::set<CBlockCandidate*> setDescendants;
+                GetDescendants(p, setDescendants);
+                BOOST_FOREACH(CBlockCandidate* pdesc, setDescendants)
                 {
-                    if (!porphan->setDependsOn.empty())
-                    {
-                        porphan->setDependsOn.erase(hash);
-                        if (porphan->setDependsOn.empty())
-                        {
-                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->dFeePerKb, porphan->ptx));
-                            std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
-                        }
-                    }
+                    bool fQueued = setByAncestorFee.erase(pdesc);
+                    pdesc->nSizeWithAncestors -= p->nTxSize;
+                    pdesc->nFeesWithAncestors -= p->nFee;
+                    pdesc->nSigOpsWithAncestors -= p->nSigOps;
+                    if (fQueued)
+                        setByAncestorFee.insert(pdesc);
                 }
             }
         }
@@ -415,6 +566,48 @@ void FormatHashBuffers(CBlock* pblock, char* pmidstate, char* pdata, char* phash
 double dHashesPerSec = 0.0;
 int64_t nHPSTimerStart = 0;
 
+// Number of nonces handed to a miner thread at a time
+static const unsigned int MINER_NONCE_RANGE = 0x10000;
+
+// The block all miner threads are working on. Threads take disjoint nonce
+// ranges of the current header, so only one template is built for all of
+// them; when the nonce space runs out the extra nonce is incremented.
+class CMinerWork
+{
+public:
+    CCriticalSection cs;
+    CBlockTemplate* pblocktemplate;
+    CBlockIndex* pindexPrev;
+    unsigned int nTransactionsUpdatedLast;
+    int64_t nStart;
+    unsigned int nExtraNonce;
+    unsigned int nNextNonce;
+    // Changes whenever the block other than its nonce and time changes, so
+    // threads can notice their range has gone stale.
+    volatile unsigned int nWorkId;
+    CReserveKey* preservekey;
+    std::vector<double> vThreadHashesPerSec;
+
+    CMinerWork()
+    {
+        pblocktemplate = NULL;
+        pindexPrev = NULL;
+        nTransactionsUpdatedLast = 0;
+        nStart = 0;
+        nExtraNonce = 0;
+        nNextNonce = 0;
+        nWorkId = 0;
+        preservekey = NULL;
+    }
+
+    ~CMinerWork()
+    {
+        delete pblocktemplate;
+        delete preservekey;
+    }
+};
+static CMinerWork* pminerwork = NULL;
+
 CBlockTemplate* CreateNewBlockWithKey(CReserveKey& reservekey)
 {
     CPubKey pubkey;
@@ -463,15 +656,98 @@ bool CheckWork(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey)
     return true;
 }
 
-void static CarboncoinMiner(CWallet *pwallet)
+// Hand out the next nonce range of the shared block, building a new template
+// first if there is none or it has gone stale. Requires work.cs.
+static bool GetMinerWork(CMinerWork& work, CWallet* pwallet, CBlockHeader& header,
+                         unsigned int& nNonceBegin, unsigned int& nNonceEnd, unsigned int& nWorkId)
+{
+    CBlockIndex* pindexTip = chainActive.Tip();
+    bool fStale = (work.pblocktemplate == NULL || work.pindexPrev != pindexTip ||
+                   (mempool.GetTransactionsUpdated() != work.nTransactionsUpdatedLast && GetTime() - work.nStart > 60));
+    if (fStale)
+    {
+        delete work.pblocktemplate;
+        work.pblocktemplate = NULL;
+        if (work.preservekey == NULL)
+            work.preservekey = new CReserveKey(pwallet);
+
+        work.nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
+        work.pindexPrev = pindexTip;
+        work.pblocktemplate = CreateNewBlockWithKey(*work.preservekey);
+        if (!work.pblocktemplate)
+            return false;
+        work.nStart = GetTime();
+        IncrementExtraNonce(&work.pblocktemplate->block, work.pindexPrev, work.nExtraNonce);
+        work.nNextNonce = 0;
+        work.nWorkId++;
+
+        LogPrintf("Running CarboncoinMiner with %u transactions in block (%u bytes)\n", work.pblocktemplate->block.vtx.size(),
+               ::GetSerializeSize(work.pblocktemplate->block, SER_NETWORK, PROTOCOL_VERSION));
+    }
+    else if (work.nNextNonce >= 0xffff0000)
+    {
+        // Nonce space exhausted: roll the coinbase
+        IncrementExtraNonce(&work.pblocktemplate->block, work.pindexPrev, work.nExtraNonce);
+        work.nNextNonce = 0;
+        work.nWorkId++;
+    }
+
+    CBlock *pblock = &work.pblocktemplate->block;
+    UpdateTime(*pblock, work.pindexPrev);
+    header = pblock->GetBlockHeader();
+    nNonceBegin = work.nNextNonce;
+    nNonceEnd = nNonceBegin + MINER_NONCE_RANGE;
+    work.nNextNonce = nNonceEnd;
+    nWorkId = work.nWorkId;
+    return true;
+}
+
+// Scratchpads are touched at random on every hash; back them with huge pages
+// where the OS allows, to avoid TLB misses.
+static char* AllocScratchpad()
+{
+#ifndef WIN32
+    void* p = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    p = mmap(NULL, SCRYPT_SCRATCHPAD_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+    if (p == MAP_FAILED)
+    {
+        p = mmap(NULL, SCRYPT_SCRATCHPAD_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (p == MAP_FAILED)
+            throw std::runtime_error("CarboncoinMiner : failed to allocate scratchpad");
+#ifdef MADV_HUGEPAGE
+        madvise(p, SCRYPT_SCRATCHPAD_SIZE, MADV_HUGEPAGE);
+#endif
+    }
+    return (char*)p;
+#else
+    char* p = (char*)malloc(SCRYPT_SCRATCHPAD_SIZE);
+    if (p == NULL)
+        throw std::runtime_error("CarboncoinMiner : failed to allocate scratchpad");
+    return p;
+#endif
+}
+
+static void FreeScratchpad(char* p)
+{
+#ifndef WIN32
+    munmap(p, SCRYPT_SCRATCHPAD_SIZE);
+#else
+    free(p);
+#endif
+}
+
+void static CarboncoinMiner(CWallet *pwallet, CMinerWork* pwork, int nThread)
 {
     LogPrintf("CarboncoinMiner started\n");
     SetThreadPriority(THREAD_PRIORITY_LOWEST);
     RenameThread("carboncoin-miner");
 
-    // Each thread has its own key and counter
-    CReserveKey reservekey(pwallet);
-    unsigned int nExtraNonce = 0;
+    CMinerWork& work = *pwork;
+    char* scratchpad = AllocScratchpad();
+    int64_t nThreadTimerStart = GetTimeMillis();
+    uint64_t nThreadHashCounter = 0;
 
     try { while (true) {
         if (Params().NetworkID() != CChainParams::REGTEST) {
@@ -482,53 +758,57 @@ void static CarboncoinMiner(CWallet *pwallet)
         }
 
         //
-        // Create new block
-        //
-        unsigned int nTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
-        CBlockIndex* pindexPrev = chainActive.Tip();
-
-        auto_ptr<CBlockTemplate> pblocktemplate(CreateNewBlockWithKey(reservekey));
-        if (!pblocktemplate.get())
-            return;
-        CBlock *pblock = &pblocktemplate->block;
-        IncrementExtraNonce(pblock, pindexPrev, nExtraNonce);
-
-        LogPrintf("Running CarboncoinMiner with %u transactions in block (%u bytes)\n", pblock->vtx.size(),
-               ::GetSerializeSize(*pblock, SER_NETWORK, PROTOCOL_VERSION));
-
-        //
-        // Pre-build hash buffers
+        // Get a nonce range of the shared block
         //
-        char pmidstatebuf[32+16]; char* pmidstate = alignup<16>(pmidstatebuf);
-        char pdatabuf[128+16];    char* pdata     = alignup<16>(pdatabuf);
-        char phash1buf[64+16];    char* phash1    = alignup<16>(phash1buf);
-
-        FormatHashBuffers(pblock, pmidstate, pdata, phash1);
-
-        unsigned int& nBlockTime = *(unsigned int*)(pdata + 64 + 4);
-        unsigned int& nBlockBits = *(unsigned int*)(pdata + 64 + 8);
-
+        CBlockHeader header;
+        unsigned int nNonceBegin, nNonceEnd, nWorkId;
+        CBlockIndex* pindexPrev;
+        {
+            LOCK2(cs_main, work.cs);
+            if (!GetMinerWork(work, pwallet, header, nNonceBegin, nNonceEnd, nWorkId))
+                break;
+            pindexPrev = work.pindexPrev;
+        }
 
         //
         // Search
         //
-        int64_t nStart = GetTime();
-        uint256 hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
+        uint256 hashTarget = CBigNum().SetCompact(header.nBits).getuint256();
+        SHA256_CTX midstate;
+        scrypt_1024_1_1_256_midstate(BEGIN(header.nVersion), &midstate);
+        uint256 thash;
+        header.nNonce = nNonceBegin;
         while (true)
         {
             unsigned int nHashesDone = 0;
-
-            uint256 thash;
-            char scratchpad[SCRYPT_SCRATCHPAD_SIZE];
             while (true)
             {
-                scrypt_1024_1_1_256_sp(BEGIN(pblock->nVersion), BEGIN(thash), scratchpad);
+                scrypt_1024_1_1_256_sp_midstate(BEGIN(header.nVersion), BEGIN(thash), scratchpad, &midstate);
+                nHashesDone += 1;
 
                 if (thash <= hashTarget)
                 {
                     // Found a solution
                     SetThreadPriority(THREAD_PRIORITY_NORMAL);
-                    CheckWork(pblock, *pwallet, reservekey);
+                    {
+                        LOCK2(cs_main, work.cs);
+                        CBlock* pblock = work.pblocktemplate ? &work.pblocktemplate->block : NULL;
+                        if (pblock && pblock->hashPrevBlock == header.hashPrevBlock &&
+                            pblock->hashMerkleRoot == header.hashMerkleRoot)
+                        {
+                            CBlock block(*pblock);
+                            block.nTime = header.nTime;
+                            block.nBits = header.nBits;
+                            block.nNonce = header.nNonce;
+                            CheckWork(&block, *pwallet, *work.preservekey);
+                            // The reserved key is spent: build the next block on a new one
+                            delete work.preservekey;
+                            work.preservekey = NULL;
+                            delete work.pblocktemplate;
+                            work.pblocktemplate = NULL;
+                            work.nWorkId++;
+                        }
+                    }
                     SetThreadPriority(THREAD_PRIORITY_LOWEST);
 
                     // In regression test mode, stop mining after a block is found. This
@@ -538,68 +818,60 @@ void static CarboncoinMiner(CWallet *pwallet)
 
                     break;
                 }
-                pblock->nNonce += 1;
-                nHashesDone += 1;
-                if ((pblock->nNonce & 0xFF) == 0)
+                header.nNonce += 1;
+                if ((header.nNonce & 0xFF) == 0 || header.nNonce == nNonceEnd)
                     break;
             }
 
-            // Meter hashes/sec
-            static int64_t nHashCounter;
-            if (nHPSTimerStart == 0)
+            // Meter hashes/sec, per thread and in total
+            nThreadHashCounter += nHashesDone;
+            int64_t nNow = GetTimeMillis();
+            if (nNow - nThreadTimerStart > 4000)
             {
-                nHPSTimerStart = GetTimeMillis();
-                nHashCounter = 0;
-            }
-            else
-                nHashCounter += nHashesDone;
-            if (GetTimeMillis() - nHPSTimerStart > 4000)
-            {
-                static CCriticalSection cs;
+                LOCK(work.cs);
+                work.vThreadHashesPerSec[nThread] = 1000.0 * nThreadHashCounter / (nNow - nThreadTimerStart);
+                nThreadTimerStart = nNow;
+                nThreadHashCounter = 0;
+                dHashesPerSec = 0;
+                BOOST_FOREACH(double dThreadHashesPerSec, work.vThreadHashesPerSec)
+                    dHashesPerSec += dThreadHashesPerSec;
+                nHPSTimerStart = nNow;
+                static int64_t nLogTime;
+                if (GetTime() - nLogTime > 30 * 60)
                 {
-                    LOCK(cs);
-                    if (GetTimeMillis() - nHPSTimerStart > 4000)
-                    {
-                        dHashesPerSec = 1000.0 * nHashCounter / (GetTimeMillis() - nHPSTimerStart);
-                        nHPSTimerStart = GetTimeMillis();
-                        nHashCounter = 0;
-                        static int64_t nLogTime;
-                        if (GetTime() - nLogTime > 30 * 60)
-                        {
-                            nLogTime = GetTime();
-                            LogPrintf("hashmeter %6.0f khash/s\n", dHashesPerSec/1000.0);
-                        }
-                    }
+                    nLogTime = GetTime();
+                    LogPrintf("hashmeter %6.0f khash/s\n", dHashesPerSec/1000.0);
                 }
             }
 
-            // Check for stop or if block needs to be rebuilt
+            // Check for stop or if a new range is needed
             boost::this_thread::interruption_point();
             if (vNodes.empty() && Params().NetworkID() != CChainParams::REGTEST)
                 break;
-            if (pblock->nNonce >= 0xffff0000)
+            if (header.nNonce == nNonceEnd)
                 break;
-            if (mempool.GetTransactionsUpdated() != nTransactionsUpdatedLast && GetTime() - nStart > 60)
+            if (nWorkId != work.nWorkId)
                 break;
             if (pindexPrev != chainActive.Tip())
                 break;
-
-            // Update nTime every few seconds
-            UpdateTime(*pblock, pindexPrev);
-            nBlockTime = ByteReverse(pblock->nTime);
-            if (TestNet())
-            {
-                // Changing pblock->nTime can change work required on testnet:
-                nBlockBits = ByteReverse(pblock->nBits);
-                hashTarget = CBigNum().SetCompact(pblock->nBits).getuint256();
-            }
         }
     } }
     catch (boost::thread_interrupted)
     {
+        FreeScratchpad(scratchpad);
         LogPrintf("CarboncoinMiner terminated\n");
         throw;
     }
+    FreeScratchpad(scratchpad);
+}
+
+void GetMinerThreadHashRates(std::vector<double>& vHashesPerSec)
+{
+    vHashesPerSec.clear();
+    if (pminerwork == NULL || GetTimeMillis() - nHPSTimerStart > 8000)
+        return;
+    LOCK(pminerwork->cs);
+    vHashesPerSec = pminerwork->vThreadHashesPerSec;
 }
 
 void GenerateCarboncoins(bool fGenerate, CWallet* pwallet, int nThreads)
@@ -616,17 +888,21 @@ void GenerateCarboncoins(bool fGenerate, CWallet* pwallet, int nThreads)
     if (minerThreads != NULL)
     {
         minerThreads->interrupt_all();
+        minerThreads->join_all();
         delete minerThreads;
         minerThreads = NULL;
     }
+    delete pminerwork;
+    pminerwork = NULL;
 
     if (nThreads == 0 || !fGenerate)
         return;
 
+    pminerwork = new CMinerWork();
+    pminerwork->vThreadHashesPerSec.resize(nThreads, 0.0);
     minerThreads = new boost::thread_group();
     for (int i = 0; i < nThreads; i++)
-        minerThreads->create_thread(boost::bind(&CarboncoinMiner, pwallet));
+        minerThreads->create_thread(boost::bind(&CarboncoinMiner, pwallet, pminerwork, i));
 }
 
 #endif
-
@@ -7,6 +7,7 @@
 #define CARBONCOIN_MINER_H
 
 #include <stdint.h>
+#include <vector>
 
 class CBlock;
 class CBlockIndex;
@@ -26,6 +27,8 @@ void IncrementExtraNonce(CBlock* pblock, CBlockIndex* pindexPrev, unsigned int&
 void FormatHashBuffers(CBlock* pblock, char* pmidstate, char* pdata, char* phash1);
 /** Check mined block */
 bool CheckWork(CBlock* pblock, CWallet& wallet, CReserveKey& reservekey);
+/** Recent hashes per second of each miner thread, empty if not generating */
+void GetMinerThreadHashRates(std::vector<double>& vHashesPerSec);
 /** Base sha256 mining transform */
 void SHA256Transform(void* pstate, void* pinput, const void* pinit);
 
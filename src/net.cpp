@@ -18,6 +18,12 @@
 #include <string.h>
 #else
 #include <fcntl.h>
+#include <sys/uio.h>
+#endif
+
+#ifdef USE_EPOLL
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #endif
 
 #ifdef USE_UPNP
@@ -40,8 +46,14 @@ using namespace std;
 using namespace boost;
 
 static const int MAX_OUTBOUND_CONNECTIONS = 8;
+// Milliseconds between message handler passes over all nodes, for the
+// time based work in SendMessages. Nodes with messages or inventory are
+// handled as soon as they are queued.
+static const int MESSAGE_HANDLER_INTERVAL = 100;
 
 bool OpenNetworkConnection(const CAddress& addrConnect, CSemaphoreGrant *grantOutbound = NULL, const char *strDest = NULL, bool fOneShot = false);
+static void RegisterNodeSocket(CNode* pnode);
+static void WakeMessageThreads(NodeId id);
 
 
 //
@@ -59,10 +71,11 @@ uint64_t nLocalHostNonce = 0;
 static std::vector<SOCKET> vhListenSocket;
 CAddrMan addrman;
 int nMaxConnections = 125;
+int nMessageWorkerThreads = 0;
 
 vector<CNode*> vNodes;
 CCriticalSection cs_vNodes;
-map<CInv, CDataStream> mapRelay;
+map<CInv, CSharedMessage> mapRelay;
 deque<pair<int64_t, CInv> > vRelayExpiration;
 CCriticalSection cs_mapRelay;
 limitedmap<CInv, int64_t> mapAlreadyAskedFor(MAX_INV_SZ);
@@ -81,6 +94,17 @@ CCriticalSection cs_nLastNodeId;
 
 static CSemaphore *semOutbound = NULL;
 
+// Nodes queued for the message handler thread
+static boost::mutex mutexMsgHandler;
+static boost::condition_variable condMsgHandler;
+static set<NodeId> setMsgHandlerReady;
+
+// Nodes queued for the message worker threads, in arrival order
+static boost::mutex mutexMsgWorker;
+static boost::condition_variable condMsgWorker;
+static deque<NodeId> vMsgWorkerQueue;
+static set<NodeId> setMsgWorkerQueued;
+
 // Signals for message handling
 static CNodeSignals g_signals;
 CNodeSignals& GetNodeSignals() { return g_signals; }
@@ -409,6 +433,8 @@ uint64_t CNode::nTotalBytesRecv = 0;
 uint64_t CNode::nTotalBytesSent = 0;
 CCriticalSection CNode::cs_totalBytesRecv;
 CCriticalSection CNode::cs_totalBytesSent;
+mapMsgCmdStats CNode::mapTotalMsgStats;
+CCriticalSection CNode::cs_mapTotalMsgStats;
 
 CNode* FindNode(const CNetAddr& ip)
 {
@@ -484,6 +510,7 @@ CNode* ConnectNode(CAddress addrConnect, const char *pszDest)
             LOCK(cs_vNodes);
             vNodes.push_back(pnode);
         }
+        RegisterNodeSocket(pnode);
 
         pnode->nTimeConnected = GetTime();
         return pnode;
@@ -606,18 +633,30 @@ void CNode::copyStats(CNodeStats &stats)
 
     // Leave string empty if addrLocal invalid (not filled in yet)
     stats.addrLocal = addrLocal.IsValid() ? addrLocal.ToString() : "";
+
+    {
+        LOCK(cs_mapMsgStats);
+        X(mapMsgStats);
+    }
 }
 #undef X
 
 // requires LOCK(cs_vRecvMsg)
-bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
+bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes, bool& fComplete)
 {
     while (nBytes > 0) {
 
         // get current incomplete message, or create a new one
         if (vRecvMsg.empty() ||
             vRecvMsg.back().complete())
+        {
             vRecvMsg.push_back(CNetMessage(SER_NETWORK, nRecvVersion));
+            if (!vRecvPool.empty())
+            {
+                vRecvMsg.back().vRecv.SwapBuffer(vRecvPool.back());
+                vRecvPool.pop_back();
+            }
+        }
 
         CNetMessage& msg = vRecvMsg.back();
 
@@ -633,6 +672,12 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
 
         pch += handled;
         nBytes -= handled;
+
+        if (msg.complete())
+        {
+            RecordMessageRecv(msg.hdr);
+            fComplete = true;
+        }
     }
 
     return true;
@@ -641,31 +686,30 @@ bool CNode::ReceiveMsgBytes(const char *pch, unsigned int nBytes)
 int CNetMessage::readHeader(const char *pch, unsigned int nBytes)
 {
     // copy data to temporary parsing buffer
-    unsigned int nRemaining = 24 - nHdrPos;
+    unsigned int nRemaining = CMessageHeader::HEADER_SIZE - nHdrPos;
     unsigned int nCopy = std::min(nRemaining, nBytes);
 
-    memcpy(&hdrbuf[nHdrPos], pch, nCopy);
+    memcpy(&pchHdr[nHdrPos], pch, nCopy);
     nHdrPos += nCopy;
 
     // if header incomplete, exit
-    if (nHdrPos < 24)
+    if (nHdrPos < CMessageHeader::HEADER_SIZE)
         return nCopy;
 
-    // deserialize to CMessageHeader
-    try {
-        hdrbuf >> hdr;
-    }
-    catch (std::exception &e) {
-        return -1;
-    }
+    // deserialize to CMessageHeader, laid out as written by EndMessage
+    memcpy(hdr.pchMessageStart, pchHdr, MESSAGE_START_SIZE);
+    memcpy(hdr.pchCommand, &pchHdr[MESSAGE_START_SIZE], CMessageHeader::COMMAND_SIZE);
+    memcpy(&hdr.nMessageSize, &pchHdr[CMessageHeader::MESSAGE_SIZE_OFFSET], sizeof(hdr.nMessageSize));
+    memcpy(&hdr.nChecksum, &pchHdr[CMessageHeader::CHECKSUM_OFFSET], sizeof(hdr.nChecksum));
 
     // reject messages larger than MAX_SIZE
     if (hdr.nMessageSize > MAX_SIZE)
             return -1;
 
-    // switch state to reading message data
+    // switch state to reading message data. The buffer is only grown as the
+    // data arrives, so a header alone cannot make us allocate MAX_SIZE.
     in_data = true;
-    vRecv.resize(hdr.nMessageSize);
+    vRecv.clear();
 
     return nCopy;
 }
@@ -675,12 +719,37 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
     unsigned int nRemaining = hdr.nMessageSize - nDataPos;
     unsigned int nCopy = std::min(nRemaining, nBytes);
 
+    if (vRecv.size() < nDataPos + nCopy)
+    {
+        // Grow at least a chunk, or double, but never beyond the size the
+        // header announced
+        unsigned int nSize = std::max(nDataPos + nCopy, std::max((unsigned int)vRecv.size() * 2, RECV_CHUNK_SIZE));
+        nSize = std::min(nSize, hdr.nMessageSize);
+        vRecv.reserve(nSize);
+        vRecv.resize(nSize);
+    }
+
     memcpy(&vRecv[nDataPos], pch, nCopy);
+    hasher.write(pch, nCopy);
     nDataPos += nCopy;
 
     return nCopy;
 }
 
+// requires LOCK(cs_vRecvMsg)
+void CNode::PopRecvMsg()
+{
+    CNetMessage& msg = vRecvMsg.front();
+    if (vRecvPool.size() < MAX_RECV_POOL_BUFFERS && msg.vRecv.capacity() > 0 &&
+        msg.vRecv.capacity() <= MAX_POOLED_RECV_BUFFER)
+    {
+        msg.vRecv.clear();
+        vRecvPool.push_back(CSerializeData());
+        msg.vRecv.SwapBuffer(vRecvPool.back());
+    }
+    vRecvMsg.pop_front();
+}
+
 
 
 
@@ -689,26 +758,70 @@ int CNetMessage::readData(const char *pch, unsigned int nBytes)
 
 
 
+void FinishMessageHeader(CDataStream& ss)
+{
+    // Set the size
+    unsigned int nSize = ss.size() - CMessageHeader::HEADER_SIZE;
+    memcpy((char*)&ss[CMessageHeader::MESSAGE_SIZE_OFFSET], &nSize, sizeof(nSize));
+
+    // Set the checksum
+    uint256 hash = Hash(ss.begin() + CMessageHeader::HEADER_SIZE, ss.end());
+    unsigned int nChecksum = 0;
+    memcpy(&nChecksum, &hash, sizeof(nChecksum));
+    assert(ss.size () >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
+    memcpy((char*)&ss[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+}
+
 // requires LOCK(cs_vSend)
 void SocketSendData(CNode *pnode)
 {
-    std::deque<CSerializeData>::iterator it = pnode->vSendMsg.begin();
+    bool fSendBufferFull = pnode->nSendSize >= SendBufferSize();
 
-    while (it != pnode->vSendMsg.end()) {
-        const CSerializeData &data = *it;
-        assert(data.size() > pnode->nSendOffset);
-        int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], data.size() - pnode->nSendOffset, MSG_NOSIGNAL | MSG_DONTWAIT);
+    while (!pnode->vSendMsg.empty()) {
+        assert(pnode->vSendMsg.front()->size() > pnode->nSendOffset);
+#ifdef WIN32
+        const CSerializeData &data = *pnode->vSendMsg.front();
+        size_t nWanted = data.size() - pnode->nSendOffset;
+        int nBytes = send(pnode->hSocket, &data[pnode->nSendOffset], nWanted, MSG_NOSIGNAL | MSG_DONTWAIT);
+#else
+        // Gather as many queued messages as fit into a single call
+        struct iovec iov[MAX_SEND_IOVECS];
+        int nIov = 0;
+        size_t nWanted = 0;
+        for (std::deque<CSharedMessage>::const_iterator it = pnode->vSendMsg.begin();
+             it != pnode->vSendMsg.end() && nIov < MAX_SEND_IOVECS; it++, nIov++) {
+            size_t nOffset = (nIov == 0) ? pnode->nSendOffset : 0;
+            iov[nIov].iov_base = (void*)&(**it)[nOffset];
+            iov[nIov].iov_len = (*it)->size() - nOffset;
+            nWanted += iov[nIov].iov_len;
+        }
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = nIov;
+        int nBytes = sendmsg(pnode->hSocket, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+#endif
         if (nBytes > 0) {
             pnode->nLastSend = GetTime();
             pnode->nSendBytes += nBytes;
-            pnode->nSendOffset += nBytes;
             pnode->RecordBytesSent(nBytes);
-            if (pnode->nSendOffset == data.size()) {
+
+            // Drop the messages that went out completely
+            size_t nSent = nBytes;
+            while (nSent > 0) {
+                size_t nLeft = pnode->vSendMsg.front()->size() - pnode->nSendOffset;
+                if (nSent < nLeft) {
+                    pnode->nSendOffset += nSent;
+                    break;
+                }
+                nSent -= nLeft;
                 pnode->nSendOffset = 0;
-                pnode->nSendSize -= data.size();
-                it++;
-            } else {
-                // could not send full message; stop sending more
+                pnode->nSendSize -= pnode->vSendMsg.front()->size();
+                pnode->vSendMsg.pop_front();
+            }
+
+            if ((size_t)nBytes < nWanted) {
+                // could not send everything; stop sending more
                 break;
             }
         } else {
@@ -726,83 +839,418 @@ void SocketSendData(CNode *pnode)
         }
     }
 
-    if (it == pnode->vSendMsg.end()) {
+    if (pnode->vSendMsg.empty()) {
         assert(pnode->nSendOffset == 0);
         assert(pnode->nSendSize == 0);
     }
-    pnode->vSendMsg.erase(pnode->vSendMsg.begin(), it);
+
+    // The message handler stops processing a node's messages while its send
+    // buffer is full
+    if (fSendBufferFull && pnode->nSendSize < SendBufferSize())
+        WakeMessageHandler(pnode->GetId());
 }
 
 static list<CNode*> vNodesDisconnected;
 
-void ThreadSocketHandler()
+#ifdef USE_EPOLL
+// Created by StartNode, closed by StopNode
+static int hEpoll = -1;
+static int hWakeupEvent = -1;
+// Registration tags for the epoll entries that are not peers
+static char chEpollWakeup;
+static char chEpollListen;
+
+static bool EpollRegister(int hFd, void* ptr, uint32_t nEvents)
 {
-    unsigned int nPrevNodeCount = 0;
-    while (true)
+    struct epoll_event event;
+    memset(&event, 0, sizeof(event));
+    event.events = nEvents;
+    event.data.ptr = ptr;
+    return epoll_ctl(hEpoll, EPOLL_CTL_ADD, hFd, &event) == 0;
+}
+#endif
+
+void WakeSocketHandler()
+{
+#ifdef USE_EPOLL
+    if (hWakeupEvent != -1)
     {
-        //
-        // Disconnect nodes
-        //
+        uint64_t nOne = 1;
+        if (write(hWakeupEvent, &nOne, sizeof(nOne)) != sizeof(nOne) && errno != EAGAIN)
+            LogPrintf("WakeSocketHandler() : write failed, error %s\n", NetworkErrorString(errno));
+    }
+#endif
+}
+
+// Called when a node is added to vNodes
+static void RegisterNodeSocket(CNode* pnode)
+{
+#ifdef USE_EPOLL
+    // Edge triggered: the handler drains the socket on every notification,
+    // and is told again only once more data or send space arrives.
+    if (!EpollRegister(pnode->hSocket, pnode, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET))
+    {
+        LogPrintf("epoll_ctl failed for %s, error %s\n", pnode->addrName, NetworkErrorString(errno));
+        pnode->CloseSocketDisconnect();
+    }
+#endif
+}
+
+static void DisconnectNodes(unsigned int& nPrevNodeCount)
+{
+    {
+        LOCK(cs_vNodes);
+        // Disconnect unused nodes
+        vector<CNode*> vNodesCopy = vNodes;
+        BOOST_FOREACH(CNode* pnode, vNodesCopy)
         {
-            LOCK(cs_vNodes);
-            // Disconnect unused nodes
-            vector<CNode*> vNodesCopy = vNodes;
-            BOOST_FOREACH(CNode* pnode, vNodesCopy)
+            if (pnode->fDisconnect ||
+                (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty()))
             {
-                if (pnode->fDisconnect ||
-                    (pnode->GetRefCount() <= 0 && pnode->vRecvMsg.empty() && pnode->nSendSize == 0 && pnode->ssSend.empty()))
-                {
-                    // remove from vNodes
-                    vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
+                // remove from vNodes
+                vNodes.erase(remove(vNodes.begin(), vNodes.end(), pnode), vNodes.end());
 
-                    // release outbound grant (if any)
-                    pnode->grantOutbound.Release();
+                // release outbound grant (if any)
+                pnode->grantOutbound.Release();
 
-                    // close socket and cleanup
-                    pnode->CloseSocketDisconnect();
-                    pnode->Cleanup();
+                // close socket and cleanup
+                pnode->CloseSocketDisconnect();
+                pnode->Cleanup();
 
-                    // hold in disconnected pool until all refs are released
-                    if (pnode->fNetworkNode || pnode->fInbound)
-                        pnode->Release();
-                    vNodesDisconnected.push_back(pnode);
-                }
+                // hold in disconnected pool until all refs are released
+                if (pnode->fNetworkNode || pnode->fInbound)
+                    pnode->Release();
+                vNodesDisconnected.push_back(pnode);
             }
         }
+    }
+    {
+        // Delete disconnected nodes
+        list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
+        BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
         {
-            // Delete disconnected nodes
-            list<CNode*> vNodesDisconnectedCopy = vNodesDisconnected;
-            BOOST_FOREACH(CNode* pnode, vNodesDisconnectedCopy)
+            // wait until threads are done using it
+            if (pnode->GetRefCount() <= 0)
             {
-                // wait until threads are done using it
-                if (pnode->GetRefCount() <= 0)
+                bool fDelete = false;
                 {
-                    bool fDelete = false;
+                    TRY_LOCK(pnode->cs_vSend, lockSend);
+                    if (lockSend)
                     {
-                        TRY_LOCK(pnode->cs_vSend, lockSend);
-                        if (lockSend)
+                        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                        if (lockRecv)
                         {
-                            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                            if (lockRecv)
-                            {
-                                TRY_LOCK(pnode->cs_inventory, lockInv);
-                                if (lockInv)
-                                    fDelete = true;
-                            }
+                            TRY_LOCK(pnode->cs_inventory, lockInv);
+                            if (lockInv)
+                                fDelete = true;
                         }
                     }
-                    if (fDelete)
-                    {
-                        vNodesDisconnected.remove(pnode);
-                        delete pnode;
-                    }
+                }
+                if (fDelete)
+                {
+                    vNodesDisconnected.remove(pnode);
+                    delete pnode;
                 }
             }
         }
-        if(vNodes.size() != nPrevNodeCount) {
-            nPrevNodeCount = vNodes.size();
-            uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
+    }
+    if(vNodes.size() != nPrevNodeCount) {
+        nPrevNodeCount = vNodes.size();
+        uiInterface.NotifyNumConnectionsChanged(nPrevNodeCount);
+    }
+}
+
+// Accept one pending connection on hListenSocket. Returns false if there
+// was none.
+static bool AcceptConnection(SOCKET hListenSocket)
+{
+    struct sockaddr_storage sockaddr;
+    socklen_t len = sizeof(sockaddr);
+    SOCKET hSocket = accept(hListenSocket, (struct sockaddr*)&sockaddr, &len);
+    CAddress addr;
+    int nInbound = 0;
+
+    if (hSocket != INVALID_SOCKET)
+        if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
+            LogPrintf("Warning: Unknown socket family\n");
+
+    {
+        LOCK(cs_vNodes);
+        BOOST_FOREACH(CNode* pnode, vNodes)
+            if (pnode->fInbound)
+                nInbound++;
+    }
+
+    if (hSocket == INVALID_SOCKET)
+    {
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK)
+            LogPrintf("socket error accept failed: %s\n", NetworkErrorString(nErr));
+        return false;
+    }
+    else if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS)
+    {
+        closesocket(hSocket);
+    }
+    else if (CNode::IsBanned(addr))
+    {
+        LogPrintf("connection from %s dropped (banned)\n", addr.ToString());
+        closesocket(hSocket);
+    }
+    else
+    {
+        LogPrint("net", "accepted connection %s\n", addr.ToString());
+        CNode* pnode = new CNode(hSocket, addr, "", true);
+        pnode->AddRef();
+        {
+            LOCK(cs_vNodes);
+            vNodes.push_back(pnode);
+        }
+        RegisterNodeSocket(pnode);
+    }
+    return true;
+}
+
+// Read what is available from the socket into vRecvMsg. Requires
+// cs_vRecvMsg. fComplete is set if a message was completed. Returns true if
+// the socket may still have more data.
+static bool SocketRecvData(CNode* pnode, bool& fComplete)
+{
+    // typical socket buffer is 8K-64K
+    char pchBuf[0x10000];
+    int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
+    if (nBytes > 0)
+    {
+        if (!pnode->ReceiveMsgBytes(pchBuf, nBytes, fComplete))
+            pnode->CloseSocketDisconnect();
+        pnode->nLastRecv = GetTime();
+        pnode->nRecvBytes += nBytes;
+        pnode->RecordBytesRecv(nBytes);
+        return nBytes == (int)sizeof(pchBuf);
+    }
+    else if (nBytes == 0)
+    {
+        // socket closed gracefully
+        if (!pnode->fDisconnect)
+            LogPrint("net", "socket closed\n");
+        pnode->CloseSocketDisconnect();
+    }
+    else if (nBytes < 0)
+    {
+        // error
+        int nErr = WSAGetLastError();
+        if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
+        {
+            if (!pnode->fDisconnect)
+                LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
+            pnode->CloseSocketDisconnect();
         }
+    }
+    return false;
+}
+
+// Whether there is room to receive more: either no complete message is
+// waiting to be processed, or the buffer is below the flood limit.
+// Requires cs_vRecvMsg.
+static bool CanReceive(CNode* pnode)
+{
+    return pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
+           pnode->GetTotalRecvSize() <= ReceiveFloodSize();
+}
+
+static void InactivityCheck(CNode* pnode)
+{
+    if (pnode->vSendMsg.empty())
+        pnode->nLastSendEmpty = GetTime();
+    if (GetTime() - pnode->nTimeConnected > 60)
+    {
+        if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
+        {
+            LogPrint("net", "socket no message in first 60 seconds, %d %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0);
+            pnode->fDisconnect = true;
+        }
+        else if (GetTime() - pnode->nLastSend > 90*60 && GetTime() - pnode->nLastSendEmpty > 90*60)
+        {
+            LogPrintf("socket not sending\n");
+            pnode->fDisconnect = true;
+        }
+        else if (GetTime() - pnode->nLastRecv > 90*60)
+        {
+            LogPrintf("socket inactivity timeout\n");
+            pnode->fDisconnect = true;
+        }
+    }
+}
+
+#ifdef USE_EPOLL
+// Maximum number of readiness events handled per epoll_wait
+static const int MAX_EPOLL_EVENTS = 256;
+
+// Drain a node's socket after a read notification. Returns false if the node
+// needs another attempt that no notification will trigger: its receive lock
+// was busy, or the receive buffer is full and reading is paused.
+static bool EpollRecv(CNode* pnode)
+{
+    bool fComplete = false;
+    bool fDrained = true;
+    {
+        TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+        if (!lockRecv)
+            return false;
+        while (pnode->hSocket != INVALID_SOCKET)
+        {
+            if (!CanReceive(pnode))
+            {
+                // The message handler wakes us once it has drained the buffer
+                pnode->fPauseRecv = true;
+                fDrained = false;
+                break;
+            }
+            if (!SocketRecvData(pnode, fComplete))
+                break;
+        }
+        if (fDrained)
+            pnode->fPauseRecv = false;
+    }
+    if (fComplete)
+        WakeMessageThreads(pnode->GetId());
+    return fDrained;
+}
+
+// Send queued data after a write notification. Returns false if the send
+// lock was busy.
+static bool EpollSend(CNode* pnode)
+{
+    TRY_LOCK(pnode->cs_vSend, lockSend);
+    if (!lockSend)
+        return false;
+    if (pnode->hSocket != INVALID_SOCKET && !pnode->vSendMsg.empty())
+        SocketSendData(pnode);
+    return true;
+}
+
+void ThreadSocketHandler()
+{
+    unsigned int nPrevNodeCount = 0;
+    int64_t nLastHousekeeping = 0;
+
+    BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+        if (!EpollRegister(hListenSocket, &chEpollListen, EPOLLIN | EPOLLET))
+            LogPrintf("epoll_ctl failed for listen socket, error %s\n", NetworkErrorString(errno));
+
+    // Nodes whose receive or send must be retried without a new notification,
+    // each holding a reference so it is not deleted meanwhile
+    set<CNode*> setRecvRetry;
+    set<CNode*> setSendRetry;
+
+    struct epoll_event events[MAX_EPOLL_EVENTS];
+    while (true)
+    {
+        //
+        // Disconnect nodes and check for inactivity, at most once a second
+        // rather than on every wakeup
+        //
+        if (GetTimeMillis() - nLastHousekeeping >= 1000)
+        {
+            nLastHousekeeping = GetTimeMillis();
+            DisconnectNodes(nPrevNodeCount);
+            LOCK(cs_vNodes);
+            BOOST_FOREACH(CNode* pnode, vNodes)
+                InactivityCheck(pnode);
+        }
+
+        // Lock contention is the only case that needs polling; a paused
+        // receive is resumed through WakeSocketHandler.
+        bool fContended = !setSendRetry.empty();
+        BOOST_FOREACH(CNode* pnode, setRecvRetry)
+            if (!pnode->fPauseRecv)
+                fContended = true;
+        int nTimeout = fContended ? 10 : 1000;
+
+        int nEvents = epoll_wait(hEpoll, events, MAX_EPOLL_EVENTS, nTimeout);
+        boost::this_thread::interruption_point();
+        if (nEvents < 0)
+        {
+            if (errno != EINTR)
+            {
+                LogPrintf("socket epoll error %s\n", NetworkErrorString(errno));
+                MilliSleep(50);
+            }
+            continue;
+        }
+
+        for (int i = 0; i < nEvents; i++)
+        {
+            void* ptr = events[i].data.ptr;
+            if (ptr == &chEpollWakeup)
+            {
+                uint64_t nCount;
+                if (read(hWakeupEvent, &nCount, sizeof(nCount)) < 0 && errno != EAGAIN)
+                    LogPrintf("socket handler wakeup read error %s\n", NetworkErrorString(errno));
+                continue;
+            }
+            if (ptr == &chEpollListen)
+            {
+                BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
+                    while (hListenSocket != INVALID_SOCKET && AcceptConnection(hListenSocket))
+                        boost::this_thread::interruption_point();
+                continue;
+            }
+
+            // Nodes are only deleted by this thread, so the pointer is valid
+            CNode* pnode = (CNode*)ptr;
+            uint32_t nFlags = events[i].events;
+            if ((nFlags & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) && !setRecvRetry.count(pnode))
+            {
+                if (!EpollRecv(pnode))
+                {
+                    pnode->AddRef();
+                    setRecvRetry.insert(pnode);
+                }
+            }
+            if ((nFlags & EPOLLOUT) && !setSendRetry.count(pnode))
+            {
+                if (!EpollSend(pnode))
+                {
+                    pnode->AddRef();
+                    setSendRetry.insert(pnode);
+                }
+            }
+        }
+
+        //
+        // Retry nodes that could not be serviced when notified
+        //
+        vector<CNode*> vRetried;
+        BOOST_FOREACH(CNode* pnode, setRecvRetry)
+            if (pnode->hSocket == INVALID_SOCKET || EpollRecv(pnode))
+                vRetried.push_back(pnode);
+        BOOST_FOREACH(CNode* pnode, vRetried)
+        {
+            setRecvRetry.erase(pnode);
+            pnode->Release();
+        }
+        vRetried.clear();
+        BOOST_FOREACH(CNode* pnode, setSendRetry)
+            if (pnode->hSocket == INVALID_SOCKET || EpollSend(pnode))
+                vRetried.push_back(pnode);
+        BOOST_FOREACH(CNode* pnode, vRetried)
+        {
+            setSendRetry.erase(pnode);
+            pnode->Release();
+        }
+    }
+}
+#else
+void ThreadSocketHandler()
+{
+    unsigned int nPrevNodeCount = 0;
+    while (true)
+    {
+        //
+        // Disconnect nodes
+        //
+        DisconnectNodes(nPrevNodeCount);
 
 
         //
@@ -860,9 +1308,7 @@ void ThreadSocketHandler()
                 }
                 {
                     TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                    if (lockRecv && (
-                        pnode->vRecvMsg.empty() || !pnode->vRecvMsg.front().complete() ||
-                        pnode->GetTotalRecvSize() <= ReceiveFloodSize()))
+                    if (lockRecv && CanReceive(pnode))
                         FD_SET(pnode->hSocket, &fdsetRecv);
                 }
             }
@@ -893,48 +1339,7 @@ void ThreadSocketHandler()
         BOOST_FOREACH(SOCKET hListenSocket, vhListenSocket)
         if (hListenSocket != INVALID_SOCKET && FD_ISSET(hListenSocket, &fdsetRecv))
         {
-            struct sockaddr_storage sockaddr;
-            socklen_t len = sizeof(sockaddr);
-            SOCKET hSocket = accept(hListenSocket, (struct sockaddr*)&sockaddr, &len);
-            CAddress addr;
-            int nInbound = 0;
-
-            if (hSocket != INVALID_SOCKET)
-                if (!addr.SetSockAddr((const struct sockaddr*)&sockaddr))
-                    LogPrintf("Warning: Unknown socket family\n");
-
-            {
-                LOCK(cs_vNodes);
-                BOOST_FOREACH(CNode* pnode, vNodes)
-                    if (pnode->fInbound)
-                        nInbound++;
-            }
-
-            if (hSocket == INVALID_SOCKET)
-            {
-                int nErr = WSAGetLastError();
-                if (nErr != WSAEWOULDBLOCK)
-                    LogPrintf("socket error accept failed: %s\n", NetworkErrorString(nErr));
-            }
-            else if (nInbound >= nMaxConnections - MAX_OUTBOUND_CONNECTIONS)
-            {
-                closesocket(hSocket);
-            }
-            else if (CNode::IsBanned(addr))
-            {
-                LogPrintf("connection from %s dropped (banned)\n", addr.ToString());
-                closesocket(hSocket);
-            }
-            else
-            {
-                LogPrint("net", "accepted connection %s\n", addr.ToString());
-                CNode* pnode = new CNode(hSocket, addr, "", true);
-                pnode->AddRef();
-                {
-                    LOCK(cs_vNodes);
-                    vNodes.push_back(pnode);
-                }
-            }
+            AcceptConnection(hListenSocket);
         }
 
 
@@ -959,41 +1364,14 @@ void ThreadSocketHandler()
                 continue;
             if (FD_ISSET(pnode->hSocket, &fdsetRecv) || FD_ISSET(pnode->hSocket, &fdsetError))
             {
-                TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
-                if (lockRecv)
+                bool fComplete = false;
                 {
-                    {
-                        // typical socket buffer is 8K-64K
-                        char pchBuf[0x10000];
-                        int nBytes = recv(pnode->hSocket, pchBuf, sizeof(pchBuf), MSG_DONTWAIT);
-                        if (nBytes > 0)
-                        {
-                            if (!pnode->ReceiveMsgBytes(pchBuf, nBytes))
-                                pnode->CloseSocketDisconnect();
-                            pnode->nLastRecv = GetTime();
-                            pnode->nRecvBytes += nBytes;
-                            pnode->RecordBytesRecv(nBytes);
-                        }
-                        else if (nBytes == 0)
-                        {
-                            // socket closed gracefully
-                            if (!pnode->fDisconnect)
-                                LogPrint("net", "socket closed\n");
-                            pnode->CloseSocketDisconnect();
-                        }
-                        else if (nBytes < 0)
-                        {
-                            // error
-                            int nErr = WSAGetLastError();
-                            if (nErr != WSAEWOULDBLOCK && nErr != WSAEMSGSIZE && nErr != WSAEINTR && nErr != WSAEINPROGRESS)
-                            {
-                                if (!pnode->fDisconnect)
-                                    LogPrintf("socket recv error %s\n", NetworkErrorString(nErr));
-                                pnode->CloseSocketDisconnect();
-                            }
-                        }
-                    }
+                    TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+                    if (lockRecv)
+                        SocketRecvData(pnode, fComplete);
                 }
+                if (fComplete)
+                    WakeMessageThreads(pnode->GetId());
             }
 
             //
@@ -1011,26 +1389,7 @@ void ThreadSocketHandler()
             //
             // Inactivity checking
             //
-            if (pnode->vSendMsg.empty())
-                pnode->nLastSendEmpty = GetTime();
-            if (GetTime() - pnode->nTimeConnected > 60)
-            {
-                if (pnode->nLastRecv == 0 || pnode->nLastSend == 0)
-                {
-                    LogPrint("net", "socket no message in first 60 seconds, %d %d\n", pnode->nLastRecv != 0, pnode->nLastSend != 0);
-                    pnode->fDisconnect = true;
-                }
-                else if (GetTime() - pnode->nLastSend > 90*60 && GetTime() - pnode->nLastSendEmpty > 90*60)
-                {
-                    LogPrintf("socket not sending\n");
-                    pnode->fDisconnect = true;
-                }
-                else if (GetTime() - pnode->nLastRecv > 90*60)
-                {
-                    LogPrintf("socket inactivity timeout\n");
-                    pnode->fDisconnect = true;
-                }
-            }
+            InactivityCheck(pnode);
         }
         {
             LOCK(cs_vNodes);
@@ -1039,6 +1398,7 @@ void ThreadSocketHandler()
         }
     }
 }
+#endif
 
 
 
@@ -1481,11 +1841,55 @@ void static StartSync(const vector<CNode*> &vNodes) {
     }
 }
 
+void WakeMessageHandler(NodeId id)
+{
+    {
+        boost::lock_guard<boost::mutex> lock(mutexMsgHandler);
+        setMsgHandlerReady.insert(id);
+    }
+    condMsgHandler.notify_one();
+}
+
+static void WakeMessageWorker(NodeId id)
+{
+    {
+        boost::lock_guard<boost::mutex> lock(mutexMsgWorker);
+        if (!setMsgWorkerQueued.insert(id).second)
+            return;
+        vMsgWorkerQueue.push_back(id);
+    }
+    condMsgWorker.notify_one();
+}
+
+// Called once a node's receive lock is released, so a worker finds it free
+static void WakeMessageThreads(NodeId id)
+{
+    WakeMessageHandler(id);
+    if (nMessageWorkerThreads > 0)
+        WakeMessageWorker(id);
+}
+
 void ThreadMessageHandler()
 {
     SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
+    int64_t nLastFullPass = 0;
     while (true)
     {
+        // Wait for a node to be queued, or for the next pass over all nodes
+        set<NodeId> setReady;
+        {
+            boost::unique_lock<boost::mutex> lock(mutexMsgHandler);
+            int64_t nWait = nLastFullPass + MESSAGE_HANDLER_INTERVAL - GetTimeMillis();
+            if (setMsgHandlerReady.empty() && nWait > 0)
+                condMsgHandler.timed_wait(lock, boost::posix_time::milliseconds(nWait));
+            setReady.swap(setMsgHandlerReady);
+        }
+        boost::this_thread::interruption_point();
+
+        bool fFullPass = (GetTimeMillis() - nLastFullPass >= MESSAGE_HANDLER_INTERVAL);
+        if (fFullPass)
+            nLastFullPass = GetTimeMillis();
+
         bool fHaveSyncNode = false;
 
         vector<CNode*> vNodesCopy;
@@ -1502,17 +1906,20 @@ void ThreadMessageHandler()
         if (!fHaveSyncNode)
             StartSync(vNodesCopy);
 
-        // Poll the connected nodes for messages
+        // Trickle to a random node once per full pass
         CNode* pnodeTrickle = NULL;
-        if (!vNodesCopy.empty())
+        if (fFullPass && !vNodesCopy.empty())
             pnodeTrickle = vNodesCopy[GetRand(vNodesCopy.size())];
 
-        bool fSleep = true;
+        // Nodes that still have work after this pass
+        vector<NodeId> vStillReady;
 
         BOOST_FOREACH(CNode* pnode, vNodesCopy)
         {
             if (pnode->fDisconnect)
                 continue;
+            if (!fFullPass && !setReady.count(pnode->GetId()))
+                continue;
 
             // Receive messages
             {
@@ -1522,14 +1929,24 @@ void ThreadMessageHandler()
                     if (!g_signals.ProcessMessages(pnode))
                         pnode->CloseSocketDisconnect();
 
+                    // Resume receiving if we made room in a full buffer
+                    if (pnode->fPauseRecv && CanReceive(pnode))
+                    {
+                        pnode->fPauseRecv = false;
+                        WakeSocketHandler();
+                    }
+
                     if (pnode->nSendSize < SendBufferSize())
                     {
-                        if (!pnode->vRecvGetData.empty() || (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete()))
+                        if (!pnode->vRecvGetData.empty() || !pnode->setOrphanWorkSet.empty() ||
+                            (!pnode->vRecvMsg.empty() && pnode->vRecvMsg[0].complete()))
                         {
-                            fSleep = false;
+                            vStillReady.push_back(pnode->GetId());
                         }
                     }
                 }
+                else
+                    vStillReady.push_back(pnode->GetId());
             }
             boost::this_thread::interruption_point();
 
@@ -1538,6 +1955,8 @@ void ThreadMessageHandler()
                 TRY_LOCK(pnode->cs_vSend, lockSend);
                 if (lockSend)
                     g_signals.SendMessages(pnode, pnode == pnodeTrickle);
+                else
+                    vStillReady.push_back(pnode->GetId());
             }
             boost::this_thread::interruption_point();
         }
@@ -1548,8 +1967,71 @@ void ThreadMessageHandler()
                 pnode->Release();
         }
 
-        if (fSleep)
-            MilliSleep(100);
+        if (!vStillReady.empty())
+        {
+            boost::lock_guard<boost::mutex> lock(mutexMsgHandler);
+            setMsgHandlerReady.insert(vStillReady.begin(), vStillReady.end());
+        }
+    }
+}
+
+// Serves the messages at the front of a peer's receive queue that don't need
+// cs_main, so pings and address or filter traffic keep flowing while the
+// message handler is busy validating. A peer's messages are only ever handled
+// under its cs_vRecvMsg and in order, by whichever thread holds it.
+void ThreadMessageWorker()
+{
+    SetThreadPriority(THREAD_PRIORITY_BELOW_NORMAL);
+    while (true)
+    {
+        NodeId id;
+        {
+            boost::unique_lock<boost::mutex> lock(mutexMsgWorker);
+            while (vMsgWorkerQueue.empty())
+                condMsgWorker.wait(lock);
+            id = vMsgWorkerQueue.front();
+            vMsgWorkerQueue.pop_front();
+            setMsgWorkerQueued.erase(id);
+        }
+
+        CNode* pnode = NULL;
+        {
+            LOCK(cs_vNodes);
+            BOOST_FOREACH(CNode* pnodeFind, vNodes)
+            {
+                if (pnodeFind->GetId() == id)
+                {
+                    pnode = pnodeFind->AddRef();
+                    break;
+                }
+            }
+        }
+        if (!pnode)
+            continue;
+
+        if (!pnode->fDisconnect)
+        {
+            // If the lock is taken the message handler, which was woken for
+            // the same messages, is working on this peer
+            TRY_LOCK(pnode->cs_vRecvMsg, lockRecv);
+            if (lockRecv)
+            {
+                if (!g_signals.ProcessWorkerMessages(pnode))
+                    pnode->CloseSocketDisconnect();
+
+                if (pnode->fPauseRecv && CanReceive(pnode))
+                {
+                    pnode->fPauseRecv = false;
+                    WakeSocketHandler();
+                }
+            }
+        }
+
+        {
+            LOCK(cs_vNodes);
+            pnode->Release();
+        }
+        boost::this_thread::interruption_point();
     }
 }
 
@@ -1716,6 +2198,16 @@ void StartNode(boost::thread_group& threadGroup)
     if (pnodeLocalHost == NULL)
         pnodeLocalHost = new CNode(INVALID_SOCKET, CAddress(CService("127.0.0.1", 0), nLocalServices));
 
+#ifdef USE_EPOLL
+    if (hEpoll == -1)
+    {
+        hEpoll = epoll_create(MAX_EPOLL_EVENTS);
+        hWakeupEvent = eventfd(0, EFD_NONBLOCK);
+        if (hEpoll == -1 || hWakeupEvent == -1 || !EpollRegister(hWakeupEvent, &chEpollWakeup, EPOLLIN | EPOLLET))
+            throw runtime_error(strprintf("StartNode() : epoll setup failed, error %s", NetworkErrorString(errno)));
+    }
+#endif
+
     Discover(threadGroup);
 
     //
@@ -1744,6 +2236,12 @@ void StartNode(boost::thread_group& threadGroup)
     // Process messages
     threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msghand", &ThreadMessageHandler));
 
+    // Serve messages that don't need cs_main
+    if (nMessageWorkerThreads)
+        LogPrintf("Using %u threads for peer messages\n", nMessageWorkerThreads);
+    for (int i = 0; i < nMessageWorkerThreads; i++)
+        threadGroup.create_thread(boost::bind(&TraceThread<void (*)()>, "msgwork", &ThreadMessageWorker));
+
     // Dump network addresses
     threadGroup.create_thread(boost::bind(&LoopForever<void (*)()>, "dumpaddr", &DumpAddresses, DUMP_ADDRESSES_INTERVAL * 1000));
 }
@@ -1758,6 +2256,14 @@ bool StopNode()
     MilliSleep(50);
     DumpAddresses();
 
+#ifdef USE_EPOLL
+    if (hWakeupEvent != -1)
+        close(hWakeupEvent);
+    if (hEpoll != -1)
+        close(hEpoll);
+    hWakeupEvent = hEpoll = -1;
+#endif
+
     return true;
 }
 
@@ -1815,6 +2321,7 @@ void RelayTransaction(const CTransaction& tx, const uint256& hash)
 void RelayTransaction(const CTransaction& tx, const uint256& hash, const CDataStream& ss)
 {
     CInv inv(MSG_TX, hash);
+    CSharedMessage pmsg = MakeSharedMessage("tx", ss);
     {
         LOCK(cs_mapRelay);
         // Expire old relay messages
@@ -1824,10 +2331,13 @@ void RelayTransaction(const CTransaction& tx, const uint256& hash, const CDataSt
             vRelayExpiration.pop_front();
         }
 
-        // Save original serialized message so newer versions are preserved
-        mapRelay.insert(std::make_pair(inv, ss));
+        // Save original serialized message so newer versions are preserved,
+        // ready to be queued for every peer that asks for it
+        mapRelay.insert(std::make_pair(inv, pmsg));
         vRelayExpiration.push_back(std::make_pair(GetTime() + 15 * 60, inv));
     }
+    // Parse the scripts once for all filtered peers
+    CBloomTxElements elements(tx, hash);
     LOCK(cs_vNodes);
     BOOST_FOREACH(CNode* pnode, vNodes)
     {
@@ -1836,7 +2346,7 @@ void RelayTransaction(const CTransaction& tx, const uint256& hash, const CDataSt
         LOCK(pnode->cs_filter);
         if (pnode->pfilter)
         {
-            if (pnode->pfilter->IsRelevantAndUpdate(tx, hash))
+            if (pnode->pfilter->IsRelevantAndUpdate(elements))
                 pnode->PushInventory(inv);
         } else
             pnode->PushInventory(inv);
@@ -1867,6 +2377,70 @@ uint64_t CNode::GetTotalBytesSent()
     return nTotalBytesSent;
 }
 
+static std::string MessageStatsKey(const std::string& strCommand)
+{
+    if (IsKnownMessageCommand(strCommand))
+        return strCommand;
+    return "*other*";
+}
+
+void CNode::RecordMessageSent(const CSerializeData& msg)
+{
+    if (msg.size() < CMessageHeader::HEADER_SIZE)
+        return;
+    const char* pchCommand = &msg[MESSAGE_START_SIZE];
+    std::string strKey = MessageStatsKey(std::string(pchCommand, std::find(pchCommand, pchCommand + CMessageHeader::COMMAND_SIZE, '\0')));
+    {
+        LOCK(cs_mapMsgStats);
+        CMessageStats& stats = mapMsgStats[strKey];
+        stats.nMsgsSent++;
+        stats.nBytesSent += msg.size();
+    }
+    {
+        LOCK(cs_mapTotalMsgStats);
+        CMessageStats& stats = mapTotalMsgStats[strKey];
+        stats.nMsgsSent++;
+        stats.nBytesSent += msg.size();
+    }
+}
+
+void CNode::RecordMessageRecv(const CMessageHeader& hdr)
+{
+    std::string strKey = MessageStatsKey(hdr.GetCommand());
+    uint64_t nBytes = hdr.nMessageSize + CMessageHeader::HEADER_SIZE;
+    {
+        LOCK(cs_mapMsgStats);
+        CMessageStats& stats = mapMsgStats[strKey];
+        stats.nMsgsRecv++;
+        stats.nBytesRecv += nBytes;
+    }
+    {
+        LOCK(cs_mapTotalMsgStats);
+        CMessageStats& stats = mapTotalMsgStats[strKey];
+        stats.nMsgsRecv++;
+        stats.nBytesRecv += nBytes;
+    }
+}
+
+void CNode::RecordMessageHandled(const std::string& strCommand, int64_t nUsec)
+{
+    std::string strKey = MessageStatsKey(strCommand);
+    {
+        LOCK(cs_mapMsgStats);
+        mapMsgStats[strKey].AddHandleTime(nUsec);
+    }
+    {
+        LOCK(cs_mapTotalMsgStats);
+        mapTotalMsgStats[strKey].AddHandleTime(nUsec);
+    }
+}
+
+void CNode::GetTotalMessageStats(mapMsgCmdStats& mapStats)
+{
+    LOCK(cs_mapTotalMsgStats);
+    mapStats = mapTotalMsgStats;
+}
+
 void CNode::Fuzz(int nChance)
 {
     if (!fSuccessfullyConnected) return; // Don't fuzz initial handshake
@@ -10,7 +10,6 @@
 #include "compat.h"
 #include "hash.h"
 #include "limitedmap.h"
-#include "mruset.h"
 #include "netbase.h"
 #include "protocol.h"
 #include "sync.h"
@@ -25,6 +24,7 @@
 #endif
 
 #include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/signals2/signal.hpp>
 #include <openssl/rand.h>
 
@@ -42,6 +42,32 @@ static const unsigned int MAX_INV_SZ = 50000;
 static const size_t MAPASKFOR_MAX_SZ = MAX_INV_SZ;
 /** The maximum number of new addresses to accumulate before announcing. */
 static const unsigned int MAX_ADDR_TO_SEND = 1000;
+/** Addresses remembered per peer as already known to it */
+static const unsigned int MAX_ADDR_KNOWN = 5000;
+/** False positive rate of a peer's known address filter; a false positive
+ * only means an address is not relayed to that peer */
+static const double ADDR_KNOWN_FP_RATE = 0.001;
+/** False positive rate of a peer's known inventory filter; a false positive
+ * means an inv is not announced to that peer, so keep it low */
+static const double INVENTORY_KNOWN_FP_RATE = 0.000001;
+/** Minimum allocation for a receive buffer that is not yet complete */
+static const unsigned int RECV_CHUNK_SIZE = 64 * 1024;
+/** The maximum number of spare receive buffers kept per peer */
+static const unsigned int MAX_RECV_POOL_BUFFERS = 4;
+/** The largest receive buffer kept for reuse */
+static const unsigned int MAX_POOLED_RECV_BUFFER = 256 * 1024;
+/** The maximum number of queued messages handed to the kernel in one send */
+static const int MAX_SEND_IOVECS = 64;
+
+/** Maximum number of message worker threads */
+static const int MAX_MSGWORKER_THREADS = 16;
+/** -msgthreads default (number of message worker threads, 0 = auto) */
+static const int DEFAULT_MSGWORKER_THREADS = 0;
+
+#if defined(HAVE_SYS_EPOLL_H) && defined(HAVE_SYS_EVENTFD_H)
+/** Service sockets with epoll, which unlike select() has no FD_SETSIZE limit */
+#define USE_EPOLL
+#endif
 
 inline unsigned int ReceiveFloodSize() { return 1000*GetArg("-maxreceivebuffer", 5*1000); }
 inline unsigned int SendBufferSize() { return 1000*GetArg("-maxsendbuffer", 1*1000); }
@@ -58,15 +84,43 @@ unsigned short GetListenPort();
 bool BindListenPort(const CService &bindAddr, std::string& strError=REF(std::string()));
 void StartNode(boost::thread_group& threadGroup);
 bool StopNode();
+/** Wake the socket handler thread, e.g. after a paused receive buffer drained */
+void WakeSocketHandler();
 void SocketSendData(CNode *pnode);
 
 typedef int NodeId;
 
+/** A complete serialized message, header included. Queued messages are
+ * shared, so data relayed to many peers is serialized only once. */
+typedef boost::shared_ptr<const CSerializeData> CSharedMessage;
+
+/** Fill in the size and checksum of the CMessageHeader at the start of ss */
+void FinishMessageHeader(CDataStream& ss);
+
+/** Serialize a message once for queueing to any number of peers with
+ * CNode::PushSharedMessage. Only for data that is encoded the same way for
+ * every protocol version. */
+template<typename T>
+CSharedMessage MakeSharedMessage(const char* pszCommand, const T& obj)
+{
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << CMessageHeader(pszCommand, 0) << obj;
+    FinishMessageHeader(ss);
+    boost::shared_ptr<CSerializeData> pdata(new CSerializeData());
+    ss.SwapBuffer(*pdata);
+    return pdata;
+}
+
+/** Queue a node for the message handler thread, e.g. when a complete message
+ * arrived or there is something to send */
+void WakeMessageHandler(NodeId id);
+
 // Signals for message handling
 struct CNodeSignals
 {
     boost::signals2::signal<int ()> GetHeight;
     boost::signals2::signal<bool (CNode*)> ProcessMessages;
+    boost::signals2::signal<bool (CNode*)> ProcessWorkerMessages;
     boost::signals2::signal<bool (CNode*, bool)> SendMessages;
     boost::signals2::signal<void (NodeId, const CNode*)> InitializeNode;
     boost::signals2::signal<void (NodeId)> FinalizeNode;
@@ -106,10 +160,11 @@ extern uint64_t nLocalServices;
 extern uint64_t nLocalHostNonce;
 extern CAddrMan addrman;
 extern int nMaxConnections;
+extern int nMessageWorkerThreads;
 
 extern std::vector<CNode*> vNodes;
 extern CCriticalSection cs_vNodes;
-extern std::map<CInv, CDataStream> mapRelay;
+extern std::map<CInv, CSharedMessage> mapRelay;
 extern std::deque<std::pair<int64_t, CInv> > vRelayExpiration;
 extern CCriticalSection cs_mapRelay;
 extern limitedmap<CInv, int64_t> mapAlreadyAskedFor;
@@ -128,6 +183,42 @@ struct LocalServiceInfo {
 extern CCriticalSection cs_mapLocalHost;
 extern map<CNetAddr, LocalServiceInfo> mapLocalHost;
 
+/** Number of buckets in the message handling time histogram. Bucket i
+ * counts messages handled in under 10^(i+1) microseconds, the last one
+ * everything slower. */
+static const int MESSAGE_TIME_BUCKETS = 7;
+
+/** Traffic and handling time of one message command. Messages with commands
+ * we don't know are counted under "*other*", so a peer can't grow the maps. */
+class CMessageStats
+{
+public:
+    uint64_t nMsgsSent;
+    uint64_t nBytesSent;
+    uint64_t nMsgsRecv;
+    uint64_t nBytesRecv;
+    // Time spent in ProcessMessage, in total and as a histogram
+    uint64_t nHandleUsec;
+    uint64_t vHandleBuckets[MESSAGE_TIME_BUCKETS];
+
+    CMessageStats()
+    {
+        nMsgsSent = nBytesSent = nMsgsRecv = nBytesRecv = nHandleUsec = 0;
+        memset(vHandleBuckets, 0, sizeof(vHandleBuckets));
+    }
+
+    void AddHandleTime(int64_t nUsec)
+    {
+        nHandleUsec += nUsec;
+        int nBucket = 0;
+        for (int64_t nLimit = 10; nBucket < MESSAGE_TIME_BUCKETS - 1 && nUsec >= nLimit; nLimit *= 10)
+            nBucket++;
+        vHandleBuckets[nBucket]++;
+    }
+};
+
+typedef std::map<std::string, CMessageStats> mapMsgCmdStats;
+
 class CNodeStats
 {
 public:
@@ -147,6 +238,7 @@ public:
     double dPingTime;
     double dPingWait;
     std::string addrLocal;
+    mapMsgCmdStats mapMsgStats;
 };
 
 
@@ -156,18 +248,21 @@ class CNetMessage {
 public:
     bool in_data;                   // parsing header (false) or data (true)
 
-    CDataStream hdrbuf;             // partially received header
+    char pchHdr[CMessageHeader::HEADER_SIZE]; // partially received header
     CMessageHeader hdr;             // complete header
     unsigned int nHdrPos;
 
-    CDataStream vRecv;              // received message data
+    CDataStream vRecv;              // received message data, grown as it arrives
     unsigned int nDataPos;
 
-    CNetMessage(int nTypeIn, int nVersionIn) : hdrbuf(nTypeIn, nVersionIn), vRecv(nTypeIn, nVersionIn) {
-        hdrbuf.resize(24);
+    CHashWriter hasher;             // checksum of the data received so far
+    uint256 hashData;               // set once complete, see GetMessageHash
+
+    CNetMessage(int nTypeIn, int nVersionIn) : vRecv(nTypeIn, nVersionIn), hasher(SER_GETHASH, 0) {
         in_data = false;
         nHdrPos = 0;
         nDataPos = 0;
+        hashData = 0;
     }
 
     bool complete() const
@@ -179,10 +274,18 @@ public:
 
     void SetVersion(int nVersionIn)
     {
-        hdrbuf.SetVersion(nVersionIn);
         vRecv.SetVersion(nVersionIn);
     }
 
+    // Double-SHA256 of the message data, for checking against hdr.nChecksum
+    const uint256& GetMessageHash()
+    {
+        assert(complete());
+        if (hashData == 0)
+            hashData = hasher.GetHash();
+        return hashData;
+    }
+
     int readHeader(const char *pch, unsigned int nBytes);
     int readData(const char *pch, unsigned int nBytes);
 };
@@ -202,14 +305,22 @@ public:
     size_t nSendSize; // total size of all vSendMsg entries
     size_t nSendOffset; // offset inside the first vSendMsg already sent
     uint64_t nSendBytes;
-    std::deque<CSerializeData> vSendMsg;
+    std::deque<CSharedMessage> vSendMsg;
     CCriticalSection cs_vSend;
 
     std::deque<CInv> vRecvGetData;
+    // Orphan transactions whose missing inputs may have been provided by this
+    // peer; drained a step at a time by ProcessMessages. Requires cs_main.
+    std::set<uint256> setOrphanWorkSet;
     std::deque<CNetMessage> vRecvMsg;
     CCriticalSection cs_vRecvMsg;
+    // Buffers of processed messages, handed to new ones. Requires cs_vRecvMsg.
+    std::vector<CSerializeData> vRecvPool;
     uint64_t nRecvBytes;
     int nRecvVersion;
+    // Receiving is paused until the message handler drains vRecvMsg below
+    // ReceiveFloodSize(). Requires cs_vRecvMsg.
+    bool fPauseRecv;
 
     int64_t nLastSend;
     int64_t nLastRecv;
@@ -259,28 +370,38 @@ public:
 
     // flood relay
     std::vector<CAddress> vAddrToSend;
-    mruset<CAddress> setAddrKnown;
+    CRollingBloomFilter addrKnown;
+    CCriticalSection cs_vAddrToSend; // guards vAddrToSend and addrKnown
     bool fGetAddr;
     std::set<uint256> setKnown;
     uint256 hashCheckpointKnown;
 
     // inventory based relay
-    mruset<CInv> setInventoryKnown;
+    CRollingBloomFilter filterInventoryKnown;
     std::vector<CInv> vInventoryToSend;
     CCriticalSection cs_inventory;
     std::multimap<int64_t, CInv> mapAskFor;
 
-    // Ping time measurement
+    // Per-command traffic and handling time, see CMessageStats
+    mapMsgCmdStats mapMsgStats;
+    CCriticalSection cs_mapMsgStats;
+
+    // Ping time measurement. Written by SendMessages and the pong handler,
+    // both under cs_vSend.
     uint64_t nPingNonceSent;
     int64_t nPingUsecStart;
     int64_t nPingUsecTime;
     bool fPingQueued;
 
-    CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn=false) : ssSend(SER_NETWORK, INIT_PROTO_VERSION), setAddrKnown(5000)
+    CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn = "", bool fInboundIn=false) : ssSend(SER_NETWORK, INIT_PROTO_VERSION),
+        addrKnown(MAX_ADDR_KNOWN, ADDR_KNOWN_FP_RATE),
+        filterInventoryKnown(SendBufferSize() / 1000, INVENTORY_KNOWN_FP_RATE)
     {
         nServices = 0;
         hSocket = hSocketIn;
         nRecvVersion = INIT_PROTO_VERSION;
+        fPauseRecv = false;
+        vRecvPool.reserve(MAX_RECV_POOL_BUFFERS);
         nLastSend = 0;
         nLastRecv = 0;
         nSendBytes = 0;
@@ -308,7 +429,6 @@ public:
         fGetAddr = false;
         hashCheckpointKnown = 0;
         fRelayTxes = false;
-        setInventoryKnown.max_size(SendBufferSize() / 1000);
         pfilter = new CBloomFilter();
         nPingNonceSent = 0;
         nPingUsecStart = 0;
@@ -345,6 +465,8 @@ private:
     static CCriticalSection cs_totalBytesSent;
     static uint64_t nTotalBytesRecv;
     static uint64_t nTotalBytesSent;
+    static mapMsgCmdStats mapTotalMsgStats;
+    static CCriticalSection cs_mapTotalMsgStats;
 
     CNode(const CNode&);
     void operator=(const CNode&);
@@ -371,7 +493,11 @@ public:
     }
 
     // requires LOCK(cs_vRecvMsg)
-    bool ReceiveMsgBytes(const char *pch, unsigned int nBytes);
+    bool ReceiveMsgBytes(const char *pch, unsigned int nBytes, bool& fComplete);
+
+    // Drop the processed message at the front of vRecvMsg, keeping its
+    // buffer for reuse. requires LOCK(cs_vRecvMsg)
+    void PopRecvMsg();
 
     // requires LOCK(cs_vRecvMsg)
     void SetRecvVersion(int nVersionIn)
@@ -396,7 +522,8 @@ public:
 
     void AddAddressKnown(const CAddress& addr)
     {
-        setAddrKnown.insert(addr);
+        LOCK(cs_vAddrToSend);
+        addrKnown.insert(addr.GetKey());
     }
 
     void PushAddress(const CAddress& addr)
@@ -404,7 +531,8 @@ public:
         // Known checking here is only to save space from duplicates.
         // SendMessages will filter it again for knowns that were added
         // after addresses were pushed.
-        if (addr.IsValid() && !setAddrKnown.count(addr)) {
+        LOCK(cs_vAddrToSend);
+        if (addr.IsValid() && !addrKnown.contains(addr.GetKey())) {
             if (vAddrToSend.size() >= MAX_ADDR_TO_SEND) {
                 vAddrToSend[insecure_rand() % vAddrToSend.size()] = addr;
             } else {
@@ -418,7 +546,7 @@ public:
     {
         {
             LOCK(cs_inventory);
-            setInventoryKnown.insert(inv);
+            filterInventoryKnown.insert(inv.hash);
         }
     }
 
@@ -426,9 +554,10 @@ public:
     {
         {
             LOCK(cs_inventory);
-            if (!setInventoryKnown.count(inv))
+            if (!filterInventoryKnown.contains(inv.hash))
                 vInventoryToSend.push_back(inv);
         }
+        WakeMessageHandler(id);
     }
 
     void AskFor(const CInv& inv)
@@ -501,28 +630,37 @@ public:
         if (ssSend.size() == 0)
             return;
 
-        // Set the size
-        unsigned int nSize = ssSend.size() - CMessageHeader::HEADER_SIZE;
-        memcpy((char*)&ssSend[CMessageHeader::MESSAGE_SIZE_OFFSET], &nSize, sizeof(nSize));
+        // Set the size and checksum
+        FinishMessageHeader(ssSend);
 
-        // Set the checksum
-        uint256 hash = Hash(ssSend.begin() + CMessageHeader::HEADER_SIZE, ssSend.end());
-        unsigned int nChecksum = 0;
-        memcpy(&nChecksum, &hash, sizeof(nChecksum));
-        assert(ssSend.size () >= CMessageHeader::CHECKSUM_OFFSET + sizeof(nChecksum));
-        memcpy((char*)&ssSend[CMessageHeader::CHECKSUM_OFFSET], &nChecksum, sizeof(nChecksum));
+        LogPrint("net", "(%d bytes)\n", ssSend.size() - CMessageHeader::HEADER_SIZE);
 
-        LogPrint("net", "(%d bytes)\n", nSize);
+        boost::shared_ptr<CSerializeData> pdata(new CSerializeData());
+        pdata->reserve(ssSend.size());
+        ssSend.GetAndClear(*pdata);
+        QueueSendMsg(pdata);
 
-        std::deque<CSerializeData>::iterator it = vSendMsg.insert(vSendMsg.end(), CSerializeData());
-        ssSend.GetAndClear(*it);
-        nSendSize += (*it).size();
+        LEAVE_CRITICAL_SECTION(cs_vSend);
+    }
+
+    // requires LOCK(cs_vSend)
+    void QueueSendMsg(const CSharedMessage& pmsg)
+    {
+        RecordMessageSent(*pmsg);
+        vSendMsg.push_back(pmsg);
+        nSendSize += pmsg->size();
 
         // If write queue empty, attempt "optimistic write"
-        if (it == vSendMsg.begin())
+        if (vSendMsg.size() == 1)
             SocketSendData(this);
+    }
 
-        LEAVE_CRITICAL_SECTION(cs_vSend);
+    // Queue a message made by MakeSharedMessage, without copying it
+    void PushSharedMessage(const CSharedMessage& pmsg)
+    {
+        LOCK(cs_vSend);
+        LogPrint("net", "sending: shared message (%d bytes)\n", pmsg->size() - CMessageHeader::HEADER_SIZE);
+        QueueSendMsg(pmsg);
     }
 
     void PushVersion();
@@ -718,6 +856,12 @@ public:
 
     static uint64_t GetTotalBytesRecv();
     static uint64_t GetTotalBytesSent();
+
+    // Per-command stats, for this peer and for all peers since startup
+    void RecordMessageSent(const CSerializeData& msg);
+    void RecordMessageRecv(const CMessageHeader& hdr);
+    void RecordMessageHandled(const std::string& strCommand, int64_t nUsec);
+    static void GetTotalMessageStats(mapMsgCmdStats& mapStats);
 };
 
 
@@ -16,7 +16,17 @@ static const char* ppszTypeName[] =
     "ERROR",
     "tx",
     "block",
-    "filtered block"
+    "filtered block",
+    "compact block"
+};
+
+static const char* ppszMessageCommands[] =
+{
+    "version", "verack", "addr", "getaddr", "inv", "getdata", "notfound",
+    "getblocks", "getheaders", "headers", "block", "merkleblock", "tx",
+    "mempool", "cmpctblock", "getblocktxn", "blocktxn", "ping", "pong",
+    "alert", "checkpoint", "reject", "filterload", "filteradd", "filterclear",
+    "getcfilters", "cfilter", "getcfheaders", "cfheaders", "getcfcheckpt", "cfcheckpt"
 };
 
 CMessageHeader::CMessageHeader()
@@ -149,3 +159,10 @@ void CInv::print() const
     LogPrintf("CInv(%s)\n", ToString());
 }
 
+bool IsKnownMessageCommand(const std::string& strCommand)
+{
+    for (unsigned int i = 0; i < ARRAYLEN(ppszMessageCommands); i++)
+        if (strCommand == ppszMessageCommands[i])
+            return true;
+    return false;
+}
@@ -62,6 +62,8 @@ class CMessageHeader
 enum
 {
     NODE_NETWORK = (1 << 0),
+    // Serves compact block filters (getcfilters, getcfheaders, getcfcheckpt)
+    NODE_COMPACT_FILTERS = (1 << 6),
 };
 
 /** A CService with information about it as peer */
@@ -135,6 +137,12 @@ enum
     // Nodes may always request a MSG_FILTERED_BLOCK in a getdata, however,
     // MSG_FILTERED_BLOCK should not appear in any invs except as a part of getdata.
     MSG_FILTERED_BLOCK,
+    // Like MSG_FILTERED_BLOCK, MSG_CMPCT_BLOCK only appears in getdata and
+    // is answered with a "cmpctblock" message.
+    MSG_CMPCT_BLOCK,
 };
 
+/** Whether strCommand is one of the message types this version knows about */
+bool IsKnownMessageCommand(const std::string& strCommand);
+
 #endif // __INCLUDED_PROTOCOL_H__
@@ -0,0 +1,338 @@
+// Copyright (c) 2014 The Carboncoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "core.h"
+#include "jsonwriter.h"
+#include "main.h"
+#include "rpcprotocol.h"
+#include "rpcserver.h"
+#include "sync.h"
+#include "txmempool.h"
+#include "util.h"
+
+#include <limits>
+
+#include <boost/algorithm/string.hpp>
+#include <boost/foreach.hpp>
+
+using namespace std;
+using namespace json_spirit;
+
+extern void blockToJSON(const CBlock& block, const CBlockIndex* blockindex, int nConfirmations, const CBlockIndex* pnext, CJSONWriter& writer);
+extern void TxToJSON(const CTransaction& tx, const uint256 hashBlock, CJSONWriter& writer);
+extern void ScriptPubKeyToJSON(const CScript& scriptPubKey, CJSONWriter& writer, bool fIncludeHex);
+
+/** Most headers /rest/headers returns */
+static const unsigned int MAX_REST_HEADERS_RESULTS = 2000;
+/** Most outputs one /rest/getutxos request asks for */
+static const unsigned int MAX_GETUTXOS_OUTPOINTS = 15;
+
+enum RESTFormat
+{
+    RF_BINARY,
+    RF_HEX,
+    RF_JSON,
+};
+
+static const struct
+{
+    RESTFormat rf;
+    const char* pszExtension;
+    const char* pszContentType;
+} rf_names[] = {
+    { RF_BINARY, "bin",  "application/octet-stream" },
+    { RF_HEX,    "hex",  "text/plain" },
+    { RF_JSON,   "json", "application/json" },
+};
+
+// An unspent output as /rest/getutxos returns it
+class CRESTCoin
+{
+public:
+    uint32_t nTxVer;
+    uint32_t nHeight;
+    CTxOut out;
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(nTxVer);
+        READWRITE(nHeight);
+        READWRITE(out);
+    )
+};
+
+static string RESTError(int nStatus, const string& strMessage, bool fKeepAlive)
+{
+    return HTTPReply(nStatus, strMessage + "\r\n", fKeepAlive, "text/plain");
+}
+
+// Binary data as the requested format asks, JSON is written by the caller
+static string RESTReply(RESTFormat rf, const string& strData, bool fKeepAlive)
+{
+    if (rf == RF_HEX)
+        return HTTPReply(HTTP_OK, HexStr(strData.begin(), strData.end()) + "\n", fKeepAlive, "text/plain");
+    return HTTPReply(HTTP_OK, strData, fKeepAlive, "application/octet-stream");
+}
+
+static bool ParseHashStr(const string& strHash, uint256& hash)
+{
+    if (strHash.size() != 64 || !IsHex(strHash))
+        return false;
+    hash.SetHex(strHash);
+    return true;
+}
+
+static string RESTGetBlock(const vector<string>& vParams, RESTFormat rf, bool fKeepAlive)
+{
+    uint256 hash;
+    if (vParams.size() != 1 || !ParseHashStr(vParams[0], hash))
+        return RESTError(HTTP_BAD_REQUEST, "Invalid hash: " + (vParams.empty() ? "" : vParams[0]), fKeepAlive);
+
+    CBlockIndex* pblockindex;
+    int nConfirmations;
+    CBlockIndex* pnext;
+    {
+        LOCK(cs_main);
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+        if (mi == mapBlockIndex.end() || !(mi->second->nStatus & BLOCK_HAVE_DATA))
+            return RESTError(HTTP_NOT_FOUND, vParams[0] + " not found", fKeepAlive);
+        pblockindex = mi->second;
+        nConfirmations = chainActive.Contains(pblockindex) ? chainActive.Height() - pblockindex->nHeight + 1 : -1;
+        pnext = chainActive.Next(pblockindex);
+    }
+
+    // Sent as it is stored, it is only decoded for JSON
+    vector<unsigned char> vchBlock;
+    if (!ReadRawBlockFromDisk(vchBlock, pblockindex))
+        return RESTError(HTTP_NOT_FOUND, vParams[0] + " not found", fKeepAlive);
+
+    if (rf != RF_JSON)
+        return RESTReply(rf, string(vchBlock.begin(), vchBlock.end()), fKeepAlive);
+
+    CBlock block;
+    CDataStream ssBlock(vchBlock, SER_DISK, CLIENT_VERSION);
+    ssBlock >> block;
+    CJSONWriter writer;
+    blockToJSON(block, pblockindex, nConfirmations, pnext, writer);
+    return HTTPReply(HTTP_OK, writer.GetBuffer() + "\n", fKeepAlive);
+}
+
+static string RESTGetTx(const vector<string>& vParams, RESTFormat rf, bool fKeepAlive)
+{
+    uint256 hash;
+    if (vParams.size() != 1 || !ParseHashStr(vParams[0], hash))
+        return RESTError(HTTP_BAD_REQUEST, "Invalid hash: " + (vParams.empty() ? "" : vParams[0]), fKeepAlive);
+
+    CTransaction tx;
+    uint256 hashBlock = 0;
+    if (!GetTransaction(hash, tx, hashBlock, true))
+        return RESTError(HTTP_NOT_FOUND, vParams[0] + " not found", fKeepAlive);
+
+    CDataStream ssTx(SER_NETWORK, PROTOCOL_VERSION);
+    ssTx << tx;
+    if (rf != RF_JSON)
+        return RESTReply(rf, ssTx.str(), fKeepAlive);
+
+    // The same as verbose getrawtransaction
+    CJSONWriter writer;
+    writer.BeginObject();
+    writer.Pair("hex", HexStr(ssTx.begin(), ssTx.end()));
+    TxToJSON(tx, hashBlock, writer);
+    writer.EndObject();
+    return HTTPReply(HTTP_OK, writer.GetBuffer() + "\n", fKeepAlive);
+}
+
+static string RESTGetHeaders(const vector<string>& vParams, RESTFormat rf, bool fKeepAlive)
+{
+    if (vParams.size() != 2)
+        return RESTError(HTTP_BAD_REQUEST, "No header count specified. Use /rest/headers/<count>/<hash>.<ext>.", fKeepAlive);
+
+    long nCount = strtol(vParams[0].c_str(), NULL, 10);
+    if (nCount < 1 || nCount > (long)MAX_REST_HEADERS_RESULTS)
+        return RESTError(HTTP_BAD_REQUEST, strprintf("Header count out of range: %s", vParams[0]), fKeepAlive);
+    uint256 hash;
+    if (!ParseHashStr(vParams[1], hash))
+        return RESTError(HTTP_BAD_REQUEST, "Invalid hash: " + vParams[1], fKeepAlive);
+
+    // Headers from the given one on along the active chain, none if it isn't in it
+    CDataStream ssHeaders(SER_NETWORK, PROTOCOL_VERSION);
+    CJSONWriter writer;
+    writer.BeginArray();
+    {
+        LOCK(cs_main);
+        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+        CBlockIndex* pindex = (mi != mapBlockIndex.end() && chainActive.Contains(mi->second)) ? mi->second : NULL;
+        for (long i = 0; pindex != NULL && i < nCount; i++, pindex = chainActive.Next(pindex))
+        {
+            if (rf != RF_JSON)
+            {
+                ssHeaders << pindex->GetBlockHeader();
+                continue;
+            }
+            CBlockIndex* pnext = chainActive.Next(pindex);
+            writer.BeginObject();
+            writer.Pair("hash", pindex->GetBlockHash().GetHex());
+            writer.Pair("confirmations", chainActive.Height() - pindex->nHeight + 1);
+            writer.Pair("height", pindex->nHeight);
+            writer.Pair("version", pindex->nVersion);
+            writer.Pair("merkleroot", pindex->hashMerkleRoot.GetHex());
+            writer.Pair("time", pindex->GetBlockTime());
+            writer.Pair("nonce", (uint64_t)pindex->nNonce);
+            writer.Pair("bits", HexBits(pindex->nBits));
+            writer.Pair("difficulty", GetDifficulty(pindex));
+            writer.Pair("chainwork", pindex->nChainWork.GetHex());
+            if (pindex->pprev)
+                writer.Pair("previousblockhash", pindex->pprev->GetBlockHash().GetHex());
+            if (pnext)
+                writer.Pair("nextblockhash", pnext->GetBlockHash().GetHex());
+            writer.EndObject();
+        }
+    }
+    writer.EndArray();
+
+    if (rf != RF_JSON)
+        return RESTReply(rf, ssHeaders.str(), fKeepAlive);
+    return HTTPReply(HTTP_OK, writer.GetBuffer() + "\n", fKeepAlive);
+}
+
+static string RESTGetUTXOs(vector<string> vParams, RESTFormat rf, bool fKeepAlive)
+{
+    // /rest/getutxos/checkmempool/<txid>-<n>/... also counts what the
+    // memory pool adds
+    bool fCheckMemPool = !vParams.empty() && vParams[0] == "checkmempool";
+    if (fCheckMemPool)
+        vParams.erase(vParams.begin());
+    if (vParams.empty())
+        return RESTError(HTTP_BAD_REQUEST, "No outpoints specified. Use /rest/getutxos/<txid>-<n>/....<ext>.", fKeepAlive);
+    if (vParams.size() > MAX_GETUTXOS_OUTPOINTS)
+        return RESTError(HTTP_BAD_REQUEST, strprintf("Error: max outpoints exceeded (max: %d, tried: %d)", MAX_GETUTXOS_OUTPOINTS, vParams.size()), fKeepAlive);
+
+    vector<COutPoint> vOutPoints;
+    BOOST_FOREACH(const string& strOutPoint, vParams)
+    {
+        size_t nPos = strOutPoint.find('-');
+        uint256 hash;
+        if (nPos == string::npos || !ParseHashStr(strOutPoint.substr(0, nPos), hash))
+            return RESTError(HTTP_BAD_REQUEST, "Parse error: " + strOutPoint, fKeepAlive);
+        const char* pszIndex = strOutPoint.c_str() + nPos + 1;
+        char* pszEnd;
+        unsigned long n = strtoul(pszIndex, &pszEnd, 10);
+        if (*pszIndex < '0' || *pszIndex > '9' || *pszEnd != '\0' || n > std::numeric_limits<unsigned int>::max())
+            return RESTError(HTTP_BAD_REQUEST, "Parse error: " + strOutPoint, fKeepAlive);
+        vOutPoints.push_back(COutPoint(hash, (unsigned int)n));
+    }
+
+    // One bit per outpoint, set if it is unspent
+    vector<unsigned char> vBitmap((vOutPoints.size() + 7) / 8, 0);
+    string strBitmap;
+    vector<CRESTCoin> vCoins;
+    int nHeight;
+    uint256 hashTip;
+    {
+        LOCK2(cs_main, mempool.cs);
+        CCoinsViewMemPool viewMemPool(*pcoinsTip, mempool);
+        CCoinsView& view = fCheckMemPool ? (CCoinsView&)viewMemPool : (CCoinsView&)*pcoinsTip;
+        for (unsigned int i = 0; i < vOutPoints.size(); i++)
+        {
+            CCoins coins;
+            const uint256& hash = vOutPoints[i].hash;
+            bool fUnspent = false;
+            if (view.GetCoins(hash, coins))
+            {
+                if (fCheckMemPool)
+                    mempool.pruneSpent(hash, coins);
+                if (coins.IsAvailable(vOutPoints[i].n))
+                {
+                    fUnspent = true;
+                    CRESTCoin coin;
+                    coin.nTxVer = coins.nVersion;
+                    coin.nHeight = coins.nHeight;
+                    coin.out = coins.vout[vOutPoints[i].n];
+                    vCoins.push_back(coin);
+                }
+            }
+            if (fUnspent)
+                vBitmap[i / 8] |= (1 << (i % 8));
+            strBitmap += fUnspent ? "1" : "0";
+        }
+        nHeight = chainActive.Height();
+        hashTip = chainActive.Tip()->GetBlockHash();
+    }
+
+    if (rf != RF_JSON)
+    {
+        CDataStream ssUTXOs(SER_NETWORK, PROTOCOL_VERSION);
+        ssUTXOs << nHeight << hashTip << vBitmap << vCoins;
+        return RESTReply(rf, ssUTXOs.str(), fKeepAlive);
+    }
+
+    CJSONWriter writer;
+    writer.BeginObject();
+    writer.Pair("chainHeight", nHeight);
+    writer.Pair("chaintipHash", hashTip.GetHex());
+    writer.Pair("bitmap", strBitmap);
+    writer.Key("utxos");
+    writer.BeginArray();
+    BOOST_FOREACH(const CRESTCoin& coin, vCoins)
+    {
+        writer.BeginObject();
+        writer.Pair("txvers", (int64_t)coin.nTxVer);
+        writer.Pair("height", (int64_t)coin.nHeight);
+        writer.Pair("value", ValueFromAmount(coin.out.nValue));
+        writer.Key("scriptPubKey");
+        writer.BeginObject();
+        ScriptPubKeyToJSON(coin.out.scriptPubKey, writer, true);
+        writer.EndObject();
+        writer.EndObject();
+    }
+    writer.EndArray();
+    writer.EndObject();
+    return HTTPReply(HTTP_OK, writer.GetBuffer() + "\n", fKeepAlive);
+}
+
+string RESTReply(const string& strURI, bool fKeepAlive)
+{
+    // /rest/<resource>/<params>.../<last param>.<format>
+    vector<string> vParams;
+    string strPath = strURI.substr(strlen("/rest/"));
+    boost::split(vParams, strPath, boost::is_any_of("/"));
+    string strResource = vParams[0];
+    vParams.erase(vParams.begin());
+
+    size_t nDot = vParams.empty() ? string::npos : vParams.back().rfind('.');
+    if (nDot == string::npos)
+        return RESTError(HTTP_NOT_FOUND, "output format not found (available: bin, hex, json)", fKeepAlive);
+    string strFormat = vParams.back().substr(nDot + 1);
+    vParams.back().erase(nDot);
+
+    RESTFormat rf = RF_BINARY;
+    bool fFound = false;
+    for (unsigned int i = 0; i < ARRAYLEN(rf_names); i++)
+    {
+        if (strFormat == rf_names[i].pszExtension)
+        {
+            rf = rf_names[i].rf;
+            fFound = true;
+        }
+    }
+    if (!fFound)
+        return RESTError(HTTP_NOT_FOUND, "output format not found (available: bin, hex, json)", fKeepAlive);
+
+    try
+    {
+        if (strResource == "block")
+            return RESTGetBlock(vParams, rf, fKeepAlive);
+        if (strResource == "tx")
+            return RESTGetTx(vParams, rf, fKeepAlive);
+        if (strResource == "headers")
+            return RESTGetHeaders(vParams, rf, fKeepAlive);
+        if (strResource == "getutxos")
+            return RESTGetUTXOs(vParams, rf, fKeepAlive);
+    }
+    catch (std::exception& e)
+    {
+        return RESTError(HTTP_INTERNAL_SERVER_ERROR, e.what(), fKeepAlive);
+    }
+    return RESTError(HTTP_NOT_FOUND, "Unknown REST resource: " + strResource, fKeepAlive);
+}
@@ -4,6 +4,8 @@
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
 #include "rpcserver.h"
+#include "blockfilter.h"
+#include "jsonwriter.h"
 #include "main.h"
 #include "sync.h"
 #include "checkpoints.h"
@@ -23,10 +25,9 @@ double GetDifficulty(const CBlockIndex* blockindex)
     // minimum difficulty = 1.0.
     if (blockindex == NULL)
     {
-        if (chainActive.Tip() == NULL)
+        blockindex = GetChainTipSnapshot();
+        if (blockindex == NULL)
             return 1.0;
-        else
-            blockindex = chainActive.Tip();
     }
 
     int nShift = (blockindex->nBits >> 24) & 0xff;
@@ -49,13 +50,13 @@ double GetDifficulty(const CBlockIndex* blockindex)
 }
 
 
-Object blockToJSON(const CBlock& block, const CBlockIndex* blockindex)
+// nConfirmations and pnext are where blockindex stood in chainActive when
+// the block was looked up, so the rest can be built without cs_main
+Object blockToJSON(const CBlock& block, const CBlockIndex* blockindex, int nConfirmations, const CBlockIndex* pnext)
 {
     Object result;
     result.push_back(Pair("hash", block.GetHash().GetHex()));
-    CMerkleTx txGen(block.vtx[0]);
-    txGen.SetMerkleBranch(&block);
-    result.push_back(Pair("confirmations", (int)txGen.GetDepthInMainChain()));
+    result.push_back(Pair("confirmations", nConfirmations));
     result.push_back(Pair("size", (int)::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION)));
     result.push_back(Pair("height", blockindex->nHeight));
     result.push_back(Pair("version", block.nVersion));
@@ -72,12 +73,39 @@ Object blockToJSON(const CBlock& block, const CBlockIndex* blockindex)
 
     if (blockindex->pprev)
         result.push_back(Pair("previousblockhash", blockindex->pprev->GetBlockHash().GetHex()));
-    CBlockIndex *pnext = chainActive.Next(blockindex);
     if (pnext)
         result.push_back(Pair("nextblockhash", pnext->GetBlockHash().GetHex()));
     return result;
 }
 
+// Same as above, written as it goes
+void blockToJSON(const CBlock& block, const CBlockIndex* blockindex, int nConfirmations, const CBlockIndex* pnext, CJSONWriter& writer)
+{
+    writer.BeginObject();
+    writer.Pair("hash", block.GetHash().GetHex());
+    writer.Pair("confirmations", nConfirmations);
+    writer.Pair("size", (int)::GetSerializeSize(block, SER_NETWORK, PROTOCOL_VERSION));
+    writer.Pair("height", blockindex->nHeight);
+    writer.Pair("version", block.nVersion);
+    writer.Pair("merkleroot", block.hashMerkleRoot.GetHex());
+    writer.Key("tx");
+    writer.BeginArray();
+    BOOST_FOREACH(const CTransaction&tx, block.vtx)
+        writer.String(tx.GetHash().GetHex());
+    writer.EndArray();
+    writer.Pair("time", block.GetBlockTime());
+    writer.Pair("nonce", (uint64_t)block.nNonce);
+    writer.Pair("bits", HexBits(block.nBits));
+    writer.Pair("difficulty", GetDifficulty(blockindex));
+    writer.Pair("chainwork", blockindex->nChainWork.GetHex());
+
+    if (blockindex->pprev)
+        writer.Pair("previousblockhash", blockindex->pprev->GetBlockHash().GetHex());
+    if (pnext)
+        writer.Pair("nextblockhash", pnext->GetBlockHash().GetHex());
+    writer.EndObject();
+}
+
 
 Value getblockcount(const Array& params, bool fHelp)
 {
@@ -92,7 +120,8 @@ Value getblockcount(const Array& params, bool fHelp)
             + HelpExampleRpc("getblockcount", "")
         );
 
-    return chainActive.Height();
+    CBlockIndex* pindexTip = GetChainTipSnapshot();
+    return pindexTip ? pindexTip->nHeight : -1;
 }
 
 Value getbestblockhash(const Array& params, bool fHelp)
@@ -108,7 +137,10 @@ Value getbestblockhash(const Array& params, bool fHelp)
             + HelpExampleRpc("getbestblockhash", "")
         );
 
-    return chainActive.Tip()->GetBlockHash().GetHex();
+    CBlockIndex* pindexTip = GetChainTipSnapshot();
+    if (pindexTip == NULL)
+        throw JSONRPCError(RPC_MISC_ERROR, "No blocks loaded");
+    return pindexTip->GetBlockHash().GetHex();
 }
 
 Value getdifficulty(const Array& params, bool fHelp)
@@ -166,6 +198,8 @@ Value getrawmempool(const Array& params, bool fHelp)
 
     if (fVerbose)
     {
+        CBlockIndex* pindexTip = GetChainTipSnapshot();
+        int nHeight = pindexTip ? pindexTip->nHeight : -1;
         LOCK(mempool.cs);
         Object o;
         BOOST_FOREACH(const PAIRTYPE(uint256, CTxMemPoolEntry)& entry, mempool.mapTx)
@@ -178,7 +212,7 @@ Value getrawmempool(const Array& params, bool fHelp)
             info.push_back(Pair("time", e.GetTime()));
             info.push_back(Pair("height", (int)e.GetHeight()));
             info.push_back(Pair("startingpriority", e.GetPriority(e.GetHeight())));
-            info.push_back(Pair("currentpriority", e.GetPriority(chainActive.Height())));
+            info.push_back(Pair("currentpriority", e.GetPriority(nHeight)));
             const CTransaction& tx = e.GetTx();
             set<string> setDepends;
             BOOST_FOREACH(const CTxIn& txin, tx.vin)
@@ -205,6 +239,88 @@ Value getrawmempool(const Array& params, bool fHelp)
     }
 }
 
+// What getrawmempool shows of a transaction
+struct CMempoolInfo
+{
+    uint256 hash;
+    int nSize;
+    int64_t nFee;
+    int64_t nTime;
+    int nHeight;
+    double dStartingPriority;
+    double dCurrentPriority;
+    set<string> setDepends;
+};
+
+void getrawmempool(const Array& params, CJSONWriter& writer)
+{
+    if (params.size() > 1)
+        getrawmempool(params, true);
+
+    bool fVerbose = false;
+    if (params.size() > 0)
+        fVerbose = params[0].get_bool();
+
+    if (!fVerbose)
+    {
+        vector<uint256> vtxid;
+        mempool.queryHashes(vtxid);
+
+        writer.BeginArray();
+        BOOST_FOREACH(const uint256& hash, vtxid)
+            writer.String(hash.ToString());
+        writer.EndArray();
+        return;
+    }
+
+    // Copy out what is shown, so the pool isn't locked while writing
+    CBlockIndex* pindexTip = GetChainTipSnapshot();
+    int nHeight = pindexTip ? pindexTip->nHeight : -1;
+    vector<CMempoolInfo> vInfo;
+    {
+        LOCK(mempool.cs);
+        vInfo.reserve(mempool.mapTx.size());
+        BOOST_FOREACH(const PAIRTYPE(uint256, CTxMemPoolEntry)& entry, mempool.mapTx)
+        {
+            const CTxMemPoolEntry& e = entry.second;
+            vInfo.push_back(CMempoolInfo());
+            CMempoolInfo& info = vInfo.back();
+            info.hash = entry.first;
+            info.nSize = e.GetTxSize();
+            info.nFee = e.GetFee();
+            info.nTime = e.GetTime();
+            info.nHeight = e.GetHeight();
+            info.dStartingPriority = e.GetPriority(e.GetHeight());
+            info.dCurrentPriority = e.GetPriority(nHeight);
+            BOOST_FOREACH(const CTxIn& txin, e.GetTx().vin)
+            {
+                if (mempool.exists(txin.prevout.hash))
+                    info.setDepends.insert(txin.prevout.hash.ToString());
+            }
+        }
+    }
+
+    writer.BeginObject();
+    BOOST_FOREACH(const CMempoolInfo& info, vInfo)
+    {
+        writer.Key(info.hash.ToString());
+        writer.BeginObject();
+        writer.Pair("size", info.nSize);
+        writer.Pair("fee", ValueFromAmount(info.nFee));
+        writer.Pair("time", info.nTime);
+        writer.Pair("height", info.nHeight);
+        writer.Pair("startingpriority", info.dStartingPriority);
+        writer.Pair("currentpriority", info.dCurrentPriority);
+        writer.Key("depends");
+        writer.BeginArray();
+        BOOST_FOREACH(const string& strDepend, info.setDepends)
+            writer.String(strDepend);
+        writer.EndArray();
+        writer.EndObject();
+    }
+    writer.EndObject();
+}
+
 Value getblockhash(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() != 1)
@@ -221,6 +337,7 @@ Value getblockhash(const Array& params, bool fHelp)
         );
 
     int nHeight = params[0].get_int();
+    LOCK(cs_main);
     if (nHeight < 0 || nHeight > chainActive.Height())
         throw runtime_error("Block number out of range.");
 
@@ -228,6 +345,26 @@ Value getblockhash(const Array& params, bool fHelp)
     return pblockindex->GetBlockHash().GetHex();
 }
 
+// Reads the block getblock was asked for, and where it stood in chainActive
+static void ReadRequestedBlock(const Array& params, CBlock& block, CBlockIndex*& pblockindex, int& nConfirmations, CBlockIndex*& pnext)
+{
+    std::string strHash = params[0].get_str();
+    uint256 hash(strHash);
+
+    {
+        LOCK(cs_main);
+        std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hash);
+        if (mi == mapBlockIndex.end())
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
+        pblockindex = mi->second;
+        nConfirmations = chainActive.Contains(pblockindex) ? chainActive.Height() - pblockindex->nHeight + 1 : -1;
+        pnext = chainActive.Next(pblockindex);
+    }
+
+    if(!ReadBlockFromDisk(block, pblockindex))
+        throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read block from disk");
+}
+
 Value getblock(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() < 1 || params.size() > 2)
@@ -264,21 +401,15 @@ Value getblock(const Array& params, bool fHelp)
             + HelpExampleRpc("getblock", "\"00000000c937983704a73af28acdec37b049d214adbda81d7e2a3dd146f6ed09\"")
         );
 
-    std::string strHash = params[0].get_str();
-    uint256 hash(strHash);
-
     bool fVerbose = true;
     if (params.size() > 1)
         fVerbose = params[1].get_bool();
 
-    if (mapBlockIndex.count(hash) == 0)
-        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
-
     CBlock block;
-    CBlockIndex* pblockindex = mapBlockIndex[hash];
-
-    if(!ReadBlockFromDisk(block, pblockindex))
-        throw JSONRPCError(RPC_INTERNAL_ERROR, "Can't read block from disk");
+    CBlockIndex* pblockindex;
+    int nConfirmations;
+    CBlockIndex* pnext;
+    ReadRequestedBlock(params, block, pblockindex, nConfirmations, pnext);
 
     if (!fVerbose)
     {
@@ -288,7 +419,79 @@ Value getblock(const Array& params, bool fHelp)
         return strHex;
     }
 
-    return blockToJSON(block, pblockindex);
+    return blockToJSON(block, pblockindex, nConfirmations, pnext);
+}
+
+void getblock(const Array& params, CJSONWriter& writer)
+{
+    if (params.size() < 1 || params.size() > 2)
+        getblock(params, true);
+
+    bool fVerbose = true;
+    if (params.size() > 1)
+        fVerbose = params[1].get_bool();
+
+    CBlock block;
+    CBlockIndex* pblockindex;
+    int nConfirmations;
+    CBlockIndex* pnext;
+    ReadRequestedBlock(params, block, pblockindex, nConfirmations, pnext);
+
+    if (!fVerbose)
+    {
+        CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
+        ssBlock << block;
+        writer.String(HexStr(ssBlock.begin(), ssBlock.end()));
+        return;
+    }
+
+    blockToJSON(block, pblockindex, nConfirmations, pnext, writer);
+}
+
+Value getblockfilter(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() < 1 || params.size() > 2)
+        throw runtime_error(
+            "getblockfilter \"hash\" ( \"filtertype\" )\n"
+            "\nReturns the compact filter of block <hash>, and its filter header.\n"
+            "Requires -blockfilterindex.\n"
+            "\nArguments:\n"
+            "1. \"hash\"          (string, required) The block hash\n"
+            "2. \"filtertype\"    (string, optional, default=\"basic\") The type of filter\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"filter\" : \"xxxx\",   (string) The hex encoded filter\n"
+            "  \"header\" : \"xxxx\"    (string) The filter header, committing to this filter and all previous ones\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getblockfilter", "\"00000000c937983704a73af28acdec37b049d214adbda81d7e2a3dd146f6ed09\"")
+            + HelpExampleRpc("getblockfilter", "\"00000000c937983704a73af28acdec37b049d214adbda81d7e2a3dd146f6ed09\"")
+        );
+
+    uint256 hash(params[0].get_str());
+
+    BlockFilterType filterType = BLOCK_FILTER_BASIC;
+    if (params.size() > 1 && !BlockFilterTypeByName(params[1].get_str(), filterType))
+        throw JSONRPCError(RPC_INVALID_PARAMETER, "Unknown filtertype");
+
+    if (!pblockfilterindex)
+        throw JSONRPCError(RPC_MISC_ERROR, "Block filters are not being indexed, start with -blockfilterindex");
+
+    {
+        LOCK(cs_main);
+        if (mapBlockIndex.count(hash) == 0)
+            throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "Block not found");
+    }
+
+    CBlockFilter filter;
+    CBlockFilterEntry entry;
+    if (!pblockfilterindex->LookupFilter(hash, filter) || !pblockfilterindex->LookupEntry(hash, entry))
+        throw JSONRPCError(RPC_MISC_ERROR, "Filter not found, the block may not be indexed yet");
+
+    Object result;
+    result.push_back(Pair("filter", HexStr(filter.GetEncodedFilter())));
+    result.push_back(Pair("header", entry.header.GetHex()));
+    return result;
 }
 
 Value gettxoutsetinfo(const Array& params, bool fHelp)
@@ -459,11 +662,14 @@ Value getblockchaininfo(const Array& params, bool fHelp)
     std::string chain = Params().DataDir();
     if(chain.empty())
         chain = "main";
+    CBlockIndex* pindexTip = GetChainTipSnapshot();
+    if (pindexTip == NULL)
+        throw JSONRPCError(RPC_MISC_ERROR, "No blocks loaded");
     obj.push_back(Pair("chain",         chain));
-    obj.push_back(Pair("blocks",        (int)chainActive.Height()));
-    obj.push_back(Pair("bestblockhash", chainActive.Tip()->GetBlockHash().GetHex()));
-    obj.push_back(Pair("difficulty",    (double)GetDifficulty()));
-    obj.push_back(Pair("verificationprogress", Checkpoints::GuessVerificationProgress(chainActive.Tip())));
-    obj.push_back(Pair("chainwork",     chainActive.Tip()->nChainWork.GetHex()));
+    obj.push_back(Pair("blocks",        (int)pindexTip->nHeight));
+    obj.push_back(Pair("bestblockhash", pindexTip->GetBlockHash().GetHex()));
+    obj.push_back(Pair("difficulty",    (double)GetDifficulty(pindexTip)));
+    obj.push_back(Pair("verificationprogress", Checkpoints::GuessVerificationProgress(pindexTip)));
+    obj.push_back(Pair("chainwork",     pindexTip->nChainWork.GetHex()));
     return obj;
 }
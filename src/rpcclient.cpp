@@ -5,6 +5,7 @@
 
 #include "rpcclient.h"
 
+#include "jsonreader.h"
 #include "rpcprotocol.h"
 #include "util.h"
 #include "ui_interface.h"
@@ -83,7 +84,7 @@ Object CallRPC(const string& strMethod, const Array& params)
 
     // Parse reply
     Value valReply;
-    if (!read_string(strReply, valReply))
+    if (!ParseJSON(strReply, valReply))
         throw runtime_error("couldn't parse reply from server");
     const Object& reply = valReply.get_obj();
     if (reply.empty())
@@ -102,7 +103,7 @@ void ConvertTo(Value& value, bool fAllowNull=false)
         // reinterpret string as unquoted json value
         Value value2;
         string strJSON = value.get_str();
-        if (!read_string(strJSON, value2))
+        if (!ParseJSON(strJSON, value2))
             throw runtime_error(string("Error parsing JSON:")+strJSON);
         ConvertTo<T>(value2, fAllowNull);
         value = value2;
@@ -55,10 +55,14 @@ void ShutdownRPCMining()
 // or from the last difficulty change if 'lookup' is nonpositive.
 // If 'height' is nonnegative, compute the estimate at the time when a given block was found.
 Value GetNetworkHashPS(int lookup, int height) {
-    CBlockIndex *pb = chainActive.Tip();
+    // Walking back through pprev needs no lock, only the lookup by height does
+    CBlockIndex *pb = GetChainTipSnapshot();
 
-    if (height >= 0 && height < chainActive.Height())
+    if (pb != NULL && height >= 0 && height < pb->nHeight)
+    {
+        LOCK(cs_main);
         pb = chainActive[height];
+    }
 
     if (pb == NULL || !pb->nHeight)
         return 0;
@@ -248,6 +252,7 @@ Value getmininginfo(const Array& params, bool fHelp)
             "  \"generate\": true|false     (boolean) If the generation is on or off (see getgenerate or setgenerate calls)\n"
             "  \"genproclimit\": n          (numeric) The processor limit for generation. -1 if no generation. (see getgenerate or setgenerate calls)\n"
             "  \"hashespersec\": n          (numeric) The hashes per second of the generation, or 0 if no generation.\n"
+            "  \"threadhashespersec\": [n,...] (array) The hashes per second of each miner thread, empty if no generation.\n"
             "  \"pooledtx\": n              (numeric) The size of the mem pool\n"
             "  \"testnet\": true|false      (boolean) If using testnet or not\n"
             "}\n"
@@ -256,11 +261,13 @@ Value getmininginfo(const Array& params, bool fHelp)
             + HelpExampleRpc("getmininginfo", "")
         );
 
+    CBlockIndex* pindexTip = GetChainTipSnapshot();
+
     Object obj;
-    obj.push_back(Pair("blocks",           (int)chainActive.Height()));
+    obj.push_back(Pair("blocks",           pindexTip ? pindexTip->nHeight : -1));
     obj.push_back(Pair("currentblocksize", (uint64_t)nLastBlockSize));
     obj.push_back(Pair("currentblocktx",   (uint64_t)nLastBlockTx));
-    obj.push_back(Pair("difficulty",       (double)GetDifficulty()));
+    obj.push_back(Pair("difficulty",       (double)GetDifficulty(pindexTip)));
     obj.push_back(Pair("errors",           GetWarnings("statusbar")));
     obj.push_back(Pair("genproclimit",     (int)GetArg("-genproclimit", -1)));
     obj.push_back(Pair("networkhashps",    getnetworkhashps(params, false)));
@@ -269,6 +276,12 @@ Value getmininginfo(const Array& params, bool fHelp)
 #ifdef ENABLE_WALLET
     obj.push_back(Pair("generate",         getgenerate(params, false)));
     obj.push_back(Pair("hashespersec",     gethashespersec(params, false)));
+    std::vector<double> vThreadHashesPerSec;
+    GetMinerThreadHashRates(vThreadHashesPerSec);
+    Array threadHashesPerSec;
+    BOOST_FOREACH(double dThreadHashesPerSec, vThreadHashesPerSec)
+        threadHashesPerSec.push_back((int64_t)dThreadHashesPerSec);
+    obj.push_back(Pair("threadhashespersec", threadHashesPerSec));
 #endif
     return obj;
 }
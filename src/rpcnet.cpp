@@ -94,7 +94,21 @@ Value getpeerinfo(const Array& params, bool fHelp)
             "    \"inbound\": true|false,     (boolean) Inbound (true) or Outbound (false)\n"
             "    \"startingheight\": n,       (numeric) The starting height (block) of the peer\n"
             "    \"banscore\": n,              (numeric) The ban score (stats.nMisbehavior)\n"
+            "    \"syncheight\": n,            (numeric) The best header height known to be available from the peer\n"
+            "    \"inflight\": n,              (numeric) The number of blocks being downloaded from the peer\n"
             "    \"syncnode\" : true|false     (booleamn) if sync node\n"
+            "    \"bytessent_per_msg\": {        (json object) Bytes sent to the peer by message command\n"
+            "      \"cmd\": n,                    (numeric) Bytes of \"cmd\" messages, including headers\n"
+            "      ...\n"
+            "    },\n"
+            "    \"bytesrecv_per_msg\": {        (json object) Bytes received from the peer by message command\n"
+            "      \"cmd\": n,\n"
+            "      ...\n"
+            "    },\n"
+            "    \"handleusec_per_msg\": {       (json object) Microseconds spent handling the peer's messages, by command\n"
+            "      \"cmd\": n,\n"
+            "      ...\n"
+            "    }\n"
             "  }\n"
             "  ,...\n"
             "}\n"
@@ -134,9 +148,24 @@ Value getpeerinfo(const Array& params, bool fHelp)
         obj.push_back(Pair("startingheight", stats.nStartingHeight));
         if (fStateStats) {
             obj.push_back(Pair("banscore", statestats.nMisbehavior));
+            obj.push_back(Pair("syncheight", statestats.nSyncHeight));
+            obj.push_back(Pair("inflight", statestats.nBlocksInFlight));
         }
         obj.push_back(Pair("syncnode", stats.fSyncNode));
 
+        Object sendPerMsg, recvPerMsg, handlePerMsg;
+        BOOST_FOREACH(const PAIRTYPE(string, CMessageStats)& item, stats.mapMsgStats) {
+            if (item.second.nMsgsSent)
+                sendPerMsg.push_back(Pair(item.first, item.second.nBytesSent));
+            if (item.second.nMsgsRecv) {
+                recvPerMsg.push_back(Pair(item.first, item.second.nBytesRecv));
+                handlePerMsg.push_back(Pair(item.first, item.second.nHandleUsec));
+            }
+        }
+        obj.push_back(Pair("bytessent_per_msg", sendPerMsg));
+        obj.push_back(Pair("bytesrecv_per_msg", recvPerMsg));
+        obj.push_back(Pair("handleusec_per_msg", handlePerMsg));
+
         ret.push_back(obj);
     }
 
@@ -367,7 +396,10 @@ Value getnetworkinfo(const Array& params, bool fHelp)
     obj.push_back(Pair("version",       (int)CLIENT_VERSION));
     obj.push_back(Pair("protocolversion",(int)PROTOCOL_VERSION));
     obj.push_back(Pair("timeoffset",    GetTimeOffset()));
-    obj.push_back(Pair("connections",   (int)vNodes.size()));
+    {
+        LOCK(cs_vNodes);
+        obj.push_back(Pair("connections",   (int)vNodes.size()));
+    }
     obj.push_back(Pair("proxy",         (proxy.first.IsValid() ? proxy.first.ToStringIPPort() : string())));
     obj.push_back(Pair("relayfee",      ValueFromAmount(CTransaction::nMinRelayTxFee)));
     Array localAddresses;
@@ -551,3 +583,68 @@ Value makekeypair(const Array& params, bool fHelp)
     result.push_back(Pair("PrivateKey", CCarboncoinSecret(key).ToString()));
     return result;
 }
+
+Value getnetstats(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() > 0)
+        throw runtime_error(
+            "getnetstats\n"
+            "\nReturns network traffic and message handling time since startup, by message command.\n"
+            "Messages with unknown commands are counted under \"*other*\".\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"totalbytesrecv\": n,      (numeric) Total bytes received\n"
+            "  \"totalbytessent\": n,      (numeric) Total bytes sent\n"
+            "  \"commands\": {\n"
+            "    \"cmd\": {\n"
+            "      \"msgssent\": n,        (numeric) Messages sent\n"
+            "      \"bytessent\": n,       (numeric) Bytes sent, including message headers\n"
+            "      \"msgsrecv\": n,        (numeric) Messages received\n"
+            "      \"bytesrecv\": n,       (numeric) Bytes received, including message headers\n"
+            "      \"handleusec\": n,      (numeric) Microseconds spent handling received messages\n"
+            "      \"handletime\": {       (json object) Number of messages by handling time\n"
+            "        \"<10us\": n,\n"
+            "        \"<100us\": n,\n"
+            "        \"<1ms\": n,\n"
+            "        \"<10ms\": n,\n"
+            "        \"<100ms\": n,\n"
+            "        \"<1s\": n,\n"
+            "        \">=1s\": n\n"
+            "      }\n"
+            "    },\n"
+            "    ...\n"
+            "  }\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("getnetstats", "")
+            + HelpExampleRpc("getnetstats", "")
+       );
+
+    static const char* ppszBucketNames[MESSAGE_TIME_BUCKETS] =
+        { "<10us", "<100us", "<1ms", "<10ms", "<100ms", "<1s", ">=1s" };
+
+    mapMsgCmdStats mapStats;
+    CNode::GetTotalMessageStats(mapStats);
+
+    Object commands;
+    BOOST_FOREACH(const PAIRTYPE(string, CMessageStats)& item, mapStats) {
+        const CMessageStats& stats = item.second;
+        Object cmd;
+        cmd.push_back(Pair("msgssent", stats.nMsgsSent));
+        cmd.push_back(Pair("bytessent", stats.nBytesSent));
+        cmd.push_back(Pair("msgsrecv", stats.nMsgsRecv));
+        cmd.push_back(Pair("bytesrecv", stats.nBytesRecv));
+        cmd.push_back(Pair("handleusec", stats.nHandleUsec));
+        Object handletime;
+        for (int i = 0; i < MESSAGE_TIME_BUCKETS; i++)
+            handletime.push_back(Pair(ppszBucketNames[i], stats.vHandleBuckets[i]));
+        cmd.push_back(Pair("handletime", handletime));
+        commands.push_back(Pair(item.first, cmd));
+    }
+
+    Object obj;
+    obj.push_back(Pair("totalbytesrecv", CNode::GetTotalBytesRecv()));
+    obj.push_back(Pair("totalbytessent", CNode::GetTotalBytesSent()));
+    obj.push_back(Pair("commands", commands));
+    return obj;
+}
@@ -54,7 +54,8 @@ static string rfc1123Time()
     return DateTimeStrFormat("%a, %d %b %Y %H:%M:%S +0000", GetTime());
 }
 
-string HTTPReply(int nStatus, const string& strMsg, bool keepalive)
+string HTTPReply(int nStatus, const string& strMsg, bool keepalive,
+                 const char *contentType)
 {
     if (nStatus == HTTP_UNAUTHORIZED)
         return strprintf("HTTP/1.0 401 Authorization Required\r\n"
@@ -85,7 +86,7 @@ string HTTPReply(int nStatus, const string& strMsg, bool keepalive)
             "Date: %s\r\n"
             "Connection: %s\r\n"
             "Content-Length: %u\r\n"
-            "Content-Type: application/json\r\n"
+            "Content-Type: %s\r\n"
             "Server: carboncoin-json-rpc/%s\r\n"
             "\r\n"
             "%s",
@@ -94,10 +95,29 @@ string HTTPReply(int nStatus, const string& strMsg, bool keepalive)
         rfc1123Time(),
         keepalive ? "keep-alive" : "close",
         strMsg.size(),
+        contentType,
         FormatFullVersion(),
         strMsg);
 }
 
+// Header of a reply whose length isn't known up front: its body is sent in
+// chunks, or for HTTP/1.0 clients ends when the connection is closed
+string HTTPReplyHeaderStreamed(bool fChunked, bool keepalive)
+{
+    return strprintf(
+            "HTTP/1.1 200 OK\r\n"
+            "Date: %s\r\n"
+            "Connection: %s\r\n"
+            "%s"
+            "Content-Type: application/json\r\n"
+            "Server: carboncoin-json-rpc/%s\r\n"
+            "\r\n",
+        rfc1123Time(),
+        keepalive ? "keep-alive" : "close",
+        fChunked ? "Transfer-Encoding: chunked\r\n" : "",
+        FormatFullVersion());
+}
+
 bool ReadHTTPRequestLine(std::basic_istream<char>& stream, int &proto,
                          string& http_method, string& http_uri)
 {
@@ -174,6 +194,33 @@ int ReadHTTPHeaders(std::basic_istream<char>& stream, map<string, string>& mapHe
 }
 
 
+// Reads a body sent with chunked transfer encoding
+static bool ReadHTTPChunkedBody(std::basic_istream<char>& stream, string& strMessageRet)
+{
+    while (true)
+    {
+        // Chunk size in hex, any chunk extensions after it are ignored
+        string str;
+        if (!std::getline(stream, str))
+            return false;
+        unsigned long nChunk = strtoul(str.c_str(), NULL, 16);
+        if (nChunk == 0)
+            break;
+        if (nChunk > MAX_SIZE - strMessageRet.size())
+            return false;
+        size_t nOffset = strMessageRet.size();
+        strMessageRet.resize(nOffset + nChunk);
+        if (!stream.read(&strMessageRet[nOffset], nChunk))
+            return false;
+        std::getline(stream, str);
+    }
+
+    // Trailer, up to an empty line
+    map<string, string> mapTrailers;
+    ReadHTTPHeaders(stream, mapTrailers);
+    return true;
+}
+
 int ReadHTTPMessage(std::basic_istream<char>& stream, map<string,
                     string>& mapHeadersRet, string& strMessageRet,
                     int nProto)
@@ -187,7 +234,13 @@ int ReadHTTPMessage(std::basic_istream<char>& stream, map<string,
         return HTTP_INTERNAL_SERVER_ERROR;
 
     // Read message
-    if (nLen > 0)
+    map<string, string>::const_iterator it = mapHeadersRet.find("transfer-encoding");
+    if (it != mapHeadersRet.end() && boost::iequals(it->second, "chunked"))
+    {
+        if (!ReadHTTPChunkedBody(stream, strMessageRet))
+            return HTTP_INTERNAL_SERVER_ERROR;
+    }
+    else if (nLen > 0)
     {
         vector<char> vch(nLen);
         stream.read(&vch[0], nLen);
@@ -6,6 +6,7 @@
 #include "base58.h"
 #include "core.h"
 #include "init.h"
+#include "jsonwriter.h"
 #include "keystore.h"
 #include "main.h"
 #include "net.h"
@@ -51,6 +52,46 @@ void ScriptPubKeyToJSON(const CScript& scriptPubKey, Object& out, bool fIncludeH
     out.push_back(Pair("addresses", a));
 }
 
+void ScriptPubKeyToJSON(const CScript& scriptPubKey, CJSONWriter& writer, bool fIncludeHex)
+{
+    txnouttype type;
+    vector<CTxDestination> addresses;
+    int nRequired;
+
+    writer.Pair("asm", scriptPubKey.ToString());
+    if (fIncludeHex)
+        writer.Pair("hex", HexStr(scriptPubKey.begin(), scriptPubKey.end()));
+
+    if (!ExtractDestinations(scriptPubKey, type, addresses, nRequired))
+    {
+        writer.Pair("type", string(GetTxnOutputType(type)));
+        return;
+    }
+
+    writer.Pair("reqSigs", nRequired);
+    writer.Pair("type", string(GetTxnOutputType(type)));
+
+    writer.Key("addresses");
+    writer.BeginArray();
+    BOOST_FOREACH(const CTxDestination& addr, addresses)
+        writer.String(CCarboncoinAddress(addr).ToString());
+    writer.EndArray();
+}
+
+// Confirmations and time of the block with hashBlock, false if the block
+// isn't known. A block off the active chain has no confirmations.
+static bool GetTxBlockInfo(const uint256& hashBlock, int& nConfirmations, int64_t& nBlockTime)
+{
+    LOCK(cs_main);
+    map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
+    if (mi == mapBlockIndex.end() || !(*mi).second)
+        return false;
+    CBlockIndex* pindex = (*mi).second;
+    nConfirmations = chainActive.Contains(pindex) ? 1 + chainActive.Height() - pindex->nHeight : 0;
+    nBlockTime = pindex->nTime;
+    return true;
+}
+
 void TxToJSON(const CTransaction& tx, const uint256 hashBlock, Object& entry)
 {
     entry.push_back(Pair("txid", tx.GetHash().GetHex()));
@@ -92,18 +133,75 @@ void TxToJSON(const CTransaction& tx, const uint256 hashBlock, Object& entry)
     if (hashBlock != 0)
     {
         entry.push_back(Pair("blockhash", hashBlock.GetHex()));
-        map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(hashBlock);
-        if (mi != mapBlockIndex.end() && (*mi).second)
+        int nConfirmations;
+        int64_t nBlockTime;
+        if (GetTxBlockInfo(hashBlock, nConfirmations, nBlockTime))
         {
-            CBlockIndex* pindex = (*mi).second;
-            if (chainActive.Contains(pindex))
+            entry.push_back(Pair("confirmations", nConfirmations));
+            if (nConfirmations > 0)
             {
-                entry.push_back(Pair("confirmations", 1 + chainActive.Height() - pindex->nHeight));
-                entry.push_back(Pair("time", (int64_t)pindex->nTime));
-                entry.push_back(Pair("blocktime", (int64_t)pindex->nTime));
+                entry.push_back(Pair("time", nBlockTime));
+                entry.push_back(Pair("blocktime", nBlockTime));
+            }
+        }
+    }
+}
+
+void TxToJSON(const CTransaction& tx, const uint256 hashBlock, CJSONWriter& writer)
+{
+    writer.Pair("txid", tx.GetHash().GetHex());
+    writer.Pair("version", tx.nVersion);
+    writer.Pair("locktime", (int64_t)tx.nLockTime);
+    writer.Key("vin");
+    writer.BeginArray();
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    {
+        writer.BeginObject();
+        if (tx.IsCoinBase())
+            writer.Pair("coinbase", HexStr(txin.scriptSig.begin(), txin.scriptSig.end()));
+        else
+        {
+            writer.Pair("txid", txin.prevout.hash.GetHex());
+            writer.Pair("vout", (int64_t)txin.prevout.n);
+            writer.Key("scriptSig");
+            writer.BeginObject();
+            writer.Pair("asm", txin.scriptSig.ToString());
+            writer.Pair("hex", HexStr(txin.scriptSig.begin(), txin.scriptSig.end()));
+            writer.EndObject();
+        }
+        writer.Pair("sequence", (int64_t)txin.nSequence);
+        writer.EndObject();
+    }
+    writer.EndArray();
+    writer.Key("vout");
+    writer.BeginArray();
+    for (unsigned int i = 0; i < tx.vout.size(); i++)
+    {
+        const CTxOut& txout = tx.vout[i];
+        writer.BeginObject();
+        writer.Pair("value", ValueFromAmount(txout.nValue));
+        writer.Pair("n", (int64_t)i);
+        writer.Key("scriptPubKey");
+        writer.BeginObject();
+        ScriptPubKeyToJSON(txout.scriptPubKey, writer, true);
+        writer.EndObject();
+        writer.EndObject();
+    }
+    writer.EndArray();
+
+    if (hashBlock != 0)
+    {
+        writer.Pair("blockhash", hashBlock.GetHex());
+        int nConfirmations;
+        int64_t nBlockTime;
+        if (GetTxBlockInfo(hashBlock, nConfirmations, nBlockTime))
+        {
+            writer.Pair("confirmations", nConfirmations);
+            if (nConfirmations > 0)
+            {
+                writer.Pair("time", nBlockTime);
+                writer.Pair("blocktime", nBlockTime);
             }
-            else
-                entry.push_back(Pair("confirmations", 0));
         }
     }
 }
@@ -195,6 +293,37 @@ Value getrawtransaction(const Array& params, bool fHelp)
     return result;
 }
 
+void getrawtransaction(const Array& params, CJSONWriter& writer)
+{
+    if (params.size() < 1 || params.size() > 2)
+        getrawtransaction(params, true);
+
+    uint256 hash = ParseHashV(params[0], "parameter 1");
+
+    bool fVerbose = false;
+    if (params.size() > 1)
+        fVerbose = (params[1].get_int() != 0);
+
+    CTransaction tx;
+    uint256 hashBlock = 0;
+    if (!GetTransaction(hash, tx, hashBlock, true))
+        throw JSONRPCError(RPC_INVALID_ADDRESS_OR_KEY, "No information available about transaction");
+
+    CDataStream ssTx(SER_NETWORK, PROTOCOL_VERSION);
+    ssTx << tx;
+
+    if (!fVerbose)
+    {
+        writer.String(HexStr(ssTx.begin(), ssTx.end()));
+        return;
+    }
+
+    writer.BeginObject();
+    writer.Pair("hex", HexStr(ssTx.begin(), ssTx.end()));
+    TxToJSON(tx, hashBlock, writer);
+    writer.EndObject();
+}
+
 #ifdef ENABLE_WALLET
 Value listunspent(const Array& params, bool fHelp)
 {
@@ -7,6 +7,8 @@
 
 #include "base58.h"
 #include "init.h"
+#include "jsonreader.h"
+#include "jsonwriter.h"
 #include "main.h"
 #include "ui_interface.h"
 #include "util.h"
@@ -14,15 +16,17 @@
 #include "wallet.h"
 #endif
 
+#include <deque>
+#include <list>
+
 #include <boost/algorithm/string.hpp>
 #include <boost/asio.hpp>
 #include <boost/asio/ssl.hpp>
 #include <boost/bind.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/foreach.hpp>
-#include <boost/iostreams/concepts.hpp>
-#include <boost/iostreams/stream.hpp>
 #include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
 #include "json/json_spirit_writer_template.h"
 
 using namespace std;
@@ -32,6 +36,8 @@ using namespace json_spirit;
 
 static std::string strRPCUserColonPass;
 
+class CRPCWorkQueue;
+
 // These are created by StartRPCThreads, destroyed in StopRPCThreads
 static asio::io_service* rpc_io_service = NULL;
 static map<string, boost::shared_ptr<deadline_timer> > deadlineTimers;
@@ -39,6 +45,9 @@ static ssl::context* rpc_ssl_context = NULL;
 static boost::thread_group* rpc_worker_group = NULL;
 static boost::asio::io_service::work *rpc_dummy_work = NULL;
 static std::vector< boost::shared_ptr<ip::tcp::acceptor> > rpc_acceptors;
+static CRPCWorkQueue* rpc_work_queue = NULL;
+static int nRPCBatchParallel = DEFAULT_RPC_BATCH_PARALLEL;
+static bool fRESTEnabled = false;
 
 void RPCTypeCheck(const Array& params,
                   const list<Value_type>& typesExpected,
@@ -221,104 +230,106 @@ Value stop(const Array& params, bool fHelp)
 
 
 static const CRPCCommand vRPCCommands[] =
-{ //  name                      actor (function)         okSafeMode threadSafe reqWallet
-  //  ------------------------  -----------------------  ---------- ---------- ---------
+{ //  name                      actor (function)         okSafeMode locks                             reqWallet  streamActor
+  //  ------------------------  -----------------------  ---------- --------------------------------- ---------  ------------------
     /* Overall control/query calls */
-    { "getinfo",                &getinfo,                true,      false,      false }, /* uses wallet if enabled */
-    { "help",                   &help,                   true,      true,       false },
-    { "stop",                   &stop,                   true,      true,       false },
+    { "getinfo",                &getinfo,                true,      RPC_LOCK_NONE,                    false }, /* uses wallet if enabled */
+    { "help",                   &help,                   true,      RPC_LOCK_NONE,                    false },
+    { "stop",                   &stop,                   true,      RPC_LOCK_NONE,                    false },
 
     /* P2P networking */
-    { "getnetworkinfo",         &getnetworkinfo,         true,      false,      false },
-    { "addnode",                &addnode,                true,      true,       false },
-    { "getaddednodeinfo",       &getaddednodeinfo,       true,      true,       false },
-    { "getconnectioncount",     &getconnectioncount,     true,      false,      false },
-    { "getnettotals",           &getnettotals,           true,      true,       false },
-    { "getpeerinfo",            &getpeerinfo,            true,      false,      false },
-    { "ping",                   &ping,                   true,      false,      false },
+    { "getnetworkinfo",         &getnetworkinfo,         true,      RPC_LOCK_NONE,                    false },
+    { "addnode",                &addnode,                true,      RPC_LOCK_NONE,                    false },
+    { "getaddednodeinfo",       &getaddednodeinfo,       true,      RPC_LOCK_NONE,                    false },
+    { "getconnectioncount",     &getconnectioncount,     true,      RPC_LOCK_NONE,                    false },
+    { "getnetstats",            &getnetstats,            true,      RPC_LOCK_NONE,                    false },
+    { "getnettotals",           &getnettotals,           true,      RPC_LOCK_NONE,                    false },
+    { "getpeerinfo",            &getpeerinfo,            true,      RPC_LOCK_NONE,                    false },
+    { "ping",                   &ping,                   true,      RPC_LOCK_NONE,                    false },
 
     /* Block chain and UTXO */
-    { "getblockchaininfo",      &getblockchaininfo,      true,      false,      false },
-    { "getbestblockhash",       &getbestblockhash,       true,      false,      false },
-    { "getblockcount",          &getblockcount,          true,      false,      false },
-    { "getblock",               &getblock,               false,     false,      false },
-    { "getblockhash",           &getblockhash,           false,     false,      false },
-    { "getdifficulty",          &getdifficulty,          true,      false,      false },
-    { "getrawmempool",          &getrawmempool,          true,      false,      false },
-    { "gettxout",               &gettxout,               true,      false,      false },
-    { "gettxoutsetinfo",        &gettxoutsetinfo,        true,      false,      false },
-    { "verifychain",            &verifychain,            true,      false,      false },
-    { "sendalert",              &sendalert,              true,      false,      false },
-    { "getcheckpoint",          &getcheckpoint,          true,      false,      false },
-    { "sendcheckpoint",         &sendcheckpoint,         true,      false,      false },
-    { "enforcecheckpoint",      &enforcecheckpoint,      true,      false,      false },
-    { "makekeypair",            &makekeypair,            true,      false,      false },
+    { "getblockchaininfo",      &getblockchaininfo,      true,      RPC_LOCK_NONE,                    false },
+    { "getbestblockhash",       &getbestblockhash,       true,      RPC_LOCK_NONE,                    false },
+    { "getblockcount",          &getblockcount,          true,      RPC_LOCK_NONE,                    false },
+    { "getblock",               &getblock,               false,     RPC_LOCK_NONE,                    false, &getblock },
+    { "getblockfilter",         &getblockfilter,         true,      RPC_LOCK_NONE,                    false },
+    { "getblockhash",           &getblockhash,           false,     RPC_LOCK_NONE,                    false },
+    { "getdifficulty",          &getdifficulty,          true,      RPC_LOCK_NONE,                    false },
+    { "getrawmempool",          &getrawmempool,          true,      RPC_LOCK_NONE,                    false, &getrawmempool },
+    { "gettxout",               &gettxout,               true,      RPC_LOCK_MAIN,                    false },
+    { "gettxoutsetinfo",        &gettxoutsetinfo,        true,      RPC_LOCK_NONE,                    false },
+    { "verifychain",            &verifychain,            true,      RPC_LOCK_MAIN,                    false },
+    { "sendalert",              &sendalert,              true,      RPC_LOCK_MAIN,                    false },
+    { "getcheckpoint",          &getcheckpoint,          true,      RPC_LOCK_MAIN,                    false },
+    { "sendcheckpoint",         &sendcheckpoint,         true,      RPC_LOCK_MAIN,                    false },
+    { "enforcecheckpoint",      &enforcecheckpoint,      true,      RPC_LOCK_MAIN,                    false },
+    { "makekeypair",            &makekeypair,            true,      RPC_LOCK_NONE,                    false },
 
     /* Mining */
-    { "getblocktemplate",       &getblocktemplate,       true,      false,      false },
-    { "getmininginfo",          &getmininginfo,          true,      false,      false },
-    { "getnetworkhashps",       &getnetworkhashps,       true,      false,      false },
-    { "submitblock",            &submitblock,            false,     false,      false },
+    { "getblocktemplate",       &getblocktemplate,       true,      RPC_LOCK_MAIN,                    false },
+    { "getmininginfo",          &getmininginfo,          true,      RPC_LOCK_NONE,                    false },
+    { "getnetworkhashps",       &getnetworkhashps,       true,      RPC_LOCK_NONE,                    false },
+    { "submitblock",            &submitblock,            false,     RPC_LOCK_MAIN,                    false },
 
     /* Raw transactions */
-    { "createrawtransaction",   &createrawtransaction,   false,     false,      false },
-    { "decoderawtransaction",   &decoderawtransaction,   false,     false,      false },
-    { "decodescript",           &decodescript,           false,     false,      false },
-    { "getrawtransaction",      &getrawtransaction,      false,     false,      false },
-    { "sendrawtransaction",     &sendrawtransaction,     false,     false,      false },
-    { "signrawtransaction",     &signrawtransaction,     false,     false,      false }, /* uses wallet if enabled */
+    { "createrawtransaction",   &createrawtransaction,   false,     RPC_LOCK_NONE,                    false },
+    { "decoderawtransaction",   &decoderawtransaction,   false,     RPC_LOCK_NONE,                    false },
+    { "decodescript",           &decodescript,           false,     RPC_LOCK_NONE,                    false },
+    { "getrawtransaction",      &getrawtransaction,      false,     RPC_LOCK_NONE,                    false, &getrawtransaction },
+    { "sendrawtransaction",     &sendrawtransaction,     false,     RPC_LOCK_MAIN,                    false },
+    { "signrawtransaction",     &signrawtransaction,     false,     RPC_LOCK_MAIN | RPC_LOCK_WALLET,  false }, /* uses wallet if enabled */
 
     /* Utility functions */
-    { "createmultisig",         &createmultisig,         true,      true ,      false },
-    { "validateaddress",        &validateaddress,        true,      false,      false }, /* uses wallet if enabled */
-    { "verifymessage",          &verifymessage,          false,     false,      false },
+    { "createmultisig",         &createmultisig,         true,      RPC_LOCK_NONE,                    false },
+    { "validateaddress",        &validateaddress,        true,      RPC_LOCK_WALLET,                  false }, /* uses wallet if enabled */
+    { "verifymessage",          &verifymessage,          false,     RPC_LOCK_NONE,                    false },
 
 #ifdef ENABLE_WALLET
     /* Wallet */
-    { "addmultisigaddress",     &addmultisigaddress,     false,     false,      true },
-    { "backupwallet",           &backupwallet,           true,      false,      true },
-    { "dumpprivkey",            &dumpprivkey,            true,      false,      true },
-    { "dumpwallet",             &dumpwallet,             true,      false,      true },
-    { "encryptwallet",          &encryptwallet,          false,     false,      true },
-    { "getaccountaddress",      &getaccountaddress,      true,      false,      true },
-    { "getaccount",             &getaccount,             false,     false,      true },
-    { "getaddressesbyaccount",  &getaddressesbyaccount,  true,      false,      true },
-    { "getbalance",             &getbalance,             false,     false,      true },
-    { "getnewaddress",          &getnewaddress,          true,      false,      true },
-    { "getrawchangeaddress",    &getrawchangeaddress,    true,      false,      true },
-    { "getreceivedbyaccount",   &getreceivedbyaccount,   false,     false,      true },
-    { "getreceivedbyaddress",   &getreceivedbyaddress,   false,     false,      true },
-    { "gettransaction",         &gettransaction,         false,     false,      true },
-    { "getunconfirmedbalance",  &getunconfirmedbalance,  false,     false,      true },
-    { "getwalletinfo",          &getwalletinfo,          true,      false,      true },
-    { "importprivkey",          &importprivkey,          false,     false,      true },
-    { "importwallet",           &importwallet,           false,     false,      true },
-    { "keypoolrefill",          &keypoolrefill,          true,      false,      true },
-    { "listaccounts",           &listaccounts,           false,     false,      true },
-    { "listaddressgroupings",   &listaddressgroupings,   false,     false,      true },
-    { "listlockunspent",        &listlockunspent,        false,     false,      true },
-    { "listreceivedbyaccount",  &listreceivedbyaccount,  false,     false,      true },
-    { "listreceivedbyaddress",  &listreceivedbyaddress,  false,     false,      true },
-    { "listsinceblock",         &listsinceblock,         false,     false,      true },
-    { "listtransactions",       &listtransactions,       false,     false,      true },
-    { "listunspent",            &listunspent,            false,     false,      true },
-    { "lockunspent",            &lockunspent,            false,     false,      true },
-    { "move",                   &movecmd,                false,     false,      true },
-    { "sendfrom",               &sendfrom,               false,     false,      true },
-    { "sendmany",               &sendmany,               false,     false,      true },
-    { "sendtoaddress",          &sendtoaddress,          false,     false,      true },
-    { "setaccount",             &setaccount,             true,      false,      true },
-    { "settxfee",               &settxfee,               false,     false,      true },
-    { "signmessage",            &signmessage,            false,     false,      true },
-    { "walletlock",             &walletlock,             true,      false,      true },
-    { "walletpassphrasechange", &walletpassphrasechange, false,     false,      true },
-    { "walletpassphrase",       &walletpassphrase,       true,      false,      true },
+    { "addmultisigaddress",     &addmultisigaddress,     false,     RPC_LOCK_WALLET,                  true  },
+    { "backupwallet",           &backupwallet,           true,      RPC_LOCK_WALLET,                  true  },
+    { "dumpprivkey",            &dumpprivkey,            true,      RPC_LOCK_WALLET,                  true  },
+    { "dumpwallet",             &dumpwallet,             true,      RPC_LOCK_MAIN | RPC_LOCK_WALLET,  true  },
+    { "encryptwallet",          &encryptwallet,          false,     RPC_LOCK_MAIN | RPC_LOCK_WALLET,  true  },
+    { "getaccountaddress",      &getaccountaddress,      true,      RPC_LOCK_WALLET,                  true  },
+    { "getaccount",             &getaccount,             false,     RPC_LOCK_WALLET,                  true  },
+    { "getaddressesbyaccount",  &getaddressesbyaccount,  true,      RPC_LOCK_WALLET,                  true  },
+    { "getbalance",             &getbalance,             false,     RPC_LOCK_MAIN | RPC_LOCK_WALLET,  true  },
+    { "getnewaddress",          &getnewaddress,          true,      RPC_LOCK_WALLET,                  true  },
+    { "getrawchangeaddress",    &getrawchangeaddress,    true,      RPC_LOCK_WALLET,                  true  },
+    { "getreceivedbyaccount",   &getreceivedbyaccount,   false,     RPC_LOCK_MAIN | RPC_LOCK_WALLET,  true  },
+    { "getreceivedbyaddress",   &getreceivedbyaddress,   false,     RPC_LOCK_MAIN | RPC_LOCK_WALLET,  true  },
+    { "gettransaction",         &gettransaction,         false,     RPC_LOCK_MAIN | RPC_LOCK_WALLET,  true  },
+    { "getunconfirmedbalance",  &getunconfirmedbalance,  false,     RPC_LOCK_MAIN | RPC_LOCK_WALLET,  true  },
+    { "getwalletinfo",          &getwalletinfo,          true,      RPC_LOCK_MAIN | RPC_LOCK_WALLET,  true  },
+    { "importprivkey",          &importprivkey,          false,     RPC_LOCK_MAIN | RPC_LOCK_WALLET,  true  },
+    { "importwallet",           &importwallet,           false,     RPC_LOCK_MAIN | RPC_LOCK_WALLET,  true  },
+    { "keypoolrefill",          &keypoolrefill,          true,      RPC_LOCK_WALLET,                  true  },
+    { "listaccounts",           &listaccounts,           false,     RPC_LOCK_MAIN | RPC_LOCK_WALLET,  true  },
+    { "listaddressgroupings",   &listaddressgroupings,   false,     RPC_LOCK_MAIN | RPC_LOCK_WALLET,  true  },
+    { "listlockunspent",        &listlockunspent,        false,     RPC_LOCK_WALLET,                  true  },
+    { "listreceivedbyaccount",  &listreceivedbyaccount,  false,     RPC_LOCK_MAIN | RPC_LOCK_WALLET,  true  },
+    { "listreceivedbyaddress",  &listreceivedbyaddress,  false,     RPC_LOCK_MAIN | RPC_LOCK_WALLET,  true  },
+    { "listsinceblock",         &listsinceblock,         false,     RPC_LOCK_MAIN | RPC_LOCK_WALLET,  true  },
+    { "listtransactions",       &listtransactions,       false,     RPC_LOCK_MAIN | RPC_LOCK_WALLET,  true  },
+    { "listunspent",            &listunspent,            false,     RPC_LOCK_MAIN | RPC_LOCK_WALLET,  true  },
+    { "lockunspent",            &lockunspent,            false,     RPC_LOCK_WALLET,                  true  },
+    { "move",                   &movecmd,                false,     RPC_LOCK_WALLET,                  true  },
+    { "sendfrom",               &sendfrom,               false,     RPC_LOCK_MAIN | RPC_LOCK_WALLET,  true  },
+    { "sendmany",               &sendmany,               false,     RPC_LOCK_MAIN | RPC_LOCK_WALLET,  true  },
+    { "sendtoaddress",          &sendtoaddress,          false,     RPC_LOCK_MAIN | RPC_LOCK_WALLET,  true  },
+    { "setaccount",             &setaccount,             true,      RPC_LOCK_WALLET,                  true  },
+    { "settxfee",               &settxfee,               false,     RPC_LOCK_WALLET,                  true  },
+    { "signmessage",            &signmessage,            false,     RPC_LOCK_WALLET,                  true  },
+    { "walletlock",             &walletlock,             true,      RPC_LOCK_WALLET,                  true  },
+    { "walletpassphrasechange", &walletpassphrasechange, false,     RPC_LOCK_WALLET,                  true  },
+    { "walletpassphrase",       &walletpassphrase,       true,      RPC_LOCK_WALLET,                  true  },
 
     /* Wallet-enabled mining */
-    { "getgenerate",            &getgenerate,            true,      false,      false },
-    { "gethashespersec",        &gethashespersec,        true,      false,      false },
-    { "getwork",                &getwork,                true,      false,      true  },
-    { "setgenerate",            &setgenerate,            true,      true,       false },
+    { "getgenerate",            &getgenerate,            true,      RPC_LOCK_NONE,                    false },
+    { "gethashespersec",        &gethashespersec,        true,      RPC_LOCK_NONE,                    false },
+    { "getwork",                &getwork,                true,      RPC_LOCK_MAIN | RPC_LOCK_WALLET,  true  },
+    { "setgenerate",            &setgenerate,            true,      RPC_LOCK_NONE,                    false },
 #endif // ENABLE_WALLET
 };
 
@@ -330,6 +341,7 @@ CRPCTable::CRPCTable()
         const CRPCCommand *pcmd;
 
         pcmd = &vRPCCommands[vcidx];
+        assert(!pcmd->streamActor || pcmd->nLocks == RPC_LOCK_NONE);
         mapCommands[pcmd->name] = pcmd;
     }
 }
@@ -353,15 +365,15 @@ bool HTTPAuthorized(map<string, string>& mapHeaders)
     return TimingResistantEqual(strUserPass, strRPCUserColonPass);
 }
 
-void ErrorReply(std::ostream& stream, const Object& objError, const Value& id)
+string ErrorReply(const Object& objError, const Value& id)
 {
-    // Send error reply from json-rpc error object
+    // HTTP error reply from json-rpc error object
     int nStatus = HTTP_INTERNAL_SERVER_ERROR;
     int code = find_value(objError, "code").get_int();
     if (code == RPC_INVALID_REQUEST) nStatus = HTTP_BAD_REQUEST;
     else if (code == RPC_METHOD_NOT_FOUND) nStatus = HTTP_NOT_FOUND;
     string strReply = JSONRPCReply(Value::null, objError, id);
-    stream << HTTPReply(nStatus, strReply, false) << std::flush;
+    return HTTPReply(nStatus, strReply, false);
 }
 
 bool ClientAllowed(const boost::asio::ip::address& address)
@@ -387,121 +399,413 @@ bool ClientAllowed(const boost::asio::ip::address& address)
     return false;
 }
 
-class AcceptedConnection
+//
+// RPC HTTP server
+//
+// Sockets are read and written asynchronously by a single I/O thread, which
+// also parses the HTTP requests. Their JSON bodies are parsed and executed by
+// the -rpcthreads worker threads, fed from a CRPCWorkQueue. A connection has
+// at most one request outstanding and isn't read from again until it has been
+// answered, so an idle keep-alive connection costs a socket and nothing more.
+//
+
+/** Requests waiting for an RPC worker thread. At most nMaxDepth of them are
+ * queued, and at most nMaxPerClient per client address are queued or being
+ * executed; the rest wait their turn in order of arrival. The connections
+ * they came in on aren't read from meanwhile, which pushes back on clients
+ * sending faster than their requests are executed.
+ */
+class CRPCWorkQueue
 {
+private:
+    class CItem
+    {
+    public:
+        std::string strClient;
+        boost::function<void()> func;
+    };
+
+    boost::mutex cs;
+    boost::condition_variable cond;
+    std::deque<CItem> queue;
+    std::list<CItem> listWaiting;
+    // Requests queued or executing, per client address
+    std::map<std::string, int> mapInFlight;
+    size_t nMaxDepth;
+    int nMaxPerClient;
+    bool fRunning;
+
+    // Move waiting requests to the queue while there is room; cs must be held
+    void Promote()
+    {
+        std::list<CItem>::iterator it = listWaiting.begin();
+        while (it != listWaiting.end() && queue.size() < nMaxDepth)
+        {
+            int& nInFlight = mapInFlight[it->strClient];
+            if (nInFlight >= nMaxPerClient)
+            {
+                ++it;
+                continue;
+            }
+            nInFlight++;
+            queue.push_back(*it);
+            listWaiting.erase(it++);
+            cond.notify_one();
+        }
+    }
+
 public:
-    virtual ~AcceptedConnection() {}
+    CRPCWorkQueue(size_t nMaxDepthIn, int nMaxPerClientIn) : nMaxDepth(nMaxDepthIn), nMaxPerClient(nMaxPerClientIn), fRunning(true) {}
+
+    // Returns false if the request has to wait for room in the queue
+    bool Submit(const std::string& strClient, const boost::function<void()>& func)
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        CItem item;
+        item.strClient = strClient;
+        item.func = func;
+        listWaiting.push_back(item);
+        const CItem* pitem = &listWaiting.back();
+        Promote();
+        // Still waiting if it wasn't taken off the back of the list
+        return listWaiting.empty() || &listWaiting.back() != pitem;
+    }
+
+    // Worker thread loop, returns once interrupted
+    void Run()
+    {
+        while (true)
+        {
+            CItem item;
+            {
+                boost::unique_lock<boost::mutex> lock(cs);
+                while (fRunning && queue.empty())
+                    cond.wait(lock);
+                if (!fRunning)
+                    return;
+                item = queue.front();
+                queue.pop_front();
+            }
+            item.func();
+            {
+                boost::unique_lock<boost::mutex> lock(cs);
+                if (--mapInFlight[item.strClient] <= 0)
+                    mapInFlight.erase(item.strClient);
+                Promote();
+            }
+        }
+    }
 
-    virtual std::iostream& stream() = 0;
-    virtual std::string peer_address_to_string() const = 0;
-    virtual void close() = 0;
+    void Interrupt()
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        fRunning = false;
+        cond.notify_all();
+    }
 };
 
-template <typename Protocol>
-class AcceptedConnectionImpl : public AcceptedConnection
+class CRPCConnection
 {
 public:
-    AcceptedConnectionImpl(
-            asio::io_service& io_service,
-            ssl::context &context,
-            bool fUseSSL) :
-        sslStream(io_service, context),
-        _d(sslStream, fUseSSL),
-        _stream(_d)
+    ssl::stream<ip::tcp::socket> sslStream;
+    bool fUseSSL;
+    ip::tcp::endpoint peer;
+    std::string strPeer;
+    asio::streambuf buf;
+    std::string strSend;
+    deadline_timer timer;
+
+    // The request being read
+    int nProto;
+    std::string strMethod;
+    std::string strURI;
+    std::map<std::string, std::string> mapHeaders;
+    unsigned int nContentLength;
+
+    CRPCConnection(asio::io_service& io_service, ssl::context& context, bool fUseSSLIn) :
+        sslStream(io_service, context), fUseSSL(fUseSSLIn), buf(MAX_SIZE), timer(io_service), nProto(0), nContentLength(0) {}
+};
+typedef boost::shared_ptr<CRPCConnection> RPCConnectionRef;
+
+static void RPCRead(RPCConnectionRef conn);
+static void RPCHandleRequest(RPCConnectionRef conn);
+
+template <typename Handler>
+static void RPCAsyncReadUntil(RPCConnectionRef conn, const char* pszDelim, Handler handler)
+{
+    if (conn->fUseSSL)
+        async_read_until(conn->sslStream, conn->buf, pszDelim, handler);
+    else
+        async_read_until(conn->sslStream.next_layer(), conn->buf, pszDelim, handler);
+}
+
+template <typename Handler>
+static void RPCAsyncRead(RPCConnectionRef conn, size_t nBytes, Handler handler)
+{
+    if (conn->fUseSSL)
+        async_read(conn->sslStream, conn->buf, transfer_at_least(nBytes), handler);
+    else
+        async_read(conn->sslStream.next_layer(), conn->buf, transfer_at_least(nBytes), handler);
+}
+
+template <typename Handler>
+static void RPCAsyncWrite(RPCConnectionRef conn, Handler handler)
+{
+    if (conn->fUseSSL)
+        async_write(conn->sslStream, buffer(conn->strSend), handler);
+    else
+        async_write(conn->sslStream.next_layer(), buffer(conn->strSend), handler);
+}
+
+static void RPCClose(RPCConnectionRef conn)
+{
+    boost::system::error_code ec;
+    conn->timer.cancel(ec);
+    conn->sslStream.lowest_layer().close(ec);
+}
+
+static void RPCWriteHandler(RPCConnectionRef conn, bool fKeepAlive, const boost::system::error_code& err)
+{
+    if (err || !fKeepAlive || ShutdownRequested())
+        RPCClose(conn);
+    else
+        RPCRead(conn);
+}
+
+static void RPCWriteReply(RPCConnectionRef conn, const std::string& strReply, bool fKeepAlive)
+{
+    conn->strSend = strReply;
+    RPCAsyncWrite(conn, boost::bind(&RPCWriteHandler, conn, fKeepAlive, asio::placeholders::error));
+}
+
+static void RPCDelayedReply(RPCConnectionRef conn, const std::string& strReply, const boost::system::error_code& err)
+{
+    if (err)
+        RPCClose(conn);
+    else
+        RPCWriteReply(conn, strReply, false);
+}
+
+/** Sends a reply from an RPC worker thread as it is written, so a large
+ * result isn't held in memory whole. The I/O thread writes one piece at a
+ * time and the worker waits for each to go out before handing over the
+ * next. A reply finished before anything was sent goes out in one piece
+ * with a Content-Length; otherwise it is sent with chunked transfer
+ * encoding, or to HTTP/1.0 clients ends with the connection.
+ */
+class CRPCReplyStream
+{
+private:
+    // Shared with the write handler on the I/O thread
+    class CWriteState
+    {
+    public:
+        boost::mutex cs;
+        boost::condition_variable cond;
+        bool fWriting;
+        bool fFailed;
+
+        CWriteState() : fWriting(false), fFailed(false) {}
+    };
+
+    RPCConnectionRef conn;
+    boost::shared_ptr<CWriteState> state;
+    bool fChunked;
+    bool fKeepAlive;
+    bool fStarted;
+
+    static void WriteHandler(boost::shared_ptr<CWriteState> state, const boost::system::error_code& err)
     {
+        boost::unique_lock<boost::mutex> lock(state->cs);
+        state->fWriting = false;
+        if (err)
+            state->fFailed = true;
+        state->cond.notify_all();
     }
 
-    virtual std::iostream& stream()
+    static void StartWrite(RPCConnectionRef conn, boost::shared_ptr<CWriteState> state, const std::string& str)
     {
-        return _stream;
+        conn->strSend = str;
+        RPCAsyncWrite(conn, boost::bind(&WriteHandler, state, asio::placeholders::error));
     }
 
-    virtual std::string peer_address_to_string() const
+    // Waits for the piece being written; false if it failed or we are
+    // shutting down
+    bool WaitForWrite()
     {
-        return peer.address().to_string();
+        boost::unique_lock<boost::mutex> lock(state->cs);
+        while (state->fWriting && !ShutdownRequested())
+            state->cond.timed_wait(lock, posix_time::milliseconds(100));
+        return !state->fWriting && !state->fFailed;
     }
 
-    virtual void close()
+    std::string Chunk(const std::string& str) const
     {
-        _stream.close();
+        if (!fChunked || str.empty())
+            return str;
+        return strprintf("%x\r\n", str.size()) + str + "\r\n";
     }
 
-    typename Protocol::endpoint peer;
-    asio::ssl::stream<typename Protocol::socket> sslStream;
+public:
+    CRPCReplyStream(RPCConnectionRef connIn, int nProto, bool fKeepAliveIn) :
+        conn(connIn), state(new CWriteState()), fChunked(nProto >= 1), fKeepAlive(fKeepAliveIn), fStarted(false) {}
+
+    // CJSONWriter sink; throws if the client is gone
+    void Write(const std::string& str)
+    {
+        if (!WaitForWrite())
+            throw runtime_error("RPC client connection lost");
+        std::string strSend = Chunk(str);
+        if (!fStarted)
+            strSend = HTTPReplyHeaderStreamed(fChunked, fChunked && fKeepAlive) + strSend;
+        fStarted = true;
+        {
+            boost::unique_lock<boost::mutex> lock(state->cs);
+            state->fWriting = true;
+        }
+        rpc_io_service->post(boost::bind(&StartWrite, conn, state, strSend));
+    }
 
-private:
-    SSLIOStreamDevice<Protocol> _d;
-    iostreams::stream< SSLIOStreamDevice<Protocol> > _stream;
+    // Sends the rest of a successful reply
+    void Finish(const std::string& strRest)
+    {
+        if (!fStarted)
+        {
+            rpc_io_service->post(boost::bind(&RPCWriteReply, conn, HTTPReply(HTTP_OK, strRest, fKeepAlive), fKeepAlive));
+            return;
+        }
+        if (!WaitForWrite())
+            throw runtime_error("RPC client connection lost");
+        std::string strSend = Chunk(strRest);
+        if (fChunked)
+            strSend += "0\r\n\r\n";
+        rpc_io_service->post(boost::bind(&RPCWriteReply, conn, strSend, fChunked && fKeepAlive));
+    }
+
+    // Sends an error reply, or cuts the reply short if it was started
+    void Fail(const std::string& strErrorReply)
+    {
+        if (!fStarted)
+        {
+            rpc_io_service->post(boost::bind(&RPCWriteReply, conn, strErrorReply, false));
+            return;
+        }
+        LogPrint("rpc", "ThreadRPCServer reply to %s cut short\n", conn->strPeer);
+        WaitForWrite();
+        rpc_io_service->post(boost::bind(&RPCClose, conn));
+    }
 };
 
-void ServiceConnection(AcceptedConnection *conn);
+static void RPCReadBodyHandler(RPCConnectionRef conn, const boost::system::error_code& err)
+{
+    if (err)
+    {
+        RPCClose(conn);
+        return;
+    }
+    RPCHandleRequest(conn);
+}
+
+static void RPCReadHeaderHandler(RPCConnectionRef conn, const boost::system::error_code& err)
+{
+    if (err)
+    {
+        RPCClose(conn);
+        return;
+    }
 
-// Forward declaration required for RPCListen
-template <typename Protocol, typename SocketAcceptorService>
-static void RPCAcceptHandler(boost::shared_ptr< basic_socket_acceptor<Protocol, SocketAcceptorService> > acceptor,
-                             ssl::context& context,
-                             bool fUseSSL,
-                             boost::shared_ptr< AcceptedConnection > conn,
-                             const boost::system::error_code& error);
+    // Read HTTP request line and headers, the body may follow in buf
+    std::istream stream(&conn->buf);
+    conn->mapHeaders.clear();
+    if (!ReadHTTPRequestLine(stream, conn->nProto, conn->strMethod, conn->strURI))
+    {
+        RPCClose(conn);
+        return;
+    }
+    int nLen = ReadHTTPHeaders(stream, conn->mapHeaders);
+    if (nLen < 0 || nLen > (int)MAX_SIZE)
+    {
+        RPCWriteReply(conn, HTTPReply(HTTP_BAD_REQUEST, "", false), false);
+        return;
+    }
+    conn->nContentLength = nLen;
 
-/**
- * Sets up I/O resources to accept and handle a new connection.
- */
-template <typename Protocol, typename SocketAcceptorService>
-static void RPCListen(boost::shared_ptr< basic_socket_acceptor<Protocol, SocketAcceptorService> > acceptor,
-                   ssl::context& context,
-                   const bool fUseSSL)
+    if (conn->buf.size() >= conn->nContentLength)
+        RPCHandleRequest(conn);
+    else
+        RPCAsyncRead(conn, conn->nContentLength - conn->buf.size(),
+                     boost::bind(&RPCReadBodyHandler, conn, asio::placeholders::error));
+}
+
+static void RPCRead(RPCConnectionRef conn)
 {
-    // Accept connection
-    boost::shared_ptr< AcceptedConnectionImpl<Protocol> > conn(new AcceptedConnectionImpl<Protocol>(acceptor->get_io_service(), context, fUseSSL));
+    RPCAsyncReadUntil(conn, "\r\n\r\n", boost::bind(&RPCReadHeaderHandler, conn, asio::placeholders::error));
+}
 
-    acceptor->async_accept(
-            conn->sslStream.lowest_layer(),
-            conn->peer,
-            boost::bind(&RPCAcceptHandler<Protocol, SocketAcceptorService>,
-                acceptor,
-                boost::ref(context),
-                fUseSSL,
-                conn,
-                _1));
+static void RPCHandshakeHandler(RPCConnectionRef conn, const boost::system::error_code& err)
+{
+    if (err)
+        RPCClose(conn);
+    else
+        RPCRead(conn);
 }
 
+static void RPCListen(boost::shared_ptr<ip::tcp::acceptor> acceptor, bool fUseSSL);
 
 /**
  * Accept and handle incoming connection.
  */
-template <typename Protocol, typename SocketAcceptorService>
-static void RPCAcceptHandler(boost::shared_ptr< basic_socket_acceptor<Protocol, SocketAcceptorService> > acceptor,
-                             ssl::context& context,
-                             const bool fUseSSL,
-                             boost::shared_ptr< AcceptedConnection > conn,
+static void RPCAcceptHandler(boost::shared_ptr<ip::tcp::acceptor> acceptor,
+                             bool fUseSSL,
+                             RPCConnectionRef conn,
                              const boost::system::error_code& error)
 {
     // Immediately start accepting new connections, except when we're cancelled or our socket is closed.
     if (error != asio::error::operation_aborted && acceptor->is_open())
-        RPCListen(acceptor, context, fUseSSL);
-
-    AcceptedConnectionImpl<ip::tcp>* tcp_conn = dynamic_cast< AcceptedConnectionImpl<ip::tcp>* >(conn.get());
+        RPCListen(acceptor, fUseSSL);
 
     if (error)
     {
         // TODO: Actually handle errors
         LogPrintf("%s: Error: %s\n", __func__, error.message());
+        return;
     }
+
+    conn->strPeer = conn->peer.address().to_string();
+
     // Restrict callers by IP.  It is important to
-    // do this before starting client thread, to filter out
+    // do this before reading from the connection, to filter out
     // certain DoS and misbehaving clients.
-    else if (tcp_conn && !ClientAllowed(tcp_conn->peer.address()))
+    if (!ClientAllowed(conn->peer.address()))
     {
         // Only send a 403 if we're not using SSL to prevent a DoS during the SSL handshake.
         if (!fUseSSL)
-            conn->stream() << HTTPReply(HTTP_FORBIDDEN, "", false) << std::flush;
-        conn->close();
-    }
-    else {
-        ServiceConnection(conn.get());
-        conn->close();
+            RPCWriteReply(conn, HTTPReply(HTTP_FORBIDDEN, "", false), false);
+        else
+            RPCClose(conn);
     }
+    else if (fUseSSL)
+        conn->sslStream.async_handshake(ssl::stream_base::server,
+                                        boost::bind(&RPCHandshakeHandler, conn, asio::placeholders::error));
+    else
+        RPCRead(conn);
+}
+
+/**
+ * Sets up I/O resources to accept and handle a new connection.
+ */
+static void RPCListen(boost::shared_ptr<ip::tcp::acceptor> acceptor, bool fUseSSL)
+{
+    RPCConnectionRef conn(new CRPCConnection(acceptor->get_io_service(), *rpc_ssl_context, fUseSSL));
+
+    acceptor->async_accept(
+            conn->sslStream.lowest_layer(),
+            conn->peer,
+            boost::bind(&RPCAcceptHandler,
+                acceptor,
+                fUseSSL,
+                conn,
+                asio::placeholders::error));
 }
 
 void StartRPCThreads()
@@ -580,7 +884,7 @@ void StartRPCThreads()
         acceptor->bind(endpoint);
         acceptor->listen(socket_base::max_connections);
 
-        RPCListen(acceptor, *rpc_ssl_context, fUseSSL);
+        RPCListen(acceptor, fUseSSL);
 
         rpc_acceptors.push_back(acceptor);
         fListening = true;
@@ -602,7 +906,7 @@ void StartRPCThreads()
             acceptor->bind(endpoint);
             acceptor->listen(socket_base::max_connections);
 
-            RPCListen(acceptor, *rpc_ssl_context, fUseSSL);
+            RPCListen(acceptor, fUseSSL);
 
             rpc_acceptors.push_back(acceptor);
             fListening = true;
@@ -619,9 +923,18 @@ void StartRPCThreads()
         return;
     }
 
+    nRPCBatchParallel = std::max((int)GetArg("-rpcbatchparallel", DEFAULT_RPC_BATCH_PARALLEL), 1);
+    fRESTEnabled = GetBoolArg("-rest", false);
+
+    // One thread does all the socket I/O, the others execute the requests
+    rpc_work_queue = new CRPCWorkQueue(std::max((int)GetArg("-rpcworkqueue", DEFAULT_RPC_WORK_QUEUE), 1),
+                                       std::max((int)GetArg("-rpcclientinflight", DEFAULT_RPC_CLIENT_IN_FLIGHT), 1));
     rpc_worker_group = new boost::thread_group();
-    for (int i = 0; i < GetArg("-rpcthreads", 4); i++)
-        rpc_worker_group->create_thread(boost::bind(&asio::io_service::run, rpc_io_service));
+    rpc_worker_group->create_thread(boost::bind(&TraceThread<boost::function<void()> >, "rpc",
+                                                boost::function<void()>(boost::bind(&asio::io_service::run, rpc_io_service))));
+    for (int i = 0; i < std::max((int)GetArg("-rpcthreads", DEFAULT_RPC_THREADS), 1); i++)
+        rpc_worker_group->create_thread(boost::bind(&TraceThread<boost::function<void()> >, "rpcworker",
+                                                    boost::function<void()>(boost::bind(&CRPCWorkQueue::Run, rpc_work_queue))));
 }
 
 void StartDummyRPCThread()
@@ -660,9 +973,14 @@ void StopRPCThreads()
     }
     deadlineTimers.clear();
 
+    if (rpc_work_queue != NULL)
+        rpc_work_queue->Interrupt();
     rpc_io_service->stop();
     if (rpc_worker_group != NULL)
         rpc_worker_group->join_all();
+    // Requests still queued hold on to their connections, drop them while
+    // the io_service their sockets belong to is still around
+    delete rpc_work_queue; rpc_work_queue = NULL;
     delete rpc_dummy_work; rpc_dummy_work = NULL;
     delete rpc_worker_group; rpc_worker_group = NULL;
     delete rpc_ssl_context; rpc_ssl_context = NULL;
@@ -754,101 +1072,178 @@ static Object JSONRPCExecOne(const Value& req)
     return rpc_result;
 }
 
-static string JSONRPCExecBatch(const Array& vReq)
+/** The elements of a batch request, executed by up to -rpcbatchparallel RPC
+ * worker threads at once. Each thread takes the next element nobody has
+ * started on until there are none left. The thread the batch came in on
+ * works on it too, and then waits for the others to finish theirs, so the
+ * batch is done even if no other thread comes to help. Every element takes
+ * the locks its command declares, like a request of its own.
+ */
+class CRPCBatch
 {
-    Array ret;
-    for (unsigned int reqIdx = 0; reqIdx < vReq.size(); reqIdx++)
-        ret.push_back(JSONRPCExecOne(vReq[reqIdx]));
+private:
+    Array vReq;
+    Array vResult;
+    boost::mutex cs;
+    boost::condition_variable cond;
+    unsigned int nNext;
+    int nRunning;
 
-    return write_string(Value(ret), false) + "\n";
-}
+public:
+    CRPCBatch(Array& vReqIn) : nNext(0), nRunning(0)
+    {
+        vReq.swap(vReqIn);
+        vResult.resize(vReq.size());
+    }
 
-void ServiceConnection(AcceptedConnection *conn)
-{
-    bool fRun = true;
-    while (fRun && !ShutdownRequested())
+    unsigned int size() const { return vReq.size(); }
+
+    // Executes elements until none are left to start
+    void Run()
     {
-        int nProto = 0;
-        map<string, string> mapHeaders;
-        string strRequest, strMethod, strURI;
+        while (true)
+        {
+            unsigned int nReq;
+            {
+                boost::unique_lock<boost::mutex> lock(cs);
+                if (nNext >= vReq.size())
+                    return;
+                nReq = nNext++;
+                nRunning++;
+            }
+            Object result = JSONRPCExecOne(vReq[nReq]);
+            {
+                boost::unique_lock<boost::mutex> lock(cs);
+                vResult[nReq] = result;
+                if (--nRunning == 0)
+                    cond.notify_all();
+            }
+        }
+    }
 
-        // Read HTTP request line
-        if (!ReadHTTPRequestLine(conn->stream(), nProto, strMethod, strURI))
-            break;
+    // Waits until the elements other threads started are done
+    const Array& Wait()
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        while (nRunning > 0)
+            cond.wait(lock);
+        return vResult;
+    }
+};
 
-        // Read HTTP message headers and body
-        ReadHTTPMessage(conn->stream(), mapHeaders, strRequest, nProto);
+static string JSONRPCExecBatch(const std::string& strClient, Array& vReq)
+{
+    boost::shared_ptr<CRPCBatch> batch(new CRPCBatch(vReq));
 
-        if (strURI != "/") {
-            conn->stream() << HTTPReply(HTTP_NOT_FOUND, "", false) << std::flush;
-            break;
-        }
+    // Helpers queued behind other requests may find the batch done already
+    if (rpc_work_queue != NULL)
+        for (int i = 1; i < nRPCBatchParallel && i < (int)batch->size(); i++)
+            rpc_work_queue->Submit(strClient, boost::bind(&CRPCBatch::Run, batch));
+    batch->Run();
 
-        // Check authorization
-        if (mapHeaders.count("authorization") == 0)
-        {
-            conn->stream() << HTTPReply(HTTP_UNAUTHORIZED, "", false) << std::flush;
-            break;
-        }
-        if (!HTTPAuthorized(mapHeaders))
-        {
-            LogPrintf("ThreadRPCServer incorrect password attempt from %s\n", conn->peer_address_to_string());
-            /* Deter brute-forcing short passwords.
-               If this results in a DoS the user really
-               shouldn't have their RPC port exposed. */
-            if (mapArgs["-rpcpassword"].size() < 20)
-                MilliSleep(250);
-
-            conn->stream() << HTTPReply(HTTP_UNAUTHORIZED, "", false) << std::flush;
-            break;
-        }
-        if (mapHeaders["connection"] == "close")
-            fRun = false;
+    return write_string(Value(batch->Wait()), false) + "\n";
+}
 
-        JSONRequest jreq;
-        try
-        {
-            // Parse request
-            Value valRequest;
-            if (!read_string(strRequest, valRequest))
-                throw JSONRPCError(RPC_PARSE_ERROR, "Parse error");
+// Runs on an RPC worker thread; the reply is written by the I/O thread
+static void RPCExecuteRequest(RPCConnectionRef conn, const std::string& strRequest, int nProto, bool fKeepAlive)
+{
+    CRPCReplyStream reply(conn, nProto, fKeepAlive);
+    JSONRequest jreq;
+    try
+    {
+        // Parse request
+        Value valRequest;
+        if (!ParseJSON(strRequest, valRequest))
+            throw JSONRPCError(RPC_PARSE_ERROR, "Parse error");
+
+        // singleton request, the reply is sent as the result is written
+        if (valRequest.type() == obj_type) {
+            jreq.parse(valRequest);
+
+            CJSONWriter writer(boost::bind(&CRPCReplyStream::Write, &reply, _1));
+            writer.BeginObject();
+            writer.Key("result");
+            tableRPC.execute(jreq.strMethod, jreq.params, writer);
+            writer.Pair("error", Value::null);
+            writer.Pair("id", jreq.id);
+            writer.EndObject();
+            reply.Finish(writer.GetBuffer() + "\n");
+
+        // array of requests
+        } else if (valRequest.type() == array_type)
+            reply.Finish(JSONRPCExecBatch(conn->strPeer, valRequest.get_array()));
+        else
+            throw JSONRPCError(RPC_PARSE_ERROR, "Top-level object parse error");
+    }
+    catch (Object& objError)
+    {
+        reply.Fail(ErrorReply(objError, jreq.id));
+    }
+    catch (std::exception& e)
+    {
+        reply.Fail(ErrorReply(JSONRPCError(RPC_PARSE_ERROR, e.what()), jreq.id));
+    }
+}
 
-            string strReply;
+// Runs on an RPC worker thread like RPCExecuteRequest
+static void RPCExecuteREST(RPCConnectionRef conn, const std::string& strURI, bool fKeepAlive)
+{
+    rpc_io_service->post(boost::bind(&RPCWriteReply, conn, RESTReply(strURI, fKeepAlive), fKeepAlive));
+}
 
-            // singleton request
-            if (valRequest.type() == obj_type) {
-                jreq.parse(valRequest);
+static void RPCHandleRequest(RPCConnectionRef conn)
+{
+    string strRequest(buffers_begin(conn->buf.data()), buffers_begin(conn->buf.data()) + conn->nContentLength);
+    conn->buf.consume(conn->nContentLength);
 
-                Value result = tableRPC.execute(jreq.strMethod, jreq.params);
+    string strConnection = conn->mapHeaders["connection"];
+    bool fKeepAlive = (strConnection == "keep-alive" || (strConnection != "close" && conn->nProto >= 1));
 
-                // Send reply
-                strReply = JSONRPCReply(result, Value::null, jreq.id);
+    // The REST interface is public and read-only, it needs no password
+    if (fRESTEnabled && conn->strMethod == "GET" && boost::algorithm::starts_with(conn->strURI, "/rest/"))
+    {
+        if (!rpc_work_queue->Submit(conn->strPeer, boost::bind(&RPCExecuteREST, conn, conn->strURI, fKeepAlive)))
+            LogPrint("rpc", "ThreadRPCServer request from %s waiting for room in the work queue\n", conn->strPeer);
+        return;
+    }
 
-            // array of requests
-            } else if (valRequest.type() == array_type)
-                strReply = JSONRPCExecBatch(valRequest.get_array());
-            else
-                throw JSONRPCError(RPC_PARSE_ERROR, "Top-level object parse error");
+    if (conn->strURI != "/") {
+        RPCWriteReply(conn, HTTPReply(HTTP_NOT_FOUND, "", false), false);
+        return;
+    }
 
-            conn->stream() << HTTPReply(HTTP_OK, strReply, fRun) << std::flush;
-        }
-        catch (Object& objError)
-        {
-            ErrorReply(conn->stream(), objError, jreq.id);
-            break;
-        }
-        catch (std::exception& e)
+    // Check authorization
+    if (conn->mapHeaders.count("authorization") == 0)
+    {
+        RPCWriteReply(conn, HTTPReply(HTTP_UNAUTHORIZED, "", false), false);
+        return;
+    }
+    if (!HTTPAuthorized(conn->mapHeaders))
+    {
+        LogPrintf("ThreadRPCServer incorrect password attempt from %s\n", conn->strPeer);
+        /* Deter brute-forcing short passwords.
+           If this results in a DoS the user really
+           shouldn't have their RPC port exposed. */
+        if (mapArgs["-rpcpassword"].size() < 20)
         {
-            ErrorReply(conn->stream(), JSONRPCError(RPC_PARSE_ERROR, e.what()), jreq.id);
-            break;
+            conn->timer.expires_from_now(posix_time::milliseconds(250));
+            conn->timer.async_wait(boost::bind(&RPCDelayedReply, conn, HTTPReply(HTTP_UNAUTHORIZED, "", false), asio::placeholders::error));
         }
+        else
+            RPCWriteReply(conn, HTTPReply(HTTP_UNAUTHORIZED, "", false), false);
+        return;
     }
+
+    // Nothing more is read from the connection until this request is
+    // answered, so a full queue pushes back on the clients
+    if (!rpc_work_queue->Submit(conn->strPeer, boost::bind(&RPCExecuteRequest, conn, strRequest, conn->nProto, fKeepAlive)))
+        LogPrint("rpc", "ThreadRPCServer request from %s waiting for room in the work queue\n", conn->strPeer);
 }
 
-json_spirit::Value CRPCTable::execute(const std::string &strMethod, const json_spirit::Array &params) const
+const CRPCCommand* CRPCTable::lookup(const std::string &strMethod) const
 {
     // Find method
-    const CRPCCommand *pcmd = tableRPC[strMethod];
+    const CRPCCommand *pcmd = (*this)[strMethod];
     if (!pcmd)
         throw JSONRPCError(RPC_METHOD_NOT_FOUND, "Method not found");
 #ifdef ENABLE_WALLET
@@ -861,28 +1256,31 @@ json_spirit::Value CRPCTable::execute(const std::string &strMethod, const json_s
     if (strWarning != "" && !GetBoolArg("-disablesafemode", false) &&
         !pcmd->okSafeMode)
         throw JSONRPCError(RPC_FORBIDDEN_BY_SAFE_MODE, string("Safe mode: ") + strWarning);
+    return pcmd;
+}
 
+// Execute, holding the locks the command declared
+static Value ExecuteCommand(const CRPCCommand *pcmd, const Array &params)
+{
     try
     {
-        // Execute
         Value result;
-        {
-            if (pcmd->threadSafe)
-                result = pcmd->actor(params, false);
+        bool fLockMain = pcmd->nLocks & RPC_LOCK_MAIN;
 #ifdef ENABLE_WALLET
-            else if (!pwalletMain) {
-                LOCK(cs_main);
-                result = pcmd->actor(params, false);
-            } else {
-                LOCK2(cs_main, pwalletMain->cs_wallet);
-                result = pcmd->actor(params, false);
-            }
-#else // ENABLE_WALLET
-            else {
-                LOCK(cs_main);
-                result = pcmd->actor(params, false);
-            }
-#endif // !ENABLE_WALLET
+        CWallet* pwallet = (pcmd->nLocks & RPC_LOCK_WALLET) ? pwalletMain : NULL;
+        if (fLockMain && pwallet) {
+            LOCK2(cs_main, pwallet->cs_wallet);
+            result = pcmd->actor(params, false);
+        } else if (pwallet) {
+            LOCK(pwallet->cs_wallet);
+            result = pcmd->actor(params, false);
+        } else
+#endif // ENABLE_WALLET
+        if (fLockMain) {
+            LOCK(cs_main);
+            result = pcmd->actor(params, false);
+        } else {
+            result = pcmd->actor(params, false);
         }
         return result;
     }
@@ -892,6 +1290,30 @@ json_spirit::Value CRPCTable::execute(const std::string &strMethod, const json_s
     }
 }
 
+json_spirit::Value CRPCTable::execute(const std::string &strMethod, const json_spirit::Array &params) const
+{
+    return ExecuteCommand(lookup(strMethod), params);
+}
+
+void CRPCTable::execute(const std::string &strMethod, const json_spirit::Array &params, CJSONWriter& writer) const
+{
+    const CRPCCommand *pcmd = lookup(strMethod);
+    if (!pcmd->streamActor)
+    {
+        writer.Write(ExecuteCommand(pcmd, params));
+        return;
+    }
+
+    try
+    {
+        pcmd->streamActor(params, writer);
+    }
+    catch (std::exception& e)
+    {
+        throw JSONRPCError(RPC_MISC_ERROR, e.what());
+    }
+}
+
 std::string HelpExampleCli(string methodname, string args){
     return "> carboncoin-cli " + methodname + " " + args + "\n";
 }
@@ -19,6 +19,18 @@
 #include "json/json_spirit_writer_template.h"
 
 class CBlockIndex;
+class CJSONWriter;
+
+/** Default for -rpcthreads, the threads executing RPC requests */
+static const int DEFAULT_RPC_THREADS = 4;
+/** Default for -rpcworkqueue, requests queued for the RPC threads */
+static const int DEFAULT_RPC_WORK_QUEUE = 16;
+/** Default for -rpcclientinflight, requests one client address may have
+ * queued or executing at once */
+static const int DEFAULT_RPC_CLIENT_IN_FLIGHT = 8;
+/** Default for -rpcbatchparallel, elements of one batch request executed at
+ * once */
+static const int DEFAULT_RPC_BATCH_PARALLEL = 4;
 
 /* Start RPC threads */
 void StartRPCThreads();
@@ -50,7 +62,23 @@ void RPCTypeCheck(const json_spirit::Object& o,
  */
 void RPCRunLater(const std::string& name, boost::function<void(void)> func, int64_t nSeconds);
 
+/** Answers a GET of /rest/... with a complete HTTP reply (in rest.cpp) */
+std::string RESTReply(const std::string& strURI, bool fKeepAlive);
+
 typedef json_spirit::Value(*rpcfn_type)(const json_spirit::Array& params, bool fHelp);
+typedef void(*rpcstreamfn_type)(const json_spirit::Array& params, CJSONWriter& writer);
+
+/** Locks CRPCTable::execute holds for the whole of a command. Commands that
+ * need cs_main or cs_wallet only for part of their work declare less and
+ * take those locks themselves, so they don't hold up block validation or
+ * each other while reading from disk or building their reply.
+ */
+enum RPCLocks
+{
+    RPC_LOCK_NONE   = 0,
+    RPC_LOCK_MAIN   = (1 << 0), // cs_main
+    RPC_LOCK_WALLET = (1 << 1), // pwalletMain->cs_wallet, taken after cs_main
+};
 
 class CRPCCommand
 {
@@ -58,8 +86,13 @@ public:
     std::string name;
     rpcfn_type actor;
     bool okSafeMode;
-    bool threadSafe;
+    unsigned int nLocks;
     bool reqWallet;
+    // Writes the result itself instead of returning it, for commands with
+    // large results; it takes the locks it needs, nLocks must be
+    // RPC_LOCK_NONE. Called with fHelp and invalid parameters, actor throws
+    // the help text.
+    rpcstreamfn_type streamActor;
 };
 
 /**
@@ -69,6 +102,9 @@ class CRPCTable
 {
 private:
     std::map<std::string, const CRPCCommand*> mapCommands;
+
+    // Finds a command that may be executed now; throws otherwise
+    const CRPCCommand* lookup(const std::string& method) const;
 public:
     CRPCTable();
     const CRPCCommand* operator[](std::string name) const;
@@ -82,6 +118,14 @@ public:
      * @throws an exception (json_spirit::Value) when an error happens.
      */
     json_spirit::Value execute(const std::string &method, const json_spirit::Array &params) const;
+
+    /**
+     * Execute a method, writing its result to writer. Commands without a
+     * streamActor have their result written after their locks are released.
+     * @throws an exception (json_spirit::Value) when an error happens; the
+     * result may have been written in part by then.
+     */
+    void execute(const std::string &method, const json_spirit::Array &params, CJSONWriter& writer) const;
 };
 
 extern const CRPCTable tableRPC;
@@ -114,6 +158,7 @@ extern json_spirit::Value getpeerinfo(const json_spirit::Array& params, bool fHe
 extern json_spirit::Value ping(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value addnode(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getaddednodeinfo(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value getnetstats(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getnettotals(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value sendalert(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getcheckpoint(const json_spirit::Array& params, bool fHelp);
@@ -173,6 +218,7 @@ extern json_spirit::Value getblockchaininfo(const json_spirit::Array& params, bo
 extern json_spirit::Value getnetworkinfo(const json_spirit::Array& params, bool fHelp);
 
 extern json_spirit::Value getrawtransaction(const json_spirit::Array& params, bool fHelp); // in rcprawtransaction.cpp
+extern void getrawtransaction(const json_spirit::Array& params, CJSONWriter& writer);
 extern json_spirit::Value listunspent(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value lockunspent(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value listlockunspent(const json_spirit::Array& params, bool fHelp);
@@ -187,8 +233,11 @@ extern json_spirit::Value getbestblockhash(const json_spirit::Array& params, boo
 extern json_spirit::Value getdifficulty(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value settxfee(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getrawmempool(const json_spirit::Array& params, bool fHelp);
+extern void getrawmempool(const json_spirit::Array& params, CJSONWriter& writer);
 extern json_spirit::Value getblockhash(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getblock(const json_spirit::Array& params, bool fHelp);
+extern void getblock(const json_spirit::Array& params, CJSONWriter& writer);
+extern json_spirit::Value getblockfilter(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value gettxoutsetinfo(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value gettxout(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value verifychain(const json_spirit::Array& params, bool fHelp);
@@ -545,6 +545,31 @@ public:
         return GetOp2(pc, opcodeRet, NULL);
     }
 
+    // Like GetOp, but points pchData at the pushed data inside the script
+    // instead of copying it. nDataSize is 0 for opcodes that push nothing.
+    bool GetOp(const_iterator& pc, opcodetype& opcodeRet, const unsigned char*& pchData, unsigned int& nDataSize) const
+    {
+        const_iterator pcStart = pc;
+        if (!GetOp2(pc, opcodeRet, NULL))
+            return false;
+        nDataSize = 0;
+        pchData = NULL;
+        if (opcodeRet <= OP_PUSHDATA4)
+        {
+            unsigned int nHeader = 1;
+            if (opcodeRet == OP_PUSHDATA1)
+                nHeader += 1;
+            else if (opcodeRet == OP_PUSHDATA2)
+                nHeader += 2;
+            else if (opcodeRet == OP_PUSHDATA4)
+                nHeader += 4;
+            nDataSize = (pc - pcStart) - nHeader;
+            if (nDataSize)
+                pchData = &pcStart[nHeader];
+        }
+        return true;
+    }
+
     bool GetOp2(const_iterator& pc, opcodetype& opcodeRet, std::vector<unsigned char>* pvchRet) const
     {
         opcodeRet = OP_INVALIDOPCODE;
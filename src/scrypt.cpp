@@ -135,25 +135,22 @@ HMAC_SHA256_Final(unsigned char digest[32], HMAC_SHA256_CTX *ctx)
 }
 
 /**
- * PBKDF2_SHA256(passwd, passwdlen, salt, saltlen, c, buf, dkLen):
- * Compute PBKDF2(passwd, salt, c, dkLen) using HMAC-SHA256 as the PRF, and
- * write the output to buf.  The value dkLen must be at most 32 * (2^32 - 1).
+ * PBKDF2_SHA256_1(hctx, salt, saltlen, buf, dkLen):
+ * PBKDF2_SHA256 with a single iteration (c = 1), starting from an HMAC-SHA256
+ * state that has already been keyed with the password.
  */
 static void
-PBKDF2_SHA256(const uint8_t *passwd, size_t passwdlen, const uint8_t *salt,
-    size_t saltlen, uint64_t c, uint8_t *buf, size_t dkLen)
+PBKDF2_SHA256_1(const HMAC_SHA256_CTX *keyctx, const uint8_t *salt,
+    size_t saltlen, uint8_t *buf, size_t dkLen)
 {
 	HMAC_SHA256_CTX PShctx, hctx;
 	size_t i;
 	uint8_t ivec[4];
 	uint8_t U[32];
-	uint8_t T[32];
-	uint64_t j;
-	int k;
 	size_t clen;
 
 	/* Compute HMAC state after processing P and S. */
-	HMAC_SHA256_Init(&PShctx, passwd, passwdlen);
+	memcpy(&PShctx, keyctx, sizeof(HMAC_SHA256_CTX));
 	HMAC_SHA256_Update(&PShctx, salt, saltlen);
 
 	/* Iterate through the blocks. */
@@ -161,30 +158,16 @@ PBKDF2_SHA256(const uint8_t *passwd, size_t passwdlen, const uint8_t *salt,
 		/* Generate INT(i + 1). */
 		be32enc(ivec, (uint32_t)(i + 1));
 
-		/* Compute U_1 = PRF(P, S || INT(i)). */
+		/* Compute T_i = U_1 = PRF(P, S || INT(i)). */
 		memcpy(&hctx, &PShctx, sizeof(HMAC_SHA256_CTX));
 		HMAC_SHA256_Update(&hctx, ivec, 4);
 		HMAC_SHA256_Final(U, &hctx);
 
-		/* T_i = U_1 ... */
-		memcpy(T, U, 32);
-
-		for (j = 2; j <= c; j++) {
-			/* Compute U_j. */
-			HMAC_SHA256_Init(&hctx, passwd, passwdlen);
-			HMAC_SHA256_Update(&hctx, U, 32);
-			HMAC_SHA256_Final(U, &hctx);
-
-			/* ... xor U_j ... */
-			for (k = 0; k < 32; k++)
-				T[k] ^= U[k];
-		}
-
 		/* Copy as many bytes as necessary into buf. */
 		clen = dkLen - i * 32;
 		if (clen > 32)
 			clen = 32;
-		memcpy(&buf[i * 32], T, clen);
+		memcpy(&buf[i * 32], U, clen);
 	}
 
 	/* Clean PShctx, since we never called _Final on it. */
@@ -262,14 +245,41 @@ static inline void xor_salsa8(uint32_t B[16], const uint32_t Bx[16])
 
 void scrypt_1024_1_1_256_sp(const char *input, char *output, char *scratchpad)
 {
+	SHA256_CTX midstate;
+
+	scrypt_1024_1_1_256_midstate(input, &midstate);
+	scrypt_1024_1_1_256_sp_midstate(input, output, scratchpad, &midstate);
+}
+
+void scrypt_1024_1_1_256_midstate(const char *input, SHA256_CTX *midstate)
+{
+	SHA256_Init(midstate);
+	SHA256_Update(midstate, input, 64);
+}
+
+void scrypt_1024_1_1_256_sp_midstate(const char *input, char *output, char *scratchpad, const SHA256_CTX *midstate)
+{
+	HMAC_SHA256_CTX hctx;
+	SHA256_CTX kctx;
+	unsigned char khash[32];
 	uint8_t B[128];
 	uint32_t X[32];
 	uint32_t *V;
 	uint32_t i, j, k;
 
 	V = (uint32_t *)(((uintptr_t)(scratchpad) + 63) & ~ (uintptr_t)(63));
-	
-	PBKDF2_SHA256((const uint8_t *)input, 80, (const uint8_t *)input, 80, 1, B, 128);
+
+	/*
+	 * The 80-byte header is longer than a SHA256 block, so the HMAC key is
+	 * SHA256(header): finish it from the midstate, then key the HMAC state
+	 * once for both PBKDF2 passes.
+	 */
+	memcpy(&kctx, midstate, sizeof(SHA256_CTX));
+	SHA256_Update(&kctx, input + 64, 16);
+	SHA256_Final(khash, &kctx);
+	HMAC_SHA256_Init(&hctx, khash, 32);
+
+	PBKDF2_SHA256_1(&hctx, (const uint8_t *)input, 80, B, 128);
 
 	for (k = 0; k < 32; k++)
 		X[k] = le32dec(&B[4 * k]);
@@ -290,7 +300,11 @@ void scrypt_1024_1_1_256_sp(const char *input, char *output, char *scratchpad)
 	for (k = 0; k < 32; k++)
 		le32enc(&B[4 * k], X[k]);
 
-	PBKDF2_SHA256((const uint8_t *)input, 80, B, 128, 1, (uint8_t *)output, 32);
+	PBKDF2_SHA256_1(&hctx, B, 128, (uint8_t *)output, 32);
+
+	/* Clean the stack. */
+	memset(khash, 0, 32);
+	memset(&hctx, 0, sizeof(HMAC_SHA256_CTX));
 }
 
 void scrypt_1024_1_1_256(const char *input, char *output)
@@ -30,9 +30,21 @@
 #ifndef SCRYPT_H
 #define SCRYPT_H
 
+#include <openssl/sha.h>
+
 const int SCRYPT_SCRATCHPAD_SIZE = 131072 + 63;
 
 void scrypt_1024_1_1_256_sp(const char *input, char *output, char *scratchpad);
 void scrypt_1024_1_1_256(const char *input, char *output);
 
+/*
+ * Hashing many 80-byte block headers that only differ in their last 16 bytes
+ * (time, bits, nonce): scrypt_1024_1_1_256_midstate absorbs the constant
+ * first 64 bytes of the header into the SHA256 state used to derive the
+ * HMAC key, and scrypt_1024_1_1_256_sp_midstate finishes the hash of a full
+ * header from that state.
+ */
+void scrypt_1024_1_1_256_midstate(const char *input, SHA256_CTX *midstate);
+void scrypt_1024_1_1_256_sp_midstate(const char *input, char *output, char *scratchpad, const SHA256_CTX *midstate);
+
 #endif
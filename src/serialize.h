@@ -929,6 +929,7 @@ public:
     bool empty() const                               { return vch.size() == nReadPos; }
     void resize(size_type n, value_type c=0)         { vch.resize(n + nReadPos, c); }
     void reserve(size_type n)                        { vch.reserve(n + nReadPos); }
+    size_type capacity() const                       { return vch.capacity() - nReadPos; }
     const_reference operator[](size_type pos) const  { return vch[pos + nReadPos]; }
     reference operator[](size_type pos)              { return vch[pos + nReadPos]; }
     void clear()                                     { vch.clear(); nReadPos = 0; }
@@ -1125,6 +1126,13 @@ public:
         data.insert(data.end(), begin(), end());
         clear();
     }
+
+    // Exchange the underlying buffer with another, e.g. to reuse an
+    // allocation. Anything already read is dropped.
+    void SwapBuffer(CSerializeData &data) {
+        vch.swap(data);
+        nReadPos = 0;
+    }
 };
 
 
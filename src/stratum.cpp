@@ -0,0 +1,621 @@
+// Copyright (c) 2014 The Carboncoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "stratum.h"
+
+#include "base58.h"
+#include "bignum.h"
+#include "init.h"
+#include "jsonreader.h"
+#include "main.h"
+#include "miner.h"
+#include "ui_interface.h"
+#include "util.h"
+#ifdef ENABLE_WALLET
+#include "wallet.h"
+#endif
+
+#include <deque>
+
+#include <boost/algorithm/string.hpp>
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/thread.hpp>
+#include "json/json_spirit_utils.h"
+#include "json/json_spirit_writer_template.h"
+
+using namespace std;
+using namespace boost;
+using namespace boost::asio;
+using namespace json_spirit;
+
+//
+// Stratum mining server
+//
+// Miners subscribe over a line based JSON protocol and are pushed a new job
+// whenever the tip changes, or the mempool has changed and the current job
+// is older than STRATUM_JOB_REFRESH_INTERVAL. The coinbase is split around
+// an 8 byte extranonce: 4 bytes assigned per connection (extranonce1) and 4
+// bytes rolled by the miner (extranonce2).
+//
+// All connection and job state is only touched from the single server
+// thread, so it needs no locking of its own.
+//
+
+static const unsigned int STRATUM_EXTRANONCE1_SIZE = 4;
+static const unsigned int STRATUM_EXTRANONCE2_SIZE = 4;
+// Longest request line accepted from a miner
+static const unsigned int MAX_STRATUM_LINE = 16 * 1024;
+// Jobs kept around for late share submissions on the same tip
+static const unsigned int MAX_STRATUM_JOBS = 16;
+
+class CStratumJob
+{
+public:
+    std::string strId;
+    CBlock block;
+    CBlockIndex* pindexPrev;
+    std::vector<uint256> vMerkleBranch;
+    // Serialized coinbase before and after the extranonce
+    std::vector<unsigned char> vchCoinbase1;
+    std::vector<unsigned char> vchCoinbase2;
+    int64_t nTimeCreated;
+    std::set<uint256> setShares;
+};
+
+class CStratumConnection : public boost::enable_shared_from_this<CStratumConnection>
+{
+public:
+    ip::tcp::socket socket;
+    asio::streambuf buf;
+    std::deque<std::string> vSendQueue;
+    std::string strPeer;
+    std::vector<unsigned char> vchExtraNonce1;
+    bool fSubscribed;
+    bool fAuthorized;
+
+    CStratumConnection(io_service& io) : socket(io), buf(MAX_STRATUM_LINE), fSubscribed(false), fAuthorized(false) {}
+};
+typedef boost::shared_ptr<CStratumConnection> StratumConnectionRef;
+
+// These are created by StartStratumServer, destroyed in StopStratumServer
+static io_service* stratum_io_service = NULL;
+static deadline_timer* stratum_timer = NULL;
+static boost::thread_group* stratum_worker_group = NULL;
+static std::vector<boost::shared_ptr<ip::tcp::acceptor> > stratum_acceptors;
+static boost::signals2::connection stratum_blocks_changed;
+
+static std::set<StratumConnectionRef> setStratumConnections;
+static std::map<std::string, boost::shared_ptr<CStratumJob> > mapStratumJobs;
+static boost::shared_ptr<CStratumJob> pstratumjob;
+static unsigned int nStratumJobCounter = 0;
+static unsigned int nStratumExtraNonce1Counter = 0;
+static unsigned int nStratumTransactionsUpdatedLast = 0;
+static CScript scriptStratumPayout;
+static uint256 hashStratumShareTarget;
+
+static void StratumRead(StratumConnectionRef conn);
+
+static void StratumClose(StratumConnectionRef conn)
+{
+    boost::system::error_code ec;
+    conn->socket.close(ec);
+    setStratumConnections.erase(conn);
+}
+
+static std::string StratumHexInt(unsigned int n)
+{
+    return strprintf("%08x", n);
+}
+
+static bool StratumParseHexInt(const Value& value, unsigned int& n)
+{
+    if (value.type() != str_type || value.get_str().size() != 8 || !IsHex(value.get_str()))
+        return false;
+    n = strtoul(value.get_str().c_str(), NULL, 16);
+    return true;
+}
+
+// The previous block hash as stratum sends it: internal byte order with
+// every 32 bit word byte swapped.
+static std::string StratumPrevHash(const uint256& hash)
+{
+    std::vector<unsigned char> vch(hash.begin(), hash.end());
+    for (unsigned int i = 0; i < vch.size(); i += 4)
+    {
+        std::swap(vch[i], vch[i + 3]);
+        std::swap(vch[i + 1], vch[i + 2]);
+    }
+    return HexStr(vch);
+}
+
+static void StratumWriteHandler(StratumConnectionRef conn, const boost::system::error_code& err)
+{
+    conn->vSendQueue.pop_front();
+    if (err)
+    {
+        StratumClose(conn);
+        return;
+    }
+    if (!conn->vSendQueue.empty())
+        async_write(conn->socket, buffer(conn->vSendQueue.front()),
+                    boost::bind(&StratumWriteHandler, conn, asio::placeholders::error));
+}
+
+static void StratumSend(StratumConnectionRef conn, const Object& obj)
+{
+    conn->vSendQueue.push_back(write_string(Value(obj), false) + "\n");
+    if (conn->vSendQueue.size() == 1)
+        async_write(conn->socket, buffer(conn->vSendQueue.front()),
+                    boost::bind(&StratumWriteHandler, conn, asio::placeholders::error));
+}
+
+static void StratumReply(StratumConnectionRef conn, const Value& id, const Value& result, const Value& error)
+{
+    Object reply;
+    reply.push_back(Pair("id", id));
+    reply.push_back(Pair("result", result));
+    reply.push_back(Pair("error", error));
+    StratumSend(conn, reply);
+}
+
+static Value StratumError(int code, const std::string& strMessage)
+{
+    Array error;
+    error.push_back(code);
+    error.push_back(strMessage);
+    error.push_back(Value::null);
+    return error;
+}
+
+static void StratumNotify(StratumConnectionRef conn, const std::string& strMethod, const Array& params)
+{
+    Object notify;
+    notify.push_back(Pair("id", Value::null));
+    notify.push_back(Pair("method", strMethod));
+    notify.push_back(Pair("params", params));
+    StratumSend(conn, notify);
+}
+
+static void StratumSendJob(StratumConnectionRef conn, const CStratumJob& job, bool fClean)
+{
+    Array branch;
+    BOOST_FOREACH(const uint256& hash, job.vMerkleBranch)
+        branch.push_back(HexStr(hash.begin(), hash.end()));
+
+    Array params;
+    params.push_back(job.strId);
+    params.push_back(StratumPrevHash(job.block.hashPrevBlock));
+    params.push_back(HexStr(job.vchCoinbase1));
+    params.push_back(HexStr(job.vchCoinbase2));
+    params.push_back(branch);
+    params.push_back(StratumHexInt(job.block.nVersion));
+    params.push_back(StratumHexInt(job.block.nBits));
+    params.push_back(StratumHexInt(job.block.nTime));
+    params.push_back(fClean);
+    StratumNotify(conn, "mining.notify", params);
+}
+
+static void StratumSendDifficulty(StratumConnectionRef conn)
+{
+    Array params;
+    params.push_back(GetArg("-stratumdifficulty", DEFAULT_STRATUM_DIFFICULTY));
+    StratumNotify(conn, "mining.set_difficulty", params);
+}
+
+// Build a job from a fresh block template. The coinbase scriptSig is the
+// height followed by a push of the 8 extranonce bytes, so it can be split
+// into the parts before and after them.
+static bool CreateStratumJob()
+{
+    boost::shared_ptr<CStratumJob> job(new CStratumJob());
+    {
+        LOCK(cs_main);
+        if (IsInitialBlockDownload())
+            return false;
+
+        nStratumTransactionsUpdatedLast = mempool.GetTransactionsUpdated();
+        auto_ptr<CBlockTemplate> pblocktemplate(CreateNewBlock(scriptStratumPayout));
+        if (!pblocktemplate.get())
+            return false;
+        job->block = pblocktemplate->block;
+        job->pindexPrev = chainActive.Tip();
+    }
+
+    CBlock& block = job->block;
+    CScript scriptHeight = CScript() << (job->pindexPrev->nHeight + 1);
+    std::vector<unsigned char> vchExtraNonce(STRATUM_EXTRANONCE1_SIZE + STRATUM_EXTRANONCE2_SIZE, 0);
+    block.vtx[0].vin[0].scriptSig = (scriptHeight + (CScript() << vchExtraNonce)) + COINBASE_FLAGS;
+    assert(block.vtx[0].vin[0].scriptSig.size() <= 100);
+    block.BuildMerkleTree();
+    job->vMerkleBranch = block.GetMerkleBranch(0);
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << block.vtx[0];
+    // nVersion, vin count, prevout, script length, height push, extranonce push opcode
+    unsigned int nOffset = 4 + 1 + 36 + GetSizeOfCompactSize(block.vtx[0].vin[0].scriptSig.size()) + scriptHeight.size() + 1;
+    assert((unsigned char)ss[nOffset - 1] == vchExtraNonce.size());
+    job->vchCoinbase1.assign(ss.begin(), ss.begin() + nOffset);
+    job->vchCoinbase2.assign(ss.begin() + nOffset + vchExtraNonce.size(), ss.end());
+
+    job->strId = strprintf("%x", ++nStratumJobCounter);
+    job->nTimeCreated = GetTime();
+
+    bool fClean = (!pstratumjob || pstratumjob->pindexPrev != job->pindexPrev);
+    if (fClean)
+        mapStratumJobs.clear();
+    else if (mapStratumJobs.size() >= MAX_STRATUM_JOBS)
+    {
+        // Job ids are increasing, drop the oldest
+        std::map<std::string, boost::shared_ptr<CStratumJob> >::iterator itOldest = mapStratumJobs.begin();
+        for (std::map<std::string, boost::shared_ptr<CStratumJob> >::iterator it = mapStratumJobs.begin(); it != mapStratumJobs.end(); ++it)
+            if (it->second->nTimeCreated < itOldest->second->nTimeCreated)
+                itOldest = it;
+        mapStratumJobs.erase(itOldest);
+    }
+    mapStratumJobs[job->strId] = job;
+    pstratumjob = job;
+
+    LogPrint("stratum", "Stratum job %s at height %d with %u transactions\n", job->strId, job->pindexPrev->nHeight + 1, block.vtx.size());
+    BOOST_FOREACH(const StratumConnectionRef& conn, setStratumConnections)
+        if (conn->fSubscribed)
+            StratumSendJob(conn, *job, fClean);
+    return true;
+}
+
+static void StratumBlocksChanged()
+{
+    bool fNewTip;
+    {
+        LOCK(cs_main);
+        fNewTip = (!pstratumjob || pstratumjob->pindexPrev != chainActive.Tip());
+    }
+    if (fNewTip)
+        CreateStratumJob();
+}
+
+static void StratumTimer(const boost::system::error_code& err)
+{
+    if (err)
+        return;
+    if (!pstratumjob || (mempool.GetTransactionsUpdated() != nStratumTransactionsUpdatedLast &&
+                         GetTime() - pstratumjob->nTimeCreated >= STRATUM_JOB_REFRESH_INTERVAL))
+        CreateStratumJob();
+    stratum_timer->expires_from_now(posix_time::seconds(1));
+    stratum_timer->async_wait(&StratumTimer);
+}
+
+static void NotifyStratumBlocksChanged()
+{
+    // Called with cs_main held; rebuild the job on the server thread
+    stratum_io_service->post(&StratumBlocksChanged);
+}
+
+static Value StratumSubmit(StratumConnectionRef conn, const Array& params)
+{
+    if (!conn->fAuthorized)
+        return StratumError(24, "Unauthorized worker");
+    if (params.size() < 5 || params[1].type() != str_type || params[2].type() != str_type)
+        return StratumError(20, "Invalid parameters");
+
+    std::map<std::string, boost::shared_ptr<CStratumJob> >::iterator mi = mapStratumJobs.find(params[1].get_str());
+    if (mi == mapStratumJobs.end())
+        return StratumError(21, "Job not found");
+    CStratumJob& job = *mi->second;
+
+    const std::string& strExtraNonce2 = params[2].get_str();
+    unsigned int nTime, nNonce;
+    if (strExtraNonce2.size() != 2 * STRATUM_EXTRANONCE2_SIZE || !IsHex(strExtraNonce2) ||
+        !StratumParseHexInt(params[3], nTime) || !StratumParseHexInt(params[4], nNonce))
+        return StratumError(20, "Invalid parameters");
+    if (nTime < job.block.nTime || nTime > GetAdjustedTime() + 2 * 60 * 60)
+        return StratumError(20, "ntime out of range");
+
+    // Reassemble the coinbase exactly as the miner hashed it
+    std::vector<unsigned char> vchCoinbase(job.vchCoinbase1);
+    std::vector<unsigned char> vchExtraNonce2 = ParseHex(strExtraNonce2);
+    vchCoinbase.insert(vchCoinbase.end(), conn->vchExtraNonce1.begin(), conn->vchExtraNonce1.end());
+    vchCoinbase.insert(vchCoinbase.end(), vchExtraNonce2.begin(), vchExtraNonce2.end());
+    vchCoinbase.insert(vchCoinbase.end(), job.vchCoinbase2.begin(), job.vchCoinbase2.end());
+    CDataStream ss(vchCoinbase, SER_NETWORK, PROTOCOL_VERSION);
+    CTransaction txCoinbase;
+    ss >> txCoinbase;
+
+    CBlock block;
+    block.nVersion = job.block.nVersion;
+    block.hashPrevBlock = job.block.hashPrevBlock;
+    block.hashMerkleRoot = CBlock::CheckMerkleBranch(txCoinbase.GetHash(), job.vMerkleBranch, 0);
+    block.nTime = nTime;
+    block.nBits = job.block.nBits;
+    block.nNonce = nNonce;
+
+    if (!job.setShares.insert(block.GetHash()).second)
+        return StratumError(22, "Duplicate share");
+
+    uint256 hashPoW = block.GetPoWHash();
+    uint256 hashTarget = CBigNum().SetCompact(block.nBits).getuint256();
+    if (hashPoW > hashTarget && hashPoW > hashStratumShareTarget)
+        return StratumError(23, "Low difficulty share");
+
+    if (hashPoW <= hashTarget)
+    {
+        block.vtx = job.block.vtx;
+        block.vtx[0] = txCoinbase;
+        LogPrintf("Stratum: %s found block %s\n", conn->strPeer, block.GetHash().ToString());
+
+        CValidationState state;
+        LOCK(cs_main);
+        if (!ProcessBlock(state, NULL, &block))
+            return StratumError(20, "Block rejected");
+    }
+    return true;
+}
+
+static void StratumHandleRequest(StratumConnectionRef conn, const std::string& strRequest)
+{
+    Value valRequest;
+    if (!ParseJSON(strRequest, valRequest) || valRequest.type() != obj_type)
+    {
+        LogPrint("stratum", "Stratum: parse error from %s\n", conn->strPeer);
+        StratumClose(conn);
+        return;
+    }
+    const Object& request = valRequest.get_obj();
+    Value id = find_value(request, "id");
+    Value method = find_value(request, "method");
+    Value params = find_value(request, "params");
+    if (method.type() != str_type)
+    {
+        StratumReply(conn, id, Value::null, StratumError(20, "Method not found"));
+        return;
+    }
+    const std::string& strMethod = method.get_str();
+    Array paramsArray;
+    if (params.type() == array_type)
+        paramsArray = params.get_array();
+
+    if (strMethod == "mining.subscribe")
+    {
+        std::string strSubscription = HexStr(conn->vchExtraNonce1);
+        Array subscription;
+        subscription.push_back("mining.notify");
+        subscription.push_back(strSubscription);
+        Array subscriptions;
+        subscriptions.push_back(subscription);
+
+        Array result;
+        result.push_back(subscriptions);
+        result.push_back(HexStr(conn->vchExtraNonce1));
+        result.push_back((int)STRATUM_EXTRANONCE2_SIZE);
+        StratumReply(conn, id, result, Value::null);
+
+        conn->fSubscribed = true;
+        StratumSendDifficulty(conn);
+        if (pstratumjob)
+            StratumSendJob(conn, *pstratumjob, true);
+    }
+    else if (strMethod == "mining.authorize")
+    {
+        // The port is only reachable by our own miners, any worker name is accepted
+        conn->fAuthorized = true;
+        StratumReply(conn, id, true, Value::null);
+    }
+    else if (strMethod == "mining.submit")
+    {
+        Value result = StratumSubmit(conn, paramsArray);
+        if (result.type() == array_type)
+            StratumReply(conn, id, false, result);
+        else
+            StratumReply(conn, id, result, Value::null);
+    }
+    else if (strMethod == "mining.extranonce.subscribe")
+        StratumReply(conn, id, false, Value::null);
+    else
+        StratumReply(conn, id, Value::null, StratumError(20, "Method not found"));
+}
+
+static void StratumReadHandler(StratumConnectionRef conn, const boost::system::error_code& err, std::size_t nBytes)
+{
+    if (!setStratumConnections.count(conn))
+        return;
+    if (err)
+    {
+        LogPrint("stratum", "Stratum: %s disconnected: %s\n", conn->strPeer, err.message());
+        StratumClose(conn);
+        return;
+    }
+
+    std::string strLine(buffers_begin(conn->buf.data()), buffers_begin(conn->buf.data()) + nBytes);
+    conn->buf.consume(nBytes);
+    boost::trim(strLine);
+    if (!strLine.empty())
+    {
+        try {
+            StratumHandleRequest(conn, strLine);
+        }
+        catch (std::exception& e) {
+            LogPrint("stratum", "Stratum: bad request from %s: %s\n", conn->strPeer, e.what());
+            StratumClose(conn);
+        }
+    }
+    StratumRead(conn);
+}
+
+static void StratumRead(StratumConnectionRef conn)
+{
+    if (!setStratumConnections.count(conn))
+        return;
+    async_read_until(conn->socket, conn->buf, '\n',
+                     boost::bind(&StratumReadHandler, conn, asio::placeholders::error, asio::placeholders::bytes_transferred));
+}
+
+static void StratumListen(boost::shared_ptr<ip::tcp::acceptor> acceptor);
+
+static void StratumAcceptHandler(boost::shared_ptr<ip::tcp::acceptor> acceptor, StratumConnectionRef conn,
+                                 const boost::system::error_code& err)
+{
+    // Immediately start accepting new connections, except when we're cancelled or our socket is closed.
+    if (err != asio::error::operation_aborted && acceptor->is_open())
+        StratumListen(acceptor);
+
+    if (err)
+        return;
+
+    boost::system::error_code ec;
+    conn->strPeer = conn->socket.remote_endpoint(ec).address().to_string();
+    unsigned int nExtraNonce1 = ++nStratumExtraNonce1Counter;
+    conn->vchExtraNonce1.resize(STRATUM_EXTRANONCE1_SIZE);
+    for (unsigned int i = 0; i < STRATUM_EXTRANONCE1_SIZE; i++)
+        conn->vchExtraNonce1[i] = (nExtraNonce1 >> (8 * (STRATUM_EXTRANONCE1_SIZE - 1 - i))) & 0xff;
+    LogPrint("stratum", "Stratum: connection from %s\n", conn->strPeer);
+
+    setStratumConnections.insert(conn);
+    StratumRead(conn);
+}
+
+static void StratumListen(boost::shared_ptr<ip::tcp::acceptor> acceptor)
+{
+    StratumConnectionRef conn(new CStratumConnection(*stratum_io_service));
+    acceptor->async_accept(conn->socket, boost::bind(&StratumAcceptHandler, acceptor, conn, asio::placeholders::error));
+}
+
+static bool GetStratumPayoutScript(std::string& strError)
+{
+    if (mapArgs.count("-stratumaddress"))
+    {
+        CCarboncoinAddress address(mapArgs["-stratumaddress"]);
+        if (!address.IsValid())
+        {
+            strError = strprintf(_("Invalid address for -stratumaddress: '%s'"), mapArgs["-stratumaddress"]);
+            return false;
+        }
+        scriptStratumPayout.SetDestination(address.Get());
+        return true;
+    }
+#ifdef ENABLE_WALLET
+    if (pwalletMain)
+    {
+        CPubKey pubkey;
+        if (!pwalletMain->GetKeyFromPool(pubkey))
+        {
+            strError = _("Keypool ran out, please call keypoolrefill first");
+            return false;
+        }
+        scriptStratumPayout = CScript() << pubkey << OP_CHECKSIG;
+        return true;
+    }
+#endif
+    strError = _("-stratumport requires -stratumaddress when the wallet is disabled");
+    return false;
+}
+
+bool StartStratumServer(std::string& strError)
+{
+    if (!GetStratumPayoutScript(strError))
+        return false;
+
+    int64_t nDifficulty = GetArg("-stratumdifficulty", DEFAULT_STRATUM_DIFFICULTY);
+    if (nDifficulty < 1)
+    {
+        strError = _("Invalid -stratumdifficulty, must be at least 1");
+        return false;
+    }
+    // Difficulty 1 is the scrypt difficulty 1 target stratum miners assume
+    hashStratumShareTarget = (CBigNum().SetCompact(0x1f00ffff) / CBigNum(nDifficulty)).getuint256();
+
+    assert(stratum_io_service == NULL);
+    stratum_io_service = new io_service();
+
+    int nPort = GetArg("-stratumport", 0);
+    std::vector<ip::address> vBind;
+    if (mapArgs.count("-stratumbind"))
+    {
+        BOOST_FOREACH(std::string strBind, mapMultiArgs["-stratumbind"])
+        {
+            boost::system::error_code ec;
+            ip::address bindAddress = ip::address::from_string(strBind, ec);
+            if (ec)
+            {
+                strError = strprintf(_("Cannot resolve -stratumbind address: '%s'"), strBind);
+                StopStratumServer();
+                return false;
+            }
+            vBind.push_back(bindAddress);
+        }
+    }
+    else
+    {
+        vBind.push_back(ip::address_v4::loopback());
+        vBind.push_back(ip::address_v6::loopback());
+    }
+
+    BOOST_FOREACH(const ip::address& bindAddress, vBind)
+    {
+        ip::tcp::endpoint endpoint(bindAddress, nPort);
+        try
+        {
+            boost::shared_ptr<ip::tcp::acceptor> acceptor(new ip::tcp::acceptor(*stratum_io_service));
+            acceptor->open(endpoint.protocol());
+            acceptor->set_option(ip::tcp::acceptor::reuse_address(true));
+            if (endpoint.protocol() == ip::tcp::v6())
+                acceptor->set_option(ip::v6_only(true));
+            acceptor->bind(endpoint);
+            acceptor->listen(socket_base::max_connections);
+            StratumListen(acceptor);
+            stratum_acceptors.push_back(acceptor);
+        }
+        catch(boost::system::system_error &e)
+        {
+            LogPrintf("Stratum: unable to listen on %s port %d: %s\n", bindAddress.to_string(), nPort, e.what());
+        }
+    }
+    if (stratum_acceptors.empty())
+    {
+        strError = strprintf(_("Unable to bind to stratum port %d on this computer."), nPort);
+        StopStratumServer();
+        return false;
+    }
+
+    stratum_timer = new deadline_timer(*stratum_io_service);
+    stratum_timer->expires_from_now(posix_time::seconds(0));
+    stratum_timer->async_wait(&StratumTimer);
+    stratum_blocks_changed = uiInterface.NotifyBlocksChanged.connect(&NotifyStratumBlocksChanged);
+
+    stratum_worker_group = new boost::thread_group();
+    stratum_worker_group->create_thread(boost::bind(&TraceThread<boost::function<void()> >, "stratum",
+                                                    boost::function<void()>(boost::bind(&io_service::run, stratum_io_service))));
+    LogPrintf("Stratum server listening on port %d\n", nPort);
+    return true;
+}
+
+void StopStratumServer()
+{
+    if (stratum_io_service == NULL) return;
+
+    stratum_blocks_changed.disconnect();
+
+    // Cancel timers and acceptors first, see StopRPCThreads
+    boost::system::error_code ec;
+    BOOST_FOREACH(const boost::shared_ptr<ip::tcp::acceptor> &acceptor, stratum_acceptors)
+        acceptor->cancel(ec);
+    stratum_acceptors.clear();
+    if (stratum_timer)
+        stratum_timer->cancel(ec);
+
+    stratum_io_service->stop();
+    if (stratum_worker_group != NULL)
+        stratum_worker_group->join_all();
+
+    BOOST_FOREACH(const StratumConnectionRef& conn, setStratumConnections)
+        conn->socket.close(ec);
+    setStratumConnections.clear();
+    mapStratumJobs.clear();
+    pstratumjob.reset();
+    delete stratum_worker_group; stratum_worker_group = NULL;
+    delete stratum_timer; stratum_timer = NULL;
+    delete stratum_io_service; stratum_io_service = NULL;
+}
@@ -0,0 +1,21 @@
+// Copyright (c) 2014 The Carboncoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef CARBONCOIN_STRATUM_H
+#define CARBONCOIN_STRATUM_H
+
+#include <string>
+
+/** Default for -stratumdifficulty, the share difficulty handed to miners */
+static const int DEFAULT_STRATUM_DIFFICULTY = 1;
+/** Seconds after which a job is refreshed with new mempool transactions */
+static const int STRATUM_JOB_REFRESH_INTERVAL = 30;
+
+/** Start the stratum mining server on -stratumport. Returns false and sets
+ * strError if it could not be started. */
+bool StartStratumServer(std::string& strError);
+/** Stop the stratum mining server and drop its connections */
+void StopStratumServer();
+
+#endif // CARBONCOIN_STRATUM_H
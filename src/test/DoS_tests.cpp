@@ -25,9 +25,16 @@
 // Tests this internal-to-main.cpp method:
 extern bool AddOrphanTx(const CTransaction& tx, NodeId peer);
 extern void EraseOrphansFor(NodeId peer);
-extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans);
-extern std::map<uint256, CTransaction> mapOrphanTransactions;
-extern std::map<uint256, std::set<uint256> > mapOrphanTransactionsByPrev;
+extern unsigned int LimitOrphanTxSize(unsigned int nMaxOrphans, size_t nMaxOrphanBytes);
+struct COrphanTx {
+    CTransaction tx;
+    NodeId fromPeer;
+    int64_t nTimeExpire;
+    unsigned int nTxSize;
+};
+extern std::map<uint256, COrphanTx> mapOrphanTransactions;
+extern std::map<COutPoint, std::set<uint256> > mapOrphanTransactionsByPrev;
+extern size_t nOrphanTransactionsSize;
 
 CService ip(uint32_t i)
 {
@@ -152,11 +159,11 @@ BOOST_AUTO_TEST_CASE(DoS_checknbits)
 
 CTransaction RandomOrphan()
 {
-    std::map<uint256, CTransaction>::iterator it;
+    std::map<uint256, COrphanTx>::iterator it;
     it = mapOrphanTransactions.lower_bound(GetRandHash());
     if (it == mapOrphanTransactions.end())
         it = mapOrphanTransactions.begin();
-    return it->second;
+    return it->second.tx;
 }
 
 BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
@@ -231,13 +238,61 @@ BOOST_AUTO_TEST_CASE(DoS_mapOrphans)
     }
 
     // Test LimitOrphanTxSize() function:
-    LimitOrphanTxSize(40);
+    LimitOrphanTxSize(40, MAX_BLOCK_SIZE);
     BOOST_CHECK(mapOrphanTransactions.size() <= 40);
-    LimitOrphanTxSize(10);
+    LimitOrphanTxSize(10, MAX_BLOCK_SIZE);
     BOOST_CHECK(mapOrphanTransactions.size() <= 10);
-    LimitOrphanTxSize(0);
+    size_t nBytesBefore = nOrphanTransactionsSize;
+    BOOST_CHECK(nBytesBefore > 0);
+    LimitOrphanTxSize(10, nBytesBefore / 2);
+    BOOST_CHECK(nOrphanTransactionsSize <= nBytesBefore / 2);
+    LimitOrphanTxSize(0, MAX_BLOCK_SIZE);
+    BOOST_CHECK(mapOrphanTransactions.empty());
+    BOOST_CHECK(mapOrphanTransactionsByPrev.empty());
+    BOOST_CHECK_EQUAL(nOrphanTransactionsSize, 0U);
+}
+
+BOOST_AUTO_TEST_CASE(DoS_mapOrphans_limits)
+{
+    CKey key;
+    key.MakeNewKey(true);
+
+    // A single peer cannot fill more than -maxorphantxperpeer slots:
+    mapArgs["-maxorphantxperpeer"] = "5";
+    CTransaction txParent;
+    for (int i = 0; i < 20; i++)
+    {
+        CTransaction tx;
+        tx.vin.resize(1);
+        tx.vin[0].prevout.n = 0;
+        tx.vin[0].prevout.hash = GetRandHash();
+        tx.vin[0].scriptSig << OP_1;
+        tx.vout.resize(1);
+        tx.vout[0].nValue = 1*CENT;
+        tx.vout[0].scriptPubKey.SetDestination(key.GetPubKey().GetID());
+
+        BOOST_CHECK(AddOrphanTx(tx, 0));
+        txParent = tx;
+    }
+    BOOST_CHECK_EQUAL(mapOrphanTransactions.size(), 5U);
+    mapArgs.erase("-maxorphantxperpeer");
+
+    // Orphans are indexed by the outpoint they spend, not the whole parent:
+    CTransaction txChild;
+    txChild.vin.resize(1);
+    txChild.vin[0].prevout = COutPoint(txParent.GetHash(), 1);
+    txChild.vout.resize(1);
+    txChild.vout[0].nValue = 1*CENT;
+    BOOST_CHECK(AddOrphanTx(txChild, 1));
+    BOOST_CHECK(mapOrphanTransactionsByPrev.count(COutPoint(txParent.GetHash(), 1)));
+    BOOST_CHECK(!mapOrphanTransactionsByPrev.count(COutPoint(txParent.GetHash(), 0)));
+
+    // Orphans expire:
+    SetMockTime(GetTime() + ORPHAN_TX_EXPIRE_TIME + ORPHAN_TX_EXPIRE_INTERVAL + 1);
+    LimitOrphanTxSize(DEFAULT_MAX_ORPHAN_TRANSACTIONS, DEFAULT_MAX_ORPHAN_TRANSACTIONS_SIZE);
     BOOST_CHECK(mapOrphanTransactions.empty());
     BOOST_CHECK(mapOrphanTransactionsByPrev.empty());
+    SetMockTime(0);
 }
 
 BOOST_AUTO_TEST_CASE(DoS_checkSig)
@@ -324,7 +379,7 @@ BOOST_AUTO_TEST_CASE(DoS_checkSig)
         BOOST_CHECK(VerifySignature(CCoins(orphans[j], MEMPOOL_HEIGHT), tx, j, flags, SIGHASH_ALL));
     mapArgs.erase("-maxsigcachesize");
 
-    LimitOrphanTxSize(0);
+    LimitOrphanTxSize(0, 0);
 }
 
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,158 @@
+// Copyright (c) 2014 The Carboncoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "blockfilter.h"
+
+#include "hash.h"
+#include "main.h"
+#include "util.h"
+
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+static CGCSFilter::Element RandomElement()
+{
+    CGCSFilter::Element element(32);
+    for (unsigned int i = 0; i < element.size(); i++)
+        element[i] = insecure_rand() & 0xff;
+    return element;
+}
+
+BOOST_AUTO_TEST_SUITE(blockfilter_tests)
+
+BOOST_AUTO_TEST_CASE(siphash_bytes)
+{
+    // Reference vectors from the SipHash paper: key 00..0f, message 00..(n-1)
+    const uint64_t k0 = 0x0706050403020100ULL, k1 = 0x0F0E0D0C0B0A0908ULL;
+    unsigned char msg[15];
+    for (unsigned int i = 0; i < sizeof(msg); i++)
+        msg[i] = i;
+    BOOST_CHECK_EQUAL(SipHash(k0, k1, NULL, 0), 0x726fdb47dd0e0e31ULL);
+    BOOST_CHECK_EQUAL(SipHash(k0, k1, msg, 1), 0x74f839c593dc67fdULL);
+    BOOST_CHECK_EQUAL(SipHash(k0, k1, msg, 8), 0x93f5f5799a932462ULL);
+    BOOST_CHECK_EQUAL(SipHash(k0, k1, msg, 15), 0xa129ca6149be45e5ULL);
+
+    // Same as the specialized 32 byte version
+    uint256 val = GetRandHash();
+    BOOST_CHECK_EQUAL(SipHash(k0, k1, val.begin(), 32), SipHashUint256(k0, k1, val));
+}
+
+BOOST_AUTO_TEST_CASE(gcsfilter_match)
+{
+    CGCSFilter::ElementSet included, excluded;
+    for (int i = 0; i < 100; i++)
+    {
+        included.insert(RandomElement());
+        excluded.insert(RandomElement());
+    }
+
+    CGCSFilter filter(0, 0, 10, 1 << 10, included);
+    BOOST_CHECK_EQUAL(filter.GetN(), 100U);
+    BOOST_FOREACH(const CGCSFilter::Element& element, included)
+        BOOST_CHECK(filter.Match(element));
+    BOOST_CHECK(filter.MatchAny(included));
+
+    // About 1 in 2^10 false positives
+    int nFalsePositives = 0;
+    BOOST_FOREACH(const CGCSFilter::Element& element, excluded)
+        if (filter.Match(element))
+            nFalsePositives++;
+    BOOST_CHECK(nFalsePositives < 5);
+
+    CGCSFilter::ElementSet mixed(excluded);
+    mixed.insert(*included.begin());
+    BOOST_CHECK(filter.MatchAny(mixed));
+
+    // Decoding gives the same filter
+    CGCSFilter decoded(0, 0, 10, 1 << 10, filter.GetEncoded());
+    BOOST_CHECK_EQUAL(decoded.GetN(), 100U);
+    BOOST_FOREACH(const CGCSFilter::Element& element, included)
+        BOOST_CHECK(decoded.Match(element));
+
+    // A truncated filter is rejected
+    vector<unsigned char> vTruncated(filter.GetEncoded().begin(), filter.GetEncoded().end() - 20);
+    BOOST_CHECK_THROW(CGCSFilter(0, 0, 10, 1 << 10, vTruncated), std::ios_base::failure);
+
+    CGCSFilter empty(0, 0, 10, 1 << 10, CGCSFilter::ElementSet());
+    BOOST_CHECK(empty.GetEncoded() == vector<unsigned char>(1, 0));
+    BOOST_CHECK(!empty.Match(*included.begin()));
+    BOOST_CHECK(!empty.MatchAny(included));
+}
+
+BOOST_AUTO_TEST_CASE(blockfilter_basic)
+{
+    CScript scriptIncluded = CScript() << OP_DUP << OP_HASH160 << vector<unsigned char>(20, 1) << OP_EQUALVERIFY << OP_CHECKSIG;
+    CScript scriptSpent = CScript() << vector<unsigned char>(33, 2) << OP_CHECKSIG;
+    CScript scriptOpReturn = CScript() << OP_RETURN << vector<unsigned char>(4, 3);
+    CScript scriptSpentOpReturn = CScript() << OP_RETURN << vector<unsigned char>(4, 4);
+
+    CBlock block;
+    block.nTime = 1400000000;
+    block.vtx.resize(2);
+    block.vtx[0].vin.resize(1);
+    block.vtx[0].vin[0].prevout.SetNull();
+    block.vtx[0].vout.resize(2);
+    block.vtx[0].vout[0].scriptPubKey = scriptIncluded;
+    block.vtx[0].vout[1].scriptPubKey = scriptOpReturn;
+    block.vtx[1].vin.resize(3);
+    block.vtx[1].vout.resize(2);
+    block.vtx[1].vout[0].scriptPubKey = scriptIncluded;
+    block.vtx[1].vout[1].scriptPubKey = CScript();
+    block.hashMerkleRoot = block.BuildMerkleTree();
+
+    // Spent output scripts come from the undo data, OP_RETURN ones included
+    CBlockUndo blockundo;
+    blockundo.vtxundo.resize(1);
+    blockundo.vtxundo[0].vprevout.push_back(CTxInUndo(CTxOut(1, scriptSpent)));
+    blockundo.vtxundo[0].vprevout.push_back(CTxInUndo(CTxOut(1, scriptSpentOpReturn)));
+    blockundo.vtxundo[0].vprevout.push_back(CTxInUndo(CTxOut(1, CScript())));
+
+    CBlockFilter filter(BLOCK_FILTER_BASIC, block, blockundo);
+    const CGCSFilter& gcs = filter.GetFilter();
+    BOOST_CHECK_EQUAL(gcs.GetN(), 3U);
+    BOOST_CHECK(gcs.Match(CGCSFilter::Element(scriptIncluded.begin(), scriptIncluded.end())));
+    BOOST_CHECK(gcs.Match(CGCSFilter::Element(scriptSpent.begin(), scriptSpent.end())));
+    BOOST_CHECK(gcs.Match(CGCSFilter::Element(scriptSpentOpReturn.begin(), scriptSpentOpReturn.end())));
+    BOOST_CHECK(!gcs.Match(CGCSFilter::Element(scriptOpReturn.begin(), scriptOpReturn.end())));
+
+    CBlockFilter decoded(BLOCK_FILTER_BASIC, block.GetHash(), filter.GetEncodedFilter());
+    BOOST_CHECK(decoded.GetHash() == filter.GetHash());
+    BOOST_CHECK(decoded.GetFilter().Match(CGCSFilter::Element(scriptSpent.begin(), scriptSpent.end())));
+
+    // The header commits to the previous one
+    uint256 hashFilter = filter.GetHash(), hashZero = 0;
+    uint256 header1 = filter.ComputeHeader(0);
+    BOOST_CHECK(header1 == Hash(BEGIN(hashFilter), END(hashFilter), BEGIN(hashZero), END(hashZero)));
+    BOOST_CHECK(filter.ComputeHeader(header1) != header1);
+}
+
+BOOST_AUTO_TEST_CASE(blockfilter_bip158_genesis)
+{
+    // Test vector from BIP 158: the testnet3 genesis block
+    const char* pszTimestamp = "The Times 03/Jan/2009 Chancellor on brink of second bailout for banks";
+    CTransaction txNew;
+    txNew.vin.resize(1);
+    txNew.vout.resize(1);
+    txNew.vin[0].scriptSig = CScript() << 486604799 << CScriptNum(4) << vector<unsigned char>((const unsigned char*)pszTimestamp, (const unsigned char*)pszTimestamp + strlen(pszTimestamp));
+    txNew.vout[0].nValue = 50 * COIN;
+    txNew.vout[0].scriptPubKey = CScript() << ParseHex("04678afdb0fe5548271967f1a67130b7105cd6a828e03909a67962e0ea1f61deb649f6bc3f4cef38c4f35504e51ec112de5c384df7ba0b8d578a4c702b6bf11d5f") << OP_CHECKSIG;
+    CBlock block;
+    block.vtx.push_back(txNew);
+    block.hashPrevBlock = 0;
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    block.nVersion = 1;
+    block.nTime = 1296688602;
+    block.nBits = 0x1d00ffff;
+    block.nNonce = 414098458;
+    BOOST_CHECK(block.GetHash() == uint256("000000000933ea01ad0ee984209779baaec3ced90fa3f408719526f8d77f4943"));
+
+    CBlockFilter filter(BLOCK_FILTER_BASIC, block, CBlockUndo());
+    BOOST_CHECK_EQUAL(HexStr(filter.GetEncodedFilter()), "019dfca8");
+    BOOST_CHECK(filter.ComputeHeader(0) == uint256("21584579b7eb08997773e5aeff3a7f932700042d0ed2a6129012b7d7ae81b750"));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
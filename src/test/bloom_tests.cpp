@@ -7,6 +7,7 @@
 #include "base58.h"
 #include "key.h"
 #include "main.h"
+#include "net.h"
 #include "serialize.h"
 #include "uint256.h"
 #include "util.h"
@@ -451,4 +452,275 @@ BOOST_AUTO_TEST_CASE(merkle_block_4_test_update_none)
     BOOST_CHECK(!filter.contains(COutPoint(uint256("0x02981fa052f0481dbc5868f4fc2166035a10f27a03cfd2de67326471df5bc041"), 0)));
 }
 
+// IsRelevantAndUpdate as it was before matching on CBloomTxElements, for
+// checking the two agree
+static bool IsRelevantAndUpdateReference(CBloomFilter& filter, unsigned char nFlags, const CTransaction& tx, const uint256& hash)
+{
+    bool fFound = filter.contains(hash);
+    for (unsigned int i = 0; i < tx.vout.size(); i++)
+    {
+        const CTxOut& txout = tx.vout[i];
+        CScript::const_iterator pc = txout.scriptPubKey.begin();
+        vector<unsigned char> data;
+        while (pc < txout.scriptPubKey.end())
+        {
+            opcodetype opcode;
+            if (!txout.scriptPubKey.GetOp(pc, opcode, data))
+                break;
+            if (data.size() != 0 && filter.contains(data))
+            {
+                fFound = true;
+                if ((nFlags & BLOOM_UPDATE_MASK) == BLOOM_UPDATE_ALL)
+                    filter.insert(COutPoint(hash, i));
+                else if ((nFlags & BLOOM_UPDATE_MASK) == BLOOM_UPDATE_P2PUBKEY_ONLY)
+                {
+                    txnouttype type;
+                    vector<vector<unsigned char> > vSolutions;
+                    if (Solver(txout.scriptPubKey, type, vSolutions) &&
+                            (type == TX_PUBKEY || type == TX_MULTISIG))
+                        filter.insert(COutPoint(hash, i));
+                }
+                break;
+            }
+        }
+    }
+    if (fFound)
+        return true;
+
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+    {
+        if (filter.contains(txin.prevout))
+            return true;
+        CScript::const_iterator pc = txin.scriptSig.begin();
+        vector<unsigned char> data;
+        while (pc < txin.scriptSig.end())
+        {
+            opcodetype opcode;
+            if (!txin.scriptSig.GetOp(pc, opcode, data))
+                break;
+            if (data.size() != 0 && filter.contains(data))
+                return true;
+        }
+    }
+    return false;
+}
+
+static vector<unsigned char> RandomBytes(unsigned int nSize)
+{
+    vector<unsigned char> vch(nSize);
+    for (unsigned int i = 0; i < nSize; i++)
+        vch[i] = insecure_rand() & 0xff;
+    return vch;
+}
+
+// A transaction with pay-to-pubkey-hash, pay-to-pubkey and the odd
+// unparseable output, spending random outpoints
+static CTransaction RandomRelayTransaction()
+{
+    CTransaction tx;
+    tx.vin.resize(1 + insecure_rand() % 3);
+    BOOST_FOREACH(CTxIn& txin, tx.vin)
+    {
+        txin.prevout = COutPoint(GetRandHash(), insecure_rand() % 4);
+        txin.scriptSig = CScript() << RandomBytes(72) << RandomBytes(33);
+    }
+    tx.vout.resize(1 + insecure_rand() % 3);
+    BOOST_FOREACH(CTxOut& txout, tx.vout)
+    {
+        txout.nValue = insecure_rand();
+        switch (insecure_rand() % 4)
+        {
+        case 0:
+            txout.scriptPubKey = CScript() << RandomBytes(33) << OP_CHECKSIG;
+            break;
+        case 1:
+            // Pushes more than is left, parsing stops after the first element
+            txout.scriptPubKey = CScript() << RandomBytes(20);
+            txout.scriptPubKey.push_back(OP_PUSHDATA1);
+            txout.scriptPubKey.push_back(100);
+            break;
+        default:
+            txout.scriptPubKey = CScript() << OP_DUP << OP_HASH160 << RandomBytes(20) << OP_EQUALVERIFY << OP_CHECKSIG;
+        }
+    }
+    return tx;
+}
+
+// Picks a random data element of tx's scripts, or random data
+static vector<unsigned char> RandomElement(const CTransaction& tx)
+{
+    vector<unsigned char> vch;
+    const CScript& script = insecure_rand() % 2 ? tx.vout[insecure_rand() % tx.vout.size()].scriptPubKey :
+                                                  tx.vin[insecure_rand() % tx.vin.size()].scriptSig;
+    CScript::const_iterator pc = script.begin();
+    opcodetype opcode;
+    while (script.GetOp(pc, opcode, vch) && (vch.empty() || insecure_rand() % 2))
+        ;
+    if (vch.empty())
+        vch = RandomBytes(20);
+    return vch;
+}
+
+BOOST_AUTO_TEST_CASE(bloom_match_elements_like_reference)
+{
+    seed_insecure_rand(true);
+    static const unsigned char vFlags[] = { BLOOM_UPDATE_NONE, BLOOM_UPDATE_ALL, BLOOM_UPDATE_P2PUBKEY_ONLY };
+    unsigned int nMatches = 0;
+    for (int i = 0; i < 2000; i++)
+    {
+        CTransaction tx = RandomRelayTransaction();
+        uint256 hash = tx.GetHash();
+        unsigned char nFlags = vFlags[i % 3];
+        CBloomFilter filter(10, 0.0001, insecure_rand(), nFlags);
+        for (int j = insecure_rand() % 3; j > 0; j--)
+            filter.insert(RandomElement(tx));
+        if (insecure_rand() % 8 == 0)
+            filter.insert(tx.vin[0].prevout);
+        CBloomFilter filterReference = filter;
+
+        bool fMatch = filter.IsRelevantAndUpdate(CBloomTxElements(tx, hash));
+        BOOST_CHECK_EQUAL(fMatch, IsRelevantAndUpdateReference(filterReference, nFlags, tx, hash));
+        nMatches += fMatch;
+
+        // Including the outpoints added by the update
+        CDataStream ss(SER_NETWORK, PROTOCOL_VERSION), ssReference(SER_NETWORK, PROTOCOL_VERSION);
+        ss << filter;
+        ssReference << filterReference;
+        BOOST_CHECK(ss.str() == ssReference.str());
+    }
+    // Both outcomes were exercised
+    BOOST_CHECK(nMatches > 500 && nMatches < 1900);
+}
+
+BOOST_AUTO_TEST_CASE(bloom_relay_benchmark)
+{
+    // Relay transactions to 500 SPV peers, each with a filter on a couple of
+    // its own keys, as RelayTransaction did before and does now
+    static const int NPEERS = 500;
+    static const int NTXS = 200;
+    seed_insecure_rand(true);
+    vector<CTransaction> vtx;
+    for (int i = 0; i < NTXS; i++)
+        vtx.push_back(RandomRelayTransaction());
+    vector<CBloomFilter> vFilters;
+    for (int i = 0; i < NPEERS; i++)
+    {
+        vFilters.push_back(CBloomFilter(20, 0.0001, insecure_rand(), BLOOM_UPDATE_P2PUBKEY_ONLY));
+        for (int j = 0; j < 20; j++)
+            vFilters.back().insert(RandomBytes(20));
+    }
+    vector<CBloomFilter> vFiltersReference = vFilters;
+
+    int64_t nStart = GetTimeMicros();
+    unsigned int nMatchesReference = 0;
+    BOOST_FOREACH(const CTransaction& tx, vtx)
+    {
+        uint256 hash = tx.GetHash();
+        for (int i = 0; i < NPEERS; i++)
+            nMatchesReference += IsRelevantAndUpdateReference(vFiltersReference[i], BLOOM_UPDATE_P2PUBKEY_ONLY, tx, hash);
+    }
+    int64_t nReference = GetTimeMicros() - nStart;
+
+    nStart = GetTimeMicros();
+    unsigned int nMatches = 0;
+    BOOST_FOREACH(const CTransaction& tx, vtx)
+    {
+        CBloomTxElements elements(tx, tx.GetHash());
+        for (int i = 0; i < NPEERS; i++)
+            nMatches += vFilters[i].IsRelevantAndUpdate(elements);
+    }
+    int64_t nElapsed = GetTimeMicros() - nStart;
+
+    BOOST_CHECK_EQUAL(nMatches, nMatchesReference);
+    BOOST_TEST_MESSAGE(strprintf("Bloom relay to %d peers: %.1fus per transaction, was %.1fus",
+                                 NPEERS, (double)nElapsed / NTXS, (double)nReference / NTXS));
+}
+
+static std::vector<unsigned char> RandomData()
+{
+    uint256 r = GetRandHash();
+    return std::vector<unsigned char>(r.begin(), r.end());
+}
+
+BOOST_AUTO_TEST_CASE(rolling_bloom)
+{
+    // last-100-entry, 1% false positive:
+    CRollingBloomFilter rb1(100, 0.01);
+
+    // Overfill:
+    static const int DATASIZE=399;
+    std::vector<unsigned char> data[DATASIZE];
+    for (int i = 0; i < DATASIZE; i++) {
+        data[i] = RandomData();
+        rb1.insert(data[i]);
+    }
+    // Last 100 guaranteed to be remembered:
+    for (int i = 299; i < DATASIZE; i++) {
+        BOOST_CHECK(rb1.contains(data[i]));
+    }
+
+    // false positive rate is 1%, so we should get about 100 hits if
+    // testing 10,000 random keys. We get worst-case false positive
+    // behavior when the filter is as full as possible, which is
+    // when we've inserted one minus an integer multiple of nElement*2.
+    unsigned int nHits = 0;
+    for (int i = 0; i < 10000; i++) {
+        if (rb1.contains(RandomData()))
+            ++nHits;
+    }
+    // Run test_carboncoin with --log_level=message to see BOOST_TEST_MESSAGEs:
+    BOOST_TEST_MESSAGE("RollingBloomFilter got " << nHits << " false positives (~100 expected)");
+
+    // Insanely unlikely to get a fp count outside this range:
+    BOOST_CHECK(nHits > 25);
+    BOOST_CHECK(nHits < 175);
+
+    BOOST_CHECK(rb1.contains(data[DATASIZE-1]));
+    rb1.reset();
+    BOOST_CHECK(!rb1.contains(data[DATASIZE-1]));
+
+    // Now roll through data, make sure last 100 entries
+    // are always remembered:
+    for (int i = 0; i < DATASIZE; i++) {
+        if (i >= 100)
+            BOOST_CHECK(rb1.contains(data[i-100]));
+        rb1.insert(data[i]);
+        BOOST_CHECK(rb1.contains(data[i]));
+    }
+
+    // Insert 999 more random entries:
+    for (int i = 0; i < 999; i++) {
+        rb1.insert(RandomData());
+    }
+    // Sanity check to make sure the filter isn't just filling up:
+    nHits = 0;
+    for (int i = 0; i < DATASIZE; i++) {
+        if (rb1.contains(data[i]))
+            ++nHits;
+    }
+    // Expect about 5 false positives, more than 100 means
+    // something is definitely broken.
+    BOOST_TEST_MESSAGE("RollingBloomFilter got " << nHits << " false positives (~5 expected)");
+    BOOST_CHECK(nHits < 100);
+
+    // last-1000-entry, 0.01% false positive:
+    CRollingBloomFilter rb2(1000, 0.001);
+    for (int i = 0; i < DATASIZE; i++) {
+        rb2.insert(data[i]);
+    }
+    // ... room for all of them:
+    for (int i = 0; i < DATASIZE; i++) {
+        BOOST_CHECK(rb2.contains(data[i]));
+    }
+}
+
+// The per-peer filters stay far smaller than the sets they replace
+BOOST_AUTO_TEST_CASE(rolling_bloom_known_filters_size)
+{
+    CRollingBloomFilter addrKnown(MAX_ADDR_KNOWN, ADDR_KNOWN_FP_RATE);
+    BOOST_CHECK(addrKnown.DynamicMemoryUsage() < 32 * 1000);
+    CRollingBloomFilter filterInventoryKnown(1000, INVENTORY_KNOWN_FP_RATE);
+    BOOST_CHECK(filterInventoryKnown.DynamicMemoryUsage() < 12 * 1000);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
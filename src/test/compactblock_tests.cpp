@@ -0,0 +1,157 @@
+// Copyright (c) 2014 The Carboncoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "compactblock.h"
+
+#include "hash.h"
+#include "main.h"
+#include "txmempool.h"
+
+#include <vector>
+
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+
+static CBlock BuildBlock(unsigned int nTx)
+{
+    CBlock block;
+    block.nBits = 0x207fffff;
+    block.nTime = 1400000000;
+    block.vtx.resize(nTx);
+    for (unsigned int i = 0; i < nTx; i++)
+    {
+        block.vtx[i].vin.resize(1);
+        block.vtx[i].vin[0].scriptSig = CScript() << i << OP_0;
+        block.vtx[i].vout.resize(1);
+        block.vtx[i].vout[0].nValue = 1000 + i;
+        block.vtx[i].vout[0].scriptPubKey = CScript() << OP_TRUE;
+    }
+    block.vtx[0].vin[0].prevout.SetNull();
+    block.hashMerkleRoot = block.BuildMerkleTree();
+    return block;
+}
+
+static void AddToPool(CTxMemPool& pool, const CTransaction& tx)
+{
+    pool.addUnchecked(tx.GetHash(), CTxMemPoolEntry(tx, 0, 0, 0.0, 1));
+}
+
+BOOST_AUTO_TEST_SUITE(compactblock_tests)
+
+BOOST_AUTO_TEST_CASE(shorttxid_siphash)
+{
+    // Reference vector from the SipHash paper: key 00..0f, message 00..1f
+    BOOST_CHECK_EQUAL(SipHashUint256(0x0706050403020100ULL, 0x0F0E0D0C0B0A0908ULL,
+        uint256("1f1e1d1c1b1a191817161514131211100f0e0d0c0b0a09080706050403020100")), 0x7127512f72f27cceULL);
+}
+
+BOOST_AUTO_TEST_CASE(reconstruct_with_missing_transactions)
+{
+    CBlock block = BuildBlock(6);
+    CTxMemPool pool;
+    AddToPool(pool, block.vtx[2]);
+    AddToPool(pool, block.vtx[4]);
+    AddToPool(pool, BuildBlock(12).vtx[9]);
+
+    vector<pair<uint256, const CTransaction*> > vOrphans;
+    vOrphans.push_back(make_pair(block.vtx[3].GetHash(), &block.vtx[3]));
+
+    // Goes over the wire with the coinbase prefilled
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << CCompactBlock(block, 42);
+    CCompactBlock cmpctblock;
+    ss >> cmpctblock;
+    BOOST_CHECK(cmpctblock.header.GetHash() == block.GetHash());
+    BOOST_CHECK_EQUAL(cmpctblock.shorttxids.size(), 5U);
+    BOOST_CHECK_EQUAL(cmpctblock.prefilledtxn.size(), 1U);
+    BOOST_CHECK_EQUAL(cmpctblock.prefilledtxn[0].index, 0U);
+
+    CPartialBlock partialBlock(&pool);
+    BOOST_CHECK_EQUAL(partialBlock.InitData(cmpctblock, vOrphans), READ_STATUS_OK);
+    BOOST_CHECK(partialBlock.IsTxAvailable(0));
+    BOOST_CHECK(!partialBlock.IsTxAvailable(1));
+    BOOST_CHECK(partialBlock.IsTxAvailable(2));
+    BOOST_CHECK(partialBlock.IsTxAvailable(3));
+    BOOST_CHECK(partialBlock.IsTxAvailable(4));
+    BOOST_CHECK(!partialBlock.IsTxAvailable(5));
+    BOOST_CHECK_EQUAL(partialBlock.GetPrefilledCount(), 1U);
+    BOOST_CHECK_EQUAL(partialBlock.GetFromPoolCount(), 3U);
+
+    // The getblocktxn round-trip
+    CBlockTransactionsRequest req;
+    req.blockhash = block.GetHash();
+    partialBlock.GetMissing(req.indexes);
+    ss << req;
+    CBlockTransactionsRequest reqRecv;
+    ss >> reqRecv;
+    BOOST_CHECK_EQUAL(reqRecv.indexes.size(), 2U);
+    BOOST_CHECK_EQUAL(reqRecv.indexes[0], 1U);
+    BOOST_CHECK_EQUAL(reqRecv.indexes[1], 5U);
+
+    CBlockTransactions resp(reqRecv);
+    for (unsigned int i = 0; i < reqRecv.indexes.size(); i++)
+        resp.txn[i] = block.vtx[reqRecv.indexes[i]];
+    ss << resp;
+    CBlockTransactions respRecv;
+    ss >> respRecv;
+
+    CBlock blockOut;
+    BOOST_CHECK_EQUAL(partialBlock.FillBlock(blockOut, respRecv.txn), READ_STATUS_OK);
+    BOOST_CHECK(blockOut.GetHash() == block.GetHash());
+    BOOST_CHECK_EQUAL(blockOut.vtx.size(), block.vtx.size());
+    for (unsigned int i = 0; i < block.vtx.size(); i++)
+        BOOST_CHECK(blockOut.vtx[i].GetHash() == block.vtx[i].GetHash());
+}
+
+BOOST_AUTO_TEST_CASE(reconstruct_bad_transactions)
+{
+    CBlock block = BuildBlock(4);
+    CTxMemPool pool;
+    AddToPool(pool, block.vtx[1]);
+    vector<pair<uint256, const CTransaction*> > vNoExtra;
+    CCompactBlock cmpctblock(block, 7);
+
+    // Too few or too many transactions for the missing slots
+    {
+        CPartialBlock partialBlock(&pool);
+        BOOST_CHECK_EQUAL(partialBlock.InitData(cmpctblock, vNoExtra), READ_STATUS_OK);
+        CBlock blockOut;
+        BOOST_CHECK_EQUAL(partialBlock.FillBlock(blockOut, vector<CTransaction>(1, block.vtx[2])), READ_STATUS_INVALID);
+    }
+    {
+        CPartialBlock partialBlock(&pool);
+        BOOST_CHECK_EQUAL(partialBlock.InitData(cmpctblock, vNoExtra), READ_STATUS_OK);
+        CBlock blockOut;
+        BOOST_CHECK_EQUAL(partialBlock.FillBlock(blockOut, vector<CTransaction>(3, block.vtx[2])), READ_STATUS_INVALID);
+    }
+
+    // The right number of transactions, but not the block's: the merkle root
+    // gives it away and the full block has to be fetched
+    {
+        CPartialBlock partialBlock(&pool);
+        BOOST_CHECK_EQUAL(partialBlock.InitData(cmpctblock, vNoExtra), READ_STATUS_OK);
+        vector<CTransaction> vtxWrong(2, block.vtx[2]);
+        CBlock blockOut;
+        BOOST_CHECK_EQUAL(partialBlock.FillBlock(blockOut, vtxWrong), READ_STATUS_FAILED);
+    }
+
+    // Prefilled transactions must point into the block
+    {
+        CCompactBlock cmpctBad(block, 7);
+        cmpctBad.prefilledtxn[0].index = cmpctBad.BlockTxCount();
+        CPartialBlock partialBlock(&pool);
+        BOOST_CHECK_EQUAL(partialBlock.InitData(cmpctBad, vNoExtra), READ_STATUS_INVALID);
+    }
+
+    // Two transactions of the block with the same short id can't be placed
+    {
+        CCompactBlock cmpctDup(block, 7);
+        cmpctDup.shorttxids[1] = cmpctDup.shorttxids[0];
+        CPartialBlock partialBlock(&pool);
+        BOOST_CHECK_EQUAL(partialBlock.InitData(cmpctDup, vNoExtra), READ_STATUS_FAILED);
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
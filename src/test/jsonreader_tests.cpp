@@ -0,0 +1,282 @@
+// Copyright (c) 2014 The Carboncoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "jsonreader.h"
+
+#include "uint256.h"
+#include "util.h"
+
+#include <cstring>
+#include <string>
+
+#include <boost/foreach.hpp>
+#include <boost/test/unit_test.hpp>
+
+#include "json/json_spirit_reader_template.h"
+#include "json/json_spirit_writer_template.h"
+
+using namespace std;
+using namespace json_spirit;
+
+// Same type, same numeric flavour, same bits
+static bool SameValue(const Value& a, const Value& b)
+{
+    if (a.type() != b.type())
+        return false;
+    switch (a.type())
+    {
+    case obj_type:
+    {
+        const Object& objA = a.get_obj();
+        const Object& objB = b.get_obj();
+        if (objA.size() != objB.size())
+            return false;
+        for (unsigned int i = 0; i < objA.size(); i++)
+            if (objA[i].name_ != objB[i].name_ || !SameValue(objA[i].value_, objB[i].value_))
+                return false;
+        return true;
+    }
+    case array_type:
+    {
+        const Array& arrA = a.get_array();
+        const Array& arrB = b.get_array();
+        if (arrA.size() != arrB.size())
+            return false;
+        for (unsigned int i = 0; i < arrA.size(); i++)
+            if (!SameValue(arrA[i], arrB[i]))
+                return false;
+        return true;
+    }
+    case str_type:
+        return a.get_str() == b.get_str();
+    case bool_type:
+        return a.get_bool() == b.get_bool();
+    case int_type:
+        return a.is_uint64() == b.is_uint64() && a.get_int64() == b.get_int64();
+    case real_type:
+    {
+        double dA = a.get_real(), dB = b.get_real();
+        return memcmp(&dA, &dB, sizeof(double)) == 0;
+    }
+    case null_type:
+        return true;
+    }
+    return false;
+}
+
+// Parses with both readers. They must agree, except that json_spirit
+// accepts escapes the new reader rejects.
+static bool CheckBothReaders(const string& str)
+{
+    Value value, valueSpirit;
+    bool fRead = ParseJSON(str, value);
+    bool fReadSpirit = read_string(str, valueSpirit);
+    if (fRead)
+    {
+        BOOST_CHECK_MESSAGE(fReadSpirit && SameValue(value, valueSpirit), str);
+        return fReadSpirit && SameValue(value, valueSpirit);
+    }
+    BOOST_CHECK_MESSAGE(!fReadSpirit || str.find('\\') != string::npos, str);
+    return !fReadSpirit || str.find('\\') != string::npos;
+}
+
+static string RandomString()
+{
+    string str;
+    int nSize = insecure_rand() % 10;
+    for (int i = 0; i < nSize; i++)
+        str += (char)(insecure_rand() % 4 == 0 ? insecure_rand() % 256 : 'a' + insecure_rand() % 26);
+    return str;
+}
+
+static Value RandomValue(int nDepth)
+{
+    switch (insecure_rand() % (nDepth > 0 ? 9 : 7))
+    {
+    case 0: return RandomString();
+    case 1: return (int64_t)(((uint64_t)insecure_rand() << 32) | insecure_rand()) >> (insecure_rand() % 64);
+    case 2: return (uint64_t)0xffffffffffffffffULL - insecure_rand();
+    case 3: return (double)(int64_t)(((uint64_t)insecure_rand() << 32) | insecure_rand()) / (1 + insecure_rand() % 100000000);
+    case 4: return (insecure_rand() % 2) == 0;
+    case 5: return Value::null;
+    case 6: return (int)insecure_rand() % 1000;
+    case 7:
+    {
+        Object obj;
+        int nSize = insecure_rand() % 5;
+        for (int i = 0; i < nSize; i++)
+            obj.push_back(Pair(RandomString(), RandomValue(nDepth - 1)));
+        return obj;
+    }
+    default:
+    {
+        Array arr;
+        int nSize = insecure_rand() % 5;
+        for (int i = 0; i < nSize; i++)
+            arr.push_back(RandomValue(nDepth - 1));
+        return arr;
+    }
+    }
+}
+
+static string RandomDigits(int nMax)
+{
+    string str;
+    int nSize = insecure_rand() % (nMax + 1);
+    for (int i = 0; i < nSize; i++)
+        str += (char)('0' + insecure_rand() % 10);
+    return str;
+}
+
+// Mostly well formed numbers in the forms json_spirit reads
+static string RandomNumber()
+{
+    static const char* signs[] = { "", "", "-", "+" };
+    string str = signs[insecure_rand() % 4];
+    str += RandomDigits(insecure_rand() % 4 == 0 ? 25 : 6);
+    if (insecure_rand() % 2)
+        str += "." + RandomDigits(insecure_rand() % 4 == 0 ? 25 : 8);
+    if (insecure_rand() % 4 == 0)
+        str += string(insecure_rand() % 2 ? "e" : "E") + signs[insecure_rand() % 4] + RandomDigits(3);
+    return str;
+}
+
+static void Mutate(string& str)
+{
+    static const char chars[] = "{}[]:,\"\\ \t\n-+.eE0123456789truefalsenullxu/";
+    int nEdits = 1 + insecure_rand() % 3;
+    for (int i = 0; i < nEdits; i++)
+    {
+        char c = (insecure_rand() % 8 == 0) ? (char)(insecure_rand() % 256) : chars[insecure_rand() % (sizeof(chars) - 1)];
+        size_t nPos = str.empty() ? 0 : insecure_rand() % str.size();
+        switch (insecure_rand() % 3)
+        {
+        case 0: str.insert(nPos, 1, c); break;
+        case 1: if (!str.empty()) str.erase(nPos, 1); break;
+        default: if (!str.empty()) str[nPos] = c; break;
+        }
+    }
+}
+
+BOOST_AUTO_TEST_SUITE(jsonreader_tests)
+
+BOOST_AUTO_TEST_CASE(jsonreader_cases)
+{
+    const char* cases[] = {
+        "", " ", "{}", "[]", " \t\n\v\f\r[ ]\r\n", "{ \"a\" : 1 , \"b\" : [ true , false , null ] }",
+        "1", "-1", "+1", "007", "-0", "1.", ".5", "-.5", "+.5", ".", "-", "1e5", "1E+5", "1e-5", "1.e2",
+        "1.5e", "1e", "e5", ".e5", "0.1", "0.12345678", "21000000", "2100000000000000",
+        "9223372036854775807", "9223372036854775808", "-9223372036854775808", "-9223372036854775809",
+        "18446744073709551615", "18446744073709551616", "+18446744073709551615", "1e400", "-1e-400",
+        "true", "false", "null", "tru", "nul", "True", "truex", "[truex]", "[1 2]", "[1,]", "[,1]",
+        "{\"a\"}", "{\"a\":}", "{\"a\":1,}", "{a:1}", "{\"a\":1 \"b\":2}", "{\"a\":1,\"a\":2}", "[[[]]]",
+        "[\"\\\"\\\\\\/\\b\\f\\n\\r\\t\"]", "\"\\u0041\\u00e9\\u20AC\"", "\"\\u004\"", "\"\\u00zz\"",
+        "\"abc", "\"\\", "\"a\nb\"", "{} trailing", "[1] ]", "{\"a\":[1,{\"b\":null}]}",
+    };
+    BOOST_FOREACH(const char* psz, cases)
+        CheckBothReaders(psz);
+
+    // Escapes json_spirit mangled
+    Value value;
+    BOOST_CHECK(!ParseJSON("\"\\q\"", value));
+    BOOST_CHECK(!ParseJSON("\"\\x41\"", value));
+    BOOST_CHECK(!ParseJSON("\"\\101\"", value));
+    BOOST_CHECK(ParseJSON("\"\\u00e9\"", value) && value.get_str() == "\xe9");
+
+    // Integers keep their flavour
+    BOOST_CHECK(ParseJSON("9223372036854775808", value) && value.is_uint64() && value.get_uint64() == 9223372036854775808ULL);
+    BOOST_CHECK(ParseJSON("9223372036854775807", value) && !value.is_uint64());
+}
+
+BOOST_AUTO_TEST_CASE(jsonreader_depth)
+{
+    Value value;
+    string strDeep = string(MAX_JSON_DEPTH, '[') + string(MAX_JSON_DEPTH, ']');
+    BOOST_CHECK(ParseJSON(strDeep, value));
+    BOOST_CHECK(!ParseJSON("[" + strDeep + "]", value));
+    BOOST_CHECK(!ParseJSON(string(1000000, '['), value));
+    BOOST_CHECK(!ParseJSON(string(1000000, '{'), value));
+}
+
+BOOST_AUTO_TEST_CASE(jsonreader_fuzz)
+{
+    seed_insecure_rand(true);
+    for (int i = 0; i < 2000; i++)
+    {
+        // Whatever json_spirit writes reads back the same
+        Value value = RandomValue(4);
+        string str = write_string(value, (i % 2) == 0);
+        BOOST_CHECK(CheckBothReaders(str));
+
+        Mutate(str);
+        CheckBothReaders(str);
+    }
+
+    for (int i = 0; i < 5000; i++)
+    {
+        string str = "[" + RandomNumber() + "," + RandomNumber() + "]";
+        CheckBothReaders(str);
+        CheckBothReaders(RandomNumber());
+        Mutate(str);
+        CheckBothReaders(str);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(jsonreader_throughput)
+{
+    // A big signrawtransaction request and a batch of small requests
+    Array prevtxs;
+    for (int i = 0; i < 500; i++)
+    {
+        Object prevtx;
+        prevtx.push_back(Pair("txid", GetRandHash().GetHex()));
+        prevtx.push_back(Pair("vout", i % 4));
+        prevtx.push_back(Pair("scriptPubKey", GetRandHash().GetHex()));
+        prevtx.push_back(Pair("redeemScript", GetRandHash().GetHex() + GetRandHash().GetHex()));
+        prevtx.push_back(Pair("amount", 0.12345678 * i));
+        prevtxs.push_back(prevtx);
+    }
+    Array params;
+    params.push_back(string(20000, 'a'));
+    params.push_back(prevtxs);
+    Object request;
+    request.push_back(Pair("method", "signrawtransaction"));
+    request.push_back(Pair("params", params));
+    request.push_back(Pair("id", 1));
+
+    Array batch;
+    for (int i = 0; i < 1000; i++)
+    {
+        Object call;
+        call.push_back(Pair("jsonrpc", "1.0"));
+        call.push_back(Pair("method", "getrawtransaction"));
+        call.push_back(Pair("params", Array(1, GetRandHash().GetHex())));
+        call.push_back(Pair("id", i));
+        batch.push_back(call);
+    }
+
+    string texts[] = { write_string(Value(request), false), write_string(Value(batch), true) };
+    BOOST_FOREACH(const string& str, texts)
+    {
+        static const int NRUNS = 10;
+        Value value, valueSpirit;
+
+        int64_t nStart = GetTimeMicros();
+        for (int i = 0; i < NRUNS; i++)
+            BOOST_CHECK(read_string(str, valueSpirit));
+        int64_t nReference = GetTimeMicros() - nStart;
+
+        nStart = GetTimeMicros();
+        for (int i = 0; i < NRUNS; i++)
+            BOOST_CHECK(ParseJSON(str, value));
+        int64_t nElapsed = GetTimeMicros() - nStart;
+
+        BOOST_CHECK(SameValue(value, valueSpirit));
+        BOOST_TEST_MESSAGE(strprintf("JSON parsing of %u bytes: %.1f MB/s, was %.1f MB/s", str.size(),
+                                     (double)str.size() * NRUNS / max(nElapsed, (int64_t)1),
+                                     (double)str.size() * NRUNS / max(nReference, (int64_t)1)));
+    }
+}
+
+BOOST_AUTO_TEST_SUITE_END()
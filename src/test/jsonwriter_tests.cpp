@@ -0,0 +1,234 @@
+// Copyright (c) 2014 The Carboncoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "jsonwriter.h"
+
+#include "chainparams.h"
+#include "main.h"
+#include "rpcserver.h"
+#include "util.h"
+
+#include <string>
+
+#include <boost/bind.hpp>
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+using namespace json_spirit;
+
+extern Object blockToJSON(const CBlock& block, const CBlockIndex* blockindex, int nConfirmations, const CBlockIndex* pnext);
+extern void blockToJSON(const CBlock& block, const CBlockIndex* blockindex, int nConfirmations, const CBlockIndex* pnext, CJSONWriter& writer);
+extern void TxToJSON(const CTransaction& tx, const uint256 hashBlock, Object& entry);
+extern void TxToJSON(const CTransaction& tx, const uint256 hashBlock, CJSONWriter& writer);
+
+static string RandomString()
+{
+    // Printable, escaped, control and non-ASCII characters
+    static const char chars[] = { 'a', 'Z', '0', ' ', '"', '\\', '/', '\b', '\f', '\n', '\r', '\t', '\x01', '\x1f', '\x7f', '\x80', '\xc3', '\xa9', '\xff' };
+    string str;
+    int nSize = insecure_rand() % 12;
+    for (int i = 0; i < nSize; i++)
+        str += chars[insecure_rand() % sizeof(chars)];
+    return str;
+}
+
+static Value RandomValue(int nDepth)
+{
+    static const double reals[] = { 0.0, -0.0, 1.0, 0.1, -3.5, 21000000.0, 1e20, -1e-9, 0.123456789 };
+    switch (insecure_rand() % (nDepth > 0 ? 10 : 8))
+    {
+    case 0: return RandomString();
+    case 1: return (int)insecure_rand();
+    case 2: return -(int64_t)(((uint64_t)insecure_rand() << 32) | insecure_rand()) / 2;
+    case 3: return (uint64_t)0xffffffffffffffffULL - insecure_rand();
+    case 4: return reals[insecure_rand() % (sizeof(reals) / sizeof(reals[0]))];
+    case 5: return (insecure_rand() % 2) == 0;
+    case 6: return Value::null;
+    case 7: return (double)(int)insecure_rand() / 1000;
+    case 8:
+    {
+        Object obj;
+        int nSize = insecure_rand() % 5;
+        for (int i = 0; i < nSize; i++)
+            obj.push_back(Pair(RandomString(), RandomValue(nDepth - 1)));
+        return obj;
+    }
+    default:
+    {
+        Array arr;
+        int nSize = insecure_rand() % 5;
+        for (int i = 0; i < nSize; i++)
+            arr.push_back(RandomValue(nDepth - 1));
+        return arr;
+    }
+    }
+}
+
+static void AppendTo(string* pstr, const string& str)
+{
+    *pstr += str;
+}
+
+BOOST_AUTO_TEST_SUITE(jsonwriter_tests)
+
+BOOST_AUTO_TEST_CASE(jsonwriter_values)
+{
+    for (int i = 0; i < 1000; i++)
+    {
+        Value value = RandomValue(4);
+        string strExpected = write_string(value, false);
+
+        CJSONWriter writer;
+        writer.Write(value);
+        BOOST_CHECK_EQUAL(writer.GetBuffer(), strExpected);
+
+        // Flushing in small pieces gives the same text
+        string strSunk;
+        CJSONWriter writerSunk(boost::bind(&AppendTo, &strSunk, _1), 1 + i % 7);
+        writerSunk.Write(value);
+        writerSunk.Flush();
+        BOOST_CHECK(writerSunk.GetBuffer().empty());
+        BOOST_CHECK_EQUAL(strSunk, strExpected);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(jsonwriter_structure)
+{
+    Object obj;
+    obj.push_back(Pair("a", Array()));
+    obj.push_back(Pair("b", Object()));
+    Array arr;
+    arr.push_back(1);
+    arr.push_back("x\"y");
+    arr.push_back(Value::null);
+    obj.push_back(Pair("c", arr));
+    obj.push_back(Pair("d", 2.5));
+
+    CJSONWriter writer;
+    writer.BeginObject();
+    writer.Key("a");
+    writer.BeginArray();
+    writer.EndArray();
+    writer.Key("b");
+    writer.BeginObject();
+    writer.EndObject();
+    writer.Key("c");
+    writer.BeginArray();
+    writer.Int(1);
+    writer.String("x\"y");
+    writer.Null();
+    writer.EndArray();
+    writer.Pair("d", 2.5);
+    writer.EndObject();
+    BOOST_CHECK_EQUAL(writer.GetBuffer(), write_string(Value(obj), false));
+    BOOST_CHECK_EQUAL(writer.GetBuffer(), "{\"a\":[],\"b\":{},\"c\":[1,\"x\\\"y\",null],\"d\":2.50000000}");
+}
+
+BOOST_AUTO_TEST_CASE(jsonwriter_block_tx)
+{
+    LOCK(cs_main);
+    const CBlock& genesis = Params().GenesisBlock();
+    CBlockIndex* pindexGenesis = mapBlockIndex[genesis.GetHash()];
+    BOOST_REQUIRE(pindexGenesis);
+
+    // A block with a parent and a next block
+    CBlock block;
+    block.nVersion = 2;
+    block.hashPrevBlock = genesis.GetHash();
+    block.nTime = genesis.nTime + 600;
+    block.nBits = 0x1c0fffff;
+    block.nNonce = 0xfedcba98;
+    block.vtx.push_back(genesis.vtx[0]);
+    CTransaction tx;
+    tx.vin.resize(2);
+    tx.vin[0].prevout = COutPoint(genesis.vtx[0].GetHash(), 0);
+    tx.vin[0].scriptSig = CScript() << vector<unsigned char>(71, 0x30);
+    tx.vin[1].prevout = COutPoint(GetRandHash(), 7);
+    tx.vin[1].nSequence = 1;
+    tx.vout.resize(3);
+    tx.vout[0].nValue = 12345678;
+    tx.vout[0].scriptPubKey = CScript() << OP_DUP << OP_HASH160 << vector<unsigned char>(20, 1) << OP_EQUALVERIFY << OP_CHECKSIG;
+    tx.vout[1].nValue = 1;
+    tx.vout[1].scriptPubKey = CScript() << OP_RETURN << vector<unsigned char>(4, 2);
+    tx.vout[2].nValue = 0;
+    tx.vout[2].scriptPubKey = CScript() << OP_1 << vector<unsigned char>(33, 2) << vector<unsigned char>(33, 3) << OP_2 << OP_CHECKMULTISIG;
+    tx.nLockTime = 99;
+    block.vtx.push_back(tx);
+    block.hashMerkleRoot = block.BuildMerkleTree();
+
+    CBlockIndex index(block);
+    index.nHeight = 1;
+    index.pprev = pindexGenesis;
+    index.nChainWork = pindexGenesis->nChainWork + pindexGenesis->nChainWork;
+
+    CJSONWriter writer;
+    blockToJSON(block, &index, 5, pindexGenesis, writer);
+    BOOST_CHECK_EQUAL(writer.GetBuffer(), write_string(Value(blockToJSON(block, &index, 5, pindexGenesis)), false));
+
+    // In a known block, an unknown one and none
+    uint256 hashBlocks[] = { genesis.GetHash(), GetRandHash(), 0 };
+    for (unsigned int i = 0; i < block.vtx.size(); i++)
+    {
+        BOOST_FOREACH(const uint256& hashBlock, hashBlocks)
+        {
+            Object entry;
+            TxToJSON(block.vtx[i], hashBlock, entry);
+            CJSONWriter writerTx;
+            writerTx.BeginObject();
+            TxToJSON(block.vtx[i], hashBlock, writerTx);
+            writerTx.EndObject();
+            BOOST_CHECK_EQUAL(writerTx.GetBuffer(), write_string(Value(entry), false));
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(jsonwriter_commands)
+{
+    // Each streamed command writes what its other actor returns
+    const char* commands[] = { "getblock", "getrawmempool", "getrawtransaction" };
+    Array paramsBlock;
+    paramsBlock.push_back(Params().GenesisBlock().GetHash().GetHex());
+
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(GetRandHash(), 1);
+    tx.vout.resize(1);
+    tx.vout[0].nValue = 5000;
+    tx.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    mempool.addUnchecked(tx.GetHash(), CTxMemPoolEntry(tx, 100, GetTime(), 1.5, 1));
+    Array paramsTx;
+    paramsTx.push_back(tx.GetHash().GetHex());
+
+    vector<Array> vParams[3];
+    vParams[0].push_back(paramsBlock);
+    paramsBlock.push_back(false);
+    vParams[0].push_back(paramsBlock);
+    vParams[1].push_back(Array());
+    vParams[1].push_back(Array(1, true));
+    vParams[2].push_back(paramsTx);
+    paramsTx.push_back(1);
+    vParams[2].push_back(paramsTx);
+
+    for (int i = 0; i < 3; i++)
+    {
+        const CRPCCommand* pcmd = tableRPC[commands[i]];
+        BOOST_REQUIRE(pcmd && pcmd->streamActor);
+        BOOST_FOREACH(const Array& params, vParams[i])
+        {
+            CJSONWriter writer;
+            pcmd->streamActor(params, writer);
+            BOOST_CHECK_EQUAL(writer.GetBuffer(), write_string(pcmd->actor(params, false), false));
+        }
+
+        // Wrong parameters give the help text
+        Array paramsBad(3, Value(true));
+        CJSONWriter writer;
+        BOOST_CHECK_THROW(pcmd->streamActor(paramsBad, writer), runtime_error);
+    }
+
+    list<CTransaction> removed;
+    mempool.remove(tx, removed);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -4,6 +4,7 @@
 
 #include "main.h"
 #include "miner.h"
+#include "scrypt.h"
 #include "uint256.h"
 #include "util.h"
 
@@ -48,6 +49,116 @@ struct {
     {2, 0xbbbeb305}, {2, 0xfe1c810a},
 };
 
+// Give tx a confirmed output to spend
+static uint256 AddFundingCoins(CTransaction& tx, int64_t nValue)
+{
+    CTransaction txFund;
+    txFund.vin.resize(1);
+    txFund.vin[0].prevout.hash = GetRandHash();
+    txFund.vin[0].prevout.n = 0;
+    txFund.vout.resize(1);
+    txFund.vout[0].nValue = nValue;
+    txFund.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    uint256 hash = txFund.GetHash();
+    pcoinsTip->SetCoins(hash, CCoins(txFund, chainActive.Height()));
+    tx.vin.resize(1);
+    tx.vin[0].prevout.hash = hash;
+    tx.vin[0].prevout.n = 0;
+    return hash;
+}
+
+BOOST_AUTO_TEST_CASE(CreateNewBlock_ancestor_package)
+{
+    CScript scriptPubKey = CScript() << OP_TRUE;
+    CBlockTemplate *pblocktemplate;
+
+    LOCK(cs_main);
+    mapArgs["-blockprioritysize"] = "0";
+
+    // A parent paying no fee, and a child paying enough for both:
+    CTransaction txParent;
+    uint256 hashFund = AddFundingCoins(txParent, 5000000000LL);
+    txParent.vout.resize(1);
+    txParent.vout[0].nValue = 5000000000LL;
+    txParent.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    uint256 hashParent = txParent.GetHash();
+    mempool.addUnchecked(hashParent, CTxMemPoolEntry(txParent, 0, GetTime(), 0.0, 1));
+
+    CTransaction txChild;
+    txChild.vin.resize(1);
+    txChild.vin[0].prevout.hash = hashParent;
+    txChild.vin[0].prevout.n = 0;
+    txChild.vout.resize(1);
+    txChild.vout[0].nValue = 5000000000LL - 100000000LL;
+    txChild.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    uint256 hashChild = txChild.GetHash();
+    mempool.addUnchecked(hashChild, CTxMemPoolEntry(txChild, 100000000LL, GetTime(), 0.0, 1));
+
+    // ... and an unrelated transaction paying no fee, which stays out:
+    CTransaction txFree;
+    uint256 hashFundFree = AddFundingCoins(txFree, 5000000000LL);
+    txFree.vout.resize(1);
+    txFree.vout[0].nValue = 5000000000LL;
+    txFree.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    mempool.addUnchecked(txFree.GetHash(), CTxMemPoolEntry(txFree, 0, GetTime(), 0.0, 1));
+
+    BOOST_CHECK(pblocktemplate = CreateNewBlock(scriptPubKey));
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 3U);
+    BOOST_CHECK(pblocktemplate->block.vtx[1].GetHash() == hashParent);
+    BOOST_CHECK(pblocktemplate->block.vtx[2].GetHash() == hashChild);
+    BOOST_CHECK_EQUAL(pblocktemplate->vTxFees[0], -100000000LL);
+    delete pblocktemplate;
+
+    mempool.clear();
+    pcoinsTip->SetCoins(hashFund, CCoins());
+    pcoinsTip->SetCoins(hashFundFree, CCoins());
+    mapArgs.erase("-blockprioritysize");
+}
+
+BOOST_AUTO_TEST_CASE(CreateNewBlock_benchmark)
+{
+    // Build a template from a synthetic 50k-transaction mempool made of
+    // chains of dependent transactions with random fees.
+    static const int NCHAINS = 10000;
+    static const int NCHAINLENGTH = 5;
+    CScript scriptPubKey = CScript() << OP_TRUE;
+    CBlockTemplate *pblocktemplate;
+    std::vector<uint256> vFunding;
+
+    LOCK(cs_main);
+
+    for (int i = 0; i < NCHAINS; i++)
+    {
+        CTransaction tx;
+        vFunding.push_back(AddFundingCoins(tx, 5000000000LL));
+        tx.vout.resize(1);
+        tx.vout[0].nValue = 5000000000LL;
+        tx.vout[0].scriptPubKey = CScript() << OP_TRUE;
+        for (int j = 0; j < NCHAINLENGTH; j++)
+        {
+            int64_t nFee = GetRand(20000000);
+            tx.vout[0].nValue -= nFee;
+            uint256 hash = tx.GetHash();
+            mempool.addUnchecked(hash, CTxMemPoolEntry(tx, nFee, GetTime(), 0.0, 1));
+            tx.vin[0].prevout.hash = hash;
+        }
+    }
+    BOOST_CHECK_EQUAL(mempool.size(), (unsigned long)(NCHAINS * NCHAINLENGTH));
+
+    int64_t nStart = GetTimeMicros();
+    BOOST_CHECK(pblocktemplate = CreateNewBlock(scriptPubKey));
+    int64_t nElapsed = GetTimeMicros() - nStart;
+    BOOST_TEST_MESSAGE(strprintf("CreateNewBlock: %u of %u transactions, fees %d, %.2fms",
+                                 pblocktemplate->block.vtx.size() - 1, mempool.size(),
+                                 -pblocktemplate->vTxFees[0], nElapsed * 0.001));
+    BOOST_CHECK(::GetSerializeSize(pblocktemplate->block, SER_NETWORK, PROTOCOL_VERSION) <= DEFAULT_BLOCK_MAX_SIZE);
+    delete pblocktemplate;
+
+    mempool.clear();
+    BOOST_FOREACH(const uint256& hash, vFunding)
+        pcoinsTip->SetCoins(hash, CCoins());
+}
+
 // NOTE: These tests rely on CreateNewBlock doing its own self-validation!
 BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
 {
@@ -285,4 +396,31 @@ BOOST_AUTO_TEST_CASE(sha256transform_equality)
     BOOST_CHECK(hash == hash_reference);
 }
 
+BOOST_AUTO_TEST_CASE(scrypt_midstate_equality)
+{
+    // The miner hashes successive nonces from one midstate of the header
+    // prefix; that must give the same result as hashing from scratch.
+    CBlock header;
+    header.nVersion = 2;
+    header.hashPrevBlock = uint256("0x4fe1c0e2b3c3f1bfb4e0c6b7a3a5c9d1e8f7a6b5c4d3e2f1a0b9c8d7e6f5a4b3");
+    header.hashMerkleRoot = uint256("0x9a8b7c6d5e4f3a2b1c0d9e8f7a6b5c4d3e2f1a0b9c8d7e6f5a4b3c2d1e0f9a8b");
+    header.nTime = 1400000000;
+    header.nBits = 0x1e0ffff0;
+
+    char scratchpad[SCRYPT_SCRATCHPAD_SIZE];
+    SHA256_CTX midstate;
+    scrypt_1024_1_1_256_midstate(BEGIN(header.nVersion), &midstate);
+    for (unsigned int nNonce = 0; nNonce < 8; nNonce++)
+    {
+        header.nNonce = nNonce * 0x01010101;
+        uint256 hash, hashMidstate;
+        scrypt_1024_1_1_256(BEGIN(header.nVersion), BEGIN(hash));
+        scrypt_1024_1_1_256_sp_midstate(BEGIN(header.nVersion), BEGIN(hashMidstate), scratchpad, &midstate);
+        BOOST_CHECK(hash == hashMidstate);
+        BOOST_CHECK(hash == header.GetPoWHash());
+        if (nNonce == 0)
+            BOOST_CHECK(hash == uint256("0x648ef8d20ea6007db9a2ab0811ee269337d913f86367803c8129c7a0cc87b1c3"));
+    }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,265 @@
+// Copyright (c) 2014 The Carboncoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+//
+// Unit tests for peer message handling
+//
+
+#include "bloom.h"
+#include "main.h"
+#include "net.h"
+#include "serialize.h"
+#include "util.h"
+
+#include <boost/test/unit_test.hpp>
+
+#ifndef WIN32
+#include <fcntl.h>
+#endif
+
+using namespace std;
+
+// Serialize a message as it goes over the wire
+static CDataStream MakeMessage(const char* pszCommand, const CDataStream& ssPayload)
+{
+    CMessageHeader hdr(pszCommand, ssPayload.size());
+    uint256 hash = Hash(ssPayload.begin(), ssPayload.end());
+    memcpy(&hdr.nChecksum, &hash, sizeof(hdr.nChecksum));
+
+    CDataStream ss(SER_NETWORK, PROTOCOL_VERSION);
+    ss << hdr;
+    ss += ssPayload;
+    return ss;
+}
+
+// Feed a complete message to a node as if it came off the wire
+static void ReceiveMessage(CNode& node, const char* pszCommand, const CDataStream& ssPayload)
+{
+    CDataStream ss = MakeMessage(pszCommand, ssPayload);
+    bool fComplete = false;
+    LOCK(node.cs_vRecvMsg);
+    BOOST_CHECK(node.ReceiveMsgBytes(&ss[0], ss.size(), fComplete));
+    BOOST_CHECK(fComplete);
+}
+
+BOOST_AUTO_TEST_SUITE(net_tests)
+
+BOOST_AUTO_TEST_CASE(worker_messages_keep_order)
+{
+    CAddress addr(CService("10.0.0.1", Params().GetDefaultPort()));
+    CNode node(INVALID_SOCKET, addr, "", true);
+
+    vector<unsigned char> vchFirst = ParseHex("99108ad8ed9bb6274d3980bab5a85c048f0950c8");
+    vector<unsigned char> vchSecond = ParseHex("b5a2c786d9ef4658287ced5914b37a1b4aa32eee");
+
+    CDataStream ssLoad(SER_NETWORK, PROTOCOL_VERSION);
+    ssLoad << CBloomFilter(10, 0.000001, 0, BLOOM_UPDATE_ALL);
+    CDataStream ssAddFirst(SER_NETWORK, PROTOCOL_VERSION);
+    ssAddFirst << vchFirst;
+    CDataStream ssGetBlock(SER_NETWORK, PROTOCOL_VERSION);
+    ssGetBlock << vector<CInv>(1, CInv(MSG_BLOCK, uint256(1)));
+    CDataStream ssAddSecond(SER_NETWORK, PROTOCOL_VERSION);
+    ssAddSecond << vchSecond;
+
+    ReceiveMessage(node, "filterload", ssLoad);
+    ReceiveMessage(node, "filteradd", ssAddFirst);
+    ReceiveMessage(node, "getdata", ssGetBlock);
+    ReceiveMessage(node, "filteradd", ssAddSecond);
+
+    LOCK(node.cs_vRecvMsg);
+
+    // Nothing is handed to the workers before the version handshake
+    BOOST_CHECK(ProcessWorkerMessages(&node));
+    BOOST_CHECK_EQUAL(node.vRecvMsg.size(), 4U);
+
+    // The filter messages are served up to the block request, which needs
+    // cs_main; the filteradd after it has to wait for the message handler
+    node.nVersion = PROTOCOL_VERSION;
+    BOOST_CHECK(ProcessWorkerMessages(&node));
+    BOOST_CHECK(!node.fDisconnect);
+    BOOST_CHECK_EQUAL(node.vRecvMsg.size(), 2U);
+    BOOST_CHECK_EQUAL(node.vRecvMsg.front().hdr.GetCommand(), "getdata");
+    {
+        LOCK(node.cs_filter);
+        BOOST_CHECK(node.pfilter->contains(vchFirst));
+        BOOST_CHECK(!node.pfilter->contains(vchSecond));
+    }
+
+    // Running again makes no progress past it
+    BOOST_CHECK(ProcessWorkerMessages(&node));
+    BOOST_CHECK_EQUAL(node.vRecvMsg.size(), 2U);
+}
+
+BOOST_AUTO_TEST_CASE(message_stats_by_command)
+{
+    CAddress addr(CService("10.0.0.1", Params().GetDefaultPort()));
+    CNode node(INVALID_SOCKET, addr, "", true);
+    node.nVersion = PROTOCOL_VERSION;
+
+    CDataStream ssLoad(SER_NETWORK, PROTOCOL_VERSION);
+    ssLoad << CBloomFilter(10, 0.000001, 0, BLOOM_UPDATE_ALL);
+    CDataStream ssAdd(SER_NETWORK, PROTOCOL_VERSION);
+    ssAdd << ParseHex("99108ad8ed9bb6274d3980bab5a85c048f0950c8");
+
+    ReceiveMessage(node, "filterload", ssLoad);
+    ReceiveMessage(node, "filteradd", ssAdd);
+    ReceiveMessage(node, "filteradd", ssAdd);
+    ReceiveMessage(node, "nosuchcmd", ssAdd);
+    {
+        LOCK(node.cs_vRecvMsg);
+        BOOST_CHECK(ProcessWorkerMessages(&node));
+        // The unknown command is left for the message handler
+        BOOST_CHECK_EQUAL(node.vRecvMsg.size(), 1U);
+    }
+    node.PushMessage("ping", (uint64_t)1);
+
+    CNodeStats stats;
+    node.copyStats(stats);
+    const mapMsgCmdStats& mapStats = stats.mapMsgStats;
+
+    // Unknown commands share one entry
+    BOOST_CHECK_EQUAL(mapStats.size(), 4U);
+    BOOST_CHECK(mapStats.count("*other*"));
+    BOOST_CHECK(!mapStats.count("nosuchcmd"));
+
+    const CMessageStats& add = mapStats.find("filteradd")->second;
+    BOOST_CHECK_EQUAL(add.nMsgsRecv, 2U);
+    BOOST_CHECK_EQUAL(add.nBytesRecv, 2 * (CMessageHeader::HEADER_SIZE + ssAdd.size()));
+    BOOST_CHECK_EQUAL(add.nMsgsSent, 0U);
+    uint64_t nHandled = 0;
+    for (int i = 0; i < MESSAGE_TIME_BUCKETS; i++)
+        nHandled += add.vHandleBuckets[i];
+    BOOST_CHECK_EQUAL(nHandled, 2U);
+
+    const CMessageStats& ping = mapStats.find("ping")->second;
+    BOOST_CHECK_EQUAL(ping.nMsgsSent, 1U);
+    BOOST_CHECK_EQUAL(ping.nBytesSent, CMessageHeader::HEADER_SIZE + sizeof(uint64_t));
+    BOOST_CHECK_EQUAL(ping.nMsgsRecv, 0U);
+
+    // Handling time buckets are powers of ten microseconds
+    CMessageStats timing;
+    timing.AddHandleTime(0);
+    timing.AddHandleTime(9);
+    timing.AddHandleTime(10);
+    timing.AddHandleTime(999);
+    timing.AddHandleTime(60 * 1000000);
+    BOOST_CHECK_EQUAL(timing.vHandleBuckets[0], 2U);
+    BOOST_CHECK_EQUAL(timing.vHandleBuckets[1], 1U);
+    BOOST_CHECK_EQUAL(timing.vHandleBuckets[2], 1U);
+    BOOST_CHECK_EQUAL(timing.vHandleBuckets[MESSAGE_TIME_BUCKETS - 1], 1U);
+    BOOST_CHECK_EQUAL(timing.nHandleUsec, 60 * 1000000U + 1018U);
+}
+
+BOOST_AUTO_TEST_CASE(recv_buffer_grows_with_data)
+{
+    CAddress addr(CService("10.0.0.1", Params().GetDefaultPort()));
+    CNode node(INVALID_SOCKET, addr, "", true);
+
+    vector<char> vchData(MAX_POOLED_RECV_BUFFER + 1000);
+    for (unsigned int i = 0; i < vchData.size(); i++)
+        vchData[i] = (char)(i * 7);
+    CDataStream ssPayload(SER_NETWORK, PROTOCOL_VERSION);
+    ssPayload.write(&vchData[0], vchData.size());
+    CDataStream ss = MakeMessage("block", ssPayload);
+
+    LOCK(node.cs_vRecvMsg);
+    bool fComplete = false;
+
+    // The header alone doesn't get the announced size allocated
+    unsigned int nPos = CMessageHeader::HEADER_SIZE + 100;
+    BOOST_CHECK(node.ReceiveMsgBytes(&ss[0], nPos, fComplete));
+    BOOST_CHECK(!fComplete);
+    BOOST_CHECK_EQUAL(node.vRecvMsg.size(), 1U);
+    BOOST_CHECK(node.vRecvMsg.back().vRecv.capacity() <= RECV_CHUNK_SIZE);
+    BOOST_CHECK(node.GetTotalRecvSize() <= RECV_CHUNK_SIZE + CMessageHeader::HEADER_SIZE);
+
+    while (nPos < ss.size())
+    {
+        unsigned int nBytes = std::min((unsigned int)ss.size() - nPos, 1000U);
+        BOOST_CHECK(node.ReceiveMsgBytes(&ss[nPos], nBytes, fComplete));
+        nPos += nBytes;
+    }
+    BOOST_CHECK(fComplete);
+
+    // Data and incremental checksum match what was sent
+    CNetMessage& msg = node.vRecvMsg.front();
+    BOOST_CHECK(msg.complete());
+    BOOST_CHECK_EQUAL(msg.vRecv.size(), vchData.size());
+    BOOST_CHECK(msg.vRecv.capacity() == vchData.size());
+    BOOST_CHECK(std::equal(vchData.begin(), vchData.end(), msg.vRecv.begin()));
+    BOOST_CHECK(msg.GetMessageHash() == Hash(vchData.begin(), vchData.end()));
+
+    // Too large to keep around
+    node.PopRecvMsg();
+    BOOST_CHECK(node.vRecvMsg.empty());
+    BOOST_CHECK(node.vRecvPool.empty());
+
+    // A small buffer is kept and handed to the next message
+    CDataStream ssPing(SER_NETWORK, PROTOCOL_VERSION);
+    ssPing << (uint64_t)1;
+    ReceiveMessage(node, "ping", ssPing);
+    node.PopRecvMsg();
+    BOOST_CHECK_EQUAL(node.vRecvPool.size(), 1U);
+    ReceiveMessage(node, "ping", ssPing);
+    BOOST_CHECK(node.vRecvPool.empty());
+    BOOST_CHECK(node.vRecvMsg.front().GetMessageHash() == Hash(ssPing.begin(), ssPing.end()));
+}
+
+#ifndef WIN32
+BOOST_AUTO_TEST_CASE(send_gathers_shared_messages)
+{
+    int fds[2];
+    BOOST_REQUIRE(socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == 0);
+    int nSendBuf = 4096;
+    setsockopt(fds[0], SOL_SOCKET, SO_SNDBUF, &nSendBuf, sizeof(nSendBuf));
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+
+    CAddress addr(CService("10.0.0.1", Params().GetDefaultPort()));
+    CNode node(fds[0], addr, "", true);
+
+    // Larger than the socket buffer, so sends are partial
+    CDataStream ssBig(SER_NETWORK, PROTOCOL_VERSION);
+    ssBig << vector<char>(200000, 'x');
+    CSharedMessage pBig = MakeSharedMessage("block", ssBig);
+    BOOST_CHECK(string(pBig->begin(), pBig->end()) == MakeMessage("block", ssBig).str());
+
+    CDataStream ssPing(SER_NETWORK, PROTOCOL_VERSION);
+    ssPing << (uint64_t)1;
+    CDataStream ssExpected(SER_NETWORK, PROTOCOL_VERSION);
+    ssExpected.write(&(*pBig)[0], pBig->size());
+    ssExpected += MakeMessage("ping", ssPing);
+    ssExpected += MakeMessage("ping", ssPing);
+    ssExpected.write(&(*pBig)[0], pBig->size());
+
+    node.PushSharedMessage(pBig);
+    node.PushMessage("ping", (uint64_t)1);
+    node.PushMessage("ping", (uint64_t)1);
+    node.PushSharedMessage(pBig);
+
+    // Both copies are queued by reference
+    BOOST_CHECK_EQUAL(pBig.use_count(), 3);
+
+    // Drain the other end, letting the node send more as room frees up
+    vector<char> vchReceived;
+    for (int i = 0; i < 100000 && vchReceived.size() < ssExpected.size(); i++)
+    {
+        char pchBuf[0x10000];
+        int nBytes = recv(fds[1], pchBuf, sizeof(pchBuf), 0);
+        if (nBytes > 0)
+            vchReceived.insert(vchReceived.end(), pchBuf, pchBuf + nBytes);
+        LOCK(node.cs_vSend);
+        SocketSendData(&node);
+    }
+    close(fds[1]);
+
+    BOOST_CHECK(!node.fDisconnect);
+    BOOST_CHECK(node.vSendMsg.empty());
+    BOOST_CHECK_EQUAL(node.nSendSize, 0U);
+    BOOST_CHECK_EQUAL(pBig.use_count(), 1);
+    BOOST_CHECK_EQUAL(vchReceived.size(), ssExpected.size());
+    BOOST_CHECK(std::equal(vchReceived.begin(), vchReceived.end(), ssExpected.begin()));
+}
+#endif
+
+BOOST_AUTO_TEST_SUITE_END()
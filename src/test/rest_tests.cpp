@@ -0,0 +1,161 @@
+// Copyright (c) 2014 The Carboncoin developers
+// Distributed under the MIT/X11 software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "chainparams.h"
+#include "jsonreader.h"
+#include "main.h"
+#include "rpcserver.h"
+#include "util.h"
+
+#include <string>
+
+#include <boost/algorithm/string.hpp>
+#include <boost/test/unit_test.hpp>
+
+using namespace std;
+using namespace json_spirit;
+
+// Status and body of a REST reply
+static int GetREST(const string& strURI, string& strBody)
+{
+    string strReply = RESTReply(strURI, false);
+    size_t nPos = strReply.find("\r\n\r\n");
+    BOOST_REQUIRE(nPos != string::npos);
+    strBody = strReply.substr(nPos + 4);
+    return atoi(strReply.substr(strlen("HTTP/1.1 "), 3));
+}
+
+static Value GetRESTJSON(const string& strURI)
+{
+    string strBody;
+    BOOST_REQUIRE_EQUAL(GetREST(strURI, strBody), 200);
+    Value value;
+    BOOST_REQUIRE(ParseJSON(strBody, value));
+    return value;
+}
+
+BOOST_AUTO_TEST_SUITE(rest_tests)
+
+BOOST_AUTO_TEST_CASE(rest_block_headers)
+{
+    const CBlock& genesis = Params().GenesisBlock();
+    string strHash = genesis.GetHash().GetHex();
+    CDataStream ssBlock(SER_NETWORK, PROTOCOL_VERSION);
+    ssBlock << genesis;
+
+    // The block as it is stored, in every format
+    string strBody;
+    BOOST_CHECK_EQUAL(GetREST("/rest/block/" + strHash + ".bin", strBody), 200);
+    BOOST_CHECK(strBody == ssBlock.str());
+    BOOST_CHECK_EQUAL(GetREST("/rest/block/" + strHash + ".hex", strBody), 200);
+    BOOST_CHECK_EQUAL(strBody, HexStr(ssBlock.begin(), ssBlock.end()) + "\n");
+
+    Array params;
+    params.push_back(strHash);
+    BOOST_CHECK_EQUAL(GetREST("/rest/block/" + strHash + ".json", strBody), 200);
+    BOOST_CHECK_EQUAL(strBody, write_string(tableRPC.execute("getblock", params), false) + "\n");
+
+    // Headers from the genesis block on
+    CDataStream ssHeader(SER_NETWORK, PROTOCOL_VERSION);
+    ssHeader << genesis.GetBlockHeader();
+    BOOST_CHECK_EQUAL(GetREST("/rest/headers/5/" + strHash + ".bin", strBody), 200);
+    BOOST_CHECK_EQUAL(strBody.size(), 80U * (chainActive.Height() < 4 ? chainActive.Height() + 1 : 5));
+    BOOST_CHECK(strBody.substr(0, 80) == ssHeader.str());
+
+    Array headers = GetRESTJSON("/rest/headers/1/" + strHash + ".json").get_array();
+    BOOST_REQUIRE_EQUAL(headers.size(), 1U);
+    BOOST_CHECK_EQUAL(find_value(headers[0].get_obj(), "hash").get_str(), strHash);
+    BOOST_CHECK_EQUAL(find_value(headers[0].get_obj(), "height").get_int(), 0);
+    BOOST_CHECK_EQUAL(find_value(headers[0].get_obj(), "merkleroot").get_str(), genesis.hashMerkleRoot.GetHex());
+
+    // Blocks that aren't known give nothing
+    string strUnknown = GetRandHash().GetHex();
+    BOOST_CHECK_EQUAL(GetREST("/rest/block/" + strUnknown + ".bin", strBody), 404);
+    BOOST_CHECK(GetRESTJSON("/rest/headers/5/" + strUnknown + ".json").get_array().empty());
+}
+
+BOOST_AUTO_TEST_CASE(rest_tx_getutxos)
+{
+    CTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].prevout = COutPoint(GetRandHash(), 1);
+    tx.vout.resize(2);
+    tx.vout[0].nValue = 5000;
+    tx.vout[0].scriptPubKey = CScript() << OP_TRUE;
+    tx.vout[1].nValue = 7000;
+    tx.vout[1].scriptPubKey = CScript() << OP_TRUE;
+    mempool.addUnchecked(tx.GetHash(), CTxMemPoolEntry(tx, 100, GetTime(), 1.5, 1));
+    string strHash = tx.GetHash().GetHex();
+    CDataStream ssTx(SER_NETWORK, PROTOCOL_VERSION);
+    ssTx << tx;
+
+    string strBody;
+    BOOST_CHECK_EQUAL(GetREST("/rest/tx/" + strHash + ".bin", strBody), 200);
+    BOOST_CHECK(strBody == ssTx.str());
+    Array params;
+    params.push_back(strHash);
+    params.push_back(1);
+    BOOST_CHECK_EQUAL(GetREST("/rest/tx/" + strHash + ".json", strBody), 200);
+    BOOST_CHECK_EQUAL(strBody, write_string(tableRPC.execute("getrawtransaction", params), false) + "\n");
+
+    // The outputs of a memory pool transaction are only there with checkmempool
+    string strOutPoints = strHash + "-0/" + strHash + "-1/" + strHash + "-2";
+    Object utxos = GetRESTJSON("/rest/getutxos/" + strOutPoints + ".json").get_obj();
+    BOOST_CHECK_EQUAL(find_value(utxos, "bitmap").get_str(), "000");
+    BOOST_CHECK_EQUAL(find_value(utxos, "chainHeight").get_int(), chainActive.Height());
+    BOOST_CHECK(find_value(utxos, "utxos").get_array().empty());
+
+    utxos = GetRESTJSON("/rest/getutxos/checkmempool/" + strOutPoints + ".json").get_obj();
+    BOOST_CHECK_EQUAL(find_value(utxos, "bitmap").get_str(), "110");
+    Array coins = find_value(utxos, "utxos").get_array();
+    BOOST_REQUIRE_EQUAL(coins.size(), 2U);
+    BOOST_CHECK_EQUAL(AmountFromValue(find_value(coins[1].get_obj(), "value")), 7000);
+    BOOST_CHECK_EQUAL(find_value(find_value(coins[1].get_obj(), "scriptPubKey").get_obj(), "hex").get_str(), "51");
+
+    BOOST_CHECK_EQUAL(GetREST("/rest/getutxos/checkmempool/" + strOutPoints + ".bin", strBody), 200);
+    CDataStream ssUTXOs(strBody.data(), strBody.data() + strBody.size(), SER_NETWORK, PROTOCOL_VERSION);
+    int nHeight;
+    uint256 hashTip;
+    vector<unsigned char> vBitmap;
+    ssUTXOs >> nHeight >> hashTip >> vBitmap;
+    BOOST_CHECK_EQUAL(nHeight, chainActive.Height());
+    BOOST_CHECK(hashTip == chainActive.Tip()->GetBlockHash());
+    BOOST_REQUIRE_EQUAL(vBitmap.size(), 1U);
+    BOOST_CHECK_EQUAL(vBitmap[0], 3);
+
+    list<CTransaction> removed;
+    mempool.remove(tx, removed);
+    BOOST_CHECK_EQUAL(GetREST("/rest/tx/" + strHash + ".hex", strBody), 404);
+}
+
+BOOST_AUTO_TEST_CASE(rest_bad_requests)
+{
+    string strHash = Params().GenesisBlock().GetHash().GetHex();
+    string strBody;
+    BOOST_CHECK_EQUAL(GetREST("/rest/block/" + strHash, strBody), 404);
+    BOOST_CHECK_EQUAL(GetREST("/rest/block/" + strHash + ".xml", strBody), 404);
+    BOOST_CHECK(boost::algorithm::contains(strBody, "available: bin, hex, json"));
+    BOOST_CHECK_EQUAL(GetREST("/rest/nothing/" + strHash + ".bin", strBody), 404);
+    BOOST_CHECK_EQUAL(GetREST("/rest/block/1234.bin", strBody), 400);
+    BOOST_CHECK_EQUAL(GetREST("/rest/block/" + strHash.substr(1) + "z.bin", strBody), 400);
+    BOOST_CHECK_EQUAL(GetREST("/rest/tx/" + strHash + "/x.bin", strBody), 400);
+
+    BOOST_CHECK_EQUAL(GetREST("/rest/headers/" + strHash + ".bin", strBody), 400);
+    BOOST_CHECK_EQUAL(GetREST("/rest/headers/0/" + strHash + ".bin", strBody), 400);
+    BOOST_CHECK_EQUAL(GetREST("/rest/headers/2001/" + strHash + ".bin", strBody), 400);
+
+    BOOST_CHECK_EQUAL(GetREST("/rest/getutxos.bin", strBody), 404);
+    BOOST_CHECK_EQUAL(GetREST("/rest/getutxos/checkmempool.json", strBody), 400);
+    BOOST_CHECK_EQUAL(GetREST("/rest/getutxos/" + strHash + ".json", strBody), 400);
+    BOOST_CHECK_EQUAL(GetREST("/rest/getutxos/" + strHash + "-.json", strBody), 400);
+    BOOST_CHECK_EQUAL(GetREST("/rest/getutxos/" + strHash + "--1.json", strBody), 400);
+    BOOST_CHECK_EQUAL(GetREST("/rest/getutxos/" + strHash + "-99999999999.json", strBody), 400);
+    string strOutPoints;
+    for (int i = 0; i < 16; i++)
+        strOutPoints += strprintf("/%s-%d", strHash, i);
+    BOOST_CHECK_EQUAL(GetREST("/rest/getutxos" + strOutPoints + ".json", strBody), 400);
+    BOOST_CHECK_EQUAL(GetREST("/rest/getutxos" + strOutPoints.substr(strOutPoints.find('/', 1)) + ".json", strBody), 200);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
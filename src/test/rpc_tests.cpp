@@ -6,9 +6,12 @@
 #include "rpcclient.h"
 
 #include "base58.h"
+#include "main.h"
+#include "sync.h"
 
 #include <boost/algorithm/string.hpp>
 #include <boost/test/unit_test.hpp>
+#include <boost/thread.hpp>
 
 using namespace std;
 using namespace json_spirit;
@@ -138,4 +141,50 @@ BOOST_AUTO_TEST_CASE(rpc_parse_monetary_values)
     BOOST_CHECK(AmountFromValue(ValueFromString("20999999.99999999")) == 2099999999999999LL);
 }
 
+static void ReadOnlyCalls(int nRounds)
+{
+    const char* commands[] = { "getblockcount", "getbestblockhash", "getdifficulty", "getblockchaininfo" };
+    for (int i = 0; i < nRounds; i++)
+        BOOST_FOREACH(const char* strMethod, commands)
+            tableRPC.execute(strMethod, Array());
+}
+
+BOOST_AUTO_TEST_CASE(rpc_readonly_without_cs_main)
+{
+    // Tip queries declare no locks, so they keep being answered while
+    // cs_main is busy with a block
+    const int NTHREADS = 4;
+    const int NROUNDS = 2000;
+    const int NCALLS = NTHREADS * NROUNDS * 4;
+
+    std::vector<boost::thread*> vThreads;
+    int nFinished = 0;
+    int64_t nElapsed;
+    {
+        // Stands in for a block being connected
+        LOCK(cs_main);
+
+        int64_t nStart = GetTimeMicros();
+        for (int i = 0; i < NTHREADS; i++)
+            vThreads.push_back(new boost::thread(boost::bind(&ReadOnlyCalls, NROUNDS)));
+        // A call waiting for cs_main would never return; give up after a while
+        BOOST_FOREACH(boost::thread* pthread, vThreads)
+            if (pthread->timed_join(boost::posix_time::seconds(30)))
+                nFinished++;
+        nElapsed = GetTimeMicros() - nStart;
+    }
+
+    // Threads still stuck are left behind rather than hanging the tests
+    BOOST_FOREACH(boost::thread* pthread, vThreads)
+    {
+        if (!pthread->timed_join(boost::posix_time::seconds(5)))
+            pthread->detach();
+        delete pthread;
+    }
+
+    BOOST_CHECK_EQUAL(nFinished, NTHREADS);
+    BOOST_TEST_MESSAGE(strprintf("%d read-only RPC calls on %d threads while cs_main was held: %.1fus per call",
+                                 NCALLS, NTHREADS, (double)nElapsed / NCALLS));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
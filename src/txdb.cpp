@@ -10,6 +10,8 @@
 
 #include <stdint.h>
 
+#include <boost/scoped_ptr.hpp>
+
 using namespace std;
 
 void static BatchWriteCoins(CLevelDBBatch &batch, const uint256 &hash, const CCoins &coins) {
@@ -108,12 +110,14 @@ bool CBlockTreeDB::ReadLastBlockFile(int &nFile) {
 }
 
 bool CCoinsViewDB::GetStats(CCoinsStats &stats) {
+    // The best block is read through the same iterator as the coins, so both
+    // come from one snapshot of the database even if it is flushed meanwhile.
+    // Its 'B' key sorts before all the 'c' ones.
     leveldb::Iterator *pcursor = db.NewIterator();
     pcursor->SeekToFirst();
 
     CHashWriter ss(SER_GETHASH, PROTOCOL_VERSION);
-    stats.hashBlock = GetBestBlock();
-    ss << stats.hashBlock;
+    bool fHashedBestBlock = false;
     int64_t nTotalAmount = 0;
     while (pcursor->Valid()) {
         boost::this_thread::interruption_point();
@@ -122,7 +126,15 @@ bool CCoinsViewDB::GetStats(CCoinsStats &stats) {
             CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
             char chType;
             ssKey >> chType;
-            if (chType == 'c') {
+            if (chType == 'B') {
+                leveldb::Slice slValue = pcursor->value();
+                CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+                ssValue >> stats.hashBlock;
+            } else if (chType == 'c') {
+                if (!fHashedBestBlock) {
+                    ss << stats.hashBlock;
+                    fHashedBestBlock = true;
+                }
                 leveldb::Slice slValue = pcursor->value();
                 CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
                 CCoins coins;
@@ -152,7 +164,14 @@ bool CCoinsViewDB::GetStats(CCoinsStats &stats) {
         }
     }
     delete pcursor;
-    stats.nHeight = mapBlockIndex.find(GetBestBlock())->second->nHeight;
+    if (!fHashedBestBlock)
+        ss << stats.hashBlock;
+    {
+        LOCK(cs_main);
+        std::map<uint256, CBlockIndex*>::iterator mi = mapBlockIndex.find(stats.hashBlock);
+        if (mi != mapBlockIndex.end())
+            stats.nHeight = mi->second->nHeight;
+    }
     stats.hashSerialized = ss.GetHash();
     stats.nTotalAmount = nTotalAmount;
     return true;
@@ -169,6 +188,84 @@ bool CBlockTreeDB::WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos>
     return WriteBatch(batch);
 }
 
+bool CBlockTreeDB::UpdateAddressIndex(const std::vector<std::pair<CAddressIndexKey, int64_t> > &vHistory,
+                                      const std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &vUnspent, bool fConnect) {
+    CLevelDBBatch batch;
+    for (std::vector<std::pair<CAddressIndexKey, int64_t> >::const_iterator it = vHistory.begin(); it != vHistory.end(); it++) {
+        if (fConnect)
+            batch.Write(make_pair('a', it->first), it->second);
+        else
+            batch.Erase(make_pair('a', it->first));
+    }
+    for (std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> >::const_iterator it = vUnspent.begin(); it != vUnspent.end(); it++) {
+        if (it->second.IsNull())
+            batch.Erase(make_pair('u', it->first));
+        else
+            batch.Write(make_pair('u', it->first), it->second);
+    }
+    return WriteBatch(batch);
+}
+
+bool CBlockTreeDB::ReadAddressHistory(unsigned char type, const uint160 &hashBytes, int nStart, int nEnd,
+                                      std::vector<std::pair<CAddressIndexKey, int64_t> > &vHistory) {
+    boost::scoped_ptr<leveldb::Iterator> pcursor(NewIterator());
+
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << make_pair('a', CAddressIndexKey(type, hashBytes, nStart, 0, 0, false));
+    pcursor->Seek(ssKeySet.str());
+
+    for (; pcursor->Valid(); pcursor->Next()) {
+        boost::this_thread::interruption_point();
+        try {
+            leveldb::Slice slKey = pcursor->key();
+            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+            char chType;
+            CAddressIndexKey key;
+            ssKey >> chType >> key;
+            if (chType != 'a' || key.type != type || key.hashBytes != hashBytes || (nEnd >= 0 && key.nHeight > nEnd))
+                break;
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+            int64_t nValue;
+            ssValue >> nValue;
+            vHistory.push_back(make_pair(key, nValue));
+        } catch (std::exception &e) {
+            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        }
+    }
+    return true;
+}
+
+bool CBlockTreeDB::ReadAddressUnspent(unsigned char type, const uint160 &hashBytes,
+                                      std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &vUnspent) {
+    boost::scoped_ptr<leveldb::Iterator> pcursor(NewIterator());
+
+    CDataStream ssKeySet(SER_DISK, CLIENT_VERSION);
+    ssKeySet << make_pair('u', CAddressUnspentKey(type, hashBytes, 0, 0));
+    pcursor->Seek(ssKeySet.str());
+
+    for (; pcursor->Valid(); pcursor->Next()) {
+        boost::this_thread::interruption_point();
+        try {
+            leveldb::Slice slKey = pcursor->key();
+            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
+            char chType;
+            CAddressUnspentKey key;
+            ssKey >> chType >> key;
+            if (chType != 'u' || key.type != type || key.hashBytes != hashBytes)
+                break;
+            leveldb::Slice slValue = pcursor->value();
+            CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
+            CAddressUnspentValue value;
+            ssValue >> value;
+            vUnspent.push_back(make_pair(key, value));
+        } catch (std::exception &e) {
+            return error("%s : Deserialize or I/O error - %s", __func__, e.what());
+        }
+    }
+    return true;
+}
+
 bool CBlockTreeDB::WriteFlag(const std::string &name, bool fValue) {
     return Write(std::make_pair('F', name), fValue ? '1' : '0');
 }
@@ -42,6 +42,115 @@ public:
     bool GetStats(CCoinsStats &stats);
 };
 
+/** Kinds of address the address index is keyed by */
+enum AddressType
+{
+    ADDRESS_PUBKEYHASH = 1,
+    ADDRESS_SCRIPTHASH = 2,
+};
+
+/** An output paying to an address or an input spending from it, the key of
+ * an address history entry. The value is the amount, negative for a spend.
+ * Height and index are serialized big-endian so that LevelDB keeps the
+ * history of an address in order of height.
+ */
+class CAddressIndexKey
+{
+public:
+    unsigned char type;
+    uint160 hashBytes;
+    int nHeight;
+    uint256 txhash;
+    unsigned int index; // output index, or input index if fSpending
+    bool fSpending;
+
+    CAddressIndexKey() : type(0), hashBytes(0), nHeight(0), txhash(0), index(0), fSpending(false) {}
+    CAddressIndexKey(unsigned char typeIn, const uint160& hashBytesIn, int nHeightIn, const uint256& txhashIn, unsigned int indexIn, bool fSpendingIn) :
+        type(typeIn), hashBytes(hashBytesIn), nHeight(nHeightIn), txhash(txhashIn), index(indexIn), fSpending(fSpendingIn) {}
+
+    unsigned int GetSerializeSize(int nType, int nVersion) const {
+        return 1 + 20 + 4 + 32 + 4 + 1;
+    }
+
+    template<typename Stream>
+    void Serialize(Stream &s, int nType, int nVersion) const {
+        ::Serialize(s, type, nType, nVersion);
+        ::Serialize(s, hashBytes, nType, nVersion);
+        WriteBE32(s, nHeight);
+        ::Serialize(s, txhash, nType, nVersion);
+        WriteBE32(s, index);
+        ::Serialize(s, fSpending, nType, nVersion);
+    }
+
+    template<typename Stream>
+    void Unserialize(Stream &s, int nType, int nVersion) {
+        ::Unserialize(s, type, nType, nVersion);
+        ::Unserialize(s, hashBytes, nType, nVersion);
+        nHeight = ReadBE32(s);
+        ::Unserialize(s, txhash, nType, nVersion);
+        index = ReadBE32(s);
+        ::Unserialize(s, fSpending, nType, nVersion);
+    }
+
+private:
+    template<typename Stream>
+    static void WriteBE32(Stream &s, uint32_t n) {
+        unsigned char buf[4] = { (unsigned char)(n >> 24), (unsigned char)(n >> 16), (unsigned char)(n >> 8), (unsigned char)n };
+        s.write((const char*)buf, 4);
+    }
+
+    template<typename Stream>
+    static uint32_t ReadBE32(Stream &s) {
+        unsigned char buf[4];
+        s.read((char*)buf, 4);
+        return ((uint32_t)buf[0] << 24) | ((uint32_t)buf[1] << 16) | ((uint32_t)buf[2] << 8) | buf[3];
+    }
+};
+
+/** An unspent output paying to an address */
+class CAddressUnspentKey
+{
+public:
+    unsigned char type;
+    uint160 hashBytes;
+    uint256 txhash;
+    unsigned int index;
+
+    CAddressUnspentKey() : type(0), hashBytes(0), txhash(0), index(0) {}
+    CAddressUnspentKey(unsigned char typeIn, const uint160& hashBytesIn, const uint256& txhashIn, unsigned int indexIn) :
+        type(typeIn), hashBytes(hashBytesIn), txhash(txhashIn), index(indexIn) {}
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(type);
+        READWRITE(hashBytes);
+        READWRITE(txhash);
+        READWRITE(index);
+    )
+};
+
+class CAddressUnspentValue
+{
+public:
+    int64_t nValue;
+    CScript script;
+    int nHeight;
+
+    // A null value erases the output from the index
+    CAddressUnspentValue() : nValue(-1), nHeight(0) {}
+    CAddressUnspentValue(int64_t nValueIn, const CScript& scriptIn, int nHeightIn) :
+        nValue(nValueIn), script(scriptIn), nHeight(nHeightIn) {}
+
+    bool IsNull() const { return nValue == -1; }
+
+    IMPLEMENT_SERIALIZE
+    (
+        READWRITE(nValue);
+        READWRITE(script);
+        READWRITE(nHeight);
+    )
+};
+
 /** Access to the block database (blocks/index/) */
 class CBlockTreeDB : public CLevelDBWrapper
 {
@@ -61,6 +170,15 @@ public:
     bool ReadReindexing(bool &fReindex);
     bool ReadTxIndex(const uint256 &txid, CDiskTxPos &pos);
     bool WriteTxIndex(const std::vector<std::pair<uint256, CDiskTxPos> > &list);
+    // Writes (fConnect) or erases the history entries of a block, and writes
+    // its unspent outputs or erases those with a null value, in one batch
+    bool UpdateAddressIndex(const std::vector<std::pair<CAddressIndexKey, int64_t> > &vHistory,
+                            const std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &vUnspent, bool fConnect);
+    // History of an address from height nStart to nEnd, both inclusive; nEnd < 0 for no end
+    bool ReadAddressHistory(unsigned char type, const uint160 &hashBytes, int nStart, int nEnd,
+                            std::vector<std::pair<CAddressIndexKey, int64_t> > &vHistory);
+    bool ReadAddressUnspent(unsigned char type, const uint160 &hashBytes,
+                            std::vector<std::pair<CAddressUnspentKey, CAddressUnspentValue> > &vUnspent);
     bool WriteFlag(const std::string &name, bool fValue);
     bool ReadFlag(const std::string &name, bool &fValue);
     bool LoadBlockIndexGuts();
@@ -26,7 +26,7 @@ extern const std::string CLIENT_DATE;
 // network protocol versioning
 //
 
-static const int PROTOCOL_VERSION = 70002;
+static const int PROTOCOL_VERSION = 70003;
 
 // intial proto version, to be increased after version/verack negotiation
 static const int INIT_PROTO_VERSION = 209;
@@ -48,4 +48,8 @@ static const int BIP0031_VERSION = 60000;
 // "mempool" command, enhanced "getdata" behavior starts with this version:
 static const int MEMPOOL_GD_VERSION = 60002;
 
+// "cmpctblock", "getblocktxn" and "blocktxn" and MSG_CMPCT_BLOCK getdata
+// requests are understood starting with this version
+static const int COMPACT_BLOCKS_VERSION = 70003;
+
 #endif